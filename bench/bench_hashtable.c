@@ -0,0 +1,199 @@
+/*
+ * bench_hashtable.c - Time hash table lookups and inserts, chained and indexed
+ *
+ * The option, reserved word, widget and keymap name tables are searched
+ * with the same mix of names in them and words not in them (as the
+ * lexer does for every word in command position), once through the
+ * open-addressed index libzsh puts over them and once through the
+ * table's own chained methods; the option and reserved word tables
+ * also through the perfect hash made at build time.  Then a new table is filled with
+ * generated names and each looked up, both ways.  Both ways must find
+ * the same nodes; the time per operation of each is printed.
+ *
+ * Usage: bench_hashtable [millions of lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zsh.mdh"
+#include "zle.mdh"
+#include "libzsh.h"
+
+extern HashTable keymapnamtab;
+extern int libzsh_hashtable_index(HashTable ht);
+extern void libzsh_hashtable_unindex(HashTable ht);
+struct libzsh_phash;
+extern const struct libzsh_phash libzsh_phash_reswd, libzsh_phash_option;
+extern int libzsh_hashtable_perfect(HashTable ht,
+                                    const struct libzsh_phash *ph);
+
+/* Command words that aren't reserved words or options */
+static const char *misses[] = {
+    "ls", "cd", "git", "make", "echo", "grep", "sed", "printf", "./configure",
+    "cat", "xargs", "test", "ifx", "done2", "emacs-mode", "safe_rm",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Every name in ht, then as many misses, in a shuffled list of n */
+static char **make_queries(HashTable ht, size_t n)
+{
+    char **names = malloc(n * sizeof(*names));
+    size_t nnames = 0, sz = 64, i;
+    char **in = malloc(sz * sizeof(*in));
+    unsigned int seed = 7;
+    int b;
+
+    for (b = 0; b < ht->hsize; b++) {
+        HashNode hn;
+
+        for (hn = ht->nodes[b]; hn; hn = hn->next) {
+            if (nnames == sz)
+                in = realloc(in, (sz *= 2) * sizeof(*in));
+            in[nnames++] = hn->nam;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (nnames && (seed >> 16) & 1)
+            names[i] = in[(seed >> 4) % nnames];
+        else
+            names[i] = (char *)
+                misses[(seed >> 4) % (sizeof(misses) / sizeof(misses[0]))];
+    }
+    free(in);
+    return names;
+}
+
+static size_t lookups(HashTable ht, char **names, size_t n, double *t)
+{
+    size_t i, found = 0;
+    double t0 = now();
+
+    for (i = 0; i < n; i++)
+        if (ht->getnode2(ht, names[i]))
+            found++;
+    *t = now() - t0;
+    return found;
+}
+
+/* ph is the table's perfect hash, if it has one */
+static int bench_table(const char *name, HashTable ht,
+                       const struct libzsh_phash *ph, size_t n)
+{
+    char **names = make_queries(ht, n);
+    size_t indexed, chained, perfect = 0;
+    double ti, tc, tp = 0;
+
+    libzsh_hashtable_unindex(ht);
+    chained = lookups(ht, names, n, &tc);
+    libzsh_hashtable_index(ht);
+    indexed = lookups(ht, names, n, &ti);
+    if (ph) {
+        libzsh_hashtable_unindex(ht);
+        if (libzsh_hashtable_perfect(ht, ph) == 0)
+            perfect = lookups(ht, names, n, &tp);
+        else
+            ph = NULL;
+    }
+
+    printf("%-12s %5d names  chained %6.1f ns  indexed %6.1f ns  x%.1f",
+           name, ht->ct, tc * 1e9 / n, ti * 1e9 / n, ti > 0 ? tc / ti : 0.0);
+    if (ph)
+        printf("  perfect %6.1f ns  x%.1f", tp * 1e9 / n,
+               tp > 0 ? tc / tp : 0.0);
+    printf("\n");
+    free(names);
+    if (indexed != chained || (ph && perfect != chained)) {
+        fprintf(stderr, "%s: %zu found indexed, %zu perfect, %zu chained\n",
+                name, indexed, perfect, chained);
+        return 1;
+    }
+    return 0;
+}
+
+static void free_node(HashNode hn)
+{
+    zsfree(hn->nam);
+    zfree(hn, sizeof(*hn));
+}
+
+/* Fill a new table with n names and look each up; returns those found */
+static size_t fill(int index, size_t n, double *tadd, double *tget)
+{
+    HashTable ht = newhashtable(17, "bench", NULL);
+    char buf[32];
+    size_t i, found = 0;
+    double t0;
+
+    ht->hash = hasher;
+    ht->emptytable = emptyhashtable;
+    ht->cmpnodes = strcmp;
+    ht->addnode = addhashnode;
+    ht->getnode = gethashnode;
+    ht->getnode2 = gethashnode2;
+    ht->removenode = removehashnode;
+    ht->freenode = free_node;
+    if (index)
+        libzsh_hashtable_index(ht);
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "name%zu", i * 7919);
+        ht->addnode(ht, ztrdup(buf), zshcalloc(sizeof(struct hashnode)));
+    }
+    *tadd = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "name%zu", i * 7919);
+        if (ht->getnode(ht, buf))
+            found++;
+    }
+    *tget = now() - t0;
+
+    if (index)
+        libzsh_hashtable_unindex(ht);
+    deletehashtable(ht);
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = (argc > 1 ? strtoul(argv[1], NULL, 10) : 4) * 1000000;
+    size_t nfill = 100000, fc, fi;
+    double tca, tcg, tia, tig;
+    int failed = 0;
+
+    if (!n || libzsh_zle_init() != 0) {
+        fprintf(stderr, "usage: bench_hashtable [millions of lookups]\n");
+        return 1;
+    }
+
+    failed += bench_table("optiontab", optiontab, &libzsh_phash_option, n);
+    failed += bench_table("reswdtab", reswdtab, &libzsh_phash_reswd, n);
+    failed += bench_table("thingytab", thingytab, NULL, n);
+    failed += bench_table("keymapnamtab", keymapnamtab, NULL, n);
+
+    fc = fill(0, nfill, &tca, &tcg);
+    fi = fill(1, nfill, &tia, &tig);
+    printf("%-12s %5zu names  chained %6.1f ns  indexed %6.1f ns  (insert)\n",
+           "new table", nfill, tca * 1e9 / nfill, tia * 1e9 / nfill);
+    printf("%-12s %5zu names  chained %6.1f ns  indexed %6.1f ns  (lookup)\n",
+           "new table", nfill, tcg * 1e9 / nfill, tig * 1e9 / nfill);
+    if (fc != nfill || fi != nfill) {
+        fprintf(stderr, "new table: found %zu chained, %zu indexed of %zu\n",
+                fc, fi, nfill);
+        failed++;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * bench_keymap.c - Time key binding resolution per input byte
+ *
+ * For each of the main, emacs, viins and vicmd keymaps the same stream
+ * of typed text, cursor keys and editing chords is split into bindings
+ * twice: by looking each growing key sequence up with keybind() and
+ * keyisprefix(), as getkeymapcmd() does, and by stepping through the
+ * compiled keymap.  Both must agree; the time per byte of each is
+ * printed.
+ *
+ * Usage: bench_keymap [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zsh.mdh"
+#include "zle.mdh"
+#include "libzsh.h"
+
+extern Keymap openkeymap(char *name);
+extern Thingy keybind(Keymap km, char *seq, char **strp);
+extern int keyisprefix(Keymap km, char *seq);
+
+/* Sequences mixed into the typed text */
+static const char *chords[] = {
+    "\033[A", "\033[B", "\033[C", "\033[D", "\033OA", "\033OB",
+    "\033b", "\033f", "\033d", "\033\177", "\001", "\005", "\013",
+    "\027", "\030\025", "\030\030", "\033[3~", "\033[1;5C", "\r",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *make_input(size_t size)
+{
+    char *buf = malloc(size);
+    unsigned int seed = 12345;
+    size_t pos = 0;
+
+    while (pos < size) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 8) {
+            buf[pos++] = ' ' + (seed >> 8) % 95;
+        } else {
+            const char *c = chords[(seed >> 8) %
+                                   (sizeof(chords) / sizeof(chords[0]))];
+            size_t len = strlen(c);
+
+            if (pos + len > size)
+                len = size - pos;
+            memcpy(buf + pos, c, len);
+            pos += len;
+        }
+    }
+    return buf;
+}
+
+/* The lookup getkeymapcmd() does; returns the binding length */
+static size_t resolve_hashed(Keymap km, const char *buf, size_t n,
+                             Thingy *tp)
+{
+    char seq[129], *sp = seq;
+    size_t k = 0, found = 0;
+
+    *tp = NULL;
+    while (k < n && k < 64) {
+        unsigned char c = (unsigned char)buf[k++];
+        char *str = NULL;
+        Thingy t;
+
+        if (imeta(c)) {
+            *sp++ = Meta;
+            *sp++ = (char)(c ^ 32);
+        } else
+            *sp++ = (char)c;
+        *sp = '\0';
+
+        t = keybind(km, seq, &str);
+        if (str || (t && strcmp(t->nam, "undefined-key"))) {
+            found = k;
+            *tp = str ? NULL : t;
+        }
+        if (!keyisprefix(km, seq))
+            break;
+    }
+    return found ? found : k;
+}
+
+static int bench(const char *name, const char *input, size_t size)
+{
+    Keymap km = openkeymap((char *)name);
+    libzsh_keymap *kc;
+    size_t pos, nkeys = 0, ckeys = 0;
+    double t0, hashed, compiled;
+
+    if (!km || !(kc = libzsh_keymap_compile(name))) {
+        fprintf(stderr, "%s: no such keymap\n", name);
+        return 1;
+    }
+
+    t0 = now();
+    for (pos = 0; pos < size; nkeys++) {
+        Thingy t;
+
+        pos += resolve_hashed(km, input + pos, size - pos, &t);
+    }
+    hashed = now() - t0;
+
+    t0 = now();
+    for (pos = 0; pos < size; ckeys++) {
+        const char *widget;
+
+        pos += libzsh_keymap_lookup(kc, input + pos, size - pos, 1,
+                                    &widget, NULL);
+    }
+    compiled = now() - t0;
+
+    printf("%-6s %5zu states %9zu keys  hashed %6.1f ns/byte  "
+           "compiled %6.1f ns/byte\n", name, libzsh_keymap_states(kc),
+           nkeys, hashed * 1e9 / size, compiled * 1e9 / size);
+
+    libzsh_keymap_free(kc);
+    if (nkeys != ckeys) {
+        fprintf(stderr, "%s: %zu keys hashed but %zu compiled\n",
+                name, nkeys, ckeys);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *keymaps[] = { "main", "emacs", "viins", "vicmd" };
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 4) << 20;
+    char *input;
+    int i, failed = 0;
+
+    if (!size || libzsh_zle_init() != 0) {
+        fprintf(stderr, "usage: bench_keymap [megabytes]\n");
+        return 1;
+    }
+    input = make_input(size);
+
+    for (i = 0; i < 4; i++)
+        failed += bench(keymaps[i], input, size);
+
+    free(input);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * bench_math.c - Time arithmetic by matheval() and compiled
+ *
+ * Each expression is evaluated once per iteration with the parameter
+ * x set to the iteration number, first by matheval() on its text, as
+ * (( )) does, and then from the program libzsh_math_compile() made of
+ * it.  Both run in one entered context, so only the evaluation differs.
+ * The sums of the results must agree; the time per evaluation of each
+ * is printed.
+ *
+ * Usage: bench_math [thousands of evaluations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zsh.mdh"
+#include "libzsh.h"
+
+extern int libzsh_math_eval_entered(libzsh_math *m,
+                                    struct libzsh_number *out);
+
+static const char *exprs[] = {
+    "x + 1",
+    "x * 3 % 7 == 2",
+    "(x & 255) << 2 | y",
+    "x > 1000 ? x / 3 : y - x",
+    "rate * x / 100.0",
+    "x % 3 == 0 && x % 5 == 0 || x % 7 == 0",
+    "z = x * 2 + y, z > 500",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double as_double(mnumber n)
+{
+    return n.type == MN_FLOAT ? n.u.d : (double)n.u.l;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1000) * 1000;
+    libzsh_context *ctx;
+    char xname[] = "x";
+    size_t i, e;
+    int failed = 0;
+
+    if (!n || libzsh_init() != 0 || !(ctx = libzsh_context_new()) ||
+        libzsh_setparam(ctx, "y", "17") || libzsh_setparam(ctx, "rate", "2.5")) {
+        fprintf(stderr, "usage: bench_math [thousands of evaluations]\n");
+        return 1;
+    }
+
+    for (e = 0; e < sizeof(exprs) / sizeof(exprs[0]); e++) {
+        libzsh_math *m = libzsh_math_compile(ctx, exprs[e]);
+        struct libzsh_number num;
+        double t0, tparse, tcomp, sparse = 0, scomp = 0;
+        char *s;
+
+        if (!m) {
+            fprintf(stderr, "%s: not compiled\n", exprs[e]);
+            return 1;
+        }
+        libzsh_context_enter(ctx);
+        pushheap();
+
+        t0 = now();
+        for (i = 0; i < n; i++) {
+            setiparam(xname, (zlong)i);
+            s = dupstring(exprs[e]);
+            sparse += as_double(matheval(s));
+            if (i % 1024 == 1023)
+                freeheap();
+        }
+        tparse = now() - t0;
+
+        t0 = now();
+        for (i = 0; i < n; i++) {
+            setiparam(xname, (zlong)i);
+            if (libzsh_math_eval_entered(m, &num) == 0)
+                scomp += num.d;
+            if (i % 1024 == 1023)
+                freeheap();
+        }
+        tcomp = now() - t0;
+
+        popheap();
+        libzsh_context_leave(ctx);
+
+        printf("%-42s matheval %6.1f ns  compiled %6.1f ns  x%.1f\n",
+               exprs[e], tparse * 1e9 / n, tcomp * 1e9 / n,
+               tcomp > 0 ? tparse / tcomp : 0.0);
+        if (sparse != scomp) {
+            fprintf(stderr, "%s: matheval summed %g, compiled %g\n",
+                    exprs[e], sparse, scomp);
+            failed++;
+        }
+        libzsh_math_free(m);
+    }
+
+    libzsh_context_free(ctx);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * bench_pattern.c - Time pattern matching over many paths
+ *
+ * Each pattern is matched against the same list of generated paths
+ * twice: by pattry() on the program from patcompile(), one string at a
+ * time, and by libzsh_pattern_match_batch(), which prefilters on the
+ * pattern's literals and matches literal-and-star patterns without the
+ * matcher.  Both must find the same number of matches; the time per
+ * string of each is printed.
+ *
+ * Usage: bench_pattern [thousands of paths]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zsh.mdh"
+#include "libzsh.h"
+
+static const char *patterns[] = {
+    "main.c", "src/*", "*.c", "*core*", "lib*.so", "*.[ch]", "*/t[0-9]*",
+};
+
+static const char *kind_names[] = {
+    "generic", "exact", "prefix", "suffix", "substring", "affix", "any",
+};
+
+static const char *dirs[] = {
+    "src", "src/core", "lib", "include", "tests", "doc/api", "build/obj",
+};
+
+static const char *exts[] = {
+    ".c", ".h", ".o", ".so", ".txt", ".md", "", ".orig",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char **make_paths(size_t n)
+{
+    char **paths = malloc(n * sizeof(*paths));
+    unsigned int seed = 42;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        char buf[128];
+
+        seed = seed * 1103515245 + 12345;
+        snprintf(buf, sizeof(buf), "%s/%s%u%s",
+                 dirs[(seed >> 8) % (sizeof(dirs) / sizeof(dirs[0]))],
+                 (seed >> 12) % 5 ? "file" : "libcore", (seed >> 16) % 1000,
+                 exts[(seed >> 24) % (sizeof(exts) / sizeof(exts[0]))]);
+        paths[i] = strdup(buf);
+    }
+    return paths;
+}
+
+/* One pattry() per string, as a caller of pattern.c would do it */
+static size_t match_pattry(libzsh_context *ctx, const char *pattern,
+                           char **paths, size_t n)
+{
+    size_t i, matched = 0;
+    Patprog prog;
+    char *s;
+
+    libzsh_context_enter(ctx);
+    pushheap();
+    s = dupstring(pattern);
+    tokenize(s);
+    if ((prog = patcompile(s, 0, NULL))) {
+        for (i = 0; i < n; i++)
+            if (pattry(prog, paths[i]))
+                matched++;
+    }
+    popheap();
+    libzsh_context_leave(ctx);
+
+    return matched;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1000) * 1000;
+    libzsh_context *ctx;
+    unsigned char *results;
+    char **paths;
+    size_t i;
+    int failed = 0;
+
+    if (!n || libzsh_init() != 0 || !(ctx = libzsh_context_new())) {
+        fprintf(stderr, "usage: bench_pattern [thousands of paths]\n");
+        return 1;
+    }
+    paths = make_paths(n);
+    results = malloc((n + 7) / 8);
+
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        libzsh_pattern *pat = libzsh_pattern_compile(ctx, patterns[i],
+                                                     strlen(patterns[i]));
+        size_t slow, fast;
+        double t0, tslow, tfast;
+
+        if (!pat) {
+            fprintf(stderr, "%s: bad pattern\n", patterns[i]);
+            return 1;
+        }
+
+        t0 = now();
+        slow = match_pattry(ctx, patterns[i], paths, n);
+        tslow = now() - t0;
+
+        t0 = now();
+        fast = libzsh_pattern_match_batch(pat, (const char *const *)paths, n,
+                                          results);
+        tfast = now() - t0;
+
+        printf("%-10s %-9s %8zu matches  pattry %6.1f ns  batch %6.1f ns"
+               "  x%.1f\n", patterns[i], kind_names[libzsh_pattern_kind(pat)],
+               fast, tslow * 1e9 / n, tfast * 1e9 / n,
+               tfast > 0 ? tslow / tfast : 0.0);
+        if (slow != fast) {
+            fprintf(stderr, "%s: pattry matched %zu, batch %zu\n",
+                    patterns[i], slow, fast);
+            failed++;
+        }
+        libzsh_pattern_free(pat);
+    }
+
+    for (i = 0; i < n; i++)
+        free(paths[i]);
+    free(paths);
+    free(results);
+    libzsh_context_free(ctx);
+    return failed ? 1 : 0;
+}
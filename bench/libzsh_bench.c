@@ -0,0 +1,634 @@
+/*
+ * libzsh_bench.c - Microbenchmarks of the zsh code libzsh is built on
+ *
+ * The other bench_* programs compare a libzsh fast path with the zsh
+ * code it replaces.  This one times the zsh code itself, so that a new
+ * zsh snapshot (or a change to how libzsh builds it) can be compared
+ * with the last: ctxtlex() and parse_list() over a corpus of real
+ * scripts, patcompile() and pattry(), lookups in the built-in hash
+ * tables, and spaceinline() and foredel() on a long ZLE line.
+ *
+ * Every case runs the same fixed work each time: the inputs are read
+ * or generated once, with fixed seeds, before any timing.  Each is run
+ * once to warm up and then repeatedly; the best and median times are
+ * reported, with a count of what was found (tokens, matches, ...) that
+ * must not change unless the behaviour of the code has.  Results go to
+ * standard output (or the -o file) as one JSON object.
+ *
+ * The corpus is every regular file in the -c directories, by default
+ * the autoloaded functions and completions in the zsh sources; files
+ * that don't parse are left out.  Without any, a generated script is
+ * used and the corpus is reported as "generated".  Without ZLE in the
+ * library (LIBZSH_COMPONENTS) its tables and zle_edit are left out.
+ *
+ * Usage: libzsh_bench [-r repeats] [-s scale] [-c dir]... [-o file]
+ *                     [case]...
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zsh.mdh"
+#include "zle.mdh"
+#include "libzsh.h"
+#include "version.h"
+
+extern Eprog libzsh_parse_entered(const char *buf, size_t len, int flags);
+
+#ifdef LIBZSH_WITH_ZLE
+extern HashTable thingytab, keymapnamtab;
+extern ZLE_STRING_T zleline;
+extern int zlell, zlecs, linesz, mark;
+extern void sizeline(int sz);
+extern void spaceinline(int ct);
+extern void foredel(int ct, int flags);
+#endif
+
+#ifndef LIBZSH_BENCH_CORPUS
+#define LIBZSH_BENCH_CORPUS ""
+#endif
+
+#define MAX_DIRS    16
+#define MAX_REPEATS 101
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Inputs
+ */
+
+struct script {
+    char *buf;
+    size_t len;
+    long lines;
+};
+
+static struct script *corpus;
+static size_t ncorpus, szcorpus;
+static int corpus_generated;
+
+static long count_lines(const char *buf, size_t len)
+{
+    long lines = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (buf[i] == '\n')
+            lines++;
+    return lines + (len && buf[len - 1] != '\n');
+}
+
+static void add_script(char *buf, size_t len)
+{
+    if (ncorpus == szcorpus) {
+        szcorpus = szcorpus ? szcorpus * 2 : 256;
+        corpus = realloc(corpus, szcorpus * sizeof(*corpus));
+    }
+    corpus[ncorpus].buf = buf;
+    corpus[ncorpus].len = len;
+    corpus[ncorpus].lines = count_lines(buf, len);
+    ncorpus++;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+    struct stat st;
+    FILE *f;
+    char *buf;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size ||
+        !(f = fopen(path, "rb")))
+        return NULL;
+    buf = malloc(st.st_size);
+    *len = fread(buf, 1, st.st_size, f);
+    fclose(f);
+    if (!*len) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Every file in dir that parses, in name order so runs agree */
+static void load_dir(libzsh_context *ctx, const char *dir)
+{
+    struct dirent **names;
+    int n, i;
+
+    if ((n = scandir(dir, &names, NULL, alphasort)) < 0)
+        return;
+    for (i = 0; i < n; i++) {
+        char path[4096];
+        size_t len;
+        char *buf;
+
+        if (names[i]->d_name[0] != '.' &&
+            (size_t)snprintf(path, sizeof(path), "%s/%s", dir,
+                             names[i]->d_name) < sizeof(path) &&
+            (buf = read_file(path, &len))) {
+            if (libzsh_parse(ctx, buf, len, LIBZSH_PARSE_QUIET))
+                add_script(buf, len);
+            else
+                free(buf);
+        }
+        free(names[i]);
+    }
+    free(names);
+    libzsh_reset(ctx);
+}
+
+/* Commands of the sorts scripts are made of, with numbered names */
+static const char *templates[] = {
+    "local name%u=${1:-default} count%u=0\n",
+    "if [[ -n $name%u && $count%u -gt 2 ]]; then\n"
+    "    print -r -- \"${name%u:t}\" >> $log\n"
+    "elif (( count%u %% 3 == 0 )); then\n"
+    "    count%u=$(( count%u + 1 ))\n"
+    "fi\n",
+    "for f%u in *.c(N) $dir/**/*.h; do\n"
+    "    grep -q pattern $f%u && files+=( $f%u )\n"
+    "done\n",
+    "case $opt%u in\n"
+    "    (-v|--verbose) verbose=1 ;;\n"
+    "    (-o*) out=${opt%u#-o} ;;\n"
+    "    (*) print -u2 \"unknown: $opt%u\"; return 1 ;;\n"
+    "esac\n",
+    "fn%u() {\n"
+    "    emulate -L zsh\n"
+    "    local -a parts=( ${(s.:.)1} )\n"
+    "    (( $#parts )) || return\n"
+    "    print -l -- ${parts[@]/#/prefix%u}\n"
+    "}\n",
+    "cmd%u $(print -- `date +%%s`) 2>/dev/null | sort -u | head -n %u\n",
+    "while read -r line%u; do\n"
+    "    [[ $line%u == \\#* ]] && continue\n"
+    "done < ${file%u:-/dev/null}\n",
+    "cat <<EOF%u\n"
+    "value: $name%u\n"
+    "EOF%u\n",
+};
+
+static void generate_corpus(void)
+{
+    size_t sz = 1 << 20, len = 0;
+    char *buf = malloc(sz);
+    unsigned int seed = 2024, i;
+
+    for (i = 0; len + 512 < sz; i++) {
+        const char *t;
+
+        seed = seed * 1103515245 + 12345;
+        t = templates[(seed >> 16) %
+                      (sizeof(templates) / sizeof(templates[0]))];
+        len += snprintf(buf + len, sz - len, t, i, i, i, i, i, i);
+    }
+    add_script(buf, len);
+    corpus_generated = 1;
+}
+
+static const char *patterns[] = {
+    "main.c", "src/*", "*.c", "*core*", "lib*.so", "*.[ch]", "*/t[0-9]*",
+    "(#i)*README*", "*.(c|h|cc)", "^*.o", "**/file1??.*", "<100-200>*",
+};
+
+static const char *dirs[] = {
+    "src", "src/core", "lib", "include", "tests", "doc/api", "build/obj",
+};
+
+static const char *exts[] = {
+    ".c", ".h", ".o", ".so", ".txt", ".md", "", ".orig",
+};
+
+#define NPATHS 20000
+
+static char **paths;
+
+static void make_paths(void)
+{
+    unsigned int seed = 42;
+    size_t i;
+
+    paths = malloc(NPATHS * sizeof(*paths));
+    for (i = 0; i < NPATHS; i++) {
+        char buf[128];
+
+        seed = seed * 1103515245 + 12345;
+        snprintf(buf, sizeof(buf), "%s/%s%u%s",
+                 dirs[(seed >> 8) % (sizeof(dirs) / sizeof(dirs[0]))],
+                 (seed >> 12) % 5 ? "file" : "libcore", (seed >> 16) % 1000,
+                 exts[(seed >> 24) % (sizeof(exts) / sizeof(exts[0]))]);
+        paths[i] = strdup(buf);
+    }
+}
+
+/* Command words that aren't in any of the tables */
+static const char *misses[] = {
+    "ls", "cd", "git", "make", "grep", "sed", "./configure", "xargs",
+    "ifx", "done2", "emacs-mode", "safe_rm", "vi-cmd-moe", "zle_x",
+};
+
+#define NQUERIES 4096
+
+struct table {
+    HashTable *htp;
+    char *queries[NQUERIES];
+};
+
+static struct table tables[] = {
+    { &reswdtab, { NULL } },
+    { &optiontab, { NULL } },
+    { &aliastab, { NULL } },
+#ifdef LIBZSH_WITH_ZLE
+    { &thingytab, { NULL } },
+    { &keymapnamtab, { NULL } },
+#endif
+};
+
+#define NTABLES (sizeof(tables) / sizeof(tables[0]))
+
+/* Half names in the table, half not, in a fixed shuffle */
+static void make_queries(struct table *t)
+{
+    size_t nnames = 0, sz = 64, i;
+    char **in = malloc(sz * sizeof(*in));
+    unsigned int seed = 7;
+    int b;
+
+    for (b = 0; b < (*t->htp)->hsize; b++) {
+        HashNode hn;
+
+        for (hn = (*t->htp)->nodes[b]; hn; hn = hn->next) {
+            if (nnames == sz)
+                in = realloc(in, (sz *= 2) * sizeof(*in));
+            in[nnames++] = hn->nam;
+        }
+    }
+    for (i = 0; i < NQUERIES; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (nnames && (seed >> 16) & 1)
+            t->queries[i] = in[(seed >> 4) % nnames];
+        else
+            t->queries[i] = (char *)
+                misses[(seed >> 4) % (sizeof(misses) / sizeof(misses[0]))];
+    }
+    free(in);
+}
+
+/*
+ * Cases
+ *
+ * Each runs its work scale times with the context entered and returns
+ * how many operations that was; *check gets what was found.
+ */
+
+static libzsh_context *ctx;
+static int scale = 1;
+
+static size_t case_lex(unsigned long *check)
+{
+    size_t ops = 0, i;
+    int s;
+
+    for (s = 0; s < scale; s++)
+        for (i = 0; i < ncorpus; i++) {
+            char *input;
+
+            pushheap();
+            input = metafy(corpus[i].buf, (int)corpus[i].len, META_HEAPDUP);
+            errflag = 0;
+            lineno = 1;
+            lexinit();
+            incmdpos = 1;
+            inpush(input, 0, NULL);
+            do {
+                ctxtlex();
+                ops++;
+            } while (tok != ENDINPUT && tok != LEXERR);
+            inpop();
+            errflag = 0;
+            popheap();
+        }
+    *check = ops;
+    return ops;
+}
+
+static size_t case_parse(unsigned long *check)
+{
+    size_t ops = 0, i;
+    int s;
+
+    for (s = 0; s < scale; s++)
+        for (i = 0; i < ncorpus; i++) {
+            Eprog prog = libzsh_parse_entered(corpus[i].buf, corpus[i].len,
+                                              LIBZSH_PARSE_QUIET);
+
+            if (prog)
+                *check += prog->len;
+            ops += corpus[i].lines;
+        }
+    freeheap();
+    return ops;
+}
+
+#define COMPILES 2000
+
+static size_t case_patcompile(unsigned long *check)
+{
+    size_t ops = 0, i, j;
+    int s;
+
+    pushheap();
+    for (s = 0; s < scale; s++)
+        for (j = 0; j < COMPILES; j++) {
+            for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+                char *p = dupstring(patterns[i]);
+                Patprog prog;
+
+                tokenize(p);
+                if ((prog = patcompile(p, 0, NULL)))
+                    *check += prog->size;
+                ops++;
+            }
+            freeheap();
+        }
+    popheap();
+    return ops;
+}
+
+static size_t case_pattry(unsigned long *check)
+{
+    size_t ops = 0, i, j;
+    int s;
+
+    pushheap();
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        char *p = dupstring(patterns[i]);
+        Patprog prog;
+
+        tokenize(p);
+        if (!(prog = patcompile(p, 0, NULL)))
+            continue;
+        for (s = 0; s < scale; s++)
+            for (j = 0; j < NPATHS; j++, ops++)
+                if (pattry(prog, paths[j]))
+                    ++*check;
+    }
+    popheap();
+    return ops;
+}
+
+#define LOOKUP_ROUNDS 100
+
+static size_t case_getnode(unsigned long *check)
+{
+    size_t ops = 0, t, i;
+    int s;
+
+    for (s = 0; s < scale * LOOKUP_ROUNDS; s++)
+        for (t = 0; t < NTABLES; t++) {
+            HashTable ht = *tables[t].htp;
+
+            for (i = 0; i < NQUERIES; i++)
+                if (ht->getnode(ht, tables[t].queries[i]))
+                    ++*check;
+            ops += NQUERIES;
+        }
+    return ops;
+}
+
+#ifdef LIBZSH_WITH_ZLE
+#define LINE_LEN  20000
+#define EDIT_LEN  8
+#define EDITS     20000
+
+/*
+ * Insert and delete a few characters at scattered places on a long
+ * line, with the ZLE line globals pointed at a line of our own.
+ */
+static size_t case_edit(unsigned long *check)
+{
+    ZLE_STRING_T oline = zleline;
+    int oll = zlell, ocs = zlecs, osz = linesz, omark = mark;
+    unsigned int seed = 99;
+    size_t ops = 0;
+    int i, s;
+
+    zleline = NULL;
+    linesz = 0;
+    sizeline(LINE_LEN + EDIT_LEN + 1);
+    for (i = 0; i < LINE_LEN; i++)
+        zleline[i] = (ZLE_CHAR_T)('a' + i % 26);
+    zlell = LINE_LEN;
+    mark = 0;
+
+    for (s = 0; s < scale; s++)
+        for (i = 0; i < EDITS; i++) {
+            int pos, k;
+
+            seed = seed * 1103515245 + 12345;
+            pos = (int)((seed >> 8) % (zlell + 1));
+            zlecs = pos;
+            spaceinline(EDIT_LEN);
+            for (k = 0; k < EDIT_LEN; k++)
+                zleline[pos + k] = (ZLE_CHAR_T)'x';
+            zlecs = pos;
+            foredel(EDIT_LEN, 0);
+            ops += 2;
+        }
+    *check = (unsigned long)zlell;
+
+    /* sizeline() uses realloc() */
+    free(zleline);
+    zleline = oline;
+    zlell = oll;
+    zlecs = ocs;
+    linesz = osz;
+    mark = omark;
+    return ops;
+}
+#endif
+
+struct bench_case {
+    const char *name;
+    const char *unit;
+    size_t (*run)(unsigned long *check);
+};
+
+static const struct bench_case cases[] = {
+    { "lex", "tokens", case_lex },
+    { "parse", "lines", case_parse },
+    { "patcompile", "patterns", case_patcompile },
+    { "pattry", "matches", case_pattry },
+    { "getnode", "lookups", case_getnode },
+#ifdef LIBZSH_WITH_ZLE
+    { "zle_edit", "edits", case_edit },
+#endif
+};
+
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int wanted(const char *name, char **sel, int nsel)
+{
+    int i;
+
+    if (!nsel)
+        return 1;
+    for (i = 0; i < nsel; i++)
+        if (!strcmp(sel[i], name))
+            return 1;
+    return 0;
+}
+
+static int usage(void)
+{
+    size_t i;
+
+    fprintf(stderr, "usage: libzsh_bench [-r repeats] [-s scale] "
+            "[-c dir]... [-o file] [case]...\ncases:");
+    for (i = 0; i < NCASES; i++)
+        fprintf(stderr, " %s", cases[i].name);
+    fputc('\n', stderr);
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *cdirs[MAX_DIRS], *outpath = NULL;
+    double times[MAX_REPEATS];
+    int ndirs = 0, repeats = 5, opt, first = 1, failed = 0, r;
+    size_t i, bytes = 0;
+    long lines = 0;
+    FILE *out = stdout;
+
+    while ((opt = getopt(argc, argv, "r:s:c:o:")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 's':
+            scale = atoi(optarg);
+            break;
+        case 'c':
+            if (ndirs == MAX_DIRS)
+                return usage();
+            cdirs[ndirs++] = optarg;
+            break;
+        case 'o':
+            outpath = optarg;
+            break;
+        default:
+            return usage();
+        }
+    }
+    if (repeats < 1 || repeats > MAX_REPEATS || scale < 1)
+        return usage();
+    for (r = optind; r < argc; r++) {
+        for (i = 0; i < NCASES && strcmp(argv[r], cases[i].name); i++)
+            ;
+        if (i == NCASES)
+            return usage();
+    }
+
+    /* For the patterns with ^, (#i) and <a-b> */
+    if (libzsh_init() != 0 ||
+#ifdef LIBZSH_WITH_ZLE
+        libzsh_zle_init() != 0 ||
+#endif
+        !(ctx = libzsh_context_new()) ||
+        libzsh_context_setopt(ctx, "extendedglob", 1) != 0) {
+        fprintf(stderr, "libzsh_bench: initialization failed\n");
+        return 1;
+    }
+    if (outpath && !(out = fopen(outpath, "w"))) {
+        perror(outpath);
+        return 1;
+    }
+
+    /* The default corpus is a colon-separated list of directories */
+    if (!ndirs) {
+        static char deflt[] = LIBZSH_BENCH_CORPUS;
+        char *d;
+
+        for (d = strtok(deflt, ":"); d && ndirs < MAX_DIRS;
+             d = strtok(NULL, ":"))
+            cdirs[ndirs++] = d;
+    }
+    for (r = 0; r < ndirs; r++)
+        load_dir(ctx, cdirs[r]);
+    if (!ncorpus)
+        generate_corpus();
+    for (i = 0; i < ncorpus; i++) {
+        bytes += corpus[i].len;
+        lines += corpus[i].lines;
+    }
+    make_paths();
+    for (i = 0; i < NTABLES; i++)
+        make_queries(&tables[i]);
+
+    fprintf(out, "{\n  \"benchmark\": \"libzsh_bench\",\n"
+            "  \"zsh_version\": \"%s\",\n  \"repeats\": %d,\n"
+            "  \"scale\": %d,\n", ZSH_VERSION, repeats, scale);
+    fprintf(out, "  \"corpus\": { \"source\": \"%s\", \"files\": %zu, "
+            "\"lines\": %ld, \"bytes\": %zu },\n  \"results\": [",
+            corpus_generated ? "generated" : "files", ncorpus, lines, bytes);
+
+    for (i = 0; i < NCASES; i++) {
+        unsigned long check = 0, first_check = 0;
+        size_t ops;
+        double t0, best, median;
+
+        if (!wanted(cases[i].name, argv + optind, argc - optind))
+            continue;
+
+        libzsh_context_enter(ctx);
+        ops = cases[i].run(&first_check);
+        for (r = 0; r < repeats; r++) {
+            check = 0;
+            t0 = now();
+            cases[i].run(&check);
+            times[r] = now() - t0;
+            if (check != first_check) {
+                fprintf(stderr, "%s: found %lu on one run, %lu on another\n",
+                        cases[i].name, first_check, check);
+                failed++;
+            }
+        }
+        libzsh_context_leave(ctx);
+
+        qsort(times, repeats, sizeof(times[0]), cmp_double);
+        best = times[0];
+        median = times[repeats / 2];
+        fprintf(out, "%s\n    { \"name\": \"%s\", \"unit\": \"%s\", "
+                "\"ops\": %zu, \"check\": %lu,\n      \"best_s\": %.6f, "
+                "\"median_s\": %.6f, \"per_sec\": %.0f, \"ns_per_op\": %.2f }",
+                first ? "" : ",", cases[i].name, cases[i].unit, ops, check,
+                best, median, best > 0 ? ops / best : 0.0,
+                ops ? best * 1e9 / ops : 0.0);
+        fflush(out);
+        first = 0;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+    libzsh_context_free(ctx);
+    return failed ? 1 : 0;
+}
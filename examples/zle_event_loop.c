@@ -0,0 +1,177 @@
+/*
+ * zle_event_loop.c - Driving ZLE from a poll() loop
+ *
+ * This example shows how to:
+ * - Feed terminal input to a libzsh_zle session without blocking in ZLE
+ * - Resolve ambiguous key sequences (such as a lone ESC) on a timeout
+ * - Redraw with libzsh_screen only when a widget changed something
+ * - Take pasted text in one piece with bracketed paste
+ *
+ * Keys are handled by the real emacs keymap and widgets.  A program
+ * serving many terminals would keep one session and one screen per
+ * terminal and poll all their descriptors in the same loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libzsh.h"
+
+/* How long to wait before resolving a pending key sequence (KEYTIMEOUT) */
+#define KEY_TIMEOUT_MS 400
+
+static struct termios orig_termios;
+
+/* Ask the terminal to mark pasted text, so it isn't typed key by key */
+#define PASTE_ON  "\033[?2004h"
+#define PASTE_OFF "\033[?2004l"
+
+static void disable_raw_mode(void)
+{
+    ssize_t n = write(STDOUT_FILENO, PASTE_OFF, sizeof(PASTE_OFF) - 1);
+
+    (void)n;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+static int enable_raw_mode(void)
+{
+    struct termios raw;
+
+    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1)
+        return -1;
+    raw = orig_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_oflag &= ~(OPOST);
+    raw.c_cflag |= (CS8);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+        return -1;
+    atexit(disable_raw_mode);
+    if (write(STDOUT_FILENO, PASTE_ON, sizeof(PASTE_ON) - 1) < 0)
+        return -1;
+    return 0;
+}
+
+static int write_stdout(void *data, const char *buf, size_t len)
+{
+    (void)data;
+
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int terminal_columns(void)
+{
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+    return 80;
+}
+
+static void redraw(libzsh_zle *session, libzsh_screen *screen,
+                   const char *prompt)
+{
+    size_t len, cursor;
+    const char *line = libzsh_zle_line(session, &len, &cursor);
+
+    libzsh_screen_frame(screen, prompt, strlen(prompt), line, len, cursor);
+}
+
+int main(void)
+{
+    const char *prompt = "feed> ";
+    libzsh_zle *session;
+    libzsh_screen *screen;
+    struct pollfd pfd;
+    int pending = 0, quit = 0;
+
+    setlocale(LC_ALL, "");
+    if (libzsh_zle_init() != 0) {
+        fprintf(stderr, "Could not initialize ZLE\n");
+        return 1;
+    }
+    session = libzsh_zle_new("emacs");
+    screen = libzsh_screen_new(terminal_columns(), write_stdout, NULL);
+    if (!session || !screen) {
+        fprintf(stderr, "Could not create the editor\n");
+        return 1;
+    }
+
+    printf("ZLE Event Loop Example (Ctrl+D on an empty line quits)\n");
+    fflush(stdout);
+    enable_raw_mode();
+    redraw(session, screen, prompt);
+
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+
+    while (!quit) {
+        char buf[256];
+        ssize_t n;
+        int events, ret;
+
+        ret = poll(&pfd, 1, pending ? KEY_TIMEOUT_MS : -1);
+        if (ret < 0)
+            break;
+        if (ret == 0) {
+            events = libzsh_zle_timeout(session);
+        } else {
+            n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            events = libzsh_zle_feed(session, buf, n);
+        }
+
+        for (;;) {
+            if (events & LIBZSH_ZLE_REDRAW)
+                redraw(session, screen, prompt);
+            if (events & LIBZSH_ZLE_BEEP)
+                write_stdout(NULL, "\a", 1);
+            if (events & LIBZSH_ZLE_EOF) {
+                quit = 1;
+                break;
+            }
+            if (!(events & LIBZSH_ZLE_ACCEPT))
+                break;
+
+            /* Show the accepted line, then carry on with any queued input */
+            {
+                size_t len;
+                const char *line = libzsh_zle_line(session, &len, NULL);
+                char msg[64];
+                int mlen;
+
+                libzsh_screen_finish(screen);
+                write_stdout(NULL, "accepted: ", 10);
+                write_stdout(NULL, line, len);
+                mlen = snprintf(msg, sizeof(msg), " (%zu bytes)\r\n", len);
+                write_stdout(NULL, msg, mlen);
+            }
+            events = libzsh_zle_feed(session, NULL, 0);
+            events |= LIBZSH_ZLE_REDRAW;
+        }
+        pending = (events & LIBZSH_ZLE_PENDING) != 0;
+    }
+
+    libzsh_screen_finish(screen);
+    libzsh_screen_free(screen);
+    libzsh_zle_free(session);
+    return 0;
+}
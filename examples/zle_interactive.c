@@ -14,6 +14,7 @@
  * - Ctrl+A/E for beginning/end of line
  * - Ctrl+K to kill to end of line
  * - Ctrl+U to kill entire line
+ * - Bracketed paste, inserted in one go
  * - Enter to accept line
  * - Ctrl+C/Ctrl+D to quit
  */
@@ -24,21 +25,11 @@
 #include <locale.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 
 #include "zsh.mdh"
 #include "zle.mdh"
-
-/* Forward declarations */
-extern void createoptiontable(void);
-extern void createaliastables(void);
-extern void createreswdtable(void);
-extern void init_thingies(void);
-extern void init_keymaps(void);
-
-extern unsigned char *cmdstack;
-extern int cmdsp;
-extern int strin;
-#define CMDSTACKSZ 256
+#include "libzsh.h"
 
 /* ZLE globals */
 extern ZLE_STRING_T zleline;
@@ -56,34 +47,42 @@ extern void spaceinline(int ct);
 extern void foredel(int ct, int flags);
 extern void backdel(int ct, int flags);
 
+/* Context used for parsing accepted lines */
+static libzsh_context *parse_ctx;
+
+/* Redisplay of the prompt and line */
+static libzsh_screen *screen;
+
 /* Terminal state */
 static struct termios orig_termios;
 static int raw_mode = 0;
 
-/* History */
-#define HISTORY_MAX 100
-static char *history[HISTORY_MAX];
+/* Ask the terminal to mark pasted text (bracketed paste) */
+#define PASTE_ON  "\033[?2004h"
+#define PASTE_OFF "\033[?2004l"
+
+/* History, indexed for Ctrl+R */
+static libzsh_history *history;
 static int history_count = 0;
 static int history_pos = 0;
 static char *saved_line = NULL;  /* saves current line when browsing history */
 
+static const char *history_line(int i)
+{
+    return libzsh_history_get(history, i, NULL);
+}
+
 static void history_add(const char *line)
 {
     if (!line || !*line)
         return;
 
     /* Don't add duplicates of the last entry */
-    if (history_count > 0 && strcmp(history[history_count - 1], line) == 0)
+    if (history_count > 0 && strcmp(history_line(history_count - 1), line) == 0)
         return;
 
-    if (history_count >= HISTORY_MAX) {
-        /* Remove oldest entry */
-        free(history[0]);
-        memmove(history, history + 1, (HISTORY_MAX - 1) * sizeof(char *));
-        history_count--;
-    }
-
-    history[history_count++] = strdup(line);
+    if (libzsh_history_add(history, line, strlen(line)) >= 0)
+        history_count++;
 }
 
 static void set_line_from_string(const char *s)
@@ -108,6 +107,8 @@ static void set_line_from_string(const char *s)
 static void disable_raw_mode(void)
 {
     if (raw_mode) {
+        fputs(PASTE_OFF, stdout);
+        fflush(stdout);
         tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
         raw_mode = 0;
     }
@@ -136,6 +137,8 @@ static void enable_raw_mode(void)
         return;
 
     raw_mode = 1;
+    fputs(PASTE_ON, stdout);
+    fflush(stdout);
     if (!atexit_registered) {
         atexit(disable_raw_mode);
         atexit_registered = 1;
@@ -144,66 +147,53 @@ static void enable_raw_mode(void)
 
 static void init_zle_subsystem(void)
 {
-    int t0;
-
     setlocale(LC_ALL, "");
 
-    /* Set up metafication type table */
-    typtab['\0'] |= IMETA;
-    typtab[STOUC(Meta)] |= IMETA;
-    typtab[STOUC(Marker)] |= IMETA;
-    for (t0 = (int)STOUC(Pound); t0 <= (int)STOUC(Nularg); t0++)
-        typtab[t0] |= ITOK | IMETA;
-
-    /* Set up file descriptor table */
-    fdtable_size = zopenmax();
-    fdtable = zshcalloc(fdtable_size * sizeof(*fdtable));
-    fdtable[0] = fdtable[1] = fdtable[2] = FDT_EXTERNAL;
-
-    /* Create option table */
-    createoptiontable();
-
-    /* Initialize lexer tables */
-    initlextabs();
+    /* Shared tables, then the ZLE widget and keymap tables */
+    libzsh_zle_init();
+}
 
-    /* Initialize hash tables */
-    createreswdtable();
-    createaliastables();
+/* Screen output sink: one write() per frame */
+static int write_stdout(void *data, const char *buf, size_t len)
+{
+    (void)data;
 
-    /* Initialize command stack */
-    cmdstack = (unsigned char *)zalloc(CMDSTACKSZ);
-    cmdsp = 0;
+    /* Anything printed with stdio goes first */
+    fflush(stdout);
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
 
-    /* Initialize parser */
-    init_parse();
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
 
-    /* Initialize history */
-    strin = 1;
-    hbegin(0);
+static int terminal_columns(void)
+{
+    struct winsize ws;
 
-    /* Initialize ZLE */
-    init_thingies();
-    init_keymaps();
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+    return 80;
 }
 
 /* Refresh the display */
 static void refresh_line(const char *prompt)
 {
-    int outll, outcs;
+    int outll, outcs, len, cs, i;
     char *str = zlelineasstring(zleline, zlell, zlecs, &outll, &outcs, 1);
 
-    /* Move to beginning of line, clear line */
-    printf("\r\033[K");
-
-    /* Print prompt and line */
-    printf("%s%s", prompt, str);
-
-    /* Move cursor to correct position */
-    if (zlecs < zlell) {
-        printf("\033[%dD", zlell - zlecs);
+    /* The cursor offset in the unmetafied text */
+    for (i = cs = 0; i < outcs; i++, cs++) {
+        if (str[i] == Meta)
+            i++;
     }
+    unmetafy(str, &len);
 
-    fflush(stdout);
+    libzsh_screen_frame(screen, prompt, strlen(prompt), str, len, cs);
 }
 
 /* Insert a character at cursor position */
@@ -214,6 +204,51 @@ static void insert_char(int c)
     zlecs++;
 }
 
+/*
+ * Insert a run of text at the cursor: convert it once, make room once.
+ * Inserting a long paste with insert_char() would move the rest of the
+ * line for every character.
+ */
+static void insert_text(const char *s, size_t len)
+{
+    ZLE_STRING_T ws;
+    int wl, wsz;
+
+    ws = stringaszleline(metafy((char *)s, (int)len, META_HEAPDUP), 0,
+                         &wl, &wsz, NULL);
+    spaceinline(wl);
+    ZS_memcpy(zleline + zlecs, ws, wl);
+    zlecs += wl;
+    free(ws);
+}
+
+/* Read a bracketed paste up to ESC [201~ and insert it; -1 on EOF */
+static int read_paste(void)
+{
+    static const char end[] = "\033[201~";
+    size_t len = 0, sz = 256, matched = 0;
+    char *buf = malloc(sz);
+    int c;
+
+    while ((c = getchar()) != EOF) {
+        if (len == sz)
+            buf = realloc(buf, sz *= 2);
+        /* Terminals send returns for newlines */
+        buf[len++] = c == '\r' ? '\n' : c;
+        if (c == end[matched]) {
+            if (++matched == sizeof(end) - 1) {
+                len -= matched;
+                insert_text(buf, len);
+                free(buf);
+                return 0;
+            }
+        } else
+            matched = (c == end[0]);
+    }
+    free(buf);
+    return -1;
+}
+
 /* Reverse incremental search */
 static int reverse_search(const char *prompt)
 {
@@ -228,7 +263,7 @@ static int reverse_search(const char *prompt)
 
         /* Show matching history entry if found */
         if (found_pos >= 0 && found_pos < history_count) {
-            printf("%s", history[found_pos]);
+            printf("%s", history_line(found_pos));
         }
         fflush(stdout);
 
@@ -239,12 +274,14 @@ static int reverse_search(const char *prompt)
         if (c == '\r' || c == '\n') {
             /* Accept the found entry */
             if (found_pos >= 0) {
-                set_line_from_string(history[found_pos]);
+                set_line_from_string(history_line(found_pos));
             }
             printf("\r\n");
+            libzsh_screen_reset(screen);
             refresh_line(prompt);
             return 0;
         } else if (c == 7 || c == 27) {  /* Ctrl+G or Escape - cancel */
+            libzsh_screen_reset(screen);
             refresh_line(prompt);
             return 0;
         } else if (c == 18) {  /* Ctrl+R - search backwards more */
@@ -266,14 +303,9 @@ static int reverse_search(const char *prompt)
             continue;
         }
 
-        /* Search backwards for match */
-        found_pos = -1;
-        for (int i = search_pos - 1; i >= 0; i--) {
-            if (strstr(history[i], search_buf) != NULL) {
-                found_pos = i;
-                break;
-            }
-        }
+        /* Search backwards for match, through the index */
+        found_pos = libzsh_history_search(history, search_buf, search_len,
+                                          search_pos);
     }
 }
 
@@ -294,8 +326,8 @@ static char *readline_zle(const char *prompt)
     free(saved_line);
     saved_line = NULL;
 
-    printf("%s", prompt);
-    fflush(stdout);
+    libzsh_screen_reset(screen);
+    refresh_line(prompt);
 
     while (!done) {
         c = getchar();
@@ -306,8 +338,8 @@ static char *readline_zle(const char *prompt)
         switch (c) {
         case '\r':
         case '\n':
-            /* Accept line (use \r\n since we're in raw mode) */
-            printf("\r\n");
+            /* Accept line: move below it */
+            libzsh_screen_finish(screen);
             done = 1;
             break;
 
@@ -384,7 +416,7 @@ static char *readline_zle(const char *prompt)
                             saved_line = strdup(cur);
                         }
                         history_pos--;
-                        set_line_from_string(history[history_pos]);
+                        set_line_from_string(history_line(history_pos));
                         refresh_line(prompt);
                     }
                     break;
@@ -395,7 +427,7 @@ static char *readline_zle(const char *prompt)
                             /* Restore saved line */
                             set_line_from_string(saved_line);
                         } else {
-                            set_line_from_string(history[history_pos]);
+                            set_line_from_string(history_line(history_pos));
                         }
                         refresh_line(prompt);
                     }
@@ -420,6 +452,14 @@ static char *readline_zle(const char *prompt)
                     zlecs = zlell;
                     refresh_line(prompt);
                     break;
+                case '2':  /* Start of a paste is ESC [200~ */
+                    if (getchar() != '0' || getchar() != '0' ||
+                        getchar() != '~')
+                        break;
+                    if (read_paste() < 0)
+                        return NULL;
+                    refresh_line(prompt);
+                    break;
                 case '3':  /* Delete key (followed by ~) */
                     c = getchar();  /* consume the ~ */
                     if (c == EOF)
@@ -470,6 +510,9 @@ int main(int argc, char *argv[])
 
     /* Initialize */
     init_zle_subsystem();
+    parse_ctx = libzsh_context_new();
+    history = libzsh_history_new();
+    screen = libzsh_screen_new(terminal_columns(), write_stdout, NULL);
     enable_raw_mode();
 
     /* Interactive loop */
@@ -483,29 +526,14 @@ int main(int argc, char *argv[])
             printf("You entered: \"%s\"\n", line);
 
             /* Demo: parse the input */
-            pushheap();
-            lexinit();
-            strin = 1;
-
-            /* Allocate space for line + newline + null */
-            size_t len = strlen(line);
-            char *input = zalloc(len + 2);
-            memcpy(input, line, len);
-            input[len] = '\n';
-            input[len + 1] = '\0';
-            inpush(input, 0, NULL);
-
-            Eprog prog = parse_list();
+            Eprog prog = libzsh_parse(parse_ctx, line, strlen(line), 0);
             if (prog && !empty_eprog(prog)) {
-                char *text = getpermtext(prog, prog->prog, 0);
+                char *text = libzsh_eprog_text(parse_ctx, prog);
                 printf("Parsed as: %s\n", text);
-                freeeprog(prog);
+                zsfree(text);
             } else {
                 printf("(Could not parse)\n");
             }
-
-            inpop();
-            popheap();
         }
 
         zsfree(line);
@@ -515,10 +543,11 @@ int main(int argc, char *argv[])
     disable_raw_mode();
     printf("\nGoodbye!\n");
 
+    libzsh_screen_free(screen);
+    libzsh_context_free(parse_ctx);
+
     /* Cleanup history */
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
-    }
+    libzsh_history_free(history);
     free(saved_line);
 
     return 0;
@@ -0,0 +1,144 @@
+#!/bin/bash
+# Generate libzsh_phash.h: perfect hash tables of the reserved words,
+# builtins and option names compiled into zsh
+
+set -e
+
+ZSH_SRC_DIR="$1"
+OUTPUT_DIR="$2"
+
+mkdir -p "$OUTPUT_DIR"
+
+# Print "name value" for each {{NULL, "name", flags}, value} entry of the
+# array declared on the line matching $2 in file $1
+hashnode_entries() {
+    sed -n "/$2/,/^};/p" "$1" |
+        sed -e 's|/\*[^*]*\*/||g' |
+        sed -n 's/^[ 	]*{{NULL,[ 	]*"\([^"]*\)",[^}]*},[ 	]*\([-A-Za-z_0-9]*\)}.*/\1 \2/p'
+}
+
+# Builtins compiled in only under some condition are left out
+builtin_entries() {
+    sed -n '/^static struct builtin builtins\[\]/,/^};/p' "$1" |
+        sed -e '/^#if/,/^#endif/d' |
+        sed -n -e 's/^[ 	]*BUILTIN("\([^"]*\)".*/\1 1/p' \
+            -e 's/^[ 	]*BIN_PREFIX("\([^"]*\)".*/\1 1/p'
+}
+
+# Turn "name value" lines into a table named $1.  Each name is hashed
+# once (h = h * 33 + c from 5381) and the hash split two ways: its
+# bucket is the high bits of h times PH_BUCKET_MULT, and its slot the
+# high bits of h times PH_SLOT_MULT * (2d + 1), where d is the smallest
+# displacement for the bucket that puts all its names in free slots.
+# Must agree with libzsh_phash_find().
+perfect_table() {
+    LC_ALL=C awk -v name="$1" '
+    function mulmod32(a, b,    hi) {
+        hi = int(a / 65536)
+        return ((hi * b) % 65536 * 65536 + (a % 65536) * b) % 4294967296
+    }
+    function range(x, n) {
+        return int(x * n / 4294967296)
+    }
+    BEGIN {
+        split("", key); split("", val); n = 0
+        for (i = 0; i < 256; i++)
+            ord[sprintf("%c", i)] = i
+    }
+    NF == 2 && !($1 in seen) {
+        seen[$1] = 1
+        key[n] = $1; val[n] = $2; n++
+    }
+    END {
+        if (!n) {
+            print "gen_phash.sh: no names for " name > "/dev/stderr"
+            exit 1
+        }
+        nslots = n + int(n / 4) + 1
+        nbuckets = int(n / 2) + 1
+        for (i = 0; i < nbuckets; i++)
+            bsize[i] = 0
+        for (i = 0; i < n; i++) {
+            h = 5381
+            for (j = 1; j <= length(key[i]); j++)
+                h = (h * 33 + ord[substr(key[i], j, 1)]) % 4294967296
+            if (h in hseen) {
+                print "gen_phash.sh: " key[i] " and " key[hseen[h]] \
+                    " hash alike" > "/dev/stderr"
+                exit 1
+            }
+            hseen[h] = i
+            hash[i] = h
+            b = range(mulmod32(h, 2246822507), nbuckets)
+            member[b, bsize[b]++] = i
+        }
+        for (i = 0; i < nslots; i++)
+            slot[i] = -1
+        # Largest buckets first, while there is most room
+        for (done = 0; done < nbuckets; done++) {
+            best = -1
+            for (b = 0; b < nbuckets; b++)
+                if (!(b in disp) && (best < 0 || bsize[b] > bsize[best]))
+                    best = b
+            b = best
+            for (d = 0; d < 65536; d++) {
+                m = (2654435761 * (2 * d + 1)) % 4294967296
+                ok = 1
+                split("", taken)
+                for (k = 0; k < bsize[b] && ok; k++) {
+                    s = range(mulmod32(hash[member[b, k]], m), nslots)
+                    if (slot[s] >= 0 || (s in taken))
+                        ok = 0
+                    taken[s] = 1
+                    at[k] = s
+                }
+                if (ok)
+                    break
+            }
+            if (!ok) {
+                print "gen_phash.sh: no displacement for " name \
+                    > "/dev/stderr"
+                exit 1
+            }
+            disp[b] = d
+            for (k = 0; k < bsize[b]; k++)
+                slot[at[k]] = member[b, k]
+        }
+
+        printf "/* %s: %d names in %d slots */\n", name, n, nslots
+        printf "static const unsigned short ph_%s_disp[%d] = {", \
+            name, nbuckets
+        for (b = 0; b < nbuckets; b++)
+            printf "%s%s%d", b ? "," : "", b % 12 ? " " : "\n    ", disp[b]
+        printf "\n};\n"
+        printf "static const struct ph_entry ph_%s_slots[%d] = {\n", \
+            name, nslots
+        for (s = 0; s < nslots; s++)
+            if (slot[s] < 0)
+                printf "    { NULL, 0 },\n"
+            else
+                printf "    { \"%s\", %s },\n", key[slot[s]], val[slot[s]]
+        printf "};\n"
+        printf "#define PH_%s_TABLE { ph_%s_slots, %d, ph_%s_disp, %d }\n\n", \
+            toupper(name), name, nslots, name, nbuckets
+    }'
+}
+
+{
+    echo '/** libzsh_phash.h                                   **/'
+    echo '/** perfect hash tables of names known at build time **/'
+    echo ''
+    echo '/* format: { name, value }, in the slot the name hashes to */'
+    echo ''
+    echo '#define PH_BUCKET_MULT 2246822507U'
+    echo '#define PH_SLOT_MULT   2654435761U'
+    echo ''
+    hashnode_entries "$ZSH_SRC_DIR/hashtable.c" '^static struct reswd reswds\[\]' |
+        perfect_table reswd
+    hashnode_entries "$ZSH_SRC_DIR/options.c" '^static struct optname optns\[\]' |
+        perfect_table option
+    builtin_entries "$ZSH_SRC_DIR/builtin.c" |
+        perfect_table builtin
+} > "$OUTPUT_DIR/libzsh_phash.h"
+
+echo "Generated perfect hash tables in $OUTPUT_DIR"
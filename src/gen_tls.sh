@@ -0,0 +1,379 @@
+#!/bin/bash
+# Make the zsh globals a context swaps thread-local
+#
+# gen_tls.sh ZSH_SRC_DIR ZSH_BUILD_SRC_DIR OUTPUT_DIR on|off
+#
+# Every file-scope declaration of the names below gets _Thread_local:
+# the zsh .c files with one are copied to OUTPUT_DIR/tls (their paths,
+# relative to ZSH_SRC_DIR, are listed in OUTPUT_DIR/tls/sources.list)
+# and the generated .epro and .pro headers in ZSH_BUILD_SRC_DIR are
+# patched where they are.  OUTPUT_DIR/libzsh_tls.h defines
+# LIBZSH_TLS_<name> to _Thread_local, or to nothing, for each name, so
+# that other code can declare them to match, and LIBZSH_TLS_COMPLETE
+# if nothing had to be left out.
+#
+# A name is left out, and with it those declared beside it, if it is
+# declared in a header under ZSH_SRC_DIR, defined more than once, or
+# has its address taken in a static initializer.  params.c points
+# $LINENO at lineno from its table of special parameters; that entry
+# is pointed at libzsh_lineno instead, which libzsh_context.c keeps up.
+#
+# With "off", the headers are put back and no copies are made.
+
+set -e
+
+ZSH_SRC_DIR="$1"
+ZSH_BUILD_SRC_DIR="$2"
+OUTPUT_DIR="$3"
+MODE="$4"
+
+TLS_DIR="$OUTPUT_DIR/tls"
+
+# The state lex_context_save(), parse_context_save() and
+# hist_context_save() stash, noaliases (which libzsh_lex_entered() sets
+# while it lexes), the input stack, the heaps, the options, the error
+# flags and the signal queue
+NAMES="
+    tok tokstr zshlextext tokfd toklineno lexstop isfirstln isfirstch
+    inalmore nocorrect nocomments lexflags wordbeg parbegin parend noaliases
+    lex_add_raw tokstr_raw lexbuf lexbuf_raw dbparens cmdstack cmdsp
+    incmdpos aliasspaceflag incond inredir incasepat isnewlin infor
+    inrepeat_ intypeset
+    hdocs ecbuf eclen ecused ecnpats ecstrs ecsoffs ecssub ecnfunc
+    hgetc hungetc hwaddc hwbegin hwabort hwend addtoline stophist
+    histactive histdone chline hptr chwords chwordlen chwordpos hlinesz
+    defev hist_keep_comment qbang
+    strin inbuf inbufptr inbufct inbufleft inbufflags instack
+    instacktop instacksz lineno
+    heaps fheap
+    opts
+    errflag noerrs
+    queueing_enabled queue_front queue_rear signal_queue
+    signal_mask_queue queue_in trap_queueing_enabled trap_queue_front
+    trap_queue_rear trap_queue
+"
+
+mkdir -p "$TLS_DIR"
+rm -rf "$TLS_DIR"/*.c "$TLS_DIR/Zle" "$TLS_DIR/headers" "$TLS_DIR/sources.list"
+
+# The generated headers as make left them: an earlier run may have
+# patched them in place
+HEADERS=$(cd "$ZSH_BUILD_SRC_DIR" &&
+          ls *.epro *.pro Zle/*.epro Zle/*.pro 2>/dev/null || true)
+PRISTINE="$TLS_DIR/headers"
+mkdir -p "$PRISTINE/Zle"
+for h in $HEADERS; do
+    sed -e 's/^_Thread_local //' "$ZSH_BUILD_SRC_DIR/$h" > "$PRISTINE/$h"
+done
+
+# Install the headers from dir $1, touching only those that change
+install_headers() {
+    for h in $HEADERS; do
+        if ! cmp -s "$1/$h" "$ZSH_BUILD_SRC_DIR/$h"; then
+            cp "$1/$h" "$ZSH_BUILD_SRC_DIR/$h"
+        fi
+    done
+}
+
+write_header() {
+    {
+        echo '/** libzsh_tls.h                                **/'
+        echo '/** zsh globals made thread-local by gen_tls.sh **/'
+        echo ''
+        for n in $NAMES; do
+            if echo " $1 " | grep -q " $n "; then
+                echo "#define LIBZSH_TLS_$n _Thread_local"
+            else
+                echo "#define LIBZSH_TLS_$n"
+            fi
+        done
+        if [ "$2" = complete ]; then
+            echo ''
+            echo '#define LIBZSH_TLS_COMPLETE 1'
+        fi
+    } > "$OUTPUT_DIR/libzsh_tls.h.new"
+    if cmp -s "$OUTPUT_DIR/libzsh_tls.h.new" "$OUTPUT_DIR/libzsh_tls.h"; then
+        rm -f "$OUTPUT_DIR/libzsh_tls.h.new"
+    else
+        mv "$OUTPUT_DIR/libzsh_tls.h.new" "$OUTPUT_DIR/libzsh_tls.h"
+    fi
+}
+
+if [ "$MODE" != on ]; then
+    install_headers "$PRISTINE"
+    rm -rf "$PRISTINE"
+    write_header "" ""
+    : > "$TLS_DIR/sources.list"
+    exit 0
+fi
+
+SOURCES=$(cd "$ZSH_SRC_DIR" && ls *.c Zle/*.c 2>/dev/null || true)
+STATIC_HEADERS=$(cd "$ZSH_SRC_DIR" && ls *.h Zle/*.h 2>/dev/null || true)
+
+# Find the file-scope declarations in each file given.  Prints
+#   D file line def name...   for a declaration (def: 1 if it defines)
+#   A file line name          for &name inside a static initializer
+# and, with rewrite set, writes the patched copies.
+SCAN='
+function strip(s,    out, i, c, q) {
+    out = ""
+    for (i = 1; i <= length(s); i++) {
+        c = substr(s, i, 1)
+        if (incomment) {
+            if (c == "*" && substr(s, i + 1, 1) == "/") {
+                incomment = 0
+                i++
+            }
+            continue
+        }
+        if (c == "/" && substr(s, i + 1, 1) == "*") {
+            incomment = 1
+            i++
+            continue
+        }
+        if (c == "/" && substr(s, i + 1, 1) == "/")
+            break
+        if (c == "\"" || c == "\047") {
+            q = c
+            out = out q
+            for (i++; i <= length(s); i++) {
+                c = substr(s, i, 1)
+                if (c == "\\")
+                    i++
+                else if (c == q)
+                    break
+            }
+            out = out q
+            continue
+        }
+        out = out c
+    }
+    return out
+}
+# The names a file-scope declaration declares, or "" if s is not one
+function declared(s,    p, n, i, piece, names) {
+    if (s !~ /;[ \t]*$/ || s ~ /^[ \t]/ || s ~ /^(typedef|return)[ \t]/)
+        return ""
+    sub(/;[ \t]*$/, "", s)
+    gsub(/_\(\(.*\)\)/, "", s)
+    while (match(s, /\([ \t]*\*+[ \t]*[A-Za-z_][A-Za-z0-9_]*[ \t]*\)/)) {
+        piece = substr(s, RSTART + 1, RLENGTH - 2)
+        gsub(/[ \t*]/, "", piece)
+        s = substr(s, 1, RSTART - 1) piece substr(s, RSTART + RLENGTH)
+    }
+    if (index(s, "("))
+        return ""
+    while (gsub(/\{[^{}]*\}/, "", s))
+        ;
+    gsub(/\[[^]]*\]/, "", s)
+    n = split(s, p, ",")
+    names = ""
+    for (i = 1; i <= n; i++) {
+        piece = p[i]
+        sub(/=.*$/, "", piece)
+        if (!match(piece, /[A-Za-z_][A-Za-z0-9_]*[ \t]*$/))
+            return ""
+        piece = substr(piece, RSTART, RLENGTH)
+        gsub(/[ \t]/, "", piece)
+        names = names " " piece
+    }
+    return names
+}
+FNR == 1 {
+    depth = 0; incomment = 0; ininit = 0; cont = 0; pendeq = 0
+    file = FILENAME
+    if (index(file, prefix) == 1)
+        file = substr(file, length(prefix) + 1)
+    if (rewrite) {
+        if (out)
+            close(out)
+        out = (file in patch) ? dest "/" file : ""
+    }
+}
+{
+    line = $0
+    s = strip(line)
+    if (cont || s ~ /^[ \t]*#/) {
+        cont = (s ~ /\\$/)
+        s = ""
+    } else if (depth == 0) {
+        names = declared(s)
+        if (names != "") {
+            def = (file ~ /\.c$/ && s !~ /^extern[ \t]/)
+            if (rewrite) {
+                split(names, nm, " ")
+                for (k in nm)
+                    if (nm[k] in tls) {
+                        line = "_Thread_local " line
+                        break
+                    }
+            } else
+                print "D", file, FNR, def names
+        }
+    }
+    if (depth > 0 && ininit)
+        for (k in want)
+            if (match(s, "&[ \t]*" k "([^A-Za-z0-9_]|$)")) {
+                if (rewrite && k == "lineno")
+                    gsub(/&[ \t]*lineno/, "\\&libzsh_lineno", line)
+                else if (!rewrite)
+                    print "A", file, FNR, k
+            }
+    opened = gsub(/\{/, "{", s)
+    closed = gsub(/\}/, "}", s)
+    if (depth == 0 && opened > closed)
+        ininit = (pendeq || s ~ /=[^{]*\{/)
+    if (depth == 0 && s ~ /[^ \t]/)
+        pendeq = (s ~ /=[ \t]*$/)
+    depth += opened - closed
+    if (depth < 0)
+        depth = 0
+    if (rewrite && out != "")
+        print line > out
+}
+'
+
+WANT=$(for n in $NAMES; do printf '%s ' "$n"; done)
+
+scan() {
+    awk -v prefix="$1/" -v rewrite=0 -v want_list="$WANT" \
+        "BEGIN { n = split(want_list, w, \" \"); for (i = 1; i <= n; i++) want[w[i]] = 1 } $SCAN" \
+        "${@:2}"
+}
+
+FOUND=$(
+    {
+        scan "$ZSH_SRC_DIR" $(for f in $SOURCES; do echo "$ZSH_SRC_DIR/$f"; done) |
+            sed 's/^/S /'
+        scan "$ZSH_SRC_DIR" $(for f in $STATIC_HEADERS; do echo "$ZSH_SRC_DIR/$f"; done) |
+            sed 's/^/H /'
+        [ -z "$HEADERS" ] ||
+            scan "$PRISTINE" $(for f in $HEADERS; do echo "$PRISTINE/$f"; done) |
+            sed 's/^/G /'
+    }
+)
+
+# Decide which names can be made thread-local.  Prints the names, then
+# "complete" or the names that had to be left out, then the files to
+# patch as "S file" or "G file".
+DECISION=$(echo "$FOUND" | awk -v want_list="$WANT" '
+    BEGIN {
+        n = split(want_list, w, " ")
+        for (i = 1; i <= n; i++)
+            want[w[i]] = 1
+    }
+    $2 == "D" {
+        key = $1 " " $3 " " $4
+        lines[key] = ""
+        for (i = 6; i <= NF; i++) {
+            lines[key] = lines[key] " " $i
+            if (!($i in want))
+                continue
+            decl[$i]++
+            if ($1 == "H")
+                drop[$i] = "declared in " $3
+            if ($5 == 1)
+                defs[$i]++
+        }
+    }
+    $2 == "A" && !($1 == "S" && $5 == "lineno") {
+        drop[$5] = "address taken in " $3
+    }
+    END {
+        for (k in want)
+            if (k in decl && defs[k] != 1 && !(k in drop))
+                drop[k] = defs[k] ? "defined more than once" : "no definition found"
+        # A line is patched whole, so all its names go or none do
+        do {
+            changed = 0
+            for (key in lines) {
+                m = split(lines[key], nm, " ")
+                bad = 0
+                for (i = 1; i <= m; i++)
+                    if (nm[i] in want && nm[i] in drop)
+                        bad = 1
+                    else if (!(nm[i] in want))
+                        for (j = 1; j <= m; j++)
+                            if (nm[j] in want)
+                                bad = 1
+                if (!bad)
+                    continue
+                for (i = 1; i <= m; i++)
+                    if (nm[i] in want && nm[i] in decl && !(nm[i] in drop)) {
+                        drop[nm[i]] = "declared beside a name left out"
+                        changed = 1
+                    }
+            }
+        } while (changed)
+        names = ""
+        for (k in want)
+            if (k in decl && !(k in drop))
+                names = names " " k
+        print names
+        left = ""
+        for (k in drop)
+            if (k in decl)
+                left = left " " k " (" drop[k] ")"
+        print left == "" ? "complete" : left
+        for (key in lines) {
+            split(key, kp, " ")
+            m = split(lines[key], nm, " ")
+            for (i = 1; i <= m; i++)
+                if (nm[i] in want && nm[i] in decl && !(nm[i] in drop))
+                    patch[kp[1] " " kp[2]] = 1
+        }
+        for (f in patch)
+            print f
+    }')
+
+TLS_NAMES=$(echo "$DECISION" | sed -n 1p)
+STATUS=$(echo "$DECISION" | sed -n 2p)
+PATCH_SOURCES=$(echo "$DECISION" | sed -n 's/^S //p')
+PATCH_HEADERS=$(echo "$DECISION" | sed -n 's/^G //p')
+
+rewrite() {
+    awk -v prefix="$1/" -v dest="$2" -v rewrite=1 -v want_list="$WANT" \
+        -v tls_list="$TLS_NAMES" -v patch_list="$3" \
+        "BEGIN {
+            n = split(want_list, w, \" \"); for (i = 1; i <= n; i++) want[w[i]] = 1
+            n = split(tls_list, w, \" \"); for (i = 1; i <= n; i++) tls[w[i]] = 1
+            n = split(patch_list, w, \" \"); for (i = 1; i <= n; i++) patch[w[i]] = 1
+        } $SCAN" "${@:4}"
+}
+
+# Files with &lineno in a static initializer are copied too
+COPIES=$( {
+    for f in $PATCH_SOURCES; do echo "$f"; done
+    if echo " $TLS_NAMES " | grep -q ' lineno '; then
+        echo "$FOUND" | sed -n 's/^S A \([^ ]*\) [0-9]* lineno$/\1/p'
+    fi
+} | sort -u)
+
+if [ -n "$COPIES" ]; then
+    mkdir -p "$TLS_DIR/Zle"
+    rewrite "$ZSH_SRC_DIR" "$TLS_DIR" "$(echo $COPIES)" \
+        $(for f in $COPIES; do echo "$ZSH_SRC_DIR/$f"; done)
+fi
+for f in $COPIES; do
+    echo "$f"
+done > "$TLS_DIR/sources.list"
+
+# Headers not patched are installed as they were
+if [ -n "$PATCH_HEADERS" ]; then
+    mkdir -p "$TLS_DIR/patched/Zle"
+    rewrite "$PRISTINE" "$TLS_DIR/patched" "$(echo $PATCH_HEADERS)" \
+        $(for f in $PATCH_HEADERS; do echo "$PRISTINE/$f"; done)
+    for f in $PATCH_HEADERS; do
+        mv "$TLS_DIR/patched/$f" "$PRISTINE/$f"
+    done
+    rm -rf "$TLS_DIR/patched"
+fi
+install_headers "$PRISTINE"
+rm -rf "$PRISTINE"
+
+write_header "$TLS_NAMES" "$STATUS"
+
+if [ "$STATUS" != complete ]; then
+    echo "gen_tls.sh: left shared:$STATUS" >&2
+fi
+echo "$STATUS"
@@ -0,0 +1,1090 @@
+/*
+ * libzsh.h - Public entry points of libzsh
+ *
+ * The zsh sources keep the lexer, parser, history and heap state in
+ * process globals.  A libzsh_context owns a private copy of that state
+ * and installs it while it is entered, so independent callers (and
+ * threads) can use the parser without stepping on each other.  With
+ * LIBZSH_THREAD_LOCAL those globals are per thread, and contexts on
+ * different threads parse at the same time.
+ *
+ * The read-only tables built by libzsh_init() (typtab, lexer tables,
+ * reserved words, aliases, option table) are shared by all contexts.
+ *
+ * A build may leave parts out (LIBZSH_COMPONENTS): the pattern, glob,
+ * expansion and arithmetic entry points are only there when
+ * LIBZSH_WITH_PATTERNS is defined, the ZLE and keymap ones when
+ * LIBZSH_WITH_ZLE is.
+ */
+
+#ifndef LIBZSH_H
+#define LIBZSH_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct libzsh_context libzsh_context;
+
+/* Parse output; the same type as zsh's Eprog */
+struct eprog;
+
+/*
+ * One-time process-wide initialization.  Safe to call more than once
+ * and from several threads; only the first call does any work.
+ * Returns 0 on success.
+ */
+int libzsh_init(void);
+
+/* Create and destroy a context.  libzsh_context_new() calls libzsh_init(). */
+libzsh_context *libzsh_context_new(void);
+void libzsh_context_free(libzsh_context *ctx);
+
+/*
+ * Install the context's state into the zsh globals for the current
+ * thread.  Until the matching libzsh_context_leave(), the caller may use
+ * the internal zsh API (parse_list(), zshlex(), pushheap(), ...)
+ * directly.  Entering blocks while another thread has a context entered,
+ * or the same context; contexts must not be nested.  libzsh_parse(),
+ * libzsh_parse_cached(), libzsh_lex() and the line lexer only wait for
+ * threads doing more than lexing and parsing, unless aliases are
+ * defined.
+ */
+void libzsh_context_enter(libzsh_context *ctx);
+void libzsh_context_leave(libzsh_context *ctx);
+
+/*
+ * Set a shell option (by name, as accepted by setopt) in the context's
+ * private option state.  Returns 0 on success, -1 for an unknown option.
+ * May be called with the context entered.
+ */
+int libzsh_context_setopt(libzsh_context *ctx, const char *name, int value);
+
+/*
+ * Diagnostics
+ *
+ * Errors and warnings from the lexer, parser, substitution, arithmetic,
+ * glob and pattern code are printed to stderr, as the shell prints
+ * them, unless the context has a sink.  Then each is handed to the
+ * sink as a record of the message's format and arguments, and is only
+ * formatted if the sink calls libzsh_diag_format().  Reports are made
+ * when zsh would print them: not while errors are suppressed, as by
+ * LIBZSH_PARSE_QUIET, nor after the first error of a parse.
+ */
+#define LIBZSH_DIAG_ERROR   0   /* zerr(): the operation failed */
+#define LIBZSH_DIAG_WARNING 1   /* zwarn(): reported, but carried on */
+
+/* Where a report was made */
+#define LIBZSH_DIAG_LEXER   0
+#define LIBZSH_DIAG_PARSER  1   /* syntax errors: "parse error near `%l'" */
+#define LIBZSH_DIAG_SUBST   2
+#define LIBZSH_DIAG_MATH    3
+#define LIBZSH_DIAG_GLOB    4
+#define LIBZSH_DIAG_PATTERN 5
+
+#define LIBZSH_DIAG_ARGS 3
+
+struct libzsh_diag {
+    int severity;               /* LIBZSH_DIAG_ERROR or _WARNING */
+    int source;                 /* LIBZSH_DIAG_LEXER ... */
+    long line;                  /* line of the input, from 1 */
+    long offset;                /* bytes of libzsh_parse() input read; or -1 */
+    const char *fmt;            /* the message format, as zerr() takes it */
+    /*
+     * Its arguments in order: strings (%s, %l) as raw bytes, not
+     * NUL-terminated, and numbers (%d, %L, %c, %e).  For a syntax error
+     * str[0] is the token it is near.
+     */
+    int nstr, nnum;
+    const char *str[LIBZSH_DIAG_ARGS];
+    size_t len[LIBZSH_DIAG_ARGS];
+    long num[LIBZSH_DIAG_ARGS];
+};
+
+/*
+ * Called with the context entered, like a libzsh_event_fn; the record
+ * and its strings are only valid until it returns.
+ */
+typedef void (*libzsh_diag_fn)(void *data, const struct libzsh_diag *d);
+
+/* Send the context's reports to fn, or print them again if fn is NULL */
+void libzsh_context_set_diag(libzsh_context *ctx, libzsh_diag_fn fn,
+                             void *data);
+
+/*
+ * The message as zsh prints it after "zsh:line: ", into size bytes of
+ * buf, NUL-terminated; returns its full length, as snprintf() does.
+ */
+size_t libzsh_diag_format(const struct libzsh_diag *d, char *buf,
+                          size_t size);
+
+/*
+ * Flags for libzsh_parse()
+ */
+#define LIBZSH_PARSE_KEEP      (1<<0)  /* don't reset the arena first */
+#define LIBZSH_PARSE_PERMANENT (1<<1)  /* return a malloc'd copy */
+#define LIBZSH_PARSE_QUIET     (1<<2)  /* don't print errors to stderr */
+
+/*
+ * Parse len bytes of buf as a list of commands.  The buffer is owned by
+ * the caller, need not be NUL- or newline-terminated and may contain
+ * any bytes (they are metafied as needed).
+ *
+ * The result lives in the context's heap arena and stays valid until
+ * the next libzsh_parse() without LIBZSH_PARSE_KEEP, or the next
+ * libzsh_reset(), on the same context.  With LIBZSH_PARSE_PERMANENT the
+ * result is independent of the arena and must be released with
+ * freeeprog().  Returns NULL on a parse error.
+ *
+ * The context must not be entered by the caller.
+ */
+struct eprog *libzsh_parse(libzsh_context *ctx, const char *buf,
+                           size_t len, int flags);
+
+/* Release everything allocated in the context's heap arena. */
+void libzsh_reset(libzsh_context *ctx);
+
+/*
+ * Allocation pools
+ *
+ * Built with LIBZSH_POOL_ALLOC, zsh's permanent allocations of up to
+ * 256 bytes are cut from 64K chunks, one size class per chunk, and each
+ * context has its own pool, used while it is entered; otherwise the
+ * shared pool is.  Freeing a context frees its pool whole; what libzsh
+ * hands back or keeps in shared tables comes from the shared pool.
+ */
+
+#define LIBZSH_ALLOC_CLASSES 8
+
+struct libzsh_alloc_stats {
+    unsigned long allocs;       /* zalloc()s from this pool */
+    unsigned long frees;        /* zfree()s of its blocks */
+    unsigned long large;        /* zalloc()s passed on to malloc() */
+    unsigned long chunks;       /* chunks held now */
+    unsigned long chunks_made;  /* chunks ever allocated */
+    unsigned long live[LIBZSH_ALLOC_CLASSES];       /* blocks in use */
+    unsigned int class_size[LIBZSH_ALLOC_CLASSES];  /* their sizes */
+};
+
+/*
+ * Fill st with the counts of ctx's pool, or of the shared pool if ctx
+ * is NULL.  Returns 0, or -1 (and zeroes st) if libzsh was built
+ * without LIBZSH_POOL_ALLOC.
+ */
+int libzsh_alloc_stats(libzsh_context *ctx, struct libzsh_alloc_stats *st);
+
+/*
+ * Heap arenas
+ *
+ * The arenas behind pushheap() and zhalloc() are shared by all
+ * contexts.  Freed arenas are kept mapped, up to the policy's retain
+ * bytes, and reused for the next arena of the same size instead of
+ * being mapped again.  With LIBZSH_HEAP_HUGETLB (falling back to
+ * transparent huge pages) or LIBZSH_HEAP_THP, arenas are cut from 2M
+ * regions backed by huge pages; those are kept for good.  Only
+ * available when zsh maps its heaps (configure found mmap()).
+ */
+
+#define LIBZSH_HEAP_HUGETLB (1<<0)  /* MAP_HUGETLB regions */
+#define LIBZSH_HEAP_THP     (1<<1)  /* regions advised MADV_HUGEPAGE */
+
+struct libzsh_heap_policy {
+    size_t retain;              /* freed bytes kept mapped; default 256K */
+    int flags;                  /* LIBZSH_HEAP_* */
+};
+
+struct libzsh_heap_stats {
+    size_t in_use;              /* bytes of arenas in use */
+    size_t peak;                /* most in use at once */
+    size_t retained;            /* bytes of freed arenas kept mapped */
+    size_t huge;                /* bytes of huge page regions */
+    unsigned long maps;         /* arenas and regions mapped */
+    unsigned long reused;       /* arenas handed out again */
+    unsigned long unmaps;       /* arenas given back */
+};
+
+/*
+ * Set or get the process-wide policy; setting it unmaps retained arenas
+ * beyond the new limit.  Return 0, or -1 (ENOSYS if heaps aren't mapped
+ * through libzsh, EINVAL for unknown flags).
+ */
+int libzsh_heap_set_policy(const struct libzsh_heap_policy *p);
+int libzsh_heap_get_policy(struct libzsh_heap_policy *p);
+
+/* Fill st; returns 0, or -1 with ENOSYS (and st zeroed) as above. */
+int libzsh_heap_stats(struct libzsh_heap_stats *st);
+
+/*
+ * Instrumentation
+ *
+ * Built with LIBZSH_TRACE, the lexer, the parser, pattern compilation,
+ * globbing and redisplay count what they do, and the hash table indexes
+ * and heap arenas count their work too.  Everything is counted against
+ * the context entered at the time, or the shared counters when none is
+ * (libzsh_zle sessions, screens).  Without LIBZSH_TRACE the hooks are
+ * compiled away and these functions fail with ENOSYS.
+ */
+
+/* Traced calls */
+#define LIBZSH_TRACE_PARSE      0   /* parse_list(), parse_event() */
+#define LIBZSH_TRACE_PATCOMPILE 1   /* patcompile() */
+#define LIBZSH_TRACE_GLOB       2   /* zglob() */
+#define LIBZSH_TRACE_REFRESH    3   /* zrefresh() */
+#define LIBZSH_TRACE_KINDS      4
+
+struct libzsh_stats {
+    unsigned long tokens;       /* tokens from zshlex() and ctxtlex() */
+    unsigned long eprog_bytes;  /* bytes of wordcode parsed */
+    unsigned long heap_arenas;  /* arenas handed to zhalloc() */
+    unsigned long hash_lookups; /* lookups in indexed tables */
+    unsigned long hash_probes;  /* index slots they examined */
+    unsigned long refresh_bytes;        /* bytes of screen frames */
+    unsigned long calls[LIBZSH_TRACE_KINDS];
+    unsigned long long ns[LIBZSH_TRACE_KINDS];  /* time inside them */
+};
+
+/*
+ * Fill st with ctx's counters, or the shared ones if ctx is NULL.
+ * Nested calls (a parse inside a command substitution being parsed)
+ * are counted in each call's time.  Returns 0, or -1 with ENOSYS (and
+ * st zeroed); libzsh_stats_reset() clears the counters the same way.
+ */
+int libzsh_stats_get(libzsh_context *ctx, struct libzsh_stats *st);
+int libzsh_stats_reset(libzsh_context *ctx);
+
+#define LIBZSH_TRACE_BEGIN 0
+#define LIBZSH_TRACE_END   1
+
+/*
+ * Called at the start and end of each traced call made in the context,
+ * with the context entered and CLOCK_MONOTONIC's time in nanoseconds.
+ * It must not use the context.
+ */
+typedef void (*libzsh_trace_fn)(void *data, int kind, int phase,
+                                unsigned long long ns);
+
+/* Set or clear (NULL) ctx's hook; returns 0, or -1 with ENOSYS */
+int libzsh_context_set_trace(libzsh_context *ctx, libzsh_trace_fn fn,
+                             void *data);
+
+/*
+ * Record up to max traced calls made in ctx (0 stops recording and
+ * drops them), then write those recorded so far to fd as a Chrome
+ * trace, which Perfetto and chrome://tracing load, and forget them.
+ * Calls beyond max are only counted.  libzsh_trace_write() returns the
+ * number of calls written; both return -1 with errno on failure
+ * (ENOSYS without LIBZSH_TRACE).
+ */
+int libzsh_trace_record(libzsh_context *ctx, size_t max);
+int libzsh_trace_write(libzsh_context *ctx, int fd);
+
+/*
+ * Convert a parsed program back to text, as getpermtext() does.
+ * The result is allocated with zalloc(); free with zsfree().
+ */
+char *libzsh_eprog_text(libzsh_context *ctx, struct eprog *prog);
+
+/*
+ * Drop a reference to a permanent program, as freeeprog() does, under
+ * the context lock.  Use this rather than freeeprog() for programs that
+ * may be shared between threads, such as those from the parse cache.
+ */
+void libzsh_eprog_release(libzsh_context *ctx, struct eprog *prog);
+
+/*
+ * Walking parsed programs
+ *
+ * Visit the commands of a program in the order they appear, without
+ * turning it back into text.  Each command is handed over with its
+ * words, assignments and redirections as spans of the program's own
+ * strings: metafied, and with zsh's tokens in them where the span's
+ * tokens flag says so (untokenize() a copy to get the text).  Nothing
+ * is expanded.  The walk only reads the program, so it takes no
+ * context; programs from the parse cache may be walked by several
+ * threads at once.
+ */
+
+/* Node kinds; for commands, the same as zsh's WC_* command codes */
+#define LIBZSH_NODE_SIMPLE   6      /* words, or only assignments */
+#define LIBZSH_NODE_TYPESET  7      /* typeset and friends */
+#define LIBZSH_NODE_SUBSH    8      /* ( list ) */
+#define LIBZSH_NODE_CURSH    9      /* { list } */
+#define LIBZSH_NODE_TIMED    10     /* time pipeline */
+#define LIBZSH_NODE_FUNCDEF  11     /* names, then anonymous args */
+#define LIBZSH_NODE_FOR      12     /* names, then words; or 3 for (( )) */
+#define LIBZSH_NODE_SELECT   13     /* name, then words */
+#define LIBZSH_NODE_WHILE    14     /* condition list, then body */
+#define LIBZSH_NODE_REPEAT   15     /* count */
+#define LIBZSH_NODE_CASE     16     /* word; arms under it */
+#define LIBZSH_NODE_IF       17     /* branches under it */
+#define LIBZSH_NODE_COND     18     /* [[ ]]: operands, in order */
+#define LIBZSH_NODE_ARITH    19     /* (( )): the expression */
+#define LIBZSH_NODE_AUTOFN   20     /* a function still to be autoloaded */
+#define LIBZSH_NODE_TRY      21     /* { try } always { always } */
+#define LIBZSH_NODE_ARM      32     /* of a case (patterns) or an if */
+
+/* Node flags */
+#define LIBZSH_NODE_ASYNC    (1<<0) /* in a list run with & */
+#define LIBZSH_NODE_NOT      (1<<1) /* in a pipeline negated with ! */
+#define LIBZSH_NODE_COPROC   (1<<2) /* in a coproc pipeline */
+#define LIBZSH_NODE_PIPED    (1<<3) /* output piped to the next command */
+#define LIBZSH_NODE_AND      (1<<4) /* in a pipeline following && */
+#define LIBZSH_NODE_OR       (1<<5) /* in a pipeline following || */
+#define LIBZSH_NODE_UNTIL    (1<<6) /* a while that is an until */
+#define LIBZSH_NODE_ELSE     (1<<7) /* an if's else branch */
+
+/* len bytes at s, NUL-terminated */
+struct libzsh_span {
+    const char *s;
+    size_t len;
+    int tokens;                 /* has tokens in it */
+    char inl[4];                /* for strings stored in the code */
+};
+
+struct libzsh_assign {
+    struct libzsh_span name;
+    int array;                  /* name=( ... ) */
+    int append;                 /* name+=... */
+    size_t nvalues;
+    const struct libzsh_span *values;
+};
+
+struct libzsh_redir {
+    int type;                   /* zsh's REDIR_* */
+    int fd;
+    struct libzsh_span target;  /* the word, or a here document's text */
+    struct libzsh_span here_end;    /* a here document's terminator */
+    struct libzsh_span varid;   /* for {name}>file; else empty */
+};
+
+struct libzsh_node {
+    int kind;                   /* LIBZSH_NODE_* */
+    int depth;                  /* 0 at top level */
+    long lineno;                /* 0 if not known */
+    int flags;                  /* LIBZSH_NODE_* flags */
+    size_t nwords, nnames;      /* the first nnames words define names */
+    const struct libzsh_span *words;
+    size_t nassigns;
+    const struct libzsh_assign *assigns;
+    size_t nredirs;
+    const struct libzsh_redir *redirs;
+};
+
+#define LIBZSH_VISIT_ENTER 0
+#define LIBZSH_VISIT_LEAVE 1    /* after the lists of a compound node */
+
+/* Returned by fn on ENTER to step over what is under the node */
+#define LIBZSH_VISIT_SKIP  1
+
+/*
+ * Called on entering each node and, unless it was skipped, on leaving
+ * each that has lists under it.  Leaving, only kind, depth, lineno and
+ * flags are set.  The node and its arrays are only valid until fn
+ * returns; the strings they point at are the program's.  Any return
+ * other than 0 and LIBZSH_VISIT_SKIP stops the walk.
+ */
+typedef int (*libzsh_visit_fn)(void *data, const struct libzsh_node *node,
+                               int event);
+
+/*
+ * Returns 0 when the whole program has been walked, the value fn
+ * stopped the walk with, or -1 with errno (EINVAL for code or strings
+ * that are not as the parser makes them, ENOMEM).  If fn stops the walk
+ * with -1 itself, errno is left as fn left it.
+ */
+int libzsh_visit(struct eprog *prog, libzsh_visit_fn fn, void *data);
+
+/*
+ * Parse cache
+ *
+ * An LRU cache of permanent programs keyed on the input text and the
+ * option state of the context doing the parse.  Programs handed out by
+ * the cache are shared and must be treated as read-only; each call to
+ * libzsh_parse_cached() that returns non-NULL gives the caller a
+ * reference to be dropped with libzsh_eprog_release().
+ *
+ * A cache may be shared by any number of contexts; it is protected by
+ * the context lock.  Aliases are expanded while parsing, so the cache
+ * must be cleared if the alias table changes.
+ */
+typedef struct libzsh_parse_cache libzsh_parse_cache;
+
+struct libzsh_parse_cache_stats {
+    size_t entries;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+libzsh_parse_cache *libzsh_parse_cache_new(size_t capacity);
+void libzsh_parse_cache_free(libzsh_parse_cache *cache);
+void libzsh_parse_cache_clear(libzsh_parse_cache *cache);
+void libzsh_parse_cache_stats(libzsh_parse_cache *cache,
+                              struct libzsh_parse_cache_stats *stats);
+
+/*
+ * Look buf up in the cache, parsing and inserting it on a miss.  flags
+ * are as for libzsh_parse(); the result is always permanent.  Failed
+ * parses are not cached.
+ */
+struct eprog *libzsh_parse_cached(libzsh_context *ctx,
+                                  libzsh_parse_cache *cache,
+                                  const char *buf, size_t len, int flags);
+
+/*
+ * Streaming parse
+ *
+ * Read a script from a file descriptor and parse it one top-level list
+ * (one "event", as the shell's main loop sees it) at a time, reading as
+ * input is needed.  Memory use is bounded by the largest single list.
+ *
+ * fn is called once for each non-empty list with the program and the
+ * line it started on.  The program lives in the context's heap arena
+ * and is released when fn returns, unless LIBZSH_PARSE_PERMANENT was
+ * given (then fn owns it).  fn runs with the context entered, so it must
+ * not call libzsh functions that take a context; a non-zero return stops
+ * the parse and is returned.
+ *
+ * Returns 0 at end of input, -1 on a parse error (*errline, if not
+ * NULL, gets the line it occurred on), or fn's non-zero return value.
+ */
+typedef int (*libzsh_event_fn)(void *data, struct eprog *prog, long lineno);
+
+int libzsh_parse_fd(libzsh_context *ctx, int fd, int flags,
+                    libzsh_event_fn fn, void *data, long *errline);
+
+/*
+ * Batch syntax check
+ *
+ * Parse many files as zsh -n does, with a pool of worker threads, each
+ * with a context of its own, taking files in turn until none are left.
+ * Each file is parsed as one script with the options of ctx; nothing
+ * is run.  ctx must not be entered by the caller.
+ */
+#define LIBZSH_CHECK_OK      0
+#define LIBZSH_CHECK_ESYNTAX 1  /* the file has a syntax error */
+#define LIBZSH_CHECK_EOPEN   2  /* it couldn't be opened or read */
+#define LIBZSH_CHECK_EWORKER 3  /* no worker could check it */
+
+struct libzsh_check_result {
+    const char *path;
+    int status;                 /* LIBZSH_CHECK_* */
+    long line;                  /* of a syntax error, from 1 */
+    long col;                   /* of the token it is near, from 1; or 0 */
+    const char *message;        /* as zsh would print it, or strerror() */
+};
+
+/* Called on the caller's thread, once per file as each is done */
+typedef void (*libzsh_check_fn)(void *data, size_t index,
+                                const struct libzsh_check_result *r);
+
+/*
+ * Check the n files paths[] with nworkers workers, or one per
+ * processor if 0.  Returns the number of files not LIBZSH_CHECK_OK, or
+ * -1 with errno if no worker could be started.
+ */
+int libzsh_check_files(libzsh_context *ctx, const char *const *paths,
+                       size_t n, int nworkers, libzsh_check_fn fn,
+                       void *data);
+
+/*
+ * Token stream export
+ *
+ * Lex a buffer once and describe every token by its lexer token type
+ * (enum lextok), start offset and length in the caller's buffer.  The
+ * caller owns the arrays; nothing is allocated per token.  Offsets are
+ * always in terms of the original bytes, even where the lexer saw a
+ * metafied copy.  Aliases are not expanded, so every token has a
+ * position.
+ */
+struct libzsh_tokens {
+    size_t capacity;            /* entries available in each array */
+    size_t count;               /* entries filled in */
+    unsigned short *type;       /* enum lextok */
+    unsigned int *start;
+    unsigned int *len;
+    unsigned char *flags;       /* LIBZSH_TOKEN_* */
+};
+
+#define LIBZSH_TOKEN_CMDPOS   (1<<0)  /* lexed in command position */
+#define LIBZSH_TOKEN_RESERVED (1<<1)  /* a reserved word */
+#define LIBZSH_TOKEN_COMMENT  (1<<2)  /* a comment up to its newline */
+#define LIBZSH_TOKEN_META     (1<<3)  /* contains metafied characters */
+
+/*
+ * Returns 0 when the whole buffer was lexed, 1 if the arrays filled up
+ * first (out->count == out->capacity), or -1 on a lexical error, in
+ * which case the last entry is a LEXERR token where it was noticed.
+ */
+int libzsh_lex(libzsh_context *ctx, const char *buf, size_t len,
+               struct libzsh_tokens *out);
+
+/*
+ * Batch expansion
+ *
+ * Expand strings as zsh expands the body of a here document: $name,
+ * ${...} with its flags and modifiers, $((...)) and $[...], with the
+ * context's options.  The parameter table is shared by all contexts
+ * and set up on first use.
+ */
+#define LIBZSH_EXPAND_GLOB     (1<<0)  /* glob each result, as ${~...} */
+#define LIBZSH_EXPAND_CMDSUBST (1<<1)  /* allow $(...) and `...` */
+#define LIBZSH_EXPAND_QUIET    (1<<2)  /* don't print errors to stderr */
+
+/* Why a string failed */
+#define LIBZSH_EXPAND_ESYNTAX   1   /* unbalanced quotes or braces */
+#define LIBZSH_EXPAND_EFAILED   2   /* ${x?}, bad math, no glob match, ... */
+#define LIBZSH_EXPAND_ECMDSUBST 3   /* command substitution not allowed */
+
+struct libzsh_expansion {
+    size_t count;               /* strings expanded */
+    int *status;                /* per string: 0 or LIBZSH_EXPAND_E* */
+    size_t *offs;               /* count + 1 offsets into buf */
+    char *buf;                  /* every result, each NUL-terminated */
+    size_t len;                 /* bytes used in buf */
+    size_t size;
+};
+
+/*
+ * Expand the n strings in[].  The words from in[i] lie in buf between
+ * offs[i] and offs[i + 1], one after another, each followed by a NUL:
+ * one word, or with LIBZSH_EXPAND_GLOB one per match (none under
+ * NULL_GLOB).  A failed string has no words.  Command substitutions
+ * run commands as the shell does and need it set up to do so; without
+ * LIBZSH_EXPAND_CMDSUBST nothing is run however it is reached, from
+ * ${(e)...}, a subscript or a glob qualifier, and bare glob qualifiers
+ * are off.  Returns the number of strings that failed, or -1 if out of
+ * memory.  The result can be freed without a context entered.
+ */
+int libzsh_expand(libzsh_context *ctx, const char *const *in, size_t n,
+                  int flags, struct libzsh_expansion *out);
+void libzsh_expansion_free(struct libzsh_expansion *out);
+
+/* Set a scalar parameter for later expansions; returns 0 or -1. */
+int libzsh_setparam(libzsh_context *ctx, const char *name,
+                    const char *value);
+
+/*
+ * Compiled arithmetic
+ *
+ * An arithmetic expression, as between (( and )), compiled once and
+ * evaluated any number of times against the current parameter values
+ * without parsing it again.  Precedence (C_PRECEDENCES) and the reading
+ * of numbers (OCTAL_ZEROES) follow the context's options when compiled.
+ * The context must outlive the expression; evaluating enters it.
+ */
+typedef struct libzsh_math libzsh_math;
+
+#define LIBZSH_MATH_ERROR   (-1)
+#define LIBZSH_MATH_INTEGER 0
+#define LIBZSH_MATH_FLOAT   1
+
+struct libzsh_number {
+    int type;                   /* LIBZSH_MATH_* */
+    long long i;                /* the value, truncated if a float */
+    double d;                   /* the value */
+};
+
+/*
+ * NULL with errno EINVAL for a malformed expression, or ENOTSUP for
+ * one using what isn't compiled (subscripts, math functions, $ forms,
+ * base#n); matheval() still takes those.
+ */
+libzsh_math *libzsh_math_compile(libzsh_context *ctx, const char *expr);
+void libzsh_math_free(libzsh_math *m);
+
+/*
+ * Evaluate m into *out, assigning parameters as the expression says.
+ * Returns 0, or -1 (out->type LIBZSH_MATH_ERROR) with errno EDOM for
+ * an integer division by zero or EINVAL for any other error, such as
+ * an unset parameter under NO_UNSET.  Nothing is printed.
+ */
+int libzsh_math_eval(libzsh_math *m, struct libzsh_number *out);
+
+/*
+ * Evaluate n expressions, all compiled with the same context, entering
+ * it once; returns the number that failed.
+ */
+size_t libzsh_math_eval_batch(libzsh_math *const *m, size_t n,
+                              struct libzsh_number *out);
+
+/*
+ * Incremental line lexer
+ *
+ * Keeps the tokens of the last line it was given, for editors that
+ * re-lex on every keystroke.  On update, the changed range is found by
+ * comparing with the previous text; lexing resumes after the last list
+ * separator (';', newline, '&', '|', '&&', '||') before the change and
+ * stops as soon as it produces a separator identical to one that
+ * followed the change before, so the work done is proportional to the
+ * command being edited rather than the whole line.  The result is
+ * always the same as a full libzsh_lex() of the line.
+ *
+ * The line is raw bytes, as for libzsh_lex(); from ZLE, use
+ * zlelineasstring() and unmetafy() it.  Option changes that affect
+ * lexing are not noticed: call libzsh_line_lexer_reset() after them.
+ */
+typedef struct libzsh_line_lexer libzsh_line_lexer;
+
+libzsh_line_lexer *libzsh_line_lexer_new(void);
+void libzsh_line_lexer_free(libzsh_line_lexer *ll);
+
+/* Forget the previous line; the next update lexes everything. */
+void libzsh_line_lexer_reset(libzsh_line_lexer *ll);
+
+/*
+ * Bring the tokens up to date with line.  Tokens before *first are
+ * untouched and [*first, *last) were lexed afresh; the ones from *last
+ * on are the previous tokens, with their start moved by the change in
+ * line length.  Returns 0, or -1 if the line has a lexical error (the
+ * last token is then LEXERR, as for libzsh_lex()).
+ */
+int libzsh_line_lexer_update(libzsh_context *ctx, libzsh_line_lexer *ll,
+                             const char *line, size_t len,
+                             size_t *first, size_t *last);
+
+/*
+ * The same, for a caller that knows what changed: line is the previous
+ * one with the oldlen bytes from start replaced, so it is not compared
+ * with the previous text.  An editor passes its own edit here (for ZLE,
+ * from the cursor and the change in zlell).  Sets errno to EINVAL if
+ * the range does not fit the previous line.
+ */
+int libzsh_line_lexer_edit(libzsh_context *ctx, libzsh_line_lexer *ll,
+                           const char *line, size_t len, size_t start,
+                           size_t oldlen, size_t *first, size_t *last);
+
+/* The current tokens; valid until the next update or reset. */
+const struct libzsh_tokens *libzsh_line_lexer_tokens(libzsh_line_lexer *ll);
+
+/*
+ * Screen refresh
+ *
+ * Redraws a prompt and edit line frame by frame, writing only the cells
+ * that changed since the previous frame, with relative cursor motion.
+ * The output of a frame is handed to the sink in one call (none if
+ * nothing changed), so a sink that write()s to the terminal costs one
+ * system call per frame.  Drawing starts on the row the cursor is on
+ * when the first frame is drawn.
+ *
+ * Text is laid out as the terminal shows it in the current locale:
+ * double-width and combining characters are handled, control characters
+ * are shown as ^X, tabs expand to multiples of 8 and newlines start a
+ * new row.  The prompt is plain text; it must not contain escape
+ * sequences.
+ */
+typedef struct libzsh_screen libzsh_screen;
+
+/* Sink for terminal output; returns 0, or -1 on failure */
+typedef int (*libzsh_output_fn)(void *data, const char *buf, size_t len);
+
+libzsh_screen *libzsh_screen_new(int cols, libzsh_output_fn out, void *data);
+void libzsh_screen_free(libzsh_screen *s);
+
+/*
+ * Draw a frame: the prompt followed by the line, with the cursor before
+ * byte cursor of the line.  Returns 0, or -1 if the sink failed (the
+ * next frame then redraws everything).
+ */
+int libzsh_screen_frame(libzsh_screen *s, const char *prompt, size_t plen,
+                        const char *line, size_t llen, size_t cursor);
+
+/*
+ * Forget what is on the screen, after something else has written to
+ * the terminal.  The next frame clears from the start of the cursor's
+ * row down and redraws.
+ */
+void libzsh_screen_reset(libzsh_screen *s);
+
+/* The terminal width changed; also implies libzsh_screen_reset(). */
+void libzsh_screen_resize(libzsh_screen *s, int cols);
+
+/*
+ * Leave the drawing: move to the start of the row below it, as on
+ * accepting a line, and reset.  Returns 0, or -1 if the sink failed.
+ */
+int libzsh_screen_finish(libzsh_screen *s);
+
+/*
+ * Event-driven line editing
+ *
+ * A libzsh_zle session is a line editor that is fed input as it arrives
+ * instead of reading the terminal itself, so one thread can drive any
+ * number of them from an event loop.  Keys go through the real keymaps
+ * and widgets; bytes that are a prefix of a longer binding are held
+ * until more input arrives or the caller declares a key timeout.
+ *
+ * ZLE must have been initialized (libzsh_zle_init(), or init_thingies()
+ * and init_keymaps() by hand).  Sessions take the context lock, so they
+ * must not be fed with a context entered.  The kill ring, history and
+ * keymap definitions are shared by all sessions.
+ *
+ * Widgets that run a read loop of their own (incremental search, vi
+ * operators, execute-named-cmd) are not available and just beep.
+ * Bracketed paste is: text between ESC [200~ and ESC [201~ is inserted
+ * in one go once it has all arrived.  The terminal must be asked to
+ * send it with ESC [?2004h.
+ */
+typedef struct libzsh_zle libzsh_zle;
+
+/* Events returned by libzsh_zle_feed() and libzsh_zle_timeout() */
+#define LIBZSH_ZLE_NEED_INPUT (1<<0)  /* all queued input was used */
+#define LIBZSH_ZLE_REDRAW     (1<<1)  /* the line or cursor may have changed */
+#define LIBZSH_ZLE_ACCEPT     (1<<2)  /* a line was accepted */
+#define LIBZSH_ZLE_EOF        (1<<3)  /* end-of-file key on an empty line */
+#define LIBZSH_ZLE_BEEP       (1<<4)  /* undefined key or widget failed */
+#define LIBZSH_ZLE_BREAK      (1<<5)  /* send-break: the line was abandoned */
+#define LIBZSH_ZLE_PENDING    (1<<6)  /* waiting for the rest of a key sequence */
+
+/* Initialize ZLE's widget and keymap tables once; calls libzsh_init(). */
+int libzsh_zle_init(void);
+
+/*
+ * New session using the named keymap ("main" if NULL); NULL if there is
+ * no such keymap or no memory
+ */
+libzsh_zle *libzsh_zle_new(const char *keymap);
+void libzsh_zle_free(libzsh_zle *s);
+
+/*
+ * Queue n bytes of input and run the widgets they are bound to.
+ * Processing stops after a line is accepted (LIBZSH_ZLE_ACCEPT) or at
+ * end of file; input left over stays queued for the next call, which
+ * may pass n == 0 to just continue.  The accepted line stays available
+ * from libzsh_zle_line() until then; the next call starts a new line.
+ * Returns a mask of LIBZSH_ZLE_* events.
+ *
+ * With LIBZSH_ZLE_PENDING, call libzsh_zle_timeout() if no more input
+ * arrives within KEYTIMEOUT to use the shorter binding, as zle does.
+ */
+int libzsh_zle_feed(libzsh_zle *s, const char *bytes, size_t n);
+int libzsh_zle_timeout(libzsh_zle *s);
+
+/*
+ * The current line as raw bytes, with the cursor as a byte offset.
+ * Valid until the next call on the session.
+ */
+const char *libzsh_zle_line(libzsh_zle *s, size_t *len, size_t *cursor);
+
+/* Replace the line, with the cursor at the end (e.g. from history) */
+void libzsh_zle_set_line(libzsh_zle *s, const char *buf, size_t len);
+
+/*
+ * Insert raw text at the cursor in one step, as pasting it does.  This
+ * is linear in len, where feeding the text to self-insert is not.
+ */
+void libzsh_zle_insert(libzsh_zle *s, const char *buf, size_t len);
+
+/*
+ * Compiled keymaps
+ *
+ * A keymap compiled into a flat table with one state per key sequence
+ * prefix, so resolving a binding is one table step per input byte.  A
+ * compiled keymap is a snapshot of the bindings when it was built, and
+ * holds a reference to the keymap, which a bindkey -D doesn't free
+ * until the compiled one is freed too.  libzsh_zle sessions use
+ * compiled keymaps of their own; call libzsh_keymap_invalidate() after
+ * changing bindings to have them rebuilt.  Needs libzsh_zle_init().
+ */
+typedef struct libzsh_keymap libzsh_keymap;
+
+/* Compile the named keymap; NULL if there is no such keymap */
+libzsh_keymap *libzsh_keymap_compile(const char *name);
+void libzsh_keymap_free(libzsh_keymap *kc);
+
+/*
+ * Find the longest bound key sequence at the start of buf, as zle would
+ * at that point.  Returns its length, with *widget set to the widget
+ * name or *str to the (metafied) string it is bound to; both are NULL
+ * for an undefined key.  Returns 0 if all n bytes are a prefix of a
+ * longer binding, unless final is set.  The strings stay valid until
+ * the keymap is freed.
+ */
+size_t libzsh_keymap_lookup(libzsh_keymap *kc, const char *buf, size_t n,
+                            int final, const char **widget, const char **str);
+
+/* Number of states in the table, i.e. distinct binding prefixes */
+size_t libzsh_keymap_states(libzsh_keymap *kc);
+
+/* Bindings have changed: rebuild the keymaps used by sessions */
+void libzsh_keymap_invalidate(void);
+
+/*
+ * Indexed history
+ *
+ * A store of history lines that indexes each line as it is added, so
+ * substring search (as history-incremental-search-backward does) and
+ * prefix search (as history-beginning-search-backward does) look at a
+ * few candidate lines instead of every one.  Lines are raw bytes,
+ * numbered from 0 in the order added.  Independent of contexts and not
+ * locked: use a history from one thread at a time.  A libzsh_zle
+ * session given one with libzsh_zle_set_history() runs its history
+ * widgets on it.
+ */
+typedef struct libzsh_history libzsh_history;
+
+/* NULL if out of memory */
+libzsh_history *libzsh_history_new(void);
+void libzsh_history_free(libzsh_history *h);
+
+/* Append a line; returns its number, or -1 if full or out of memory */
+long libzsh_history_add(libzsh_history *h, const char *line, size_t len);
+size_t libzsh_history_count(libzsh_history *h);
+
+/* Line idx, NUL-terminated, with its length in *len; NULL if out of range */
+const char *libzsh_history_get(libzsh_history *h, size_t idx, size_t *len);
+
+/*
+ * The newest line before line number `before' that contains needle, or
+ * starts with prefix; -1 if there is none.  Start with
+ * libzsh_history_count(h) and pass the last match to find older ones.
+ */
+long libzsh_history_search(libzsh_history *h, const char *needle,
+                           size_t nlen, size_t before);
+long libzsh_history_prefix(libzsh_history *h, const char *prefix,
+                           size_t plen, size_t before);
+
+/* The same forward: the oldest such line after line number `after' */
+long libzsh_history_search_after(libzsh_history *h, const char *needle,
+                                 size_t nlen, size_t after);
+long libzsh_history_prefix_after(libzsh_history *h, const char *prefix,
+                                 size_t plen, size_t after);
+
+/*
+ * Have session s run the history widgets on h (up-line-or-history,
+ * up-line-or-search, history-beginning-search-backward,
+ * history-incremental-search-backward and the like) instead of beeping
+ * for them; NULL to stop.  h is used while s is fed, and lines may be
+ * added between feeds.
+ */
+void libzsh_zle_set_history(libzsh_zle *s, libzsh_history *h);
+
+/*
+ * While an incremental search runs, its search string (raw bytes, for
+ * the caller to show as zle's "bck-i-search:" prompt); NULL otherwise.
+ * Valid until the next call on the session.
+ */
+const char *libzsh_zle_search(libzsh_zle *s, size_t *len);
+
+/*
+ * Append-only history files
+ *
+ * A binary history file format that is mapped and read from the newest
+ * entry backwards, so opening it costs the same however long it is, and
+ * that any number of sessions append to without locking or rewriting.
+ * Unrelated to HISTFILE, which hist.c reads and writes as before.
+ */
+typedef struct libzsh_histfile libzsh_histfile;
+
+/* Open or create a history file; NULL if it can't be or isn't one */
+libzsh_histfile *libzsh_histfile_open(const char *path);
+void libzsh_histfile_close(libzsh_histfile *hf);
+
+/* Append a line (raw bytes) with its start time; 0 or -1 with errno */
+int libzsh_histfile_append(libzsh_histfile *hf, const char *line, size_t len,
+                           long stamp);
+
+/*
+ * Pick up entries appended since the file was opened or last
+ * refreshed, by this or any other session.  Invalidates lines returned
+ * before.  0 or -1.
+ */
+int libzsh_histfile_refresh(libzsh_histfile *hf);
+
+/*
+ * Entry `back' counted from the newest (0 is the newest), with its
+ * length and start time; NULL past the oldest.  The line is
+ * NUL-terminated and points into the mapping.
+ */
+const char *libzsh_histfile_entry(libzsh_histfile *hf, size_t back,
+                                  size_t *len, long *stamp);
+
+/* Number of entries; has to look at all of them */
+size_t libzsh_histfile_count(libzsh_histfile *hf);
+
+/*
+ * Patterns
+ *
+ * A zsh pattern compiled once for matching many strings, with the
+ * options of the context it is compiled in (EXTENDED_GLOB, KSH_GLOB
+ * and so on).  Literal text the pattern requires is extracted at
+ * compile time and checked first, so most non-matching strings are
+ * rejected without running the matcher.  Patterns and strings are raw
+ * bytes.  The context must outlive the pattern; matching enters it.
+ */
+typedef struct libzsh_pattern libzsh_pattern;
+
+/* NULL if the pattern is malformed */
+libzsh_pattern *libzsh_pattern_compile(libzsh_context *ctx, const char *pat,
+                                       size_t len);
+void libzsh_pattern_free(libzsh_pattern *pat);
+
+/* 1 if the whole of s matches, else 0 */
+int libzsh_pattern_match(libzsh_pattern *pat, const char *s, size_t len);
+
+/*
+ * Match n NUL-terminated strings, setting bit i % 8 of results[i / 8]
+ * for each one that matches; results must have room for (n + 7) / 8
+ * bytes.  Returns the number matched.
+ */
+size_t libzsh_pattern_match_batch(libzsh_pattern *pat,
+                                  const char *const *strings, size_t n,
+                                  unsigned char *results);
+
+/*
+ * How a pattern is matched.  Patterns of literals and stars are
+ * recognized at compile time and matched by comparisons alone;
+ * anything else is GENERIC and runs the pattern matcher.
+ */
+#define LIBZSH_PATTERN_GENERIC   0
+#define LIBZSH_PATTERN_EXACT     1  /* literal */
+#define LIBZSH_PATTERN_PREFIX    2  /* literal* */
+#define LIBZSH_PATTERN_SUFFIX    3  /* *literal */
+#define LIBZSH_PATTERN_SUBSTRING 4  /* *literal* */
+#define LIBZSH_PATTERN_AFFIX     5  /* literal*literal */
+#define LIBZSH_PATTERN_ANY       6  /* * */
+
+int libzsh_pattern_kind(libzsh_pattern *pat);
+
+/*
+ * Recursive globs
+ *
+ * The files anywhere under dir whose names match a pattern, as a
+ * recursive `**' glob finds them, with a pool of threads walking the
+ * tree.  Names are matched with the options of ctx and the paths come
+ * back in the order zsh sorts a glob (NUMERIC_GLOB_SORT included).  Dot
+ * files are only matched with GLOB_DOTS or a pattern starting with a
+ * dot, and dot directories only entered with GLOB_DOTS; links to
+ * directories are not followed unless LIBZSH_GLOB_FOLLOW is given.
+ */
+#define LIBZSH_GLOB_FILES   (1 << 0)  /* regular files only, as (.) */
+#define LIBZSH_GLOB_DIRS    (1 << 1)  /* directories only, as (/) */
+#define LIBZSH_GLOB_FOLLOW  (1 << 2)  /* follow links, as `***' */
+
+/*
+ * Walk dir (the current directory if NULL) with nthreads threads, or
+ * one per processor if 0.  On success *paths is a NULL-terminated
+ * array of the *count paths found and 0 is returned; -1 if the pattern
+ * is malformed or dir can't be opened.  Directories that can't be read
+ * are passed over.
+ */
+int libzsh_glob_recursive(libzsh_context *ctx, const char *dir,
+                          const char *pattern, int flags, int nthreads,
+                          char ***paths, size_t *count);
+void libzsh_glob_free(char **paths, size_t count);
+
+/*
+ * The entries of dir alone that match pattern, as dir/pattern would
+ * expand, with the same flags (LIBZSH_GLOB_FOLLOW has no effect) and
+ * results.  Each call reads the directory unless a cache has been
+ * begun on ctx; then its listing is kept and used by later calls until
+ * the directory's modification time changes, so expanding several
+ * patterns in one directory reads it once.  The cache holds names and
+ * types, so a file replaced by one of another type under the same
+ * name is not noticed.  It lasts until ended or the context is freed.
+ */
+int libzsh_glob_dir(libzsh_context *ctx, const char *dir, const char *pattern,
+                    int flags, char ***paths, size_t *count);
+void libzsh_glob_cache_begin(libzsh_context *ctx);
+void libzsh_glob_cache_end(libzsh_context *ctx);
+
+/* Listings used from the cache, and directories read into it */
+void libzsh_glob_cache_stats(libzsh_context *ctx, size_t *hits,
+                             size_t *reads);
+
+/*
+ * Names known at build time
+ *
+ * Answered from tables generated from the zsh sources when libzsh is
+ * built, so they need no context and nothing set up first.  They say
+ * what zsh was built with: disable and enable, and builtins added by
+ * loading modules, make no difference.
+ */
+
+/* 1 if name is a reserved word, such as if, [[ or } */
+int libzsh_is_reserved_word(const char *name);
+
+/* 1 if name is a builtin compiled into the shell itself */
+int libzsh_is_builtin(const char *name);
+
+/*
+ * The number of the option called name (as optlookup() takes it: any
+ * case, any underscores), negated if it turns the option off as noname
+ * does; 0 if it isn't an option.
+ */
+int libzsh_option_lookup(const char *name);
+
+/*
+ * Wordcode dump files
+ *
+ * Read and write the .zwc format produced by zcompile.  A loaded file
+ * is mapped read-only and the programs handed out point straight into
+ * the mapping; they stay valid until the file is closed, and must be
+ * released with libzsh_eprog_release() before that.
+ */
+typedef struct libzsh_wordcode libzsh_wordcode;
+
+/* Map a .zwc file.  Returns NULL if it can't be read or was made by a
+ * different zsh version. */
+libzsh_wordcode *libzsh_load_wordcode(const char *path);
+void libzsh_wordcode_close(libzsh_wordcode *wc);
+
+/* Number of functions in the file, and the full name of each */
+size_t libzsh_wordcode_count(libzsh_wordcode *wc);
+const char *libzsh_wordcode_name(libzsh_wordcode *wc, size_t i);
+
+/*
+ * Program for the function whose name (without any leading directory,
+ * as autoload looks it up) is name, or the i'th function.  NULL if
+ * there is no such function.
+ */
+struct eprog *libzsh_wordcode_get(libzsh_wordcode *wc, const char *name);
+struct eprog *libzsh_wordcode_get_index(libzsh_wordcode *wc, size_t i);
+
+/*
+ * Write n programs to path in the format zcompile uses, so the result
+ * can also be used with autoload.  names[i] is the function name of
+ * progs[i].  Returns 0 on success, -1 on failure with errno set.
+ */
+int libzsh_dump_wordcode(const char *path, const char *const *names,
+                         struct eprog *const *progs, size_t n);
+
+/*
+ * State images
+ *
+ * Save what setting the shell up (as an rc file does) leaves behind to
+ * one file, and load it in another process without parsing or running
+ * anything: the options of a context, the aliases, suffix aliases and
+ * disabled reserved words, the shell functions as wordcode, and the
+ * keymaps.  Functions still to be autoloaded, functions with sticky
+ * emulation, user-defined widgets and parameters are not saved.
+ *
+ * An image is only loaded by the same build of zsh on the same kind of
+ * machine; make it again after upgrading.
+ */
+
+/*
+ * Write an image of ctx's options and the shared tables to path,
+ * replacing it in one step.  Returns 0, or -1 with errno set.
+ */
+int libzsh_image_save(libzsh_context *ctx, const char *path);
+
+/*
+ * Replace ctx's options, the aliases, the disabled reserved words and
+ * the shell functions with the image's, and link each of its keymap
+ * names to a new keymap with the saved bindings (calling
+ * libzsh_zle_init() if there are any).  Returns 0, or -1 with errno set
+ * (EINVAL if the file is damaged or from another build) without having
+ * changed anything.  Keymaps must not be replaced under libzsh_zle
+ * sessions, so load images before starting any; parse caches must be
+ * cleared afterwards, since the aliases change.
+ */
+int libzsh_image_load(libzsh_context *ctx, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBZSH_H */
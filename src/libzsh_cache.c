@@ -0,0 +1,221 @@
+/*
+ * libzsh_cache.c - LRU cache of parsed programs
+ *
+ * Entries are keyed on a hash of the input text mixed with a hash of
+ * the option array of the context that parsed it, since options such as
+ * SHORT_LOOPS, IGNORE_BRACES or KSH_GLOB change what the parser
+ * produces.  The text itself is kept to rule out collisions.
+ *
+ * Cached programs are ordinary permanent Eprogs: the cache owns one
+ * reference and every hit hands out another with useeprog(), so the
+ * existing freeeprog() reference counting decides when one really goes.
+ *
+ * Lookups run with a context entered beside other parsing threads, so
+ * the table and the LRU list have a mutex of their own; the parse on a
+ * miss is done without it.  Clearing and freeing take the context lock
+ * alone, which keeps the lookups out.
+ */
+
+#include "libzsh_int.h"
+
+struct cache_entry {
+    struct cache_entry *hnext;      /* next in hash chain */
+    struct cache_entry *prev;       /* LRU list, most recent first */
+    struct cache_entry *next;
+    zulong hash;
+    zulong opthash;
+    char *text;
+    size_t len;
+    Eprog prog;
+};
+
+struct libzsh_parse_cache {
+    struct cache_entry **buckets;
+    zulong mask;                    /* number of buckets - 1 */
+    struct cache_entry *head;       /* most recently used */
+    struct cache_entry *tail;       /* least recently used */
+    size_t capacity;
+    struct libzsh_parse_cache_stats stats;
+    pthread_mutex_t lock;           /* for lookups */
+};
+
+/* 64-bit FNV-1a, continued from h */
+static zulong cache_hash(zulong h, const char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= (zulong)1099511628211ULL;
+    }
+    return h;
+}
+
+#define CACHE_HASH_INIT ((zulong)14695981039346656037ULL)
+
+libzsh_parse_cache *libzsh_parse_cache_new(size_t capacity)
+{
+    libzsh_parse_cache *cache;
+    size_t nbuckets = 16;
+
+    if (!capacity)
+        return NULL;
+
+    /* Keep chains short: at least two buckets per entry */
+    while (nbuckets < capacity * 2)
+        nbuckets <<= 1;
+
+    cache = (libzsh_parse_cache *)zshcalloc(sizeof(*cache));
+    cache->buckets = (struct cache_entry **)
+        zshcalloc(nbuckets * sizeof(*cache->buckets));
+    cache->mask = nbuckets - 1;
+    cache->capacity = capacity;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+static void lru_unlink(libzsh_parse_cache *cache, struct cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(libzsh_parse_cache *cache, struct cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+/* Remove e from the cache and drop the cache's reference to its program */
+static void cache_remove(libzsh_parse_cache *cache, struct cache_entry *e)
+{
+    struct cache_entry **ep = &cache->buckets[e->hash & cache->mask];
+
+    while (*ep != e)
+        ep = &(*ep)->hnext;
+    *ep = e->hnext;
+
+    lru_unlink(cache, e);
+    freeeprog(e->prog);
+    zfree(e->text, e->len + 1);
+    zfree(e, sizeof(*e));
+    cache->stats.entries--;
+}
+
+static void cache_clear_locked(libzsh_parse_cache *cache)
+{
+    while (cache->head)
+        cache_remove(cache, cache->head);
+}
+
+void libzsh_parse_cache_clear(libzsh_parse_cache *cache)
+{
+    libzsh_lock();
+    cache_clear_locked(cache);
+    libzsh_unlock();
+}
+
+void libzsh_parse_cache_free(libzsh_parse_cache *cache)
+{
+    if (!cache)
+        return;
+
+    libzsh_lock();
+    cache_clear_locked(cache);
+    libzsh_unlock();
+
+    pthread_mutex_destroy(&cache->lock);
+    zfree(cache->buckets, (cache->mask + 1) * sizeof(*cache->buckets));
+    zfree(cache, sizeof(*cache));
+}
+
+void libzsh_parse_cache_stats(libzsh_parse_cache *cache,
+                              struct libzsh_parse_cache_stats *stats)
+{
+    libzsh_lock();
+    *stats = cache->stats;
+    libzsh_unlock();
+}
+
+Eprog libzsh_parse_cached(libzsh_context *ctx, libzsh_parse_cache *cache,
+                          const char *buf, size_t len, int flags)
+{
+    struct cache_entry *e;
+    zulong opthash, hash;
+    Eprog prog;
+
+    libzsh_context_enter_shared(ctx);
+
+    opthash = cache_hash(CACHE_HASH_INIT, opts, sizeof(opts));
+    hash = cache_hash(opthash, buf, len);
+
+    pthread_mutex_lock(&cache->lock);
+    for (e = cache->buckets[hash & cache->mask]; e; e = e->hnext) {
+        if (e->hash == hash && e->opthash == opthash && e->len == len &&
+            !memcmp(e->text, buf, len)) {
+            cache->stats.hits++;
+            if (e != cache->head) {
+                lru_unlink(cache, e);
+                lru_push(cache, e);
+            }
+            useeprog(e->prog);
+            prog = e->prog;
+            pthread_mutex_unlock(&cache->lock);
+            libzsh_context_leave(ctx);
+            return prog;
+        }
+    }
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /*
+     * Another thread may be parsing the same text; both copies go in,
+     * and the older one ages out.
+     */
+    prog = libzsh_parse_entered(buf, len, flags | LIBZSH_PARSE_PERMANENT);
+    if (prog) {
+        /* The entry outlives the context, as the program does */
+        struct libzsh_pool *pool = libzsh_pool_shared();
+
+        pthread_mutex_lock(&cache->lock);
+        if (cache->stats.entries >= cache->capacity) {
+            cache->stats.evictions++;
+            cache_remove(cache, cache->tail);
+        }
+
+        e = (struct cache_entry *)zshcalloc(sizeof(*e));
+        e->hash = hash;
+        e->opthash = opthash;
+        e->len = len;
+        e->text = (char *)zalloc(len + 1);
+        memcpy(e->text, buf, len);
+        e->text[len] = '\0';
+        e->prog = prog;
+        e->hnext = cache->buckets[hash & cache->mask];
+        cache->buckets[hash & cache->mask] = e;
+        lru_push(cache, e);
+        cache->stats.entries++;
+
+        /* One reference for the cache, one for the caller */
+        useeprog(prog);
+        pthread_mutex_unlock(&cache->lock);
+        libzsh_pool_use(pool);
+    }
+
+    libzsh_context_leave(ctx);
+
+    return prog;
+}
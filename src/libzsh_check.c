@@ -0,0 +1,327 @@
+/*
+ * libzsh_check.c - Syntax-checking many files at once
+ *
+ * Parsing takes the context lock shared (libzsh_context_enter_shared()),
+ * so contexts on different threads parse at the same time.
+ * libzsh_check_files() starts a pool of threads, each with a context
+ * of its own set to the caller's options.  Workers claim the next
+ * unchecked file from an atomic counter, so a long file holds up only
+ * the worker that has it; each maps the file and parses it as zsh -n
+ * would.  With aliases defined, or without all of zsh's globals
+ * thread-local, the lock is taken alone and the workers take turns at
+ * the parser, but still overlap reading the files.
+ *
+ * A worker takes the parser's reports through a diagnostics sink on
+ * its context and queues one record per file.  The caller's thread
+ * takes the records off the queue and calls back as they arrive.
+ * Files left without a record (a worker couldn't make its context or
+ * the record) are reported as such at the end.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "libzsh_int.h"
+
+#define CHECK_MAX_WORKERS 64
+#define CHECK_MSG_MAX     256       /* longest message passed on */
+
+/* What a worker queues for a file */
+struct check_rec {
+    struct check_rec *next;
+    size_t index;
+    long line, col;
+    int status;
+    char msg[CHECK_MSG_MAX + 1];
+};
+
+/* The first report on the file being parsed */
+struct check_error {
+    int seen;
+    long line, offset;
+    char tok[CHECK_MSG_MAX];
+    size_t toklen;
+    char msg[CHECK_MSG_MAX + 1];
+    size_t msglen;
+};
+
+static void check_diag(void *data, const struct libzsh_diag *d)
+{
+    struct check_error *e = (struct check_error *)data;
+
+    if (e->seen)
+        return;
+    e->seen = 1;
+    e->line = d->line;
+    e->offset = d->offset;
+    e->toklen = 0;
+    if (d->source == LIBZSH_DIAG_PARSER && d->nstr &&
+        d->len[0] <= sizeof(e->tok)) {
+        memcpy(e->tok, d->str[0], d->len[0]);
+        e->toklen = d->len[0];
+    }
+    e->msglen = libzsh_diag_format(d, e->msg, sizeof(e->msg));
+    if (e->msglen >= sizeof(e->msg))
+        e->msglen = sizeof(e->msg) - 1;
+}
+
+/*
+ * Where the token a syntax error is near is in buf, counting from 1 on
+ * its line: the last place on the line it ends by where the lexer had
+ * read to, else the first; 0 if it isn't on the line.
+ */
+static long check_column(const char *buf, size_t len,
+                         const struct check_error *e)
+{
+    const char *p, *bol, *eol, *tok = e->tok;
+    size_t tlen = e->toklen;
+    long l;
+
+    for (p = buf, l = 1; l < e->line; l++) {
+        if (!(p = memchr(p, '\n', buf + len - p)))
+            return 0;
+        p++;
+    }
+    bol = p;
+    if (!(eol = memchr(p, '\n', buf + len - p)))
+        eol = buf + len;
+    if (!tlen)
+        return 0;
+    /* An unexpected newline (or end of input) is named as \n */
+    if (tlen == 2 && !memcmp(tok, "\\n", 2))
+        return eol - bol + 1;
+    if (e->offset >= 0 && buf + e->offset >= bol) {
+        p = buf + e->offset < eol ? buf + e->offset : eol;
+        for (p -= tlen; p >= bol; p--)
+            if (!memcmp(p, tok, tlen))
+                return p - bol + 1;
+    }
+    for (p = bol; p + tlen <= eol; p++)
+        if (!memcmp(p, tok, tlen))
+            return p - bol + 1;
+    return 0;
+}
+
+/* What is shared by the workers of one libzsh_check_files() */
+struct check_job {
+    const char *const *paths;
+    size_t n;
+    atomic_size_t next;                 /* the next file to claim */
+    char opts[OPT_SIZE];                /* the caller's options */
+    pthread_mutex_t lock;               /* for the rest */
+    pthread_cond_t cond;
+    struct check_rec *done, **tail;     /* records not yet passed on */
+    int running;                        /* workers not yet finished */
+};
+
+struct check_worker {
+    struct check_job *job;
+    pthread_t thread;
+    struct check_error err;             /* check_diag()'s data */
+};
+
+/* Queue a record for the caller's thread; dropped if out of memory */
+static void check_send(struct check_job *job, size_t index, int status,
+                       long line, long col, const char *msg, size_t msglen)
+{
+    struct check_rec *rec;
+
+    if (!(rec = malloc(sizeof(*rec))))
+        return;
+    if (msglen > CHECK_MSG_MAX)
+        msglen = CHECK_MSG_MAX;
+    rec->next = NULL;
+    rec->index = index;
+    rec->line = line;
+    rec->col = col;
+    rec->status = status;
+    memcpy(rec->msg, msg, msglen);
+    rec->msg[msglen] = '\0';
+
+    pthread_mutex_lock(&job->lock);
+    *job->tail = rec;
+    job->tail = &rec->next;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void check_one(struct check_worker *w, libzsh_context *ctx,
+                      size_t index)
+{
+    struct check_job *job = w->job;
+    struct check_error *e = &w->err;
+    const char *path = job->paths[index], *msg;
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0;
+    long line;
+    int fd, ok;
+
+    if ((fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC)) < 0 ||
+        fstat(fd, &st) < 0 ||
+        (!S_ISREG(st.st_mode) && (errno = S_ISDIR(st.st_mode) ? EISDIR :
+                                  EINVAL)) ||
+        ((len = (size_t)st.st_size) &&
+         (buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+         MAP_FAILED)) {
+        msg = strerror(errno);
+        check_send(job, index, LIBZSH_CHECK_EOPEN, 0, 0, msg, strlen(msg));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    close(fd);
+
+    e->seen = 0;
+    libzsh_context_enter_shared(ctx);
+    ok = libzsh_parse_entered(len ? buf : "", len, 0) != NULL;
+    line = (long)lineno;
+    libzsh_context_leave(ctx);
+
+    if (ok) {
+        check_send(job, index, LIBZSH_CHECK_OK, 0, 0, "", 0);
+    } else if (!e->seen) {
+        msg = "parse error";
+        check_send(job, index, LIBZSH_CHECK_ESYNTAX, line, 0,
+                   msg, strlen(msg));
+    } else {
+        check_send(job, index, LIBZSH_CHECK_ESYNTAX, e->line,
+                   check_column(len ? buf : "", len, e), e->msg, e->msglen);
+    }
+    if (len)
+        munmap(buf, len);
+}
+
+static void *check_thread(void *arg)
+{
+    struct check_worker *w = (struct check_worker *)arg;
+    struct check_job *job = w->job;
+    libzsh_context *ctx = libzsh_context_new();
+    size_t i;
+
+    if (ctx) {
+        libzsh_context_set_diag(ctx, check_diag, &w->err);
+        libzsh_context_enter_shared(ctx);
+        memcpy(opts, job->opts, sizeof(opts));
+        libzsh_context_leave(ctx);
+        while ((i = atomic_fetch_add(&job->next, 1)) < job->n)
+            check_one(w, ctx, i);
+        libzsh_context_free(ctx);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->running--;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int nworkers_default(void)
+{
+    long n = -1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1)
+        return 1;
+    return n > CHECK_MAX_WORKERS ? CHECK_MAX_WORKERS : (int)n;
+}
+
+int libzsh_check_files(libzsh_context *ctx, const char *const *paths,
+                       size_t n, int nworkers, libzsh_check_fn fn, void *data)
+{
+    struct check_worker workers[CHECK_MAX_WORKERS];
+    struct libzsh_check_result r;
+    struct check_job job;
+    struct check_rec *rec, *next;
+    char *seen;
+    size_t i;
+    int started, failed = 0, err = 0;
+
+    if (!n)
+        return 0;
+    if (nworkers <= 0)
+        nworkers = nworkers_default();
+    else if (nworkers > CHECK_MAX_WORKERS)
+        nworkers = CHECK_MAX_WORKERS;
+    if ((size_t)nworkers > n)
+        nworkers = (int)n;
+
+    /* Made and freed without the context entered */
+    if (!(seen = calloc(n, 1)))
+        return -1;
+    job.paths = paths;
+    job.n = n;
+    atomic_init(&job.next, 0);
+    libzsh_context_enter(ctx);
+    memcpy(job.opts, opts, sizeof(job.opts));
+    libzsh_context_leave(ctx);
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    job.done = NULL;
+    job.tail = &job.done;
+
+    pthread_mutex_lock(&job.lock);
+    for (started = 0; started < nworkers; started++) {
+        workers[started].job = &job;
+        if ((err = pthread_create(&workers[started].thread, NULL,
+                                  check_thread, &workers[started])))
+            break;
+    }
+    job.running = started;
+    if (!started) {
+        pthread_mutex_unlock(&job.lock);
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.lock);
+        free(seen);
+        errno = err;
+        return -1;
+    }
+
+    /* Pass on what the workers queue until they have all finished */
+    for (;;) {
+        while (!job.done && job.running)
+            pthread_cond_wait(&job.cond, &job.lock);
+        if (!(rec = job.done))
+            break;
+        job.done = NULL;
+        job.tail = &job.done;
+        pthread_mutex_unlock(&job.lock);
+
+        for (; rec; rec = next) {
+            next = rec->next;
+            seen[rec->index] = 1;
+            r.path = paths[rec->index];
+            r.status = rec->status;
+            r.line = rec->line;
+            r.col = rec->col;
+            r.message = rec->msg;
+            if (rec->status != LIBZSH_CHECK_OK)
+                failed++;
+            fn(data, rec->index, &r);
+            free(rec);
+        }
+        pthread_mutex_lock(&job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    for (i = 0; i < (size_t)started; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+
+    for (i = 0; i < n; i++) {
+        if (seen[i])
+            continue;
+        r.path = paths[i];
+        r.status = LIBZSH_CHECK_EWORKER;
+        r.line = r.col = 0;
+        r.message = "not checked";
+        failed++;
+        fn(data, i, &r);
+    }
+    free(seen);
+    return failed;
+}
@@ -0,0 +1,445 @@
+/*
+ * libzsh_context.c - Per-instance interpreter state
+ *
+ * zsh keeps its lexer, parser, history and heap state in globals.  The
+ * shell itself already knows how to stash that state away and bring it
+ * back (that is what zcontext_save()/zcontext_restore() do around ZLE
+ * and command substitution), so a context is simply a saved copy of it
+ * that is swapped into the globals on enter and out again on leave.
+ *
+ * gen_tls.sh makes those globals thread-local, so each thread has a
+ * set to swap contexts through and contexts on different threads get
+ * out of each other's way.  What they still share (the hash tables,
+ * params.c, pattern.c's and text.c's statics, ZLE) is guarded by the
+ * context lock, a read-write lock: libzsh_context_enter() and
+ * libzsh_lock() take it alone, as every caller of the zsh API needs,
+ * while libzsh_context_enter_shared() takes it beside other lexing and
+ * parsing threads.  Without all of the globals thread-local (see
+ * LIBZSH_TLS_COMPLETE) it is always taken alone.
+ *
+ * Each context also has a mutex of its own, so that two threads using
+ * one context take turns as they did when there was only one lock.
+ */
+
+#include <pthread.h>
+#include <locale.h>
+
+#include "libzsh_int.h"
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+/* A steady stream of parsers must not keep ZLE out */
+static pthread_rwlock_t context_lock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t context_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+static pthread_key_t thread_key;
+
+_Thread_local libzsh_context *libzsh_current;
+
+/*
+ * $LINENO, for params.c's table (see gen_tls.sh).  lineno is the
+ * thread's own, but this can't be, so it is set from the lineno of the
+ * thread taking the context lock alone: only code run with the lock so
+ * taken reads parameters.  A shared entry, which only lexes and parses,
+ * leaves it alone, since threads sharing the lock would race on it.
+ * It is the line number as of taking the lock.
+ */
+zlong libzsh_lineno;
+
+/* The thread's own globals have been set up */
+static _Thread_local int thread_ready;
+static _Thread_local unsigned char *spare_cmdstack;
+static _Thread_local Wordcode spare_ecbuf;
+
+/*
+ * Set up the globals a context is swapped through, once per thread, as
+ * init_once_routine() used to do for the only copy.
+ */
+static void thread_setup(void)
+{
+    thread_ready = 1;
+
+    /* Initialize command stack for parser */
+    if (!cmdstack) {
+        cmdstack = (unsigned char *)zalloc(CMDSTACKSZ);
+        cmdsp = 0;
+    }
+
+    /* Initialize parser state */
+    init_parse();
+
+    /* Initialize history mechanism (sets up hgetc, hungetc, etc.) */
+    strin = 1;
+    hbegin(0);
+
+#ifdef LIBZSH_TLS_COMPLETE
+    pthread_setspecific(thread_key, &thread_ready);
+#endif
+}
+
+static void thread_init(void)
+{
+    if (thread_ready)
+        return;
+    /* That sets up the thread calling it first */
+    libzsh_init();
+    if (!thread_ready)
+        thread_setup();
+}
+
+#ifdef LIBZSH_TLS_COMPLETE
+/* At thread exit, free what thread_init() allocated */
+static void thread_end(UNUSED(void *arg))
+{
+    if (cmdstack)
+        zfree(cmdstack, CMDSTACKSZ);
+    if (spare_cmdstack)
+        zfree(spare_cmdstack, CMDSTACKSZ);
+    if (ecbuf)
+        zfree(ecbuf, eclen * sizeof(wordcode));
+    if (spare_ecbuf)
+        zfree(spare_ecbuf, 0);
+    cmdstack = spare_cmdstack = NULL;
+    ecbuf = spare_ecbuf = NULL;
+}
+#endif
+
+/*
+ * hist.c's zalloc() and zfree().  hist_context_save() gives the globals
+ * a new command stack and hist_context_restore() frees the one it puts
+ * back over, once each on every enter and leave; one is kept back per
+ * thread for the next save instead.  It outlives the context it was
+ * freed in, so it comes from the shared pool.
+ */
+void *libzsh_hist_zalloc(size_t size)
+{
+    struct libzsh_pool *pool;
+    void *p = spare_cmdstack;
+
+    if (size != CMDSTACKSZ)
+        return zalloc(size);
+    if (!p) {
+        pool = libzsh_pool_shared();
+        p = zalloc(size);
+        libzsh_pool_use(pool);
+    }
+    spare_cmdstack = NULL;
+    return p;
+}
+
+void libzsh_hist_zfree(void *p, int sz)
+{
+    if (sz == CMDSTACKSZ && p && !spare_cmdstack && libzsh_pool_is_shared(p))
+        spare_cmdstack = p;
+    else
+        zfree(p, sz);
+}
+
+/*
+ * parse.c's zalloc(), zrealloc() and zfree().  init_parse() allocates a
+ * wordcode buffer for every parse and bld_eprog() frees it again; one
+ * is kept back per thread instead, in the shared pool, and grown there,
+ * so it keeps whatever size the longest parse needed.  parse.c passes
+ * zfree() the buffer's length in words, not bytes: neither allocator
+ * libzsh builds with reads the size, but the kept buffer never gets
+ * that far.
+ */
+#define ECBUF_INIT (256 * sizeof(wordcode))     /* parse.c's EC_INIT_SIZE */
+
+void *libzsh_parse_zalloc(size_t size)
+{
+    struct libzsh_pool *pool;
+    void *p = spare_ecbuf;
+
+    if (size != ECBUF_INIT)
+        return zalloc(size);
+    if (!p) {
+        pool = libzsh_pool_shared();
+        p = zalloc(size);
+        libzsh_pool_use(pool);
+    }
+    spare_ecbuf = NULL;
+    return p;
+}
+
+void *libzsh_parse_zrealloc(void *p, size_t size)
+{
+    struct libzsh_pool *pool;
+
+    if (!p || p != (void *)ecbuf || !libzsh_pool_is_shared(p))
+        return zrealloc(p, size);
+    pool = libzsh_pool_shared();
+    p = zrealloc(p, size);
+    libzsh_pool_use(pool);
+    return p;
+}
+
+void libzsh_parse_zfree(void *p, int sz)
+{
+    if (p && p == (void *)ecbuf && !spare_ecbuf && libzsh_pool_is_shared(p))
+        spare_ecbuf = (Wordcode)p;
+    else
+        zfree(p, sz);
+}
+
+/*
+ * Build the shared tables.  This is the sequence the tests and examples
+ * used to run by hand; everything set up here is treated as read-only
+ * afterwards.
+ */
+static void init_once_routine(void)
+{
+    int t0;
+
+#ifdef USE_LOCALE
+    setlocale(LC_ALL, "");
+#endif
+
+    /* Set up metafication type table */
+    typtab['\0'] |= IMETA;
+    typtab[STOUC(Meta)] |= IMETA;
+    typtab[STOUC(Marker)] |= IMETA;
+    for (t0 = (int)STOUC(Pound); t0 <= (int)STOUC(Nularg); t0++)
+        typtab[t0] |= ITOK | IMETA;
+
+    /* Set up file descriptor table */
+    fdtable_size = zopenmax();
+    fdtable = zshcalloc(fdtable_size * sizeof(*fdtable));
+    fdtable[0] = fdtable[1] = fdtable[2] = FDT_EXTERNAL;
+
+    /* Create option table (needed for parser) */
+    createoptiontable();
+
+    /* Initialize lexer tables */
+    initlextabs();
+
+    /* Initialize hash tables needed for parsing */
+    createreswdtable();
+    createaliastables();
+#ifdef LIBZSH_HASH_INDEX
+    libzsh_hashtable_perfect(optiontab, &libzsh_phash_option);
+    libzsh_hashtable_perfect(reswdtab, &libzsh_phash_reswd);
+    libzsh_hashtable_index(aliastab);
+    libzsh_hashtable_index(sufaliastab);
+#endif
+
+#ifdef LIBZSH_TLS_COMPLETE
+    pthread_key_create(&thread_key, thread_end);
+#endif
+    thread_setup();
+}
+
+int libzsh_init(void)
+{
+    return pthread_once(&init_once, init_once_routine) ? -1 : 0;
+}
+
+/*
+ * The context lock, taken alone, for libzsh objects that are shared
+ * between contexts but used without one entered.
+ */
+void libzsh_lock(void)
+{
+    pthread_rwlock_wrlock(&context_lock);
+    thread_init();
+    libzsh_lineno = lineno;
+}
+
+void libzsh_unlock(void)
+{
+    pthread_rwlock_unlock(&context_lock);
+}
+
+/*
+ * Move the current globals into st, leaving fresh lexer/parser/history
+ * state and an empty heap list behind.  Scalars and options are copied
+ * but left in place.
+ */
+static void state_save(struct libzsh_state *st)
+{
+    hist_context_save(&st->hist, 0);
+    lex_context_save(&st->lex, 0);
+    parse_context_save(&st->parse, 0);
+    st->heaps = switch_heaps(NULL);
+    memcpy(st->opts, opts, sizeof(st->opts));
+    st->lineno = lineno;
+    st->strin = strin;
+    st->errflag = errflag;
+    st->noerrs = noerrs;
+}
+
+/*
+ * Install st into the globals.  Whatever fresh state state_save() left
+ * behind is released by the *_context_restore() functions; the heap
+ * list being replaced must be empty.
+ */
+static void state_restore(const struct libzsh_state *st)
+{
+    hist_context_restore(&st->hist, 0);
+    lex_context_restore(&st->lex, 0);
+    parse_context_restore(&st->parse, 0);
+    switch_heaps(st->heaps);
+    memcpy(opts, st->opts, sizeof(opts));
+    lineno = st->lineno;
+    strin = st->strin;
+    errflag = st->errflag;
+    noerrs = st->noerrs;
+}
+
+libzsh_context *libzsh_context_new(void)
+{
+    libzsh_context *ctx;
+
+    if (libzsh_init())
+        return NULL;
+
+    ctx = (libzsh_context *)zshcalloc(sizeof(*ctx));
+    pthread_mutex_init(&ctx->use, NULL);
+    ctx->pool = libzsh_pool_new();
+    ctx->trace = libzsh_trace_new();
+
+    libzsh_lock();
+    queue_signals();
+    state_save(&ctx->outer);
+
+    /* The globals are now pristine: that is the context's initial state. */
+    strin = 1;
+    lineno = 1;
+    errflag = 0;
+    noerrs = 0;
+    state_save(&ctx->state);
+
+    state_restore(&ctx->outer);
+    unqueue_signals();
+    libzsh_unlock();
+
+    return ctx;
+}
+
+void libzsh_context_free(libzsh_context *ctx)
+{
+    if (!ctx)
+        return;
+
+    if (ctx != libzsh_current)
+        libzsh_context_enter(ctx);
+
+    /*
+     * Restoring the outer state frees the context's command stack and
+     * wordcode buffer; its heap arenas are released by old_heaps().
+     */
+    queue_signals();
+    hist_context_restore(&ctx->outer.hist, 0);
+    lex_context_restore(&ctx->outer.lex, 0);
+    parse_context_restore(&ctx->outer.parse, 0);
+    old_heaps(ctx->outer.heaps);
+    memcpy(opts, ctx->outer.opts, sizeof(opts));
+    lineno = ctx->outer.lineno;
+    strin = ctx->outer.strin;
+    errflag = ctx->outer.errflag;
+    noerrs = ctx->outer.noerrs;
+    unqueue_signals();
+
+    ctx->entered = 0;
+    libzsh_current = NULL;
+    libzsh_pool_use(NULL);
+    libzsh_trace_use(NULL);
+    pthread_rwlock_unlock(&context_lock);
+    pthread_mutex_unlock(&ctx->use);
+
+#ifdef LIBZSH_WITH_PATTERNS
+    libzsh_glob_cache_end(ctx);
+#endif
+    libzsh_pool_free(ctx->pool);
+    libzsh_trace_free(ctx->trace);
+    pthread_mutex_destroy(&ctx->use);
+    zfree(ctx, sizeof(*ctx));
+}
+
+/* Install ctx, with the context lock taken one way or the other */
+static void context_install(libzsh_context *ctx)
+{
+    thread_init();
+
+    queue_signals();
+    state_save(&ctx->outer);
+    state_restore(&ctx->state);
+    unqueue_signals();
+
+    ctx->entered = 1;
+    libzsh_current = ctx;
+    libzsh_pool_use(ctx->pool);
+    libzsh_trace_use(ctx->trace);
+}
+
+void libzsh_context_enter(libzsh_context *ctx)
+{
+    DPUTS(ctx == libzsh_current, "BUG: libzsh context entered twice");
+
+    pthread_mutex_lock(&ctx->use);
+    pthread_rwlock_wrlock(&context_lock);
+    context_install(ctx);
+    libzsh_lineno = lineno;
+}
+
+void libzsh_context_enter_shared(libzsh_context *ctx)
+{
+    int alone = 0;
+
+    DPUTS(ctx == libzsh_current, "BUG: libzsh context entered twice");
+
+    pthread_mutex_lock(&ctx->use);
+#ifdef LIBZSH_TLS_COMPLETE
+    pthread_rwlock_rdlock(&context_lock);
+    /*
+     * Expanding an alias marks it in use in the shared table until its
+     * text has been read, so with aliases about the lexer needs the
+     * lock alone.  They only change with it taken alone.
+     */
+    if (aliastab->ct || sufaliastab->ct) {
+        pthread_rwlock_unlock(&context_lock);
+        pthread_rwlock_wrlock(&context_lock);
+        alone = 1;
+    }
+#else
+    pthread_rwlock_wrlock(&context_lock);
+    alone = 1;
+#endif
+    context_install(ctx);
+    if (alone)
+        libzsh_lineno = lineno;
+}
+
+void libzsh_context_leave(libzsh_context *ctx)
+{
+    DPUTS(!ctx->entered, "BUG: libzsh context left without entering");
+
+    queue_signals();
+    state_save(&ctx->state);
+    state_restore(&ctx->outer);
+    unqueue_signals();
+
+    ctx->entered = 0;
+    libzsh_current = NULL;
+    libzsh_pool_use(NULL);
+    libzsh_trace_use(NULL);
+    pthread_rwlock_unlock(&context_lock);
+    pthread_mutex_unlock(&ctx->use);
+}
+
+int libzsh_context_setopt(libzsh_context *ctx, const char *name, int value)
+{
+    int optno, ret = -1, entered = (ctx == libzsh_current);
+
+    /* The caller may be inside the context already; opts is then its own */
+    if (!entered)
+        libzsh_context_enter(ctx);
+    if ((optno = optlookup(name)))
+        ret = dosetopt(optno, value, 0, opts) ? -1 : 0;
+    if (!entered)
+        libzsh_context_leave(ctx);
+
+    return ret;
+}
@@ -0,0 +1,289 @@
+/*
+ * libzsh_diag.c - Errors as records instead of text on stderr
+ *
+ * The lexer, parser, substitution, arithmetic, glob and pattern code
+ * report errors with zerr() and zwarn(), which format the message with
+ * stdio straight onto stderr.  libzsh compiles those sources with the
+ * two renamed to the functions here, one pair per source so a report
+ * says where it came from.  With no sink on the entered context they
+ * behave exactly as zerr() and zwarn() do; with one, the format and its
+ * arguments are handed over as they are, and nothing is formatted
+ * unless the sink asks for it with libzsh_diag_format().
+ *
+ * Positions are given for input being parsed by libzsh_parse(): how
+ * far the lexer has read is its length less what inbufct says is left,
+ * counted in the metafied copy and mapped back to the caller's bytes.
+ */
+
+#include <stdarg.h>
+
+#include "libzsh_int.h"
+
+/*
+ * The metafied input libzsh_parse() is reading on this thread, or NULL,
+ * with its length and the number of Metas in it
+ */
+static _Thread_local const char *diag_input;
+static _Thread_local long diag_len, diag_metas;
+
+/* Metas in the n bytes at s */
+static long diag_count_metas(const char *s, long n)
+{
+    const char *end = s + n;
+    long metas = 0;
+
+    while ((s = memchr(s, Meta, end - s))) {
+        metas++;
+        s++;
+    }
+    return metas;
+}
+
+void libzsh_diag_input(const char *input)
+{
+    diag_input = input;
+    if (input) {
+        diag_len = (long)strlen(input);
+        diag_metas = diag_count_metas(input, diag_len);
+    }
+}
+
+/*
+ * Offset in the caller's bytes of how far the lexer has read, or -1.
+ * Each Meta before it stands for one byte with the one after it; a
+ * Meta just before it is counted as the whole byte.  The Metas are
+ * counted over the shorter side of it, and not at all if there are
+ * none.
+ */
+static long diag_offset(void)
+{
+    long moff, at;
+
+    if (!diag_input)
+        return -1;
+    if ((moff = diag_len - inbufct) < 0 || moff > diag_len)
+        return -1;
+    if (!diag_metas || !moff)
+        return moff;
+    at = moff - 1;
+    if (at <= diag_len - at)
+        return moff - diag_count_metas(diag_input, at);
+    return moff - diag_metas + diag_count_metas(diag_input + at,
+                                                diag_len - at);
+}
+
+/* Take the arguments of fmt, as zerrmsg() reads them, into d */
+static void diag_args(struct libzsh_diag *d, const char *fmt, va_list ap)
+{
+    const char *s;
+    int nstr = 0, nnum = 0, len;
+    long num;
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%' || !*++fmt)
+            continue;
+        switch (*fmt) {
+        case 's':
+        case 'l':
+            s = va_arg(ap, const char *);
+            len = *fmt == 'l' ? va_arg(ap, int) : -1;
+            if (nstr == LIBZSH_DIAG_ARGS)
+                break;
+            if (!s)
+                s = "";
+            if (len < 0)
+                len = (int)strlen(s);
+            /* Metafied text is only copied if there is a Meta in it */
+            if (memchr(s, Meta, len)) {
+                char *u = dupstrpfx(s, len);
+
+                unmetafy(u, &len);
+                s = u;
+            }
+            d->str[nstr] = s;
+            d->len[nstr++] = (size_t)len;
+            break;
+        case 'L':
+            num = va_arg(ap, long);
+            if (nnum < LIBZSH_DIAG_ARGS)
+                d->num[nnum++] = num;
+            break;
+        case 'd':
+        case 'c':
+        case 'e':
+            num = va_arg(ap, int);
+            if (nnum < LIBZSH_DIAG_ARGS)
+                d->num[nnum++] = num;
+            break;
+        }
+    }
+    d->nstr = nstr;
+    d->nnum = nnum;
+}
+
+/* What zwarning() in utils.c prints for a report with no command name */
+static void diag_print(const char *fmt, va_list ap)
+{
+    char *prefix = scriptname ? scriptname : (argzero ? argzero : "");
+
+    if (isatty(2))
+        zleentry(ZLE_CMD_TRASH);
+    nicezputs((isset(SHINSTDIN) && !locallevel) ? "zsh" : prefix, stderr);
+    fputc((unsigned char)':', stderr);
+    zerrmsg(stderr, fmt, ap);
+}
+
+static void diag_report(int severity, int source, const char *fmt,
+                        va_list ap)
+{
+    libzsh_context *ctx = libzsh_current;
+    struct libzsh_diag d;
+
+    if (!ctx || !ctx->diag_fn) {
+        diag_print(fmt, ap);
+        return;
+    }
+    memset(&d, 0, sizeof(d));
+    d.severity = severity;
+    d.source = source;
+    d.line = (long)lineno;
+    d.offset = diag_offset();
+    d.fmt = fmt;
+    diag_args(&d, fmt, ap);
+    ctx->diag_fn(ctx->diag_data, &d);
+}
+
+/* As zerr() and zwarn() gate what they report */
+static void diag_zerr(int source, const char *fmt, va_list ap)
+{
+    if (errflag || noerrs) {
+        if (noerrs < 2)
+            errflag |= ERRFLAG_ERROR;
+        return;
+    }
+    errflag |= ERRFLAG_ERROR;
+    diag_report(LIBZSH_DIAG_ERROR, source, fmt, ap);
+}
+
+static void diag_zwarn(int source, const char *fmt, va_list ap)
+{
+    if (errflag || noerrs)
+        return;
+    diag_report(LIBZSH_DIAG_WARNING, source, fmt, ap);
+}
+
+#define DIAG_SOURCE(name, source)                       \
+    void libzsh_zerr_##name(const char *fmt, ...)       \
+    {                                                   \
+        va_list ap;                                     \
+        va_start(ap, fmt);                              \
+        diag_zerr(source, fmt, ap);                     \
+        va_end(ap);                                     \
+    }                                                   \
+    void libzsh_zwarn_##name(const char *fmt, ...)      \
+    {                                                   \
+        va_list ap;                                     \
+        va_start(ap, fmt);                              \
+        diag_zwarn(source, fmt, ap);                    \
+        va_end(ap);                                     \
+    }
+
+DIAG_SOURCE(lex, LIBZSH_DIAG_LEXER)
+DIAG_SOURCE(parse, LIBZSH_DIAG_PARSER)
+DIAG_SOURCE(subst, LIBZSH_DIAG_SUBST)
+DIAG_SOURCE(math, LIBZSH_DIAG_MATH)
+DIAG_SOURCE(glob, LIBZSH_DIAG_GLOB)
+DIAG_SOURCE(pattern, LIBZSH_DIAG_PATTERN)
+
+void libzsh_context_set_diag(libzsh_context *ctx, libzsh_diag_fn fn,
+                             void *data)
+{
+    libzsh_context_enter(ctx);
+    ctx->diag_fn = fn;
+    ctx->diag_data = data;
+    libzsh_context_leave(ctx);
+}
+
+/*
+ * Formatting, as zerrmsg() does
+ */
+
+struct diag_out {
+    char *buf;
+    size_t size, len;
+};
+
+static void out_add(struct diag_out *o, const char *s, size_t n)
+{
+    if (o->len < o->size) {
+        size_t room = o->size - 1 - o->len;
+
+        memcpy(o->buf + o->len, s, n < room ? n : room);
+    }
+    o->len += n;
+}
+
+size_t libzsh_diag_format(const struct libzsh_diag *d, char *buf,
+                          size_t size)
+{
+    struct diag_out o;
+    const char *fmt;
+    char num[32];
+    int nstr = 0, nnum = 0;
+    long n;
+
+    o.buf = buf;
+    o.size = size;
+    o.len = 0;
+    for (fmt = d->fmt; *fmt; fmt++) {
+        if (*fmt != '%' || !fmt[1]) {
+            out_add(&o, fmt, 1);
+            continue;
+        }
+        switch (*++fmt) {
+        case 's':
+        case 'l':
+            if (nstr < d->nstr) {
+                out_add(&o, d->str[nstr], d->len[nstr]);
+                nstr++;
+            }
+            break;
+        case 'L':
+        case 'd':
+            n = nnum < d->nnum ? d->num[nnum++] : 0;
+            out_add(&o, num, sprintf(num, "%ld", n));
+            break;
+        case 'c':
+            n = nnum < d->nnum ? d->num[nnum++] : 0;
+            if (n >= 0 && n < 32) {
+                num[0] = '^';
+                num[1] = (char)(n + '@');
+                out_add(&o, num, 2);
+            } else {
+                num[0] = (char)n;
+                out_add(&o, num, 1);
+            }
+            break;
+        case 'e':
+            n = nnum < d->nnum ? d->num[nnum++] : 0;
+            if (n == EINTR)
+                out_add(&o, "interrupt", 9);
+            else {
+                const char *e = strerror((int)n);
+
+                /* Lower-cased, as zerrmsg() prints all but EIO's */
+                num[0] = n == EIO ? *e : (char)tulower(*e);
+                out_add(&o, num, 1);
+                if (*e)
+                    out_add(&o, e + 1, strlen(e + 1));
+            }
+            break;
+        default:
+            out_add(&o, fmt, 1);
+            break;
+        }
+    }
+    if (size)
+        buf[o.len < size ? o.len : size - 1] = '\0';
+    return o.len;
+}
@@ -0,0 +1,323 @@
+/*
+ * libzsh_expand.c - Expanding many strings at once
+ *
+ * Expanding a string the way zsh expands a here document (parameters,
+ * ${...} forms, arithmetic) is parsestr() to tokenize it and singsub()
+ * to substitute, both needing a context entered and a heap frame.
+ * libzsh_expand() enters once for a whole batch, keeps one heap frame
+ * that it empties after each string, and copies each result into one
+ * growing buffer, so the per-string cost is only the expansion.
+ *
+ * Command substitutions would fork and run commands, so unless the
+ * caller asks for them they are refused where they would run, not
+ * only where the string is read: ${(e)...}, subscripts and glob
+ * qualifiers reach them from text no scan of the string can see.
+ * exec.c is compiled with getoutput(), getoutputfile(), getproc() and
+ * execode() under other names and the functions here stand in for
+ * them, so everything substitution and globbing would run comes
+ * through the guard; bare glob qualifiers are off as well.  Globbing
+ * is only done when asked for, on the result as ${~...} would.
+ *
+ * libzsh_init() builds no parameter table, since parsing needs none.
+ * The first call here builds it.  setupvals() cannot be used for that:
+ * it also makes the tables libzsh_init() has already made, and the
+ * history and command stack a context owns.  So the globals behind the
+ * special parameters get the values its parameter section gives them,
+ * in its order, and the environment is read but never written: the
+ * table is made with environ pointing at a copy, and nothing in it is
+ * exported afterwards.  It is shared by all contexts, like the option
+ * and alias tables.  Results are malloc()ed, since they are freed
+ * without a context entered.
+ */
+
+#include "libzsh_int.h"
+
+extern char **environ;
+
+extern void createparamtable(void);
+
+/* exec.c's, renamed */
+extern LinkList zsh_unguarded_getoutput(char *cmd, int qt);
+extern char *zsh_unguarded_getoutputfile(char *cmd, char **eptr);
+extern char *zsh_unguarded_getproc(char *cmd, char **eptr);
+extern void zsh_unguarded_execode(Eprog p, int dont_change_job, int exiting,
+                                  char *context);
+
+/* Set once, with the context lock held */
+static int params_made;
+
+/* Expanding without LIBZSH_EXPAND_CMDSUBST; a command was refused */
+static _Thread_local int cmd_refuse, cmd_refused;
+
+static void param_unexport(HashNode hn, UNUSED(int flags))
+{
+    Param pm = (Param)hn;
+
+    if (pm->env) {
+        zsfree(pm->env);
+        pm->env = NULL;
+    }
+    pm->node.flags &= ~PM_EXPORTED;
+}
+
+void libzsh_params_init(void)
+{
+    char **env, **ep, *cwd;
+    size_t n = 0;
+
+    if (params_made)
+        return;
+    params_made = 1;
+
+    path = mkarray(NULL);
+    cdpath = mkarray(NULL);
+    manpath = mkarray(NULL);
+    fignore = mkarray(NULL);
+    fpath = mkarray(NULL);
+    mailpath = mkarray(NULL);
+    psvar = mkarray(NULL);
+    prompt = ztrdup("");
+    prompt2 = ztrdup("");
+    prompt3 = ztrdup("");
+    prompt4 = ztrdup("");
+    sprompt = ztrdup("");
+    ifs = ztrdup(DEFAULT_IFS);
+    wordchars = ztrdup(DEFAULT_WORDCHARS);
+    zoptarg = ztrdup("");
+    zoptind = 1;
+    ppid = (zlong) getppid();
+    mypid = (zlong) getpid();
+    term = ztrdup("");
+    nullcmd = ztrdup("cat");
+    readnullcmd = ztrdup(DEFAULT_READNULLCMD);
+    if (!argzero)
+        argzero = posixzero = ztrdup("zsh");
+    if (!home)
+        home = ztrdup(getenv("HOME") ? getenv("HOME") : "/");
+    if (!pwd)
+        pwd = ztrdup((cwd = zgetcwd()) ? cwd : "/");
+    if (!pparams)
+        pparams = (char **)zshcalloc(sizeof(char *));
+
+    /* What createparamtable() exports goes into the copy */
+    for (ep = environ; *ep; ep++)
+        n++;
+    env = (char **)zalloc((n + 1) * sizeof(*env));
+    memcpy(env, environ, (n + 1) * sizeof(*env));
+    ep = environ;
+    environ = env;
+    createparamtable();
+    environ = ep;
+    zfree(env, (n + 1) * sizeof(*env));
+    scanhashtable(paramtab, 0, PM_EXPORTED, 0, param_unexport, 0);
+#ifdef LIBZSH_HASH_INDEX
+    libzsh_hashtable_index(paramtab);
+#endif
+}
+
+/*
+ * exec.c's entry points for substitution and glob qualifiers.  A
+ * refusal is an error, which stops the expansion, and is reported as
+ * LIBZSH_EXPAND_ECMDSUBST.
+ */
+static int cmd_allowed(void)
+{
+    if (!cmd_refuse)
+        return 1;
+    cmd_refused = 1;
+    errflag |= ERRFLAG_ERROR;
+    return 0;
+}
+
+LinkList getoutput(char *cmd, int qt)
+{
+    return cmd_allowed() ? zsh_unguarded_getoutput(cmd, qt) : NULL;
+}
+
+char *getoutputfile(char *cmd, char **eptr)
+{
+    return cmd_allowed() ? zsh_unguarded_getoutputfile(cmd, eptr) : NULL;
+}
+
+char *getproc(char *cmd, char **eptr)
+{
+    return cmd_allowed() ? zsh_unguarded_getproc(cmd, eptr) : NULL;
+}
+
+void execode(Eprog p, int dont_change_job, int exiting, char *context)
+{
+    if (cmd_allowed())
+        zsh_unguarded_execode(p, dont_change_job, exiting, context);
+}
+
+int libzsh_setparam(libzsh_context *ctx, const char *name, const char *value)
+{
+    struct libzsh_pool *pool;
+    int ret;
+
+    libzsh_context_enter(ctx);
+    /* The parameter table is shared, so is what goes in it */
+    pool = libzsh_pool_shared();
+    libzsh_params_init();
+    pushheap();
+    errflag = 0;
+    ret = setsparam(dupstring(name), ztrdup_metafy(value)) ? 0 : -1;
+    errflag = 0;
+    popheap();
+    libzsh_pool_use(pool);
+    libzsh_context_leave(ctx);
+    return ret;
+}
+
+/* Whether the tokenized s has a command substitution in it */
+static int has_cmdsubst(const char *s)
+{
+    for (; *s; s++) {
+        if (*s == Meta && s[1])
+            s++;
+        else if (*s == Tick || *s == Qtick)
+            return 1;
+        else if ((*s == String || *s == Qstring) && s[1] == Inpar)
+            return 1;
+    }
+    return 0;
+}
+
+struct expand_buf {
+    char *buf;
+    size_t len, size;
+};
+
+/* Append s (metafied) unmetafied, with a NUL after it; 0 or -1 */
+static int buf_add(struct expand_buf *b, char *s)
+{
+    int len;
+
+    unmetafy(s, &len);
+    if (b->len + len + 1 > b->size) {
+        size_t size = b->size ? b->size : 256;
+        char *buf;
+
+        while (b->len + len + 1 > size)
+            size *= 2;
+        if (!(buf = (char *)realloc(b->buf, size)))
+            return -1;
+        b->buf = buf;
+        b->size = size;
+    }
+    memcpy(b->buf + b->len, s, len);
+    b->len += len;
+    b->buf[b->len++] = '\0';
+    return 0;
+}
+
+/* Expand one string onto b; returns 0 or LIBZSH_EXPAND_E* */
+static int expand_one(const char *in, int flags, struct expand_buf *b)
+{
+    char *s = metafy((char *)in, -1, META_HEAPDUP);
+
+    errflag = 0;
+    if (parsestr(&s) || errflag)
+        return LIBZSH_EXPAND_ESYNTAX;
+    if (!(flags & LIBZSH_EXPAND_CMDSUBST) && has_cmdsubst(s))
+        return LIBZSH_EXPAND_ECMDSUBST;
+
+    cmd_refused = 0;
+    singsub(&s);
+    if (cmd_refused)
+        return LIBZSH_EXPAND_ECMDSUBST;
+    if (errflag)
+        return LIBZSH_EXPAND_EFAILED;
+    remnulargs(s);
+    untokenize(s);
+
+    if (flags & LIBZSH_EXPAND_GLOB) {
+        LinkList list = newlinklist();
+        LinkNode node;
+
+        tokenize(s);
+        addlinknode(list, s);
+        if (haswilds(s))
+            globlist(list, 0);
+        if (cmd_refused)
+            return LIBZSH_EXPAND_ECMDSUBST;
+        if (errflag)
+            return LIBZSH_EXPAND_EFAILED;
+        for (node = firstnode(list); node; incnode(node)) {
+            char *w = (char *)getdata(node);
+
+            remnulargs(w);
+            untokenize(w);
+            if (buf_add(b, w))
+                return LIBZSH_EXPAND_EFAILED;
+        }
+    } else if (buf_add(b, s))
+        return LIBZSH_EXPAND_EFAILED;
+    return 0;
+}
+
+int libzsh_expand(libzsh_context *ctx, const char *const *in, size_t n,
+                  int flags, struct libzsh_expansion *out)
+{
+    struct expand_buf b = { NULL, 0, 0 };
+    struct libzsh_pool *pool;
+    int onoerrs, obarequal, failed = 0;
+    size_t i;
+
+    out->count = n;
+    out->buf = NULL;
+    out->len = out->size = 0;
+    out->offs = (size_t *)malloc((n + 1) * sizeof(*out->offs));
+    out->status = (int *)calloc(n ? n : 1, sizeof(*out->status));
+    if (!out->offs || !out->status) {
+        libzsh_expansion_free(out);
+        return -1;
+    }
+
+    libzsh_context_enter(ctx);
+    /* ${name=value} and the like assign in the shared table */
+    pool = libzsh_pool_shared();
+    libzsh_params_init();
+    onoerrs = noerrs;
+    if (flags & LIBZSH_EXPAND_QUIET)
+        noerrs = 1;
+    obarequal = opts[BAREGLOBQUAL];
+    if (!(flags & LIBZSH_EXPAND_CMDSUBST)) {
+        cmd_refuse = 1;
+        opts[BAREGLOBQUAL] = 0;
+    }
+    pushheap();
+    for (i = 0; i < n; i++) {
+        size_t start = b.len;
+
+        out->offs[i] = start;
+        if ((out->status[i] = expand_one(in[i], flags, &b))) {
+            b.len = start;
+            failed++;
+        }
+        freeheap();
+    }
+    out->offs[n] = b.len;
+    popheap();
+    cmd_refuse = 0;
+    opts[BAREGLOBQUAL] = obarequal;
+    errflag = 0;
+    noerrs = onoerrs;
+    libzsh_pool_use(pool);
+    libzsh_context_leave(ctx);
+
+    out->buf = b.buf;
+    out->len = b.len;
+    out->size = b.size;
+    return failed;
+}
+
+void libzsh_expansion_free(struct libzsh_expansion *out)
+{
+    free(out->buf);
+    free(out->offs);
+    free(out->status);
+    out->buf = NULL;
+    out->offs = NULL;
+    out->status = NULL;
+}
@@ -0,0 +1,882 @@
+/*
+ * libzsh_glob.c - Recursive globs walked by several threads
+ *
+ * glob.c expands `**' by reading one directory at a time with
+ * opendir(), readdir() and a stat() of every entry, so a large tree on
+ * a slow filesystem is walked at the speed of one round trip after
+ * another.  Here a pool of threads walks the tree: each keeps a deque of
+ * directories still to read, works from its own end and, when it runs
+ * dry, steals from the other end of someone else's.
+ *
+ * Directories are opened relative to a descriptor for the top of the
+ * walk and read with getdents64() where there is one.  An entry is only
+ * stat'ed when its d_type doesn't say what it is, or when it is a link
+ * and links are being followed.
+ *
+ * Walkers can't use the pattern matcher, which keeps its state in
+ * globals, nor zalloc(), which queues signals through them.  They
+ * allocate with malloc() and match names with the pattern's literal
+ * checks only; the names those can't decide are matched afterwards in
+ * the calling thread, which then sorts the lot as zsh sorts a glob.
+ *
+ * Globs in a single directory are expanded from a listing of it, which
+ * can be kept on the context and shared by every pattern expanded there
+ * until the directory changes.
+ */
+
+#include <pthread.h>
+
+#include "libzsh_int.h"
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/syscall.h>
+#if defined(SYS_getdents64)
+#define USE_GETDENTS 1
+#endif
+#endif
+
+#define GLOB_MAX_THREADS 16
+
+/* What an entry is, as far as the walk cares */
+enum { ET_UNKNOWN, ET_DIR, ET_REG, ET_LNK, ET_OTHER };
+
+/* A directory to read: its path from the top, "" or ending in a slash */
+struct glob_task {
+    char *rel;
+    size_t len;
+};
+
+struct glob_hit {
+    char *path;                 /* prefix, rel and name */
+    size_t name;                /* offset of the name in path */
+    int decided;                /* the literal checks were enough */
+};
+
+struct glob_walk;
+
+struct glob_worker {
+    pthread_t thread;
+    struct glob_walk *walk;
+    pthread_mutex_t lock;       /* guards the deque; others steal */
+    struct glob_task *tasks;    /* live between head and ntasks */
+    size_t head, ntasks, sztasks;
+    struct glob_hit *hits;
+    size_t nhits, szhits;
+};
+
+struct glob_walk {
+    int topfd;
+    libzsh_pattern *pat;
+    int flags;
+    int dots;                   /* GLOB_DOTS: match and descend into .x */
+    int matchdots;              /* the pattern starts with a dot */
+    char *prefix;               /* put before every path */
+    size_t prefixlen;
+    struct glob_worker *workers;
+    int nworkers;
+    pthread_mutex_t lock;       /* guards the rest */
+    pthread_cond_t cond;
+    long pending;               /* directories queued or being read */
+    unsigned long pushed;       /* directories ever queued */
+    int idle;
+    int failed;                 /* out of memory */
+};
+
+/*
+ * Reading directories
+ */
+
+struct dir_iter {
+#ifdef USE_GETDENTS
+    int fd;
+    long len, pos;
+    char buf[32768];
+#else
+    DIR *dir;
+#endif
+};
+
+#ifdef USE_GETDENTS
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+static int entry_type(unsigned char dt)
+{
+#ifdef DT_UNKNOWN
+    switch (dt) {
+    case DT_DIR:
+        return ET_DIR;
+    case DT_REG:
+        return ET_REG;
+    case DT_LNK:
+        return ET_LNK;
+    case DT_UNKNOWN:
+        return ET_UNKNOWN;
+    }
+    return ET_OTHER;
+#else
+    return ET_UNKNOWN;
+#endif
+}
+
+static int stat_type(mode_t mode)
+{
+    if (S_ISDIR(mode))
+        return ET_DIR;
+    if (S_ISREG(mode))
+        return ET_REG;
+    if (S_ISLNK(mode))
+        return ET_LNK;
+    return ET_OTHER;
+}
+
+/* Takes over fd */
+static int dir_open(struct dir_iter *it, int fd)
+{
+#ifdef USE_GETDENTS
+    it->fd = fd;
+    it->len = it->pos = 0;
+#else
+    if (!(it->dir = fdopendir(fd))) {
+        close(fd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* The next name, or NULL at the end */
+static const char *dir_next(struct dir_iter *it, int *type)
+{
+#ifdef USE_GETDENTS
+    struct linux_dirent64 *d;
+
+    if (it->pos >= it->len) {
+        it->len = syscall(SYS_getdents64, it->fd, it->buf, sizeof(it->buf));
+        it->pos = 0;
+        if (it->len <= 0)
+            return NULL;
+    }
+    d = (struct linux_dirent64 *)(it->buf + it->pos);
+    it->pos += d->d_reclen;
+    *type = entry_type(d->d_type);
+    return d->d_name;
+#else
+    struct dirent *d;
+
+    if (!(d = readdir(it->dir)))
+        return NULL;
+#ifdef DT_UNKNOWN
+    *type = entry_type(d->d_type);
+#else
+    *type = ET_UNKNOWN;
+#endif
+    return d->d_name;
+#endif
+}
+
+static int dir_fd(struct dir_iter *it)
+{
+#ifdef USE_GETDENTS
+    return it->fd;
+#else
+    return dirfd(it->dir);
+#endif
+}
+
+static void dir_close(struct dir_iter *it)
+{
+#ifdef USE_GETDENTS
+    close(it->fd);
+#else
+    closedir(it->dir);
+#endif
+}
+
+/*
+ * The work pool
+ */
+
+static int queue_push(struct glob_worker *w, char *rel, size_t len)
+{
+    struct glob_walk *walk = w->walk;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->ntasks == w->sztasks) {
+        /* Reclaim what has been stolen from the front before growing */
+        if (w->head) {
+            memmove(w->tasks, w->tasks + w->head,
+                    (w->ntasks - w->head) * sizeof(*w->tasks));
+            w->ntasks -= w->head;
+            w->head = 0;
+        } else {
+            size_t sz = w->sztasks ? w->sztasks * 2 : 64;
+            struct glob_task *t = realloc(w->tasks, sz * sizeof(*t));
+
+            if (!t) {
+                pthread_mutex_unlock(&w->lock);
+                return -1;
+            }
+            w->tasks = t;
+            w->sztasks = sz;
+        }
+    }
+    w->tasks[w->ntasks].rel = rel;
+    w->tasks[w->ntasks].len = len;
+    w->ntasks++;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->pending++;
+    walk->pushed++;
+    if (walk->idle)
+        pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    return 0;
+}
+
+/* Newest from our own deque, so a walker goes deep before it goes wide */
+static int queue_pop(struct glob_worker *w, struct glob_task *t)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->ntasks > w->head) {
+        *t = w->tasks[--w->ntasks];
+        if (w->ntasks == w->head)
+            w->ntasks = w->head = 0;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* Oldest from someone else's: near the top, so likely a large subtree */
+static int queue_steal(struct glob_worker *w, struct glob_task *t)
+{
+    struct glob_walk *walk = w->walk;
+    int i, n = walk->nworkers, me = (int)(w - walk->workers);
+
+    for (i = 1; i < n; i++) {
+        struct glob_worker *v = &walk->workers[(me + i) % n];
+        int ret = 0;
+
+        pthread_mutex_lock(&v->lock);
+        if (v->ntasks > v->head) {
+            *t = v->tasks[v->head++];
+            if (v->ntasks == v->head)
+                v->ntasks = v->head = 0;
+            ret = 1;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (ret)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Walking
+ */
+
+static char *join(const char *a, size_t alen, const char *b, size_t blen,
+                  const char *c, size_t clen, size_t *len)
+{
+    char *s = malloc(alen + blen + clen + 1);
+
+    if (!s)
+        return NULL;
+    memcpy(s, a, alen);
+    memcpy(s + alen, b, blen);
+    memcpy(s + alen + blen, c, clen);
+    s[alen + blen + clen] = '\0';
+    if (len)
+        *len = alen + blen + clen;
+    return s;
+}
+
+static int add_hit(struct glob_worker *w, const struct glob_task *t,
+                   const char *name, size_t nlen, int decided)
+{
+    struct glob_walk *walk = w->walk;
+    struct glob_hit *h;
+
+    if (w->nhits == w->szhits) {
+        size_t sz = w->szhits ? w->szhits * 2 : 256;
+
+        if (!(h = realloc(w->hits, sz * sizeof(*h))))
+            return -1;
+        w->hits = h;
+        w->szhits = sz;
+    }
+    h = &w->hits[w->nhits];
+    if (!(h->path = join(walk->prefix, walk->prefixlen, t->rel, t->len,
+                         name, nlen, NULL)))
+        return -1;
+    h->name = walk->prefixlen + t->len;
+    h->decided = decided;
+    w->nhits++;
+    return 0;
+}
+
+static int want_type(int flags, int type)
+{
+    if (flags & LIBZSH_GLOB_FILES)
+        return type == ET_REG;
+    if (flags & LIBZSH_GLOB_DIRS)
+        return type == ET_DIR;
+    return 1;
+}
+
+static int read_task(struct glob_worker *w, const struct glob_task *t)
+{
+    struct glob_walk *walk = w->walk;
+    int follow = walk->flags & LIBZSH_GLOB_FOLLOW;
+    struct dir_iter it;
+    const char *name;
+    int fd, type;
+
+    if (t->len)
+        fd = openat(walk->topfd, t->rel, O_RDONLY | O_DIRECTORY | O_NOCTTY |
+                    O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+    else
+        fd = dup(walk->topfd);
+    /* Unreadable directories are passed over, as glob.c does */
+    if (fd < 0 || dir_open(&it, fd))
+        return 0;
+
+    while ((name = dir_next(&it, &type))) {
+        size_t nlen = strlen(name);
+        int dot = *name == '.', descend, r;
+        struct stat st;
+
+        if (dot && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        if (dot && !walk->dots && !walk->matchdots)
+            continue;
+
+        if (type == ET_UNKNOWN &&
+            !fstatat(dir_fd(&it), name, &st, AT_SYMLINK_NOFOLLOW))
+            type = stat_type(st.st_mode);
+        descend = type == ET_DIR;
+        if (type == ET_LNK && follow &&
+            !fstatat(dir_fd(&it), name, &st, 0))
+            descend = S_ISDIR(st.st_mode);
+
+        if ((!dot || walk->dots || walk->matchdots) &&
+            want_type(walk->flags, type) &&
+            (r = libzsh_pattern_prefilter(walk->pat, name, nlen)) &&
+            add_hit(w, t, name, nlen, r == 1))
+            break;
+
+        if (descend && (!dot || walk->dots)) {
+            size_t len;
+            char *rel = join(t->rel, t->len, name, nlen, "/", 1, &len);
+
+            if (!rel || queue_push(w, rel, len)) {
+                free(rel);
+                break;
+            }
+        }
+    }
+    dir_close(&it);
+    return name ? -1 : 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct glob_worker *w = (struct glob_worker *)arg;
+    struct glob_walk *walk = w->walk;
+    struct glob_task t;
+    unsigned long seen;         /* walk->pushed when the deques were searched */
+
+    pthread_mutex_lock(&walk->lock);
+    seen = walk->pushed;
+    pthread_mutex_unlock(&walk->lock);
+    for (;;) {
+        if (queue_pop(w, &t) || queue_steal(w, &t)) {
+            int failed = read_task(w, &t);
+
+            free(t.rel);
+            pthread_mutex_lock(&walk->lock);
+            if (failed)
+                walk->failed = 1;
+            if (!--walk->pending)
+                pthread_cond_broadcast(&walk->cond);
+            seen = walk->pushed;
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+        pthread_mutex_lock(&walk->lock);
+        if (!walk->pending) {
+            pthread_mutex_unlock(&walk->lock);
+            break;
+        }
+        /*
+         * A push that came after the search, but before we were idle,
+         * signalled nobody: look again rather than sleep through it.
+         */
+        if (walk->pushed != seen) {
+            seen = walk->pushed;
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+        /* Someone is still reading and may queue more */
+        walk->idle++;
+        pthread_cond_wait(&walk->cond, &walk->lock);
+        walk->idle--;
+        seen = walk->pushed;
+        pthread_mutex_unlock(&walk->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Gathering up
+ */
+
+/* Set and read with the context entered, so one sort sees one value */
+static int glob_sortflags;
+
+static int hit_cmp(const void *a, const void *b)
+{
+    return zstrcmp(((const struct glob_hit *)a)->path,
+                   ((const struct glob_hit *)b)->path, glob_sortflags);
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return zstrcmp(*(char *const *)a, *(char *const *)b, glob_sortflags);
+}
+
+static int nthreads_default(void)
+{
+    long n = -1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1)
+        return 1;
+    return n > GLOB_MAX_THREADS ? GLOB_MAX_THREADS : (int)n;
+}
+
+int libzsh_glob_recursive(libzsh_context *ctx, const char *dir,
+                          const char *pattern, int flags, int nthreads,
+                          char ***paths, size_t *count)
+{
+    struct glob_walk walk;
+    struct glob_hit *hits = NULL;
+    size_t nhits = 0, i, n;
+    char **out;
+    int started, ret = -1;
+
+    *paths = NULL;
+    *count = 0;
+    memset(&walk, 0, sizeof(walk));
+    if (!(walk.pat = libzsh_pattern_compile(ctx, pattern, strlen(pattern))))
+        return -1;
+    if ((walk.topfd = open(dir && *dir ? dir : ".", O_RDONLY | O_DIRECTORY |
+                           O_NOCTTY | O_CLOEXEC)) < 0) {
+        libzsh_pattern_free(walk.pat);
+        return -1;
+    }
+
+    libzsh_context_enter(ctx);
+    walk.dots = isset(GLOBDOTS);
+    libzsh_context_leave(ctx);
+    /* As in glob.c, a leading dot in the pattern matches dot files */
+    walk.matchdots = *pattern == '.';
+    walk.flags = flags;
+    /* Paths come out as dir/sub/name, or sub/name for the current directory */
+    i = dir ? strlen(dir) : 0;
+    if (!(walk.prefix = join(dir ? dir : "", i, "/",
+                             i && dir[i - 1] != '/', "", 0, &walk.prefixlen))) {
+        close(walk.topfd);
+        libzsh_pattern_free(walk.pat);
+        return -1;
+    }
+
+    if (nthreads <= 0)
+        nthreads = nthreads_default();
+    else if (nthreads > GLOB_MAX_THREADS)
+        nthreads = GLOB_MAX_THREADS;
+    if (!(walk.workers = calloc(nthreads, sizeof(*walk.workers)))) {
+        free(walk.prefix);
+        close(walk.topfd);
+        libzsh_pattern_free(walk.pat);
+        return -1;
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    walk.nworkers = nthreads;
+    for (i = 0; i < (size_t)nthreads; i++) {
+        walk.workers[i].walk = &walk;
+        pthread_mutex_init(&walk.workers[i].lock, NULL);
+    }
+
+    /* The top goes to the first walker; the rest steal from it */
+    if (!(walk.workers[0].tasks = malloc(64 * sizeof(struct glob_task))) ||
+        !(walk.workers[0].tasks[0].rel = strdup("")))
+        goto out;
+    walk.workers[0].tasks[0].len = 0;
+    walk.workers[0].sztasks = 64;
+    walk.workers[0].ntasks = 1;
+    walk.pending = 1;
+    for (started = 1; started < nthreads; started++)
+        if (pthread_create(&walk.workers[started].thread, NULL,
+                           worker_main, &walk.workers[started]))
+            break;
+    worker_main(&walk.workers[0]);
+    for (i = 1; i < (size_t)started; i++)
+        pthread_join(walk.workers[i].thread, NULL);
+    if (walk.failed)
+        goto out;
+
+    for (i = 0; i < (size_t)nthreads; i++)
+        nhits += walk.workers[i].nhits;
+    if (!(hits = malloc((nhits ? nhits : 1) * sizeof(*hits))))
+        goto out;
+    for (i = 0, n = 0; i < (size_t)nthreads; i++) {
+        struct glob_worker *w = &walk.workers[i];
+
+        if (w->nhits)
+            memcpy(hits + n, w->hits, w->nhits * sizeof(*hits));
+        n += w->nhits;
+        w->nhits = 0;
+    }
+
+    /* What the literal checks couldn't decide, then zsh's order */
+    libzsh_context_enter(ctx);
+    pushheap();
+    for (i = 0, n = 0; i < nhits; i++) {
+        struct glob_hit *h = &hits[i];
+
+        if (h->decided || libzsh_pattern_match_entered(walk.pat,
+                 h->path + h->name, strlen(h->path + h->name)))
+            hits[n++] = *h;
+        else
+            free(h->path);
+        if (i % 1024 == 1023)
+            freeheap();
+    }
+    nhits = n;
+    glob_sortflags = isset(NUMERICGLOBSORT) ? SORTIT_NUMERICALLY : 0;
+    qsort(hits, nhits, sizeof(*hits), hit_cmp);
+    popheap();
+    libzsh_context_leave(ctx);
+
+    if (!(out = malloc((nhits + 1) * sizeof(*out))))
+        goto out;
+    for (i = 0; i < nhits; i++)
+        out[i] = hits[i].path;
+    out[nhits] = NULL;
+    *paths = out;
+    *count = nhits;
+    nhits = 0;
+    ret = 0;
+
+ out:
+    for (i = 0; i < nhits; i++)
+        free(hits[i].path);
+    free(hits);
+    for (i = 0; i < (size_t)nthreads; i++) {
+        struct glob_worker *w = &walk.workers[i];
+
+        for (n = w->head; n < w->ntasks; n++)
+            free(w->tasks[n].rel);
+        for (n = 0; n < w->nhits; n++)
+            free(w->hits[n].path);
+        free(w->tasks);
+        free(w->hits);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(walk.workers);
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+    free(walk.prefix);
+    close(walk.topfd);
+    libzsh_pattern_free(walk.pat);
+    return ret;
+}
+
+void libzsh_glob_free(char **paths, size_t count)
+{
+    size_t i;
+
+    if (!paths)
+        return;
+    for (i = 0; i < count; i++)
+        free(paths[i]);
+    free(paths);
+}
+
+/*
+ * Listings of single directories
+ *
+ * Without a cache every libzsh_glob_dir() reads the directory again.
+ * With one, a listing is found by the directory's device and inode and
+ * used for as long as its modification time stays the same, which
+ * costs one stat() instead of an open, reads and a close.  Timestamps
+ * are coarse: a listing read in the same tick the directory last
+ * changed may miss a later change in that tick, so such a listing is
+ * never trusted and is read again the next time (as git does with
+ * racily clean index entries).  Entries keep the type found for them,
+ * stat'ing only those d_type left unknown.
+ *
+ * Listings are read and looked up without the context entered, so
+ * they and the cache are malloc()'d rather than zalloc()'d.
+ */
+
+#define DC_BUCKETS 64
+
+struct dc_dir {
+    struct dc_dir *next;        /* in the bucket */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_ns;
+    int racy;                   /* changed too near the read to trust */
+    char *names;                /* each followed by a NUL */
+    size_t nameslen, namessz;
+    size_t *offs;               /* of each name */
+    unsigned char *types;
+    size_t count, szents;
+};
+
+struct libzsh_dircache {
+    struct dc_dir *buckets[DC_BUCKETS];
+    size_t hits, reads;
+};
+
+static long mtime_ns(const struct stat *st)
+{
+#ifdef GET_ST_MTIME_NSEC
+    return GET_ST_MTIME_NSEC(*st);
+#else
+    return 0;
+#endif
+}
+
+static void dc_free(struct dc_dir *d)
+{
+    free(d->names);
+    free(d->offs);
+    free(d->types);
+    free(d);
+}
+
+/* Returns -1 if out of memory */
+static int dc_add(struct dc_dir *d, const char *name, int type)
+{
+    size_t len = strlen(name) + 1;
+
+    if (d->nameslen + len > d->namessz) {
+        size_t sz = d->namessz ? d->namessz : 1024;
+        char *names;
+
+        while (sz < d->nameslen + len)
+            sz *= 2;
+        if (!(names = realloc(d->names, sz)))
+            return -1;
+        d->names = names;
+        d->namessz = sz;
+    }
+    if (d->count == d->szents) {
+        size_t sz = d->szents ? d->szents * 2 : 32;
+        size_t *offs;
+        unsigned char *types;
+
+        if (!(offs = realloc(d->offs, sz * sizeof(*offs))))
+            return -1;
+        d->offs = offs;
+        if (!(types = realloc(d->types, sz)))
+            return -1;
+        d->types = types;
+        d->szents = sz;
+    }
+    memcpy(d->names + d->nameslen, name, len);
+    d->offs[d->count] = d->nameslen;
+    d->types[d->count++] = (unsigned char)type;
+    d->nameslen += len;
+    return 0;
+}
+
+/* List the directory at path; NULL if it can't be read */
+static struct dc_dir *dc_read(const char *path)
+{
+    struct dir_iter it;
+    struct dc_dir *d;
+    const char *name;
+    struct stat st;
+    time_t now = time(NULL);
+    int fd, type;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_NOCTTY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+    if (dir_open(&it, fd))
+        return NULL;
+
+    if (!(d = calloc(1, sizeof(*d)))) {
+        dir_close(&it);
+        return NULL;
+    }
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtime;
+    d->mtime_ns = mtime_ns(&st);
+    d->racy = st.st_mtime >= now;
+    while ((name = dir_next(&it, &type))) {
+        if (*name == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        if (type == ET_UNKNOWN &&
+            !fstatat(dir_fd(&it), name, &st, AT_SYMLINK_NOFOLLOW))
+            type = stat_type(st.st_mode);
+        if (dc_add(d, name, type))
+            break;
+    }
+    dir_close(&it);
+    if (name) {
+        dc_free(d);
+        return NULL;
+    }
+    return d;
+}
+
+/* The listing of path, from the cache if it is still good */
+static struct dc_dir *dc_lookup(struct libzsh_dircache *dc, const char *path)
+{
+    struct dc_dir **dp, *d;
+    struct stat st;
+    size_t b;
+
+    if (stat(path, &st))
+        return NULL;
+    b = ((size_t)st.st_ino ^ ((size_t)st.st_dev << 7)) % DC_BUCKETS;
+    for (dp = &dc->buckets[b]; (d = *dp); dp = &d->next)
+        if (d->dev == st.st_dev && d->ino == st.st_ino)
+            break;
+    if (d && !d->racy && d->mtime == st.st_mtime &&
+        d->mtime_ns == mtime_ns(&st)) {
+        dc->hits++;
+        return d;
+    }
+    if (d) {
+        *dp = d->next;
+        dc_free(d);
+    }
+    dc->reads++;
+    if (!(d = dc_read(path)))
+        return NULL;
+    /* Perhaps renamed in between: file it under what was read */
+    b = ((size_t)d->ino ^ ((size_t)d->dev << 7)) % DC_BUCKETS;
+    d->next = dc->buckets[b];
+    dc->buckets[b] = d;
+    return d;
+}
+
+void libzsh_glob_cache_begin(libzsh_context *ctx)
+{
+    /* Without memory for it, globs just go uncached */
+    if (!ctx->dircache)
+        ctx->dircache = calloc(1, sizeof(*ctx->dircache));
+}
+
+void libzsh_glob_cache_end(libzsh_context *ctx)
+{
+    struct libzsh_dircache *dc = ctx->dircache;
+    size_t b;
+
+    if (!dc)
+        return;
+    for (b = 0; b < DC_BUCKETS; b++) {
+        struct dc_dir *d, *next;
+
+        for (d = dc->buckets[b]; d; d = next) {
+            next = d->next;
+            dc_free(d);
+        }
+    }
+    free(dc);
+    ctx->dircache = NULL;
+}
+
+void libzsh_glob_cache_stats(libzsh_context *ctx, size_t *hits, size_t *reads)
+{
+    *hits = ctx->dircache ? ctx->dircache->hits : 0;
+    *reads = ctx->dircache ? ctx->dircache->reads : 0;
+}
+
+int libzsh_glob_dir(libzsh_context *ctx, const char *dir, const char *pattern,
+                    int flags, char ***paths, size_t *count)
+{
+    struct dc_dir *d;
+    libzsh_pattern *pat;
+    const char *path = dir && *dir ? dir : ".";
+    size_t i, n = 0, dlen = dir ? strlen(dir) : 0, plen;
+    int dots, matchdots = *pattern == '.';
+    char **out, *prefix;
+
+    *paths = NULL;
+    *count = 0;
+    if (!(pat = libzsh_pattern_compile(ctx, pattern, strlen(pattern))))
+        return -1;
+    d = ctx->dircache ? dc_lookup(ctx->dircache, path) : dc_read(path);
+    if (!d) {
+        libzsh_pattern_free(pat);
+        return -1;
+    }
+    prefix = join(dir ? dir : "", dlen, "/", dlen && dir[dlen - 1] != '/',
+                  "", 0, &plen);
+    out = prefix ? malloc((d->count + 1) * sizeof(*out)) : NULL;
+
+    libzsh_context_enter(ctx);
+    dots = isset(GLOBDOTS);
+    glob_sortflags = isset(NUMERICGLOBSORT) ? SORTIT_NUMERICALLY : 0;
+    pushheap();
+    for (i = 0; out && i < d->count; i++) {
+        const char *name = d->names + d->offs[i];
+        size_t nlen = (i + 1 < d->count ? d->offs[i + 1] : d->nameslen) -
+            d->offs[i] - 1;
+
+        if ((*name == '.' && !dots && !matchdots) ||
+            !want_type(flags, d->types[i]) ||
+            !libzsh_pattern_match_entered(pat, name, nlen))
+            continue;
+        if (!(out[n] = join(prefix, plen, name, nlen, "", 0, NULL))) {
+            libzsh_glob_free(out, n);
+            out = NULL;
+            break;
+        }
+        n++;
+        if (n % 1024 == 0)
+            freeheap();
+    }
+    if (out)
+        qsort(out, n, sizeof(*out), path_cmp);
+    popheap();
+    libzsh_context_leave(ctx);
+
+    free(prefix);
+    if (!ctx->dircache)
+        dc_free(d);
+    libzsh_pattern_free(pat);
+    if (!out)
+        return -1;
+    out[n] = NULL;
+    *paths = out;
+    *count = n;
+    return 0;
+}
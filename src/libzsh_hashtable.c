@@ -0,0 +1,480 @@
+/*
+ * libzsh_hashtable.c - Open-addressed indexes over zsh hash tables
+ *
+ * hashtable.c keeps each table as an array of chains of separately
+ * allocated nodes, so a lookup hashes the name, follows the chain and
+ * compares names node by node, touching a node for every probe.  The
+ * lexer looks every word in command position up in reswdtab and
+ * aliastab, and most of those words are found in neither.
+ *
+ * An index is a second, open-addressed view of a table: one flat array
+ * of slots holding the hash, the length and (for short names) the bytes
+ * of each name beside the node pointer.  Probing is linear and a miss
+ * never leaves the array; a hit touches only the node it returns.
+ * Deletion shifts later slots back rather than leaving tombstones.
+ *
+ * The chained table stays the authority.  Indexing a table puts its
+ * getnode, getnode2, addnode, removenode and emptytable methods behind
+ * ones that keep the index up to date and answer lookups from it, so
+ * everything that uses the table through its methods, as zsh does,
+ * sees no difference.  Code that relinks nodes behind the methods'
+ * backs must not be used on an indexed table.
+ *
+ * A table whose names are all in one of the sets fixed at build time
+ * (libzsh_phash.c) can go further: each name has its own slot in the
+ * perfect hash, so the index is just the node for each slot and a
+ * lookup is one hash and one comparison.  No open-addressed index is
+ * built for such a table unless a name outside the set is added; then
+ * it is built from the chained table and used from there on.  zsh
+ * still builds the chained table itself, and it stays the authority.
+ *
+ * Each indexed table needs methods that know which index is theirs, so
+ * a fixed number of sets is generated below.
+ */
+
+#include "libzsh_int.h"
+
+#define HI_TABLES 8
+#define HI_INLINE 11            /* name bytes kept in a slot */
+#define HI_LONG   0xff          /* length of a longer name */
+
+struct hi_slot {
+    unsigned int hash;          /* 0: empty */
+    unsigned char len;
+    char key[HI_INLINE];
+    HashNode node;
+};
+
+struct hash_index {
+    HashTable ht;
+    struct hi_slot *slots;      /* NULL while byslot is used instead */
+    unsigned int mask;          /* number of slots less one */
+    unsigned int count;
+    unsigned long gen;          /* bumped whenever a node comes or goes */
+    /* With a perfect hash, the node for each of its slots */
+    const struct libzsh_phash *ph;
+    HashNode *byslot;
+    /* The table's own methods */
+    AddNodeFunc addnode;
+    GetNodeFunc getnode;
+    GetNodeFunc getnode2;
+    RemoveNodeFunc removenode;
+    TableFunc emptytable;
+};
+
+static struct hash_index indexes[HI_TABLES];
+
+/* FNV-1a, never 0; also measures the name */
+static unsigned int hi_hash(const char *nam, size_t *lenp)
+{
+    const unsigned char *p = (const unsigned char *)nam;
+    unsigned int h = 2166136261U;
+
+    for (; *p; p++)
+        h = (h ^ *p) * 16777619U;
+    *lenp = (size_t)(p - (const unsigned char *)nam);
+    return h ? h : 1;
+}
+
+static int hi_same(const struct hi_slot *s, unsigned int h, const char *nam,
+                   size_t len)
+{
+    if (s->hash != h)
+        return 0;
+    if (len < HI_INLINE)
+        return s->len == len && !memcmp(s->key, nam, len);
+    return s->len == HI_LONG && !strcmp(s->node->nam, nam);
+}
+
+static struct hi_slot *hi_find(struct hash_index *ix, const char *nam)
+{
+    size_t len;
+    unsigned int h, i;
+
+    if (!ix->slots)
+        return NULL;
+    h = hi_hash(nam, &len);
+    for (i = h & ix->mask; ix->slots[i].hash; i = (i + 1) & ix->mask) {
+        LIBZSH_COUNT(hash_probes, 1);
+        if (hi_same(&ix->slots[i], h, nam, len))
+            return &ix->slots[i];
+    }
+    return NULL;
+}
+
+/* Put s in the first free slot for its hash; there must be one */
+static void hi_place(struct hash_index *ix, const struct hi_slot *s)
+{
+    unsigned int i;
+
+    for (i = s->hash & ix->mask; ix->slots[i].hash; i = (i + 1) & ix->mask)
+        ;
+    ix->slots[i] = *s;
+}
+
+static void hi_resize(struct hash_index *ix, unsigned int nslots)
+{
+    struct hi_slot *old = ix->slots;
+    unsigned int i, oldn = old ? ix->mask + 1 : 0;
+
+    ix->slots = (struct hi_slot *)zshcalloc(nslots * sizeof(*ix->slots));
+    ix->mask = nslots - 1;
+    for (i = 0; i < oldn; i++)
+        if (old[i].hash)
+            hi_place(ix, &old[i]);
+    if (old)
+        zfree(old, oldn * sizeof(*old));
+}
+
+/* Add a node whose name isn't in the index yet */
+static void hi_insert(struct hash_index *ix, HashNode hn)
+{
+    struct hi_slot s;
+    size_t len;
+
+    /* Keep at most half the slots full */
+    if (2 * (ix->count + 1) > ix->mask + 1)
+        hi_resize(ix, 2 * (ix->mask + 1));
+
+    memset(&s, 0, sizeof(s));
+    s.hash = hi_hash(hn->nam, &len);
+    if (len < HI_INLINE) {
+        s.len = (unsigned char)len;
+        memcpy(s.key, hn->nam, len);
+    } else
+        s.len = HI_LONG;
+    s.node = hn;
+    hi_place(ix, &s);
+    ix->count++;
+}
+
+static void hi_del(struct hash_index *ix, const char *nam)
+{
+    struct hi_slot *s = hi_find(ix, nam);
+    unsigned int i, j, home;
+
+    if (!s)
+        return;
+    /* Move back each later slot whose home is at or before the hole */
+    i = (unsigned int)(s - ix->slots);
+    for (j = (i + 1) & ix->mask; ix->slots[j].hash; j = (j + 1) & ix->mask) {
+        home = ix->slots[j].hash & ix->mask;
+        if (((j - home) & ix->mask) >= ((j - i) & ix->mask)) {
+            ix->slots[i] = ix->slots[j];
+            i = j;
+        }
+    }
+    ix->slots[i].hash = 0;
+    ix->count--;
+}
+
+static void hi_clear(struct hash_index *ix)
+{
+    if (ix->slots)
+        memset(ix->slots, 0, (ix->mask + 1) * sizeof(*ix->slots));
+    ix->count = 0;
+    if (ix->byslot)
+        memset(ix->byslot, 0,
+               libzsh_phash_slots(ix->ph) * sizeof(*ix->byslot));
+}
+
+/* The open-addressed index of everything in the chained table */
+static void hi_build(struct hash_index *ix, HashTable ht)
+{
+    unsigned int nslots = 16;
+    int i;
+
+    while (nslots < 2 * (unsigned int)ht->ct)
+        nslots *= 2;
+    ix->count = 0;
+    hi_resize(ix, nslots);
+    for (i = 0; i < ht->hsize; i++) {
+        HashNode hn;
+
+        for (hn = ht->nodes[i]; hn; hn = hn->next)
+            hi_insert(ix, hn);
+    }
+}
+
+/* Drop the perfect hash's slots */
+static void hi_unperfect(struct hash_index *ix)
+{
+    if (ix->byslot)
+        zfree(ix->byslot, libzsh_phash_slots(ix->ph) * sizeof(*ix->byslot));
+    ix->byslot = NULL;
+    ix->ph = NULL;
+}
+
+/* Drop the open-addressed slots */
+static void hi_unslot(struct hash_index *ix)
+{
+    if (ix->slots)
+        zfree(ix->slots, (ix->mask + 1) * sizeof(*ix->slots));
+    ix->slots = NULL;
+    ix->mask = 0;
+    ix->count = 0;
+}
+
+/*
+ * Node for each of ph's slots from the names in ht, or NULL if one of
+ * them isn't in ph
+ */
+static HashNode *hi_byslot(HashTable ht, const struct libzsh_phash *ph)
+{
+    unsigned int nslots = libzsh_phash_slots(ph);
+    HashNode *byslot = (HashNode *)zshcalloc(nslots * sizeof(*byslot));
+    int i;
+
+    for (i = 0; i < ht->hsize; i++) {
+        HashNode hn;
+
+        for (hn = ht->nodes[i]; hn; hn = hn->next) {
+            int slot = libzsh_phash_find(ph, hn->nam);
+
+            if (slot < 0) {
+                zfree(byslot, nslots * sizeof(*byslot));
+                return NULL;
+            }
+            byslot[slot] = hn;
+        }
+    }
+    return byslot;
+}
+
+/*
+ * The methods of an indexed table
+ */
+
+static HashNode hi_getnode2(struct hash_index *ix, const char *nam)
+{
+    struct hi_slot *s;
+
+    LIBZSH_COUNT(hash_lookups, 1);
+    if (ix->byslot) {
+        int i = libzsh_phash_find(ix->ph, nam);
+
+        LIBZSH_COUNT(hash_probes, 1);
+        return i < 0 ? NULL : ix->byslot[i];
+    }
+    s = hi_find(ix, nam);
+    return s ? s->node : NULL;
+}
+
+static HashNode hi_getnode(struct hash_index *ix, const char *nam)
+{
+    HashNode hn = hi_getnode2(ix, nam);
+
+    return hn && !(hn->flags & DISABLED) ? hn : NULL;
+}
+
+static void hi_addnode(struct hash_index *ix, char *nam, void *node)
+{
+    /* Find a node being replaced before the table frees it */
+    struct hi_slot *s = hi_find(ix, nam);
+
+    ix->addnode(ix->ht, nam, node);
+    ix->gen++;
+    if (ix->byslot) {
+        int i = libzsh_phash_find(ix->ph, nam);
+
+        if (i >= 0) {
+            ix->byslot[i] = (HashNode)node;
+            return;
+        }
+        /* Out of the set: index the lot, this one included */
+        hi_unperfect(ix);
+        hi_build(ix, ix->ht);
+    } else if (s)
+        s->node = (HashNode)node;
+    else
+        hi_insert(ix, (HashNode)node);
+}
+
+static HashNode hi_removenode(struct hash_index *ix, const char *nam)
+{
+    HashNode hn = ix->removenode(ix->ht, nam);
+
+    if (hn) {
+        ix->gen++;
+        if (ix->byslot)
+            ix->byslot[libzsh_phash_find(ix->ph, nam)] = NULL;
+        else
+            hi_del(ix, nam);
+    }
+    return hn;
+}
+
+static void hi_emptytable(struct hash_index *ix)
+{
+    ix->emptytable(ix->ht);
+    ix->gen++;
+    hi_clear(ix);
+}
+
+#define HI_METHODS(n) \
+static HashNode hi_getnode_##n(UNUSED(HashTable ht), const char *nam) \
+{ \
+    return hi_getnode(&indexes[n], nam); \
+} \
+static HashNode hi_getnode2_##n(UNUSED(HashTable ht), const char *nam) \
+{ \
+    return hi_getnode2(&indexes[n], nam); \
+} \
+static void hi_addnode_##n(UNUSED(HashTable ht), char *nam, void *node) \
+{ \
+    hi_addnode(&indexes[n], nam, node); \
+} \
+static HashNode hi_removenode_##n(UNUSED(HashTable ht), const char *nam) \
+{ \
+    return hi_removenode(&indexes[n], nam); \
+} \
+static void hi_emptytable_##n(UNUSED(HashTable ht)) \
+{ \
+    hi_emptytable(&indexes[n]); \
+}
+
+HI_METHODS(0) HI_METHODS(1) HI_METHODS(2) HI_METHODS(3)
+HI_METHODS(4) HI_METHODS(5) HI_METHODS(6) HI_METHODS(7)
+
+#define HI_SET(n) { hi_getnode_##n, hi_getnode2_##n, hi_addnode_##n, \
+                    hi_removenode_##n, hi_emptytable_##n }
+
+static const struct {
+    GetNodeFunc getnode, getnode2;
+    AddNodeFunc addnode;
+    RemoveNodeFunc removenode;
+    TableFunc emptytable;
+} methods[HI_TABLES] = {
+    HI_SET(0), HI_SET(1), HI_SET(2), HI_SET(3),
+    HI_SET(4), HI_SET(5), HI_SET(6), HI_SET(7),
+};
+
+/* A free index for ht, or ht's own if it has one already */
+static struct hash_index *hi_index_for(HashTable ht, int *had)
+{
+    struct hash_index *ix = NULL;
+    int n;
+
+    *had = 0;
+    for (n = 0; n < HI_TABLES; n++) {
+        if (indexes[n].ht == ht) {
+            *had = 1;
+            return &indexes[n];
+        }
+        if (!ix && !indexes[n].ht)
+            ix = &indexes[n];
+    }
+    return ix;
+}
+
+/* Put ht's methods behind ix's */
+static void hi_attach(struct hash_index *ix, HashTable ht)
+{
+    int n = (int)(ix - indexes);
+
+    ix->ht = ht;
+    ix->gen = 1;
+    ix->addnode = ht->addnode;
+    ix->getnode = ht->getnode;
+    ix->getnode2 = ht->getnode2;
+    ix->removenode = ht->removenode;
+    ix->emptytable = ht->emptytable;
+    ht->addnode = methods[n].addnode;
+    ht->getnode = methods[n].getnode;
+    ht->getnode2 = methods[n].getnode2;
+    ht->removenode = methods[n].removenode;
+    ht->emptytable = methods[n].emptytable;
+}
+
+/*
+ * Index ht.  Only tables comparing names with strcmp(), which is all
+ * of zsh's own, can be indexed.  Returns -1 if it can't be or all the
+ * indexes are in use; indexing a table twice does nothing.
+ */
+int libzsh_hashtable_index(HashTable ht)
+{
+    struct hash_index *ix;
+    int had;
+
+    if (!ht || ht->cmpnodes != (CompareFunc)strcmp)
+        return -1;
+    if (!(ix = hi_index_for(ht, &had)))
+        return -1;
+    if (!had) {
+        hi_build(ix, ht);
+        hi_attach(ix, ht);
+    }
+    return 0;
+}
+
+/*
+ * A number that changes whenever a node is added to, replaced in or
+ * removed from ht, so a node found earlier is still the one its name
+ * finds while the number stays the same; 0 if ht isn't indexed.
+ */
+unsigned long libzsh_hashtable_gen(HashTable ht)
+{
+    int n;
+
+    for (n = 0; n < HI_TABLES; n++)
+        if (indexes[n].ht == ht)
+            return indexes[n].gen;
+    return 0;
+}
+
+/* Give ht its own methods back and drop the index */
+void libzsh_hashtable_unindex(HashTable ht)
+{
+    int n;
+
+    for (n = 0; n < HI_TABLES; n++) {
+        struct hash_index *ix = &indexes[n];
+
+        if (ix->ht != ht)
+            continue;
+        ht->addnode = ix->addnode;
+        ht->getnode = ix->getnode;
+        ht->getnode2 = ix->getnode2;
+        ht->removenode = ix->removenode;
+        ht->emptytable = ix->emptytable;
+        hi_unperfect(ix);
+        hi_unslot(ix);
+        memset(ix, 0, sizeof(*ix));
+        return;
+    }
+}
+
+/*
+ * If every name in ht is one of ph's, look names up by their slot in
+ * ph until one that isn't is added, with no open-addressed index until
+ * then; otherwise index ht as libzsh_hashtable_index() does.  Returns 0
+ * if ph is used, -1 if ht is only indexed or couldn't be.
+ */
+int libzsh_hashtable_perfect(HashTable ht, const struct libzsh_phash *ph)
+{
+    struct hash_index *ix;
+    HashNode *byslot;
+    int had;
+
+    if (!ht || ht->cmpnodes != (CompareFunc)strcmp)
+        return -1;
+    if (!(ix = hi_index_for(ht, &had)))
+        return -1;
+    if (ix->byslot)
+        return ix->ph == ph ? 0 : -1;
+
+    if (!(byslot = hi_byslot(ht, ph))) {
+        if (had)
+            return -1;
+        hi_build(ix, ht);
+        hi_attach(ix, ht);
+        return -1;
+    }
+    /* The perfect hash replaces any open-addressed index */
+    hi_unslot(ix);
+    ix->ph = ph;
+    ix->byslot = byslot;
+    if (!had)
+        hi_attach(ix, ht);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * libzsh_heap.c - Arena policy for zsh's heaps
+ *
+ * mem.c maps every heap arena with mmap() when it needs one and unmaps
+ * it as soon as popheap() or freeheap() is done with it, so a caller
+ * parsing in a loop maps, faults in and unmaps the same arenas over and
+ * over.  libzsh compiles mem.c with mmap() and munmap() renamed to the
+ * functions here, which keep freed arenas mapped, up to the policy's
+ * retain limit, and hand them out again for requests of the same size.
+ *
+ * With LIBZSH_HEAP_HUGETLB or LIBZSH_HEAP_THP in the policy, arenas of
+ * up to a quarter of HEAP_REGION are cut from HEAP_REGION regions that
+ * are backed by huge pages (MAP_HUGETLB, falling back to an aligned
+ * mapping advised with MADV_HUGEPAGE).  Those arenas are cut to the
+ * next power of two, so that they serve any request of close to the
+ * same size once freed; they are always kept for reuse whatever the
+ * retain limit, and regions are never unmapped.
+ *
+ * mem.c only maps anonymous memory; anything else is passed through.
+ * The arena lists have a lock of their own, since heaps are used with
+ * or without a context entered.
+ */
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "libzsh_int.h"
+
+#ifdef LIBZSH_HEAP_ARENAS
+
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define HEAP_REGION (2 * 1024 * 1024)
+#define HEAP_RETAIN (256 * 1024)        /* default retain limit */
+
+/* A freed arena, kept mapped; stored at its start */
+struct heap_free {
+    struct heap_free *next;
+    size_t len;
+    int region;                         /* cut from a huge page region */
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct libzsh_heap_policy policy = { HEAP_RETAIN, 0 };
+static struct libzsh_heap_stats stats;
+static struct heap_free *freed;
+static size_t retained_os;              /* freed bytes counted to retain */
+
+/* Huge page regions, and the free end of the newest */
+static char **regions;
+static int nregions;
+static char *region_bump, *region_end;
+
+static int in_region(const char *p)
+{
+    int i;
+
+    for (i = 0; i < nregions; i++)
+        if (p >= regions[i] && p < regions[i] + HEAP_REGION)
+            return 1;
+    return 0;
+}
+
+static char *region_map(void)
+{
+    char *p = MAP_FAILED, **grown;
+
+#ifdef MAP_HUGETLB
+    if (policy.flags & LIBZSH_HEAP_HUGETLB)
+        p = mmap(NULL, HEAP_REGION, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        /* Over-map and trim to an aligned region */
+        char *m = mmap(NULL, 2 * HEAP_REGION, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        size_t head;
+
+        if (m == MAP_FAILED)
+            return NULL;
+        head = (HEAP_REGION - (uintptr_t)m % HEAP_REGION) % HEAP_REGION;
+        if (head)
+            munmap(m, head);
+        munmap(m + head + HEAP_REGION, HEAP_REGION - head);
+        p = m + head;
+#ifdef MADV_HUGEPAGE
+        madvise(p, HEAP_REGION, MADV_HUGEPAGE);
+#endif
+    }
+    /* Kept for the process, so not from whichever pool is current */
+    grown = (char **)realloc(regions, (nregions + 1) * sizeof(*regions));
+    if (!grown) {
+        munmap(p, HEAP_REGION);
+        return NULL;
+    }
+    regions = grown;
+    regions[nregions++] = p;
+    stats.maps++;
+    stats.huge += HEAP_REGION;
+    return p;
+}
+
+/* What an arena of len bytes takes up in a region */
+static size_t region_len(size_t len)
+{
+    size_t n = 4096;
+
+    while (n < len)
+        n <<= 1;
+    return n;
+}
+
+/* An arena of len bytes from a region, or NULL to map one normally */
+static void *region_cut(size_t len)
+{
+    char *p;
+
+    if (len > HEAP_REGION / 4)
+        return NULL;
+    len = region_len(len);
+    if (!region_bump || region_bump + len > region_end) {
+        if (!(region_bump = region_map()))
+            return NULL;
+        region_end = region_bump + HEAP_REGION;
+    }
+    p = region_bump;
+    region_bump += len;
+    return p;
+}
+
+/* Unmap retained arenas not in regions until within the retain limit */
+static void heap_trim(void)
+{
+    struct heap_free **fp = &freed, *f;
+
+    while (retained_os > policy.retain && *fp) {
+        f = *fp;
+        if (f->region) {
+            fp = &f->next;
+            continue;
+        }
+        *fp = f->next;
+        retained_os -= f->len;
+        stats.retained -= f->len;
+        stats.unmaps++;
+        munmap((void *)f, f->len);
+    }
+}
+
+void *libzsh_heap_mmap(void *addr, size_t len, int prot, int flags, int fd,
+                       off_t off)
+{
+    struct heap_free **fp, *f;
+    void *p;
+
+    if (addr || fd != -1 || !(flags & MAP_ANONYMOUS))
+        return mmap(addr, len, prot, flags, fd, off);
+
+    pthread_mutex_lock(&heap_lock);
+    for (fp = &freed; (f = *fp); fp = &f->next)
+        if (f->len == (f->region ? region_len(len) : len))
+            break;
+    if (f) {
+        *fp = f->next;
+        stats.retained -= f->len;
+        if (!f->region)
+            retained_os -= len;
+        stats.reused++;
+        p = f;
+    } else if (!(policy.flags & (LIBZSH_HEAP_HUGETLB | LIBZSH_HEAP_THP)) ||
+               !(p = region_cut(len))) {
+        p = mmap(NULL, len, prot, flags, fd, off);
+        if (p != MAP_FAILED)
+            stats.maps++;
+    }
+    if (p != MAP_FAILED) {
+        LIBZSH_COUNT(heap_arenas, 1);
+        stats.in_use += len;
+        if (stats.in_use > stats.peak)
+            stats.peak = stats.in_use;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return p;
+}
+
+int libzsh_heap_munmap(void *addr, size_t len)
+{
+    struct heap_free *f = (struct heap_free *)addr;
+    int region;
+
+    pthread_mutex_lock(&heap_lock);
+    region = in_region((char *)addr);
+    if (!region && retained_os + len > policy.retain) {
+        stats.in_use -= len;
+        stats.unmaps++;
+        pthread_mutex_unlock(&heap_lock);
+        return munmap(addr, len);
+    }
+    f->len = region ? region_len(len) : len;
+    f->region = region;
+    f->next = freed;
+    freed = f;
+    if (!region)
+        retained_os += len;
+    stats.in_use -= len;
+    stats.retained += f->len;
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+int libzsh_heap_set_policy(const struct libzsh_heap_policy *p)
+{
+    if (p->flags & ~(LIBZSH_HEAP_HUGETLB | LIBZSH_HEAP_THP)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&heap_lock);
+    policy = *p;
+    heap_trim();
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+int libzsh_heap_get_policy(struct libzsh_heap_policy *p)
+{
+    pthread_mutex_lock(&heap_lock);
+    *p = policy;
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+int libzsh_heap_stats(struct libzsh_heap_stats *st)
+{
+    pthread_mutex_lock(&heap_lock);
+    *st = stats;
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+#else /* !LIBZSH_HEAP_ARENAS */
+
+int libzsh_heap_set_policy(UNUSED(const struct libzsh_heap_policy *p))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int libzsh_heap_get_policy(struct libzsh_heap_policy *p)
+{
+    memset(p, 0, sizeof(*p));
+    errno = ENOSYS;
+    return -1;
+}
+
+int libzsh_heap_stats(struct libzsh_heap_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* LIBZSH_HEAP_ARENAS */
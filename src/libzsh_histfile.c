@@ -0,0 +1,410 @@
+/*
+ * libzsh_histfile.c - Append-only history files read through a mapping
+ *
+ * hist.c reads the whole HISTFILE at startup, unmetafying every line
+ * into a Histent, and rewrites it on exit.  This is a separate binary
+ * format meant to be mapped and read from the newest end:
+ *
+ *   header   "ZSHHLOG1", version, byte order mark     (16 bytes)
+ *   record   length, REC_MAGIC, stamp (two words),
+ *            the line and at least one NUL, padded to a word,
+ *            length again
+ *
+ * The trailing length lets us step from the end of the file to the
+ * start of the record before it, so finding the newest n entries reads
+ * n records whatever the size of the file.  Offsets of records visited
+ * are kept so each is only located once.  Lines are raw bytes and are
+ * returned pointing into the mapping; nothing is copied or unmetafied.
+ * No context is entered here, so what a file needs is malloc()'d.
+ *
+ * Every record goes to the file in one write() with O_APPEND, so any
+ * number of sessions can append without locking and never overwrite
+ * each other.  A reader that maps the file while a record is half
+ * written sees a tail that doesn't check out and keeps its previous
+ * end until the next refresh.  A damaged record in the middle (from a
+ * crash) stops the backward walk; what lies before it is then found by
+ * scanning forward for record magic.
+ */
+
+#include "libzsh_int.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if defined(MAP_SHARED) && defined(PROT_READ)
+#define USE_MMAP 1
+#endif
+#endif
+
+#define HF_MAGIC    "ZSHHLOG1"
+#define HF_VERSION  1
+#define HF_BOM      0x01020304
+#define HF_HEADLEN  16
+#define REC_MAGIC   0x48524543      /* "HREC" */
+
+struct hf_head {
+    unsigned int len;           /* bytes in the line */
+    unsigned int magic;
+    unsigned int stamp_lo;      /* start time, split for alignment */
+    unsigned int stamp_hi;
+};
+
+#define REC_WORD sizeof(unsigned int)
+/* Record size for a line of len bytes: head, line, NUL and padding, length */
+#define REC_SIZE(len) (sizeof(struct hf_head) + \
+    (((len) + REC_WORD) & ~(REC_WORD - 1)) + REC_WORD)
+
+struct libzsh_histfile {
+    int fd;                     /* opened O_APPEND */
+    char *map;
+    size_t maplen;              /* bytes mapped */
+    size_t end;                 /* end of the last good record */
+    size_t *offs;               /* records found, newest first */
+    size_t noffs, szoffs;
+    size_t walk;                /* where the backward walk has got to */
+    int complete;               /* every record has been located */
+};
+
+static void hf_unmap(libzsh_histfile *hf)
+{
+    if (!hf->map)
+        return;
+#ifdef USE_MMAP
+    munmap(hf->map, hf->maplen);
+#else
+    free(hf->map);
+#endif
+    hf->map = NULL;
+    hf->maplen = 0;
+}
+
+/* Map the first len bytes of the file */
+static int hf_map(libzsh_histfile *hf, size_t len)
+{
+    char *map;
+
+#ifdef USE_MMAP
+    map = (char *)mmap(NULL, len, PROT_READ, MAP_SHARED, hf->fd, 0);
+    if (map == (char *)MAP_FAILED)
+        return -1;
+#else
+    if (!(map = malloc(len)))
+        return -1;
+    if (lseek(hf->fd, 0, SEEK_SET) != 0 ||
+        read_loop(hf->fd, map, len) != (ssize_t)len) {
+        free(map);
+        return -1;
+    }
+#endif
+    hf_unmap(hf);
+    hf->map = map;
+    hf->maplen = len;
+    return 0;
+}
+
+/* The size of a good record at off, ending before limit; 0 if none */
+static size_t rec_check(const libzsh_histfile *hf, size_t off, size_t limit)
+{
+    struct hf_head h;
+    unsigned int tail;
+    size_t size;
+
+    if (off < HF_HEADLEN || off % REC_WORD ||
+        limit - off < REC_SIZE(0) || limit > hf->maplen)
+        return 0;
+    memcpy(&h, hf->map + off, sizeof(h));
+    if (h.magic != REC_MAGIC || h.len > limit - off)
+        return 0;
+    size = REC_SIZE((size_t)h.len);
+    if (size > limit - off)
+        return 0;
+    memcpy(&tail, hf->map + off + size - REC_WORD, sizeof(tail));
+    if (tail != h.len || hf->map[off + sizeof(h) + h.len] != '\0')
+        return 0;
+    return size;
+}
+
+/* The start of the good record ending at end, or 0 */
+static size_t rec_before(const libzsh_histfile *hf, size_t end)
+{
+    unsigned int len;
+    size_t size;
+
+    if (end < HF_HEADLEN + REC_SIZE(0))
+        return 0;
+    memcpy(&len, hf->map + end - REC_WORD, sizeof(len));
+    size = REC_SIZE((size_t)len);
+    if (len > end || size > end - HF_HEADLEN)
+        return 0;
+    return rec_check(hf, end - size, end) == size ? end - size : 0;
+}
+
+/* Returns -1 if out of memory */
+static int offs_reserve(libzsh_histfile *hf, size_t n)
+{
+    size_t sz = hf->szoffs ? hf->szoffs : 256, *offs;
+
+    if (hf->noffs + n <= hf->szoffs)
+        return 0;
+    while (sz < hf->noffs + n)
+        sz *= 2;
+    if (!(offs = realloc(hf->offs, sz * sizeof(*offs))))
+        return -1;
+    hf->offs = offs;
+    hf->szoffs = sz;
+    return 0;
+}
+
+/*
+ * Locate the records before hf->walk that the backward walk couldn't
+ * reach by scanning forward, skipping anything that isn't a record.
+ * Out of memory, none are kept and the scan is made again next time.
+ */
+static void hf_scan_forward(libzsh_histfile *hf)
+{
+    size_t off = HF_HEADLEN, first = hf->noffs, i, j;
+
+    while (off < hf->walk) {
+        size_t size = rec_check(hf, off, hf->walk);
+
+        if (size) {
+            if (offs_reserve(hf, 1)) {
+                hf->noffs = first;
+                return;
+            }
+            hf->offs[hf->noffs++] = off;
+            off += size;
+        } else
+            off += REC_WORD;
+    }
+    /* Found oldest first: reverse them to go on the newest-first list */
+    for (i = first, j = hf->noffs; i + 1 < j; i++, j--) {
+        size_t t = hf->offs[i];
+
+        hf->offs[i] = hf->offs[j - 1];
+        hf->offs[j - 1] = t;
+    }
+    hf->walk = HF_HEADLEN;
+    hf->complete = 1;
+}
+
+/* Locate records until there are at least n, or all have been found */
+static void hf_locate(libzsh_histfile *hf, size_t n)
+{
+    while (hf->noffs < n && !hf->complete) {
+        size_t start;
+
+        if (hf->walk <= HF_HEADLEN) {
+            hf->complete = 1;
+            break;
+        }
+        if (!(start = rec_before(hf, hf->walk))) {
+            hf_scan_forward(hf);
+            break;
+        }
+        if (offs_reserve(hf, 1))
+            break;
+        hf->offs[hf->noffs++] = start;
+        hf->walk = start;
+    }
+}
+
+/*
+ * Count the good records from from to to going forward, skipping
+ * anything that isn't one.  With offs, also store the n of them there
+ * newest first.
+ */
+static size_t rec_scan(const libzsh_histfile *hf, size_t from, size_t to,
+                       size_t *offs, size_t n)
+{
+    size_t off = from, found = 0;
+
+    while (off < to) {
+        size_t size = rec_check(hf, off, to);
+
+        if (size) {
+            if (offs)
+                offs[n - 1 - found] = off;
+            found++;
+            off += size;
+        } else
+            off += REC_WORD;
+    }
+    return found;
+}
+
+/* The end of the records in the first len bytes, as far as they check out */
+static size_t hf_good_end(libzsh_histfile *hf, size_t from, size_t len)
+{
+    size_t off = from;
+
+    /* Normally the tail is good and one check is enough */
+    if (len == from || rec_before(hf, len))
+        return len;
+    /* Records being written: take what checks out going forward */
+    while (off < len) {
+        size_t size = rec_check(hf, off, len);
+
+        if (!size)
+            break;
+        off += size;
+    }
+    return off;
+}
+
+libzsh_histfile *libzsh_histfile_open(const char *path)
+{
+    libzsh_histfile *hf;
+    char head[HF_HEADLEN];
+    unsigned int word;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_NOCTTY, 0600)) < 0)
+        return NULL;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+
+    memcpy(head, HF_MAGIC, 8);
+    word = HF_VERSION;
+    memcpy(head + 8, &word, sizeof(word));
+    word = HF_BOM;
+    memcpy(head + 12, &word, sizeof(word));
+
+    if (st.st_size < HF_HEADLEN) {
+        /* New file: a second header from a racing session reads as damage */
+        if (st.st_size == 0 &&
+            write_loop(fd, head, HF_HEADLEN) != HF_HEADLEN) {
+            close(fd);
+            return NULL;
+        }
+        if (fstat(fd, &st) || st.st_size < HF_HEADLEN) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    if (!(hf = calloc(1, sizeof(*hf)))) {
+        close(fd);
+        return NULL;
+    }
+    hf->fd = fd;
+    if (hf_map(hf, st.st_size) || memcmp(hf->map, head, HF_HEADLEN)) {
+        libzsh_histfile_close(hf);
+        return NULL;
+    }
+    hf->end = hf->walk = hf_good_end(hf, HF_HEADLEN, st.st_size);
+
+    return hf;
+}
+
+void libzsh_histfile_close(libzsh_histfile *hf)
+{
+    if (!hf)
+        return;
+    hf_unmap(hf);
+    free(hf->offs);
+    close(hf->fd);
+    free(hf);
+}
+
+int libzsh_histfile_append(libzsh_histfile *hf, const char *line, size_t len,
+                           long stamp)
+{
+    struct hf_head h;
+    unsigned int tail;
+    size_t size, padded;
+    char *rec;
+    int ret;
+
+    if (len > 0x7fffffffU) {
+        errno = EFBIG;
+        return -1;
+    }
+    size = REC_SIZE(len);
+    padded = size - sizeof(h) - REC_WORD;
+
+    h.len = tail = (unsigned int)len;
+    h.magic = REC_MAGIC;
+    h.stamp_lo = (unsigned int)((zulong)stamp & 0xffffffffU);
+    h.stamp_hi = (unsigned int)((zulong)stamp >> 32);
+
+    if (!(rec = malloc(size)))
+        return -1;
+    memcpy(rec, &h, sizeof(h));
+    memcpy(rec + sizeof(h), line, len);
+    memset(rec + sizeof(h) + len, 0, padded - len);
+    memcpy(rec + size - REC_WORD, &tail, sizeof(tail));
+
+    /* One write: with O_APPEND, concurrent records can't interleave */
+    ret = write(hf->fd, rec, size) == (ssize_t)size ? 0 : -1;
+    free(rec);
+    return ret;
+}
+
+int libzsh_histfile_refresh(libzsh_histfile *hf)
+{
+    struct stat st;
+    size_t end, oldend = hf->end, n = 0, off, i;
+    int torn = 0;
+
+    if (fstat(hf->fd, &st))
+        return -1;
+    if ((size_t)st.st_size <= hf->maplen)
+        return 0;
+    if (hf_map(hf, st.st_size))
+        return -1;
+
+    end = hf_good_end(hf, oldend, st.st_size);
+    if (end == oldend)
+        return 0;
+
+    /* Count the new records back to the old end, then put them first */
+    for (off = end; off > oldend; n++)
+        if (!(off = rec_before(hf, off)))
+            break;
+    if (off != oldend) {
+        /* A torn record in between: scan forward from the old end */
+        n = rec_scan(hf, oldend, end, NULL, 0);
+        torn = 1;
+    }
+    if ((!hf->noffs && !hf->complete) || offs_reserve(hf, n)) {
+        /* Nothing located yet (or no room): walk from the new end later */
+        hf->noffs = 0;
+        hf->complete = 0;
+        hf->end = hf->walk = end;
+        return 0;
+    }
+    memmove(hf->offs + n, hf->offs, hf->noffs * sizeof(*hf->offs));
+    if (torn)
+        rec_scan(hf, oldend, end, hf->offs, n);
+    else
+        for (off = end, i = 0; i < n; i++)
+            hf->offs[i] = off = rec_before(hf, off);
+    hf->noffs += n;
+    hf->end = end;
+    return 0;
+}
+
+const char *libzsh_histfile_entry(libzsh_histfile *hf, size_t back,
+                                  size_t *len, long *stamp)
+{
+    struct hf_head h;
+
+    hf_locate(hf, back + 1);
+    if (back >= hf->noffs)
+        return NULL;
+    memcpy(&h, hf->map + hf->offs[back], sizeof(h));
+    if (len)
+        *len = h.len;
+    if (stamp)
+        *stamp = (long)(((zulong)h.stamp_hi << 32) | h.stamp_lo);
+    return hf->map + hf->offs[back] + sizeof(h);
+}
+
+size_t libzsh_histfile_count(libzsh_histfile *hf)
+{
+    hf_locate(hf, (size_t)-1);
+    return hf->noffs;
+}
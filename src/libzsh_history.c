@@ -0,0 +1,321 @@
+/*
+ * libzsh_history.c - History lines with a search index
+ *
+ * Incremental search in zle_hist.c, like a strstr() loop over the
+ * lines, looks at every entry older than the current one until it finds
+ * a match, so a miss costs a pass over the whole history.  Here each
+ * line is also entered in two sets of posting lists as it is added:
+ *
+ * - one per trigram (three consecutive bytes) occurring in the line,
+ *   for substring search;
+ * - one per leading one, two and three bytes, for prefix search.
+ *
+ * Trigrams and prefixes are hashed into a fixed number of lists, so a
+ * list may hold lines not containing the trigram; candidates are always
+ * checked against the text.  A substring search walks only the shortest
+ * list of the needle's trigrams, newest first.  Needles shorter than
+ * three bytes have no trigram and are searched for line by line.  The
+ * lists are in line order, so searching forward is the same walk the
+ * other way.
+ *
+ * Lines are numbered from 0 in the order added and stored in one text
+ * buffer.  A history is not locked; use it from one thread at a time.
+ * It is used without a context entered, so it is malloc()'d.
+ *
+ * zle_hist.c's widgets walk zsh's history ring, and its incremental
+ * search reads keys for itself.  A libzsh_zle session given a history
+ * here runs those widgets itself instead (libzsh_zle.c), on the index.
+ */
+
+#include "libzsh_int.h"
+
+#define HIST_TRI_BITS 18
+#define HIST_PFX_BITS 16
+
+struct hist_list {
+    unsigned int *ids;          /* line numbers, ascending */
+    unsigned int n, sz;
+};
+
+struct libzsh_history {
+    char *text;                 /* all lines, each followed by a NUL */
+    size_t textlen, textsz;
+    size_t *start;              /* offset of each line in text */
+    size_t count, startsz;
+    struct hist_list *tri;      /* 1 << HIST_TRI_BITS lists */
+    struct hist_list *pfx;      /* 1 << HIST_PFX_BITS lists */
+};
+
+static unsigned int tri_hash(const char *p)
+{
+    unsigned int t = ((unsigned int)(unsigned char)p[0] << 16) |
+                     ((unsigned int)(unsigned char)p[1] << 8) |
+                     (unsigned char)p[2];
+
+    return (t * 2654435761U) >> (32 - HIST_TRI_BITS);
+}
+
+static unsigned int pfx_hash(const char *p, size_t len)
+{
+    unsigned int h = (unsigned int)len;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h << 8) | (unsigned char)p[i];
+    return (h * 2654435761U) >> (32 - HIST_PFX_BITS);
+}
+
+/* Returns -1 if out of memory */
+static int list_add(struct hist_list *l, unsigned int id)
+{
+    /* A line may have a trigram more than once */
+    if (l->n && l->ids[l->n - 1] == id)
+        return 0;
+    if (l->n == l->sz) {
+        unsigned int sz = l->sz ? l->sz * 2 : 4;
+        unsigned int *ids = realloc(l->ids, sz * sizeof(*ids));
+
+        if (!ids)
+            return -1;
+        l->ids = ids;
+        l->sz = sz;
+    }
+    l->ids[l->n++] = id;
+    return 0;
+}
+
+/* Take id off the end of l, where list_add() put it */
+static void list_unadd(struct hist_list *l, unsigned int id)
+{
+    if (l->n && l->ids[l->n - 1] == id)
+        l->n--;
+}
+
+/* Number of entries in l less than id */
+static unsigned int list_before(const struct hist_list *l, size_t id)
+{
+    unsigned int lo = 0, hi = l->n;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (l->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int contains(const char *hay, size_t hlen, const char *needle,
+                    size_t nlen)
+{
+    const char *p = hay, *end = hay + hlen;
+
+    if (nlen > hlen)
+        return 0;
+    end -= nlen - 1;
+    while (p < end && (p = memchr(p, *needle, end - p))) {
+        if (!memcmp(p, needle, nlen))
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+libzsh_history *libzsh_history_new(void)
+{
+    libzsh_history *h = calloc(1, sizeof(*h));
+
+    if (!h)
+        return NULL;
+    h->tri = calloc((size_t)1 << HIST_TRI_BITS, sizeof(*h->tri));
+    h->pfx = calloc((size_t)1 << HIST_PFX_BITS, sizeof(*h->pfx));
+    if (!h->tri || !h->pfx) {
+        free(h->tri);
+        free(h->pfx);
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+static void lists_free(struct hist_list *l, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        free(l[i].ids);
+    free(l);
+}
+
+void libzsh_history_free(libzsh_history *h)
+{
+    if (!h)
+        return;
+    lists_free(h->tri, (size_t)1 << HIST_TRI_BITS);
+    lists_free(h->pfx, (size_t)1 << HIST_PFX_BITS);
+    free(h->text);
+    free(h->start);
+    free(h);
+}
+
+long libzsh_history_add(libzsh_history *h, const char *line, size_t len)
+{
+    unsigned int id;
+    size_t i, j;
+    char *p;
+
+    if (h->count >= 0xffffffffU)
+        return -1;
+    id = (unsigned int)h->count;
+
+    if (h->textlen + len + 1 > h->textsz) {
+        size_t sz = h->textsz ? h->textsz : 4096;
+
+        while (sz < h->textlen + len + 1)
+            sz *= 2;
+        if (!(p = realloc(h->text, sz)))
+            return -1;
+        h->text = p;
+        h->textsz = sz;
+    }
+    if (h->count == h->startsz) {
+        size_t sz = h->startsz ? h->startsz * 2 : 256;
+        size_t *start = realloc(h->start, sz * sizeof(*start));
+
+        if (!start)
+            return -1;
+        h->start = start;
+        h->startsz = sz;
+    }
+    p = h->text + h->textlen;
+    memcpy(p, line, len);
+    p[len] = '\0';
+
+    j = 1;
+    for (i = 0; i + 3 <= len; i++)
+        if (list_add(&h->tri[tri_hash(p + i)], id))
+            goto unindex;
+    for (j = 1; j <= 3 && j <= len; j++)
+        if (list_add(&h->pfx[pfx_hash(p, j)], id))
+            goto unindex;
+
+    h->start[h->count++] = h->textlen;
+    h->textlen += len + 1;
+    return id;
+
+ unindex:
+    /* Out of memory: leave the lists as they were */
+    while (j > 1)
+        list_unadd(&h->pfx[pfx_hash(p, --j)], id);
+    while (i > 0)
+        list_unadd(&h->tri[tri_hash(p + --i)], id);
+    return -1;
+}
+
+size_t libzsh_history_count(libzsh_history *h)
+{
+    return h->count;
+}
+
+const char *libzsh_history_get(libzsh_history *h, size_t idx, size_t *len)
+{
+    if (idx >= h->count)
+        return NULL;
+    if (len)
+        *len = (idx + 1 < h->count ? h->start[idx + 1] : h->textlen) -
+            h->start[idx] - 1;
+    return h->text + h->start[idx];
+}
+
+/* Whether line idx contains s, or starts with it */
+static int matches(libzsh_history *h, size_t idx, const char *s, size_t slen,
+                   int prefix)
+{
+    size_t len;
+    const char *line = libzsh_history_get(h, idx, &len);
+
+    if (prefix)
+        return len >= slen && !memcmp(line, s, slen);
+    return contains(line, len, s, slen);
+}
+
+/*
+ * The nearest line before line number at (back) or after it that
+ * contains s, or starts with it; -1 if there is none.
+ */
+static long find(libzsh_history *h, const char *s, size_t slen, size_t at,
+                 int back, int prefix)
+{
+    const struct hist_list *l = NULL;
+    unsigned int j;
+    size_t i;
+
+    if (back && at > h->count)
+        at = h->count;
+    if (!back && at + 1 >= h->count)
+        return -1;
+    if (!slen)
+        return back ? (at ? (long)at - 1 : -1) : (long)at + 1;
+
+    if (prefix)
+        l = &h->pfx[pfx_hash(s, slen < 3 ? slen : 3)];
+    else
+        for (i = 0; i + 3 <= slen; i++) {
+            const struct hist_list *t = &h->tri[tri_hash(s + i)];
+
+            if (!t->n)
+                return -1;
+            if (!l || t->n < l->n)
+                l = t;
+        }
+
+    if (!l) {
+        /* Too short for a trigram: line by line */
+        if (back) {
+            for (i = at; i--; )
+                if (matches(h, i, s, slen, 0))
+                    return (long)i;
+        } else {
+            for (i = at + 1; i < h->count; i++)
+                if (matches(h, i, s, slen, 0))
+                    return (long)i;
+        }
+        return -1;
+    }
+    if (back) {
+        for (j = list_before(l, at); j--; )
+            if (matches(h, l->ids[j], s, slen, prefix))
+                return (long)l->ids[j];
+    } else {
+        for (j = list_before(l, at + 1); j < l->n; j++)
+            if (matches(h, l->ids[j], s, slen, prefix))
+                return (long)l->ids[j];
+    }
+    return -1;
+}
+
+long libzsh_history_search(libzsh_history *h, const char *needle,
+                           size_t nlen, size_t before)
+{
+    return find(h, needle, nlen, before, 1, 0);
+}
+
+long libzsh_history_prefix(libzsh_history *h, const char *prefix,
+                           size_t plen, size_t before)
+{
+    return find(h, prefix, plen, before, 1, 1);
+}
+
+long libzsh_history_search_after(libzsh_history *h, const char *needle,
+                                 size_t nlen, size_t after)
+{
+    return find(h, needle, nlen, after, 0, 0);
+}
+
+long libzsh_history_prefix_after(libzsh_history *h, const char *prefix,
+                                 size_t plen, size_t after)
+{
+    return find(h, prefix, plen, after, 0, 1);
+}
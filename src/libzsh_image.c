@@ -0,0 +1,701 @@
+/*
+ * libzsh_image.c - Saving set-up state to a file and loading it back
+ *
+ * A worker that sets the library up the way an rc file would (options,
+ * aliases, functions, key bindings) pays for it every time it starts:
+ * the scripts are parsed and run again, and each bindkey rebuilds part
+ * of a keymap.  An image holds the result of all that, written once:
+ *
+ *   - the option settings of a context
+ *   - the aliases and suffix aliases, and the disabled reserved words
+ *   - the shell functions, as their wordcode
+ *   - each keymap with all of its bindings and the names linked to it
+ *
+ * Loading maps the file and copies everything straight into place:
+ * option bytes into the context, nodes into the tables, wordcode into
+ * programs.  Nothing is parsed.  The whole image is checked (against
+ * a checksum, and record by record) before anything is changed, so a
+ * damaged file leaves the state as it was.
+ *
+ * The file is a stream of words in native byte order and depends on
+ * the layout of the option array and of wordcode, so it is only loaded
+ * by the same zsh version on the same kind of machine; anything else
+ * is refused rather than converted.  An image is a cache, cheap to
+ * make again.  A library built without ZLE writes no keymaps, and
+ * checks but skips those it finds.
+ */
+
+#include "libzsh_int.h"
+#include "zle.mdh"
+#include "version.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if defined(MAP_PRIVATE) && defined(PROT_READ)
+#define USE_MMAP 1
+#endif
+#endif
+
+#ifdef LIBZSH_WITH_ZLE
+/* ZLE functions that are not exported */
+extern HashTable keymapnamtab;
+extern Keymap openkeymap(char *name);
+extern Keymap newkeymap(Keymap tocopy, char *kmname);
+extern int linkkeymap(Keymap km, char *name, int imm);
+extern void refkeymap(Keymap km);
+extern void unrefkeymap(Keymap km);
+extern int bindkey(Keymap km, const char *seq, Thingy bind, char *str);
+extern Thingy rthingy(char *nam);
+extern void unrefthingy(Thingy th);
+extern Thingy refthingy(Thingy th);
+#endif
+
+#define IMG_MAGIC  0x474d495aU     /* "ZIMG" on a little-endian machine */
+#define IMG_FORMAT 1
+#define IMG_NOSTR  0xffffffffU     /* in place of a string's length: NULL */
+
+/* Record types; each record starts with one */
+enum {
+    IMG_END,
+    IMG_OPTIONS,                /* option bytes */
+    IMG_ALIAS,                  /* flags, name, text */
+    IMG_RESWD,                  /* name of a disabled reserved word */
+    IMG_FUNC,                   /* flags, line, name, file, body, redir */
+    IMG_KEYMAP                  /* names, bindings */
+};
+
+#define IMG_SEEN(type) (1 << (type))
+
+/*
+ * The header is the magic number, the format, OPT_SIZE, the size of a
+ * pattern slot, a checksum of the records and the zsh version.
+ */
+#define IMG_HEAD_SUM 4              /* word holding the checksum */
+
+static wordcode img_sum(const wordcode *p, size_t n)
+{
+    wordcode h = 2166136261U;
+
+    while (n--)
+        h = (h ^ *p++) * 16777619U;
+    return h;
+}
+
+/*
+ * Writing
+ */
+
+struct img_out {
+    wordcode *buf;
+    size_t len, size;           /* in words */
+};
+
+/* Room for n more words at the end */
+static wordcode *img_grow(struct img_out *o, size_t n)
+{
+    if (o->len + n > o->size) {
+        size_t sz = o->size ? o->size : 1024;
+
+        while (sz < o->len + n)
+            sz *= 2;
+        o->buf = (wordcode *)zrealloc(o->buf, sz * sizeof(wordcode));
+        o->size = sz;
+    }
+    o->len += n;
+    return o->buf + o->len - n;
+}
+
+static void put_word(struct img_out *o, wordcode w)
+{
+    *img_grow(o, 1) = w;
+}
+
+/* A length, then n bytes padded to a word */
+static void put_bytes(struct img_out *o, const void *p, size_t n)
+{
+    size_t words = (n + sizeof(wordcode) - 1) / sizeof(wordcode);
+    wordcode *wp;
+
+    put_word(o, (wordcode)n);
+    wp = img_grow(o, words);
+    if (words)
+        wp[words - 1] = 0;
+    memcpy(wp, p, n);
+}
+
+/* A string with its NUL, or NULL */
+static void put_str(struct img_out *o, const char *s)
+{
+    if (s)
+        put_bytes(o, s, strlen(s) + 1);
+    else
+        put_word(o, IMG_NOSTR);
+}
+
+/*
+ * Wordcode and strings; the pattern slots are made afresh on loading.
+ * A program mapped from a .zwc file has its slots apart, and its len
+ * doesn't count them.
+ */
+static void put_prog(struct img_out *o, Eprog prog)
+{
+    size_t len = prog->len;
+
+    if (!(prog->flags & EF_MAP))
+        len -= prog->npats * sizeof(Patprog);
+    put_word(o, (wordcode)prog->npats);
+    put_word(o, (wordcode)(prog->strs - (char *)prog->prog));
+    put_bytes(o, prog->prog, len);
+}
+
+static void put_table(struct img_out *o, HashTable ht, int type)
+{
+    int i;
+
+    for (i = 0; i < ht->hsize; i++) {
+        HashNode hn;
+
+        for (hn = ht->nodes[i]; hn; hn = hn->next) {
+            if (type == IMG_ALIAS) {
+                put_word(o, IMG_ALIAS);
+                put_word(o, (wordcode)hn->flags);
+                put_str(o, hn->nam);
+                put_str(o, ((Alias)hn)->text);
+            } else if (hn->flags & DISABLED) {
+                put_word(o, IMG_RESWD);
+                put_str(o, hn->nam);
+            }
+        }
+    }
+}
+
+static void put_functions(struct img_out *o)
+{
+    int i;
+
+    for (i = 0; i < shfunctab->hsize; i++) {
+        HashNode hn;
+
+        for (hn = shfunctab->nodes[i]; hn; hn = hn->next) {
+            Shfunc shf = (Shfunc)hn;
+
+            if ((hn->flags & PM_UNDEFINED) || !shf->funcdef || shf->sticky)
+                continue;
+            put_word(o, IMG_FUNC);
+            put_word(o, (wordcode)hn->flags);
+            put_word(o, (wordcode)shf->lineno);
+            put_str(o, hn->nam);
+            put_str(o, shf->filename);
+            put_prog(o, shf->funcdef);
+            put_word(o, shf->redir != NULL);
+            if (shf->redir)
+                put_prog(o, shf->redir);
+        }
+    }
+}
+
+#ifdef LIBZSH_WITH_ZLE
+struct img_binds {
+    struct img_out *o;
+    wordcode count;
+};
+
+static void put_binding(void *data, const char *seq, Thingy func,
+                        const char *str)
+{
+    struct img_binds *ib = (struct img_binds *)data;
+
+    put_str(ib->o, seq);
+    put_word(ib->o, func == NULL);
+    put_str(ib->o, func ? func->nam : str);
+    ib->count++;
+}
+
+/* Each keymap once, with all the names that are linked to it */
+static void put_keymaps(struct img_out *o)
+{
+    char **names;
+    Keymap *kms;
+    int n = 0, i, j;
+
+    pushheap();
+    names = (char **)zhalloc(keymapnamtab->ct * sizeof(*names));
+    kms = (Keymap *)zhalloc(keymapnamtab->ct * sizeof(*kms));
+    for (i = 0; i < keymapnamtab->hsize; i++) {
+        HashNode hn;
+
+        for (hn = keymapnamtab->nodes[i]; hn; hn = hn->next)
+            if ((kms[n] = openkeymap(hn->nam)))
+                names[n++] = hn->nam;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct img_binds ib;
+        libzsh_keymap *kc;
+        wordcode nnames = 0;
+        size_t at;
+
+        for (j = 0; j < i && kms[j] != kms[i]; j++)
+            ;
+        if (j < i)
+            continue;
+        for (j = i; j < n; j++)
+            nnames += kms[j] == kms[i];
+
+        put_word(o, IMG_KEYMAP);
+        put_word(o, nnames);
+        for (j = i; j < n; j++)
+            if (kms[j] == kms[i])
+                put_str(o, names[j]);
+
+        at = o->len;
+        put_word(o, 0);
+        ib.o = o;
+        ib.count = 0;
+        kc = libzsh_keymap_build(kms[i]);
+        libzsh_keymap_scan(kc, put_binding, &ib);
+        libzsh_keymap_destroy(kc);
+        o->buf[at] = ib.count;
+    }
+    popheap();
+}
+#endif /* LIBZSH_WITH_ZLE */
+
+int libzsh_image_save(libzsh_context *ctx, const char *path)
+{
+    struct img_out o;
+    size_t start, plen = strlen(path);
+    char *tmp;
+    int fd, ret = 0, err;
+
+    memset(&o, 0, sizeof(o));
+    libzsh_context_enter(ctx);
+
+    put_word(&o, IMG_MAGIC);
+    put_word(&o, IMG_FORMAT);
+    put_word(&o, OPT_SIZE);
+    put_word(&o, sizeof(Patprog));
+    put_word(&o, 0);
+    put_str(&o, ZSH_VERSION);
+    start = o.len;
+
+    put_word(&o, IMG_OPTIONS);
+    put_bytes(&o, opts, OPT_SIZE);
+    put_table(&o, aliastab, IMG_ALIAS);
+    put_table(&o, sufaliastab, IMG_ALIAS);
+    put_table(&o, reswdtab, IMG_RESWD);
+    if (shfunctab)
+        put_functions(&o);
+#ifdef LIBZSH_WITH_ZLE
+    if (keymapnamtab)
+        put_keymaps(&o);
+#endif
+    put_word(&o, IMG_END);
+    o.buf[IMG_HEAD_SUM] = img_sum(o.buf + start, o.len - start);
+    libzsh_context_leave(ctx);
+
+    /*
+     * Written beside it and renamed, so loaders see one image or the
+     * other.  The new file is made afresh, so two savers don't write
+     * into one file and nothing already at the name is followed.
+     */
+    if ((tmp = malloc(plen + 8))) {
+        memcpy(tmp, path, plen);
+        memcpy(tmp + plen, ".XXXXXX", 8);
+    }
+    if (!tmp || (fd = mkstemp(tmp)) < 0)
+        ret = -1;
+    else {
+        size_t bytes = o.len * sizeof(wordcode);
+
+        if (write_loop(fd, (char *)o.buf, bytes) != (ssize_t)bytes)
+            ret = -1;
+        if (close(fd))
+            ret = -1;
+        if (!ret && rename(tmp, path))
+            ret = -1;
+        if (ret) {
+            err = errno;
+            unlink(tmp);
+            errno = err;
+        }
+    }
+    err = errno;
+    free(tmp);
+
+    libzsh_lock();
+    zfree(o.buf, o.size * sizeof(wordcode));
+    libzsh_unlock();
+
+    errno = err;
+    return ret;
+}
+
+/*
+ * Reading
+ */
+
+struct img_in {
+    const wordcode *p, *end;
+    int bad;
+};
+
+static wordcode get_word(struct img_in *in)
+{
+    if (in->p == in->end) {
+        in->bad = 1;
+        return 0;
+    }
+    return *in->p++;
+}
+
+static const void *get_bytes(struct img_in *in, size_t *np)
+{
+    size_t n = get_word(in);
+    size_t words = (n + sizeof(wordcode) - 1) / sizeof(wordcode);
+    const void *p = in->p;
+
+    if (in->bad || words > (size_t)(in->end - in->p)) {
+        in->bad = 1;
+        return NULL;
+    }
+    in->p += words;
+    *np = n;
+    return p;
+}
+
+/* A string put_str() wrote; NULL is only accepted if null is set */
+static const char *get_str(struct img_in *in, int null)
+{
+    const char *s;
+    size_t n;
+
+    if (null && in->p < in->end && *in->p == IMG_NOSTR) {
+        in->p++;
+        return NULL;
+    }
+    s = (const char *)get_bytes(in, &n);
+    if (s && (!n || memchr(s, '\0', n) != s + n - 1))
+        in->bad = 1;
+    return in->bad ? NULL : s;
+}
+
+/* A program put_prog() wrote, copied out if apply is set */
+static Eprog get_prog(struct img_in *in, int apply)
+{
+    size_t npats = get_word(in), strs = get_word(in), n;
+    const void *code = get_bytes(in, &n);
+    Patprog *pp;
+    Eprog prog;
+
+    if (in->bad || strs > n || strs % sizeof(wordcode) || npats > n) {
+        in->bad = 1;
+        return NULL;
+    }
+    if (!apply)
+        return NULL;
+
+    /* Laid out as bld_eprog() does: pattern slots, wordcode, strings */
+    prog = (Eprog)zalloc(sizeof(*prog));
+    prog->flags = EF_REAL;
+    prog->len = npats * sizeof(Patprog) + n;
+    prog->npats = (int)npats;
+    prog->nref = 1;
+    prog->pats = pp = (Patprog *)zshcalloc(prog->len);
+    prog->prog = (Wordcode)(prog->pats + npats);
+    prog->strs = (char *)prog->prog + strs;
+    prog->shf = NULL;
+    prog->dump = NULL;
+    memcpy(prog->prog, code, n);
+    while (npats--)
+        *pp++ = dummy_patprog1;
+    return prog;
+}
+
+static void get_alias(struct img_in *in, int apply)
+{
+    int flags = (int)get_word(in);
+    const char *name = get_str(in, 0), *text = get_str(in, 0);
+
+    if (apply) {
+        HashTable ht = (flags & ALIAS_SUFFIX) ? sufaliastab : aliastab;
+
+        ht->addnode(ht, ztrdup(name), createaliasnode(ztrdup(text), flags));
+    }
+}
+
+static void get_function(struct img_in *in, int apply)
+{
+    int flags = (int)get_word(in);
+    zlong line = get_word(in);
+    const char *name = get_str(in, 0), *file = get_str(in, 1);
+    Eprog body = get_prog(in, apply), redir = NULL;
+    Shfunc shf;
+
+    if (get_word(in))
+        redir = get_prog(in, apply);
+    if (!apply)
+        return;
+
+    shf = (Shfunc)zshcalloc(sizeof(*shf));
+    shf->node.flags = flags;
+    shf->filename = ztrdup(file);
+    shf->lineno = line;
+    shf->funcdef = body;
+    shf->redir = redir;
+    shfunctab->addnode(shfunctab, ztrdup(name), shf);
+}
+
+#ifdef LIBZSH_WITH_ZLE
+/*
+ * A new keymap with the image's bindings, linked to its names in place
+ * of whatever keymaps they had.  Names that can't be relinked (.safe)
+ * keep their keymap.
+ */
+static void get_keymap(struct img_in *in, int apply)
+{
+    size_t nnames = get_word(in), nbinds, i;
+    const char **names = NULL;
+    Keymap km = NULL;
+
+    /* Each name takes at least two words */
+    if (!nnames || nnames > (size_t)(in->end - in->p) / 2) {
+        in->bad = 1;
+        return;
+    }
+    if (apply)
+        names = (const char **)zhalloc(nnames * sizeof(*names));
+    for (i = 0; i < nnames; i++) {
+        const char *name = get_str(in, 0);
+
+        if (names)
+            names[i] = name;
+    }
+
+    nbinds = get_word(in);
+    if (apply) {
+        km = newkeymap(NULL, (char *)names[0]);
+        refkeymap(km);
+    }
+    for (i = 0; i < nbinds && !in->bad; i++) {
+        const char *seq = get_str(in, 0);
+        wordcode isstr = get_word(in);
+        const char *to = get_str(in, 0);
+
+        if (in->bad || !*seq || isstr > 1)
+            in->bad = 1;
+        else if (km && isstr) {
+            /* As bindkey -s does: a string is bound with undefined-key */
+            Thingy t = refthingy(t_undefinedkey);
+
+            if (bindkey(km, seq, t, (char *)to))
+                unrefthingy(t);
+        } else if (km) {
+            Thingy t = rthingy((char *)to);
+
+            if (bindkey(km, seq, t, NULL))
+                unrefthingy(t);
+        }
+    }
+    if (km) {
+        for (i = 0; i < nnames; i++)
+            linkkeymap(km, (char *)names[i], 0);
+        unrefkeymap(km);
+    }
+}
+#else /* !LIBZSH_WITH_ZLE */
+/* Check a keymap record; there is no ZLE to put it in */
+static void get_keymap(struct img_in *in, UNUSED(int apply))
+{
+    size_t nnames = get_word(in), nbinds, i;
+
+    if (!nnames || nnames > (size_t)(in->end - in->p) / 2) {
+        in->bad = 1;
+        return;
+    }
+    for (i = 0; i < nnames; i++)
+        get_str(in, 0);
+
+    nbinds = get_word(in);
+    for (i = 0; i < nbinds && !in->bad; i++) {
+        const char *seq = get_str(in, 0);
+        wordcode isstr = get_word(in);
+
+        get_str(in, 0);
+        if (in->bad || !*seq || isstr > 1)
+            in->bad = 1;
+    }
+}
+#endif /* LIBZSH_WITH_ZLE */
+
+/*
+ * Go through the records after the header.  Without apply they are
+ * only checked, with nothing allocated and no lock needed, and -1 is
+ * returned if any is damaged; otherwise a mask of the record types
+ * seen.  With apply the context must be entered and the records must
+ * already have been checked.
+ */
+static int img_records(struct img_in *in, int apply)
+{
+    int seen = 0;
+
+    for (;;) {
+        wordcode type = get_word(in);
+        const void *o;
+        size_t n;
+
+        if (in->bad)
+            return -1;
+        if (type == IMG_END)
+            break;
+        switch (type) {
+        case IMG_OPTIONS:
+            o = get_bytes(in, &n);
+            if (!in->bad && n != OPT_SIZE)
+                in->bad = 1;
+            else if (apply)
+                memcpy(opts, o, OPT_SIZE);
+            break;
+        case IMG_ALIAS:
+            get_alias(in, apply);
+            break;
+        case IMG_RESWD:
+            o = get_str(in, 0);
+            if (apply) {
+                HashNode hn = reswdtab->getnode2(reswdtab, (const char *)o);
+
+                if (hn)
+                    hn->flags |= DISABLED;
+            }
+            break;
+        case IMG_FUNC:
+            get_function(in, apply);
+            break;
+        case IMG_KEYMAP:
+            get_keymap(in, apply);
+            break;
+        default:
+            return -1;
+        }
+        if (in->bad)
+            return -1;
+        seen |= IMG_SEEN(type);
+    }
+    return in->p == in->end ? seen : -1;
+}
+
+/* Check the header and checksum; leaves in at the first record */
+static int img_header(struct img_in *in)
+{
+    const char *version;
+    wordcode sum;
+
+    if (get_word(in) != IMG_MAGIC || get_word(in) != IMG_FORMAT ||
+        get_word(in) != OPT_SIZE || get_word(in) != sizeof(Patprog))
+        return -1;
+    sum = get_word(in);
+    version = get_str(in, 0);
+    if (!version || strcmp(version, ZSH_VERSION))
+        return -1;
+    return img_sum(in->p, in->end - in->p) == sum ? 0 : -1;
+}
+
+/* Put the state the image describes in place of the current one */
+static void img_apply(struct img_in *in, int seen)
+{
+    int i;
+
+    pushheap();
+
+    aliastab->emptytable(aliastab);
+    sufaliastab->emptytable(sufaliastab);
+    for (i = 0; i < reswdtab->hsize; i++) {
+        HashNode hn;
+
+        for (hn = reswdtab->nodes[i]; hn; hn = hn->next)
+            hn->flags &= ~DISABLED;
+    }
+    if (!shfunctab && (seen & IMG_SEEN(IMG_FUNC)))
+        createshfunctable();
+    if (shfunctab)
+        shfunctab->emptytable(shfunctab);
+
+    img_records(in, 1);
+
+    popheap();
+}
+
+int libzsh_image_load(libzsh_context *ctx, const char *path)
+{
+    struct libzsh_pool *pool;
+    struct img_in in;
+    struct stat st;
+    wordcode *addr;
+    size_t words;
+    int fd, seen = -1;
+
+    if ((fd = open(path, O_RDONLY | O_NOCTTY)) < 0)
+        return -1;
+    if (fstat(fd, &st) || !st.st_size || st.st_size % sizeof(wordcode)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    words = st.st_size / sizeof(wordcode);
+#ifdef USE_MMAP
+    addr = (wordcode *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == (wordcode *)MAP_FAILED)
+        return -1;
+#else
+    libzsh_lock();
+    addr = (wordcode *)zalloc(st.st_size);
+    libzsh_unlock();
+    /* A short read is taken as an empty file, which has no header */
+    if (read_loop(fd, (char *)addr, st.st_size) != st.st_size)
+        words = 0;
+    close(fd);
+#endif
+
+    in.p = addr;
+    in.end = addr + words;
+    in.bad = 0;
+    if (img_header(&in) == 0) {
+        const wordcode *records = in.p;
+
+        if ((seen = img_records(&in, 0)) >= 0) {
+#ifdef LIBZSH_WITH_ZLE
+            if ((seen & IMG_SEEN(IMG_KEYMAP)) && libzsh_zle_init())
+                seen = -1;
+            else
+#endif
+            {
+                in.p = records;
+                libzsh_context_enter(ctx);
+                /* What it defines goes in the shared tables */
+                pool = libzsh_pool_shared();
+                img_apply(&in, seen);
+                libzsh_pool_use(pool);
+                libzsh_context_leave(ctx);
+#ifdef LIBZSH_WITH_ZLE
+                if (seen & IMG_SEEN(IMG_KEYMAP))
+                    libzsh_keymap_invalidate();
+#endif
+            }
+        }
+    }
+
+#ifdef USE_MMAP
+    munmap((void *)addr, st.st_size);
+#else
+    libzsh_lock();
+    zfree(addr, st.st_size);
+    libzsh_unlock();
+#endif
+    if (seen < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * libzsh_int.h - Internal definitions shared by the libzsh sources
+ *
+ * Not installed.  Declares the zsh internals that are not part of the
+ * exported (.epro) prototypes and the layout of libzsh_context.
+ */
+
+#ifndef LIBZSH_INT_H
+#define LIBZSH_INT_H
+
+#include <pthread.h>
+
+#include "zsh.mdh"
+#include "libzsh.h"
+#include "libzsh_tls.h"
+
+/*
+ * Forward declarations for functions not in .epro headers
+ */
+extern void createoptiontable(void);
+extern void createaliastables(void);
+extern void createreswdtable(void);
+extern void createshfunctable(void);
+
+extern void lex_context_save(struct lex_stack *ls, int toplevel);
+extern void lex_context_restore(const struct lex_stack *ls, int toplevel);
+extern void parse_context_save(struct parse_stack *ps, int toplevel);
+extern void parse_context_restore(const struct parse_stack *ps, int toplevel);
+extern void hist_context_save(struct hist_stack *hs, int toplevel);
+extern void hist_context_restore(const struct hist_stack *hs, int toplevel);
+extern void shinbufsave(void);
+extern void shinbufrestore(void);
+
+/* Global variables that are not exported (libzsh_tls.h: per thread) */
+extern Patprog dummy_patprog1;
+extern LIBZSH_TLS_cmdstack unsigned char *cmdstack;
+extern LIBZSH_TLS_cmdsp int cmdsp;
+extern LIBZSH_TLS_strin int strin;  /* flag: reading from string, not stdin */
+#define CMDSTACKSZ 256
+
+/*
+ * The part of the zsh global state that is swapped in and out
+ * when a context is entered or left.
+ */
+struct libzsh_state {
+    struct lex_stack lex;
+    struct parse_stack parse;
+    struct hist_stack hist;
+    Heap heaps;
+    char opts[OPT_SIZE];
+    zlong lineno;
+    int strin;
+    int errflag;
+    int noerrs;
+};
+
+struct libzsh_context {
+    struct libzsh_state state;   /* this context, while not entered */
+    struct libzsh_state outer;   /* the displaced globals, while entered */
+    int entered;
+    pthread_mutex_t use;        /* held while entered */
+    struct libzsh_dircache *dircache;   /* libzsh_glob_cache_begin() */
+    struct libzsh_pool *pool;   /* zalloc()s while entered */
+    libzsh_diag_fn diag_fn;     /* libzsh_context_set_diag() */
+    void *diag_data;
+    struct libzsh_trace *trace; /* counters, with LIBZSH_TRACE */
+};
+
+/* libzsh_context.c: the context lock, for shared objects */
+extern void libzsh_lock(void);
+extern void libzsh_unlock(void);
+
+/*
+ * libzsh_context.c: enter ctx beside other threads lexing and parsing
+ * in contexts of their own.  Only the context's own state and the
+ * thread-local globals may be changed; the shared tables, params.c,
+ * pattern.c, text.c and ZLE need libzsh_context_enter().  Left with
+ * libzsh_context_leave().
+ */
+extern void libzsh_context_enter_shared(libzsh_context *ctx);
+
+/* libzsh_context.c: hist.c's and parse.c's allocators (see CMakeLists.txt) */
+extern void *libzsh_hist_zalloc(size_t size);
+extern void libzsh_hist_zfree(void *p, int sz);
+extern void *libzsh_parse_zalloc(size_t size);
+extern void *libzsh_parse_zrealloc(void *p, size_t size);
+extern void libzsh_parse_zfree(void *p, int sz);
+
+/*
+ * libzsh_context.c: what $LINENO reads.  Set from the line number of
+ * whichever thread takes the context lock alone.
+ */
+extern zlong libzsh_lineno;
+
+/* libzsh_parse.c: the body of libzsh_parse(), with the context entered */
+extern Eprog libzsh_parse_entered(const char *buf, size_t len, int flags);
+
+/*
+ * libzsh_lex.c: the body of libzsh_lex(), with the context entered.
+ * Tokens are appended from out->count on and base is added to their
+ * offsets.  stop, if not NULL, is called after each token is stored;
+ * a non-zero return ends the lex early and 2 is returned.
+ */
+typedef int (*libzsh_lex_stop_fn)(void *data, struct libzsh_tokens *out);
+
+extern int libzsh_lex_entered(const char *buf, size_t len, size_t base,
+                              struct libzsh_tokens *out,
+                              libzsh_lex_stop_fn stop, void *data);
+
+/*
+ * libzsh_keymap.c: compiled keymaps for use with the context lock held.
+ * libzsh_keymap_for() returns the cached table for km, rebuilding it
+ * if bindings were invalidated since; libzsh_keymap_resolve() is
+ * libzsh_keymap_lookup() returning the binding as keybind() does.
+ */
+struct keymap;
+struct thingy;
+
+extern libzsh_keymap *libzsh_keymap_build(struct keymap *km);
+extern void libzsh_keymap_destroy(libzsh_keymap *kc);
+extern libzsh_keymap *libzsh_keymap_for(struct keymap *km);
+extern size_t libzsh_keymap_resolve(libzsh_keymap *kc, const char *buf,
+                                    size_t n, int final,
+                                    struct thingy **tp, char **strp);
+
+/* libzsh_keymap_scan() calls fn for each binding, as keybind() gives it */
+typedef void (*libzsh_keymap_scan_fn)(void *data, const char *seq,
+                                      struct thingy *func, const char *str);
+
+extern void libzsh_keymap_scan(libzsh_keymap *kc, libzsh_keymap_scan_fn fn,
+                               void *data);
+
+/*
+ * libzsh_pattern.c: libzsh_pattern_prefilter() returns 0 if s can't
+ * match, 1 if it does, 2 if the matcher must decide; it is safe to call
+ * from any thread.  libzsh_pattern_match_entered() is
+ * libzsh_pattern_match() with the pattern's context entered.
+ */
+extern int libzsh_pattern_prefilter(libzsh_pattern *pat, const char *s,
+                                    size_t len);
+extern int libzsh_pattern_match_entered(libzsh_pattern *pat, const char *s,
+                                        size_t len);
+
+/*
+ * libzsh_hashtable.c: answer a table's lookups from an open-addressed
+ * index, or stop doing so.  Unindex a table before deleting it.
+ */
+extern int libzsh_hashtable_index(HashTable ht);
+extern void libzsh_hashtable_unindex(HashTable ht);
+
+/*
+ * libzsh_hashtable.c: a number that changes with every node added to
+ * or removed from ht, or 0 if ht isn't indexed.
+ */
+extern unsigned long libzsh_hashtable_gen(HashTable ht);
+
+/*
+ * libzsh_hashtable.c: libzsh_hashtable_perfect() indexes ht and, if
+ * every name in it is one of ph's, finds its names by their slot in
+ * ph; returns -1 if it only indexed ht (or not even that).
+ */
+struct libzsh_phash;
+extern int libzsh_hashtable_perfect(HashTable ht,
+                                    const struct libzsh_phash *ph);
+
+/*
+ * libzsh_phash.c: the tables gen_phash.sh made.  libzsh_phash_find()
+ * gives the slot of name, or -1 if it isn't in the table.
+ */
+extern const struct libzsh_phash libzsh_phash_reswd;
+extern const struct libzsh_phash libzsh_phash_option;
+extern const struct libzsh_phash libzsh_phash_builtin;
+extern int libzsh_phash_find(const struct libzsh_phash *ph, const char *name);
+extern unsigned int libzsh_phash_slots(const struct libzsh_phash *ph);
+
+/*
+ * libzsh_pool.c: a context's allocation pool (NULL when libzsh is built
+ * without LIBZSH_POOL_ALLOC).  libzsh_pool_use() makes the calling
+ * thread's zalloc()s take from pool, or from the shared pool if NULL;
+ * libzsh_pool_free() frees pool with every block still in it.  Anything
+ * allocated with a context entered that must outlive it is allocated
+ * between libzsh_pool_shared(), which returns the pool to go back to,
+ * and libzsh_pool_use() of that.  zalloc() and its kin are only called
+ * with a context entered or libzsh_lock() held; what is allocated or
+ * freed without either, or handed to the caller, is malloc()'d.  What
+ * zle_utils.c allocates (the line, its conversions, undo records) never
+ * comes from a pool and is freed with free().
+ */
+struct libzsh_pool;
+extern struct libzsh_pool *libzsh_pool_new(void);
+extern void libzsh_pool_use(struct libzsh_pool *pool);
+extern struct libzsh_pool *libzsh_pool_shared(void);
+extern int libzsh_pool_is_shared(void *p);
+extern void libzsh_pool_free(struct libzsh_pool *pool);
+extern char *libzsh_sys_ztrdup(const char *s);
+
+/*
+ * libzsh_trace.c: a context's counters and recorded calls (NULL when
+ * libzsh is built without LIBZSH_TRACE).  libzsh_trace_use() makes the
+ * calling thread's hooks count into trace, or into the shared counters
+ * if NULL.  LIBZSH_COUNT() adds to a counter of the current one and
+ * compiles to nothing without LIBZSH_TRACE; it needs a context entered
+ * or the context lock.
+ */
+struct libzsh_trace;
+extern struct libzsh_trace *libzsh_trace_new(void);
+extern void libzsh_trace_use(struct libzsh_trace *trace);
+extern void libzsh_trace_free(struct libzsh_trace *trace);
+extern void libzsh_trace_refresh_bytes(size_t n);
+
+#ifdef LIBZSH_TRACE
+extern _Thread_local struct libzsh_stats *libzsh_stats_cur;
+# define LIBZSH_COUNT(field, n) ((void)(libzsh_stats_cur->field += (n)))
+#else
+# define LIBZSH_COUNT(field, n) ((void)0)
+#endif
+
+/*
+ * libzsh_expand.c: build the parameter table if that hasn't been done;
+ * with the context lock held.
+ */
+extern void libzsh_params_init(void);
+
+/*
+ * libzsh_diag.c: the input libzsh_parse() is reading (metafied), for
+ * positions in reports; NULL when done.
+ */
+extern void libzsh_diag_input(const char *input);
+
+/* libzsh_math.c: libzsh_math_eval() with the context entered */
+extern int libzsh_math_eval_entered(libzsh_math *m, struct libzsh_number *out);
+
+/* The context the calling thread has entered, or NULL */
+extern _Thread_local libzsh_context *libzsh_current;
+
+#endif /* LIBZSH_INT_H */
@@ -0,0 +1,321 @@
+/*
+ * libzsh_keymap.c - Keymaps compiled into a flat state table
+ *
+ * getkeymapcmd() finds a binding by looking the key string read so far
+ * up in the keymap's hash table with keybind(), and asking keyisprefix()
+ * whether to read on, which hashes the whole sequence again for each
+ * byte.  A compiled keymap is a DFA with one state per proper prefix of
+ * a binding and a 256-way table per state, so resolving costs one array
+ * step per byte.
+ *
+ * The layout of struct keymap is private to zle_keymap.c, so the table
+ * is built from the outside: starting from the empty sequence, every
+ * one-byte extension of each prefix is tried with keybind() and
+ * keyisprefix().  The result therefore agrees with those two by
+ * construction.
+ *
+ * There is no hook for changes to the bindings.  Compiled keymaps are a
+ * snapshot; the copies used by libzsh_zle sessions are rebuilt after
+ * libzsh_keymap_invalidate().
+ */
+
+#include "libzsh_int.h"
+#include "zle.mdh"
+
+extern Thingy keybind(Keymap km, char *seq, char **strp);
+extern int keyisprefix(Keymap km, char *seq);
+extern Keymap openkeymap(char *name);
+extern void refkeymap(Keymap km);
+extern void unrefkeymap(Keymap km);
+extern Thingy refthingy(Thingy th);
+extern void unrefthingy(Thingy th);
+
+struct kmc_state {
+    int next[256];              /* state after this byte, or -1 */
+    unsigned int bind[256];     /* binding of the sequence, 0 if none */
+};
+
+struct kmc_bind {
+    Thingy func;                /* widget, or NULL for a string */
+    char *str;                  /* string binding (metafied) */
+};
+
+struct libzsh_keymap {
+    Keymap km;                  /* keymap it was built from, held */
+    struct kmc_state *states;
+    int nstates, szstates;
+    struct kmc_bind *binds;     /* binds[0] is unused */
+    unsigned int nbinds, szbinds;
+};
+
+static int kmc_new_state(libzsh_keymap *kc)
+{
+    struct kmc_state *st;
+    int i;
+
+    if (kc->nstates == kc->szstates) {
+        int sz = kc->szstates ? kc->szstates * 2 : 16;
+
+        kc->states = (struct kmc_state *)
+            zrealloc(kc->states, sz * sizeof(*kc->states));
+        kc->szstates = sz;
+    }
+    st = &kc->states[kc->nstates];
+    for (i = 0; i < 256; i++) {
+        st->next[i] = -1;
+        st->bind[i] = 0;
+    }
+    return kc->nstates++;
+}
+
+static unsigned int kmc_new_bind(libzsh_keymap *kc, Thingy func, char *str)
+{
+    if (kc->nbinds == kc->szbinds) {
+        unsigned int sz = kc->szbinds * 2;
+
+        kc->binds = (struct kmc_bind *)
+            zrealloc(kc->binds, sz * sizeof(*kc->binds));
+        kc->szbinds = sz;
+    }
+    kc->binds[kc->nbinds].func = str ? NULL : refthingy(func);
+    kc->binds[kc->nbinds].str = str ? ztrdup(str) : NULL;
+    return kc->nbinds++;
+}
+
+/* Build the table for km; called with the context lock held */
+libzsh_keymap *libzsh_keymap_build(Keymap km)
+{
+    libzsh_keymap *kc = (libzsh_keymap *)zshcalloc(sizeof(*kc));
+    char **seqs;
+    int szseqs = 16, state;
+
+    refkeymap(km);
+    kc->km = km;
+    kc->szbinds = 64;
+    kc->nbinds = 1;
+    kc->binds = (struct kmc_bind *)zshcalloc(kc->szbinds * sizeof(*kc->binds));
+
+    pushheap();
+    /* The (metafied) key sequence leading to each state */
+    seqs = (char **)zhalloc(szseqs * sizeof(*seqs));
+    seqs[kmc_new_state(kc)] = "";
+
+    for (state = 0; state < kc->nstates; state++) {
+        char *seq = seqs[state];
+        size_t len = strlen(seq);
+        int c;
+
+        for (c = 0; c < 256; c++) {
+            char *ext = (char *)zhalloc(len + 3), *p = ext + len;
+            char *str = NULL;
+            Thingy t;
+
+            memcpy(ext, seq, len);
+            if (imeta(c)) {
+                *p++ = Meta;
+                *p++ = (char)(c ^ 32);
+            } else
+                *p++ = (char)c;
+            *p = '\0';
+
+            t = keybind(km, ext, &str);
+            if (str || (t && strcmp(t->nam, "undefined-key")))
+                kc->states[state].bind[c] = kmc_new_bind(kc, t, str);
+            if (keyisprefix(km, ext)) {
+                int next = kmc_new_state(kc);
+
+                if (next == szseqs) {
+                    char **ns = (char **)zhalloc(2 * szseqs * sizeof(*ns));
+
+                    memcpy(ns, seqs, szseqs * sizeof(*ns));
+                    seqs = ns;
+                    szseqs *= 2;
+                }
+                seqs[next] = ext;
+                kc->states[state].next[c] = next;
+            }
+        }
+    }
+    popheap();
+
+    return kc;
+}
+
+/* Free a table; called with the context lock held */
+void libzsh_keymap_destroy(libzsh_keymap *kc)
+{
+    unsigned int i;
+
+    for (i = 1; i < kc->nbinds; i++) {
+        if (kc->binds[i].func)
+            unrefthingy(kc->binds[i].func);
+        zsfree(kc->binds[i].str);
+    }
+    zfree(kc->binds, kc->szbinds * sizeof(*kc->binds));
+    if (kc->states)
+        zfree(kc->states, kc->szstates * sizeof(*kc->states));
+    unrefkeymap(kc->km);
+    zfree(kc, sizeof(*kc));
+}
+
+/*
+ * Call fn with the (metafied) key sequence and binding of each bound
+ * sequence in kc, shortest first; called with the context lock held.
+ */
+void libzsh_keymap_scan(libzsh_keymap *kc, libzsh_keymap_scan_fn fn,
+                        void *data)
+{
+    char **seqs;
+    int state;
+
+    pushheap();
+    seqs = (char **)zhalloc(kc->nstates * sizeof(*seqs));
+    seqs[0] = "";
+    /* A state's prefix always comes before the state itself */
+    for (state = 0; state < kc->nstates; state++) {
+        const struct kmc_state *st = &kc->states[state];
+        size_t len = strlen(seqs[state]);
+        int c;
+
+        for (c = 0; c < 256; c++) {
+            char *ext, *p;
+
+            if (!st->bind[c] && st->next[c] < 0)
+                continue;
+            ext = (char *)zhalloc(len + 3);
+            memcpy(ext, seqs[state], len);
+            p = ext + len;
+            if (imeta(c)) {
+                *p++ = Meta;
+                *p++ = (char)(c ^ 32);
+            } else
+                *p++ = (char)c;
+            *p = '\0';
+
+            if (st->bind[c])
+                fn(data, ext, kc->binds[st->bind[c]].func,
+                   kc->binds[st->bind[c]].str);
+            if (st->next[c] >= 0)
+                seqs[st->next[c]] = ext;
+        }
+    }
+    popheap();
+}
+
+size_t libzsh_keymap_resolve(libzsh_keymap *kc, const char *buf, size_t n,
+                             int final, Thingy *tp, char **strp)
+{
+    const struct kmc_state *st = kc->states;
+    size_t k = 0, found = 0;
+    unsigned int bind = 0;
+
+    *tp = NULL;
+    *strp = NULL;
+    while (k < n) {
+        unsigned char c = (unsigned char)buf[k++];
+
+        if (st->bind[c]) {
+            found = k;
+            bind = st->bind[c];
+        }
+        if (st->next[c] < 0)
+            break;
+        st = &kc->states[st->next[c]];
+        /* Still a prefix of a longer binding: wait unless told not to */
+        if (k == n && !final)
+            return 0;
+    }
+    /* Nothing bound: all the keys read are an undefined key */
+    if (!found)
+        found = k;
+    if (bind) {
+        *tp = kc->binds[bind].func;
+        *strp = kc->binds[bind].str;
+    }
+    return found;
+}
+
+/*
+ * Compiled tables used by sessions, one per keymap, rebuilt when the
+ * generation moves on.
+ */
+#define KMC_CACHE_SIZE 8
+
+static struct {
+    libzsh_keymap *kc;
+    unsigned int gen;
+} kmc_cache[KMC_CACHE_SIZE];
+static unsigned int kmc_gen, kmc_victim;
+
+libzsh_keymap *libzsh_keymap_for(Keymap km)
+{
+    int i, slot = -1;
+
+    for (i = 0; i < KMC_CACHE_SIZE; i++) {
+        if (kmc_cache[i].kc && kmc_cache[i].kc->km == km) {
+            if (kmc_cache[i].gen == kmc_gen)
+                return kmc_cache[i].kc;
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        for (i = 0; i < KMC_CACHE_SIZE && slot < 0; i++)
+            if (!kmc_cache[i].kc)
+                slot = i;
+        if (slot < 0)
+            slot = kmc_victim++ % KMC_CACHE_SIZE;
+    }
+    if (kmc_cache[slot].kc)
+        libzsh_keymap_destroy(kmc_cache[slot].kc);
+    kmc_cache[slot].kc = libzsh_keymap_build(km);
+    kmc_cache[slot].gen = kmc_gen;
+    return kmc_cache[slot].kc;
+}
+
+void libzsh_keymap_invalidate(void)
+{
+    libzsh_lock();
+    kmc_gen++;
+    libzsh_unlock();
+}
+
+libzsh_keymap *libzsh_keymap_compile(const char *name)
+{
+    libzsh_keymap *kc = NULL;
+    Keymap km;
+
+    libzsh_lock();
+    if ((km = openkeymap((char *)name)))
+        kc = libzsh_keymap_build(km);
+    libzsh_unlock();
+    return kc;
+}
+
+void libzsh_keymap_free(libzsh_keymap *kc)
+{
+    if (!kc)
+        return;
+    libzsh_lock();
+    libzsh_keymap_destroy(kc);
+    libzsh_unlock();
+}
+
+size_t libzsh_keymap_lookup(libzsh_keymap *kc, const char *buf, size_t n,
+                            int final, const char **widget, const char **str)
+{
+    Thingy t;
+    char *s;
+    size_t len = libzsh_keymap_resolve(kc, buf, n, final, &t, &s);
+
+    if (widget)
+        *widget = t ? t->nam : NULL;
+    if (str)
+        *str = s;
+    return len;
+}
+
+size_t libzsh_keymap_states(libzsh_keymap *kc)
+{
+    return kc->nstates;
+}
@@ -0,0 +1,153 @@
+/*
+ * libzsh_lex.c - Exporting the token stream with buffer offsets
+ *
+ * The lexer does not record where tokens start, but it tells the
+ * history code: gettok() calls hwbegin() as soon as it has read the
+ * first character of a word, comments included.  Temporarily pointing
+ * hwbegin at our own hook gives the start of each token; the end is
+ * wherever the input pointer is left after zshlex() (it ungets its
+ * lookahead).  Command substitutions are lexed recursively and call
+ * hwbegin for their inner words, so only the first call per token
+ * counts.
+ *
+ * Positions are counted in the metafied copy the lexer reads and
+ * mapped back to the caller's bytes at the end.
+ */
+
+#include <limits.h>
+
+#include "libzsh_int.h"
+
+/* Metafied offset of the start of the current token, or -1 */
+static _Thread_local int lex_tokstart;
+/* Total metafied length of the input */
+static _Thread_local int lex_inlen;
+
+static void lex_hwbegin(int offset)
+{
+    if (lex_tokstart < 0)
+        lex_tokstart = lex_inlen - inbufct + offset;
+}
+
+/*
+ * Map metafied offsets to original offsets.  Tokens arrive in order,
+ * so the walk only ever moves forward.
+ */
+struct meta_cursor {
+    const char *mstr;
+    int mpos, opos;
+};
+
+static int meta_orig(struct meta_cursor *mc, int mpos)
+{
+    while (mc->mpos < mpos) {
+        mc->mpos += (mc->mstr[mc->mpos] == Meta) ? 2 : 1;
+        mc->opos++;
+    }
+    return mc->opos;
+}
+
+int libzsh_lex_entered(const char *buf, size_t len, size_t base,
+                       struct libzsh_tokens *out, libzsh_lex_stop_fn stop,
+                       void *data)
+{
+    void (*ohwbegin)(int);
+    struct meta_cursor mc;
+    int onoaliases, ret = 0, hasmeta;
+    char *input;
+
+    if (len > (size_t)INT_MAX)
+        return -1;
+
+    pushheap();
+
+    input = metafy((char *)buf, (int)len, META_HEAPDUP);
+    lex_inlen = strlen(input);
+    hasmeta = lex_inlen != (int)len;
+    mc.mstr = input;
+    mc.mpos = mc.opos = 0;
+
+    ohwbegin = hwbegin;
+    hwbegin = lex_hwbegin;
+    /* Thread-local (gen_tls.sh), or set with the lock taken alone */
+    onoaliases = noaliases;
+    noaliases = 1;
+    errflag = 0;
+    lineno = 1;
+
+    lexinit();
+    incmdpos = 1;
+    inpush(input, 0, NULL);
+
+    for (;;) {
+        int cmdpos = incmdpos, start, end, flags = 0;
+        size_t i;
+
+        lex_tokstart = -1;
+        ctxtlex();
+        if (tok == ENDINPUT)
+            break;
+        if (out->count == out->capacity) {
+            ret = 1;
+            break;
+        }
+
+        end = lex_inlen - inbufct;
+        start = lex_tokstart >= 0 ? lex_tokstart : end;
+        if (tok == SEPER || tok == NEWLIN) {
+            /*
+             * A comment is returned as the newline ending it;
+             * otherwise the token is just the ';' or newline.
+             */
+            if (input[start] == '#') {
+                char *nl = strchr(input + start, '\n');
+                flags |= LIBZSH_TOKEN_COMMENT;
+                end = nl ? nl + 1 - input : lex_inlen;
+            } else if (start < lex_inlen)
+                end = start + 1;
+        }
+        if (cmdpos)
+            flags |= LIBZSH_TOKEN_CMDPOS;
+        if (tok >= BANG)
+            flags |= LIBZSH_TOKEN_RESERVED;
+        if (hasmeta && memchr(input + start, Meta, end - start))
+            flags |= LIBZSH_TOKEN_META;
+
+        i = out->count++;
+        out->type[i] = (unsigned short)tok;
+        out->start[i] = meta_orig(&mc, start);
+        out->len[i] = meta_orig(&mc, end) - out->start[i];
+        out->start[i] += base;
+        out->flags[i] = (unsigned char)flags;
+
+        if (tok == LEXERR) {
+            ret = -1;
+            break;
+        }
+        if (stop && stop(data, out)) {
+            ret = 2;
+            break;
+        }
+    }
+
+    inpop();
+    hwbegin = ohwbegin;
+    noaliases = onoaliases;
+    errflag = 0;
+    popheap();
+
+    return ret;
+}
+
+int libzsh_lex(libzsh_context *ctx, const char *buf, size_t len,
+               struct libzsh_tokens *out)
+{
+    int ret;
+
+    out->count = 0;
+    libzsh_context_enter_shared(ctx);
+    ret = libzsh_lex_entered(buf, len, 0, out, NULL, NULL);
+    libzsh_context_leave(ctx);
+
+    return ret;
+}
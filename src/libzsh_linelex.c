@@ -0,0 +1,333 @@
+/*
+ * libzsh_linelex.c - Incremental re-lexing of an edited line
+ *
+ * After a list separator the lexer is back in its initial state: in
+ * command position, outside any word, with nothing pending.  (Pure
+ * lexing never sets the parser-driven states such as incasepat, and a
+ * separator ends any redirection or for-list.)  The exception is
+ * incond, which the lexer sets itself from `[[' to `]]': the '&&', '||'
+ * and newlines inside a condition leave it set, and a lex started after
+ * one would take the `]]' for a word.  Which tokens lie inside a
+ * condition is kept beside the tokens, and separators there are never
+ * used.  So the tokens following any other separator depend only on
+ * the text following it, and the line can be re-lexed from the last
+ * such separator before an edit with no other state carried over.
+ *
+ * The same argument gives the stopping point: once the new lex yields a
+ * separator lying wholly in the unchanged tail of the line, matching a
+ * separator of the old lex at the shifted offset, everything after it
+ * is the old tokens moved by the change in length.
+ *
+ * A separator is only a safe resume point if the byte after it is
+ * unchanged, since the lexer looks one character ahead to tell ';'
+ * from ';;', '&' from '&&' and so on.
+ *
+ * libzsh_line_lexer_update() finds the change by comparing the line
+ * with the previous one from both ends, which is a pass over the line;
+ * libzsh_line_lexer_edit() takes it from the caller instead.
+ */
+
+#include <limits.h>
+
+#include "libzsh_int.h"
+
+struct libzsh_line_lexer {
+    char *text;                 /* the line the tokens describe */
+    size_t textlen;
+    size_t textsz;
+    int status;                 /* 0, or -1 for a lex error */
+    int valid;                  /* text and tokens are up to date */
+    struct libzsh_tokens toks;
+    unsigned char *cond;        /* per token: inside [[ ]] */
+    size_t condsz;
+    struct libzsh_tokens scratch;   /* the re-lexed middle section */
+};
+
+static int is_separator(int type)
+{
+    switch (type) {
+    case SEPER:
+    case NEWLIN:
+    case AMPER:
+    case AMPERBANG:
+    case BAR:
+    case BARAMP:
+    case DBAR:
+    case DAMPER:
+        return 1;
+    }
+    return 0;
+}
+
+/* Make room for at least n tokens, keeping the existing ones */
+static void tokens_reserve(struct libzsh_tokens *t, size_t n)
+{
+    size_t sz = t->capacity ? t->capacity : 64;
+
+    if (n <= t->capacity)
+        return;
+    while (sz < n)
+        sz *= 2;
+    t->type = (unsigned short *)zrealloc(t->type, sz * sizeof(*t->type));
+    t->start = (unsigned int *)zrealloc(t->start, sz * sizeof(*t->start));
+    t->len = (unsigned int *)zrealloc(t->len, sz * sizeof(*t->len));
+    t->flags = (unsigned char *)zrealloc(t->flags, sz * sizeof(*t->flags));
+    t->capacity = sz;
+}
+
+static void tokens_free(struct libzsh_tokens *t)
+{
+    if (t->capacity) {
+        zfree(t->type, t->capacity * sizeof(*t->type));
+        zfree(t->start, t->capacity * sizeof(*t->start));
+        zfree(t->len, t->capacity * sizeof(*t->len));
+        zfree(t->flags, t->capacity * sizeof(*t->flags));
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+libzsh_line_lexer *libzsh_line_lexer_new(void)
+{
+    return (libzsh_line_lexer *)zshcalloc(sizeof(libzsh_line_lexer));
+}
+
+void libzsh_line_lexer_free(libzsh_line_lexer *ll)
+{
+    if (!ll)
+        return;
+    if (ll->text)
+        zfree(ll->text, ll->textsz);
+    tokens_free(&ll->toks);
+    if (ll->cond)
+        zfree(ll->cond, ll->condsz);
+    tokens_free(&ll->scratch);
+    zfree(ll, sizeof(*ll));
+}
+
+void libzsh_line_lexer_reset(libzsh_line_lexer *ll)
+{
+    ll->valid = 0;
+}
+
+const struct libzsh_tokens *libzsh_line_lexer_tokens(libzsh_line_lexer *ll)
+{
+    return &ll->toks;
+}
+
+/* Index of the first old token starting at or after off */
+static size_t token_search(const struct libzsh_tokens *t, size_t lo,
+                           size_t off)
+{
+    size_t hi = t->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (t->start[mid] < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Whether a token of type leaves the lexer inside a condition */
+static int cond_after(int incond, int type)
+{
+    if (type == DINBRACK)
+        return 1;
+    if (type == DOUTBRACK)
+        return 0;
+    return incond;
+}
+
+/* State for the convergence test run after each new token */
+struct relex_stop {
+    const struct libzsh_tokens *old;
+    const unsigned char *oldcond;
+    int incond;                 /* the new token is inside [[ ]] */
+    size_t oldfrom;             /* first old token that may match */
+    size_t tailstart;           /* new offset where the unchanged tail starts */
+    long delta;                 /* new length - old length */
+    size_t match;               /* old token matched, when stopped */
+};
+
+static int relex_converged(void *data, struct libzsh_tokens *out)
+{
+    struct relex_stop *rs = (struct relex_stop *)data;
+    const struct libzsh_tokens *old = rs->old;
+    size_t i = out->count - 1, j, ostart;
+
+    rs->incond = cond_after(rs->incond, out->type[i]);
+    if (!is_separator(out->type[i]) || rs->incond ||
+        out->start[i] < rs->tailstart)
+        return 0;
+    ostart = (size_t)((long)out->start[i] - rs->delta);
+    j = token_search(old, rs->oldfrom, ostart);
+    if (j == old->count || old->start[j] != ostart ||
+        old->type[j] != out->type[i] || old->len[j] != out->len[i] ||
+        old->flags[j] != out->flags[i] || rs->oldcond[j])
+        return 0;
+    rs->match = j;
+    return 1;
+}
+
+/*
+ * Re-lex line, the previous text with the bytes between pre and
+ * the last suf of it replaced.
+ */
+static int line_relex(libzsh_context *ctx, libzsh_line_lexer *ll,
+                      const char *line, size_t len, size_t pre, size_t suf,
+                      size_t *first, size_t *last)
+{
+    struct libzsh_tokens *toks = &ll->toks, *scr = &ll->scratch;
+    struct libzsh_pool *pool;
+    struct relex_stop rs;
+    size_t r = 0, from = 0, keep, tail, i;
+    int ret, incond;
+
+    if (ll->valid) {
+        /* Back up to the last separator ending before the change */
+        r = token_search(toks, 0, pre);
+        while (r > 0 && !(is_separator(toks->type[r - 1]) &&
+                          !ll->cond[r - 1] &&
+                          toks->start[r - 1] + toks->len[r - 1] < pre))
+            r--;
+        if (r > 0)
+            from = toks->start[r - 1] + toks->len[r - 1];
+    } else
+        toks->count = 0;
+
+    rs.old = toks;
+    rs.oldcond = ll->cond;
+    rs.incond = 0;
+    rs.oldfrom = r;
+    rs.tailstart = len - suf;
+    rs.delta = (long)len - (long)ll->textlen;
+    rs.match = 0;
+
+    tokens_reserve(scr, 64);
+    libzsh_context_enter_shared(ctx);
+    /* The tokens outlive the context */
+    pool = libzsh_pool_shared();
+    for (;;) {
+        scr->count = 0;
+        ret = libzsh_lex_entered(line + from, len - from, from, scr,
+                                 ll->valid ? relex_converged : NULL, &rs);
+        if (ret != 1)
+            break;
+        tokens_reserve(scr, scr->capacity * 2);
+    }
+    libzsh_pool_use(pool);
+    libzsh_context_leave(ctx);
+
+    /* Old tokens kept after the re-lexed section, shifted by delta */
+    if (ret == 2) {
+        keep = rs.match + 1;
+        tail = toks->count - keep;
+        ret = ll->status;
+    } else {
+        keep = toks->count;
+        tail = 0;
+    }
+
+    tokens_reserve(toks, r + scr->count + tail);
+    if (ll->condsz < toks->capacity) {
+        ll->cond = (unsigned char *)zrealloc(ll->cond, toks->capacity);
+        ll->condsz = toks->capacity;
+    }
+    if (tail) {
+        size_t to = r + scr->count;
+
+        memmove(toks->type + to, toks->type + keep,
+                tail * sizeof(*toks->type));
+        memmove(toks->start + to, toks->start + keep,
+                tail * sizeof(*toks->start));
+        memmove(toks->len + to, toks->len + keep,
+                tail * sizeof(*toks->len));
+        memmove(toks->flags + to, toks->flags + keep,
+                tail * sizeof(*toks->flags));
+        memmove(ll->cond + to, ll->cond + keep, tail);
+        if (rs.delta)
+            for (i = to; i < to + tail; i++)
+                toks->start[i] = (unsigned int)((long)toks->start[i] +
+                                                rs.delta);
+    }
+    memcpy(toks->type + r, scr->type, scr->count * sizeof(*toks->type));
+    memcpy(toks->start + r, scr->start, scr->count * sizeof(*toks->start));
+    memcpy(toks->len + r, scr->len, scr->count * sizeof(*toks->len));
+    memcpy(toks->flags + r, scr->flags, scr->count * sizeof(*toks->flags));
+    /* Lexing resumed outside any condition */
+    for (i = 0, incond = 0; i < scr->count; i++)
+        ll->cond[r + i] = incond = cond_after(incond, scr->type[i]);
+    toks->count = r + scr->count + tail;
+
+    if (len + 1 > ll->textsz) {
+        if (ll->text)
+            zfree(ll->text, ll->textsz);
+        ll->textsz = len + 1 > 256 ? len + 1 : 256;
+        ll->text = (char *)zalloc(ll->textsz);
+        pre = 0;
+    }
+    /* The text before the change is already there */
+    memcpy(ll->text + pre, line + pre, len - pre);
+    ll->textlen = len;
+    ll->status = ret;
+    ll->valid = 1;
+
+    *first = r;
+    *last = r + scr->count;
+    return ret;
+}
+
+int libzsh_line_lexer_update(libzsh_context *ctx, libzsh_line_lexer *ll,
+                             const char *line, size_t len,
+                             size_t *first, size_t *last)
+{
+    size_t pre = 0, suf = 0;
+
+    if (len > (size_t)INT_MAX) {
+        *first = *last = 0;
+        return -1;
+    }
+
+    if (ll->valid) {
+        size_t min = len < ll->textlen ? len : ll->textlen;
+
+        while (pre < min && line[pre] == ll->text[pre])
+            pre++;
+        while (suf < min - pre &&
+               line[len - suf - 1] == ll->text[ll->textlen - suf - 1])
+            suf++;
+        if (pre == len && len == ll->textlen) {
+            *first = *last = ll->toks.count;
+            return ll->status;
+        }
+    }
+    return line_relex(ctx, ll, line, len, pre, suf, first, last);
+}
+
+int libzsh_line_lexer_edit(libzsh_context *ctx, libzsh_line_lexer *ll,
+                           const char *line, size_t len, size_t start,
+                           size_t oldlen, size_t *first, size_t *last)
+{
+    if (len > (size_t)INT_MAX) {
+        *first = *last = 0;
+        return -1;
+    }
+    if (!ll->valid)
+        return line_relex(ctx, ll, line, len, 0, 0, first, last);
+
+    if (start > ll->textlen || oldlen > ll->textlen - start ||
+        len + oldlen < ll->textlen) {
+        *first = *last = 0;
+        errno = EINVAL;
+        return -1;
+    }
+    if (!oldlen && len == ll->textlen) {
+        *first = *last = ll->toks.count;
+        return ll->status;
+    }
+    return line_relex(ctx, ll, line, len, start,
+                      ll->textlen - start - oldlen, first, last);
+}
@@ -0,0 +1,792 @@
+/*
+ * libzsh_math.c - Arithmetic compiled once and evaluated many times
+ *
+ * matheval() tokenizes and parses its string with the operator
+ * precedence machinery on every call, and looks every parameter up by
+ * name as it meets it.  libzsh_math_compile() does that once, into a
+ * flat program for a stack machine: operands are pushed, operators pop
+ * theirs and push their result, and && || and ?: jump.  The precedence
+ * is zsh's own, or C's if C_PRECEDENCES is set in the context when the
+ * expression is compiled; OCTAL_ZEROES likewise applies as compiled.
+ *
+ * Each parameter named takes one slot, keeping the node found there
+ * and the parameter table's generation (libzsh_hashtable_gen()) at the
+ * time, so while no parameter is created or removed evaluation goes
+ * straight to the node.  Values are read, and strings in them
+ * evaluated, as matheval() does.
+ *
+ * Integers, floats, parameters, the unary, binary, ternary and comma
+ * operators, and assignment with = and the op= forms, ++ and -- are
+ * compiled.  Subscripts, math functions, $ forms and base#number
+ * literals are not: compiling fails with ENOTSUP and the expression is
+ * for matheval().
+ */
+
+#include <math.h>
+
+#include "libzsh_int.h"
+
+enum {
+    MO_NUM,     /* push consts[arg] */
+    MO_PARAM,   /* push refs[arg]'s value */
+    MO_STORE,   /* assign the top to refs[arg], leaving it */
+    MO_DUP,
+    MO_POP,
+    MO_NEG, MO_NOT, MO_COMP,
+    MO_POW, MO_MUL, MO_DIV, MO_MOD, MO_ADD, MO_SUB, MO_SHL, MO_SHR,
+    MO_LT, MO_LE, MO_GT, MO_GE, MO_EQ, MO_NE,
+    MO_BAND, MO_BXOR, MO_BOR, MO_LXOR,
+    MO_AND,     /* if the top is false make it 0 and jump, else pop it */
+    MO_OR,      /* if the top is true make it 1 and jump, else pop it */
+    MO_BOOL,    /* the top as 0 or 1 */
+    MO_JFALSE,  /* pop; jump to arg if false */
+    MO_JMP
+};
+
+struct math_op {
+    int op, arg;
+};
+
+struct math_ref {
+    char *name;
+    Param pm;                   /* as found in ht at generation gen */
+    HashTable ht;
+    unsigned long gen;
+};
+
+struct libzsh_math {
+    libzsh_context *ctx;
+    struct math_op *ops;
+    int nops;
+    mnumber *consts;
+    int nconsts;
+    struct math_ref *refs;
+    int nrefs;
+    mnumber *stack;
+    int depth;                  /* greatest stack depth */
+    int opsize, constsize, refsize;
+};
+
+/*
+ * Compiling
+ */
+
+enum {
+    MT_END, MT_NUM, MT_IDENT, MT_OP, MT_LPAR, MT_RPAR, MT_QUEST, MT_COLON,
+    MT_COMMA, MT_INCR, MT_DECR, MT_ASSIGN
+};
+
+struct math_comp {
+    struct libzsh_math *m;
+    const char *p;
+    int tok;
+    int op;                     /* MT_OP, MT_ASSIGN: the operator */
+    mnumber num;
+    const char *ident;
+    int identlen;
+    int cprec, octal;
+    int sp;                     /* stack depth so far */
+    int err;                    /* errno to fail with, or 0 */
+};
+
+/* Binary operators by spelling, longest first */
+static const struct {
+    const char *s;
+    int op;
+} math_binops[] = {
+    { "**", MO_POW }, { "<<", MO_SHL }, { ">>", MO_SHR }, { "<=", MO_LE },
+    { ">=", MO_GE }, { "==", MO_EQ }, { "!=", MO_NE }, { "&&", MO_AND },
+    { "||", MO_OR }, { "^^", MO_LXOR }, { "*", MO_MUL }, { "/", MO_DIV },
+    { "%", MO_MOD }, { "+", MO_ADD }, { "-", MO_SUB }, { "<", MO_LT },
+    { ">", MO_GT }, { "&", MO_BAND }, { "^", MO_BXOR }, { "|", MO_BOR },
+};
+
+/* Binding strength of binary operators, zsh's and C's; higher is tighter */
+static int math_prec(int op, int cprec)
+{
+    switch (op) {
+    case MO_SHL: case MO_SHR:
+        return cprec ? 10 : 12;
+    case MO_BAND:
+        return cprec ? 7 : 11;
+    case MO_BXOR:
+        return cprec ? 6 : 10;
+    case MO_BOR:
+        return cprec ? 5 : 9;
+    case MO_POW:
+        return cprec ? 13 : 8;
+    case MO_MUL: case MO_DIV: case MO_MOD:
+        return cprec ? 12 : 7;
+    case MO_ADD: case MO_SUB:
+        return cprec ? 11 : 6;
+    case MO_LT: case MO_LE: case MO_GT: case MO_GE:
+        return cprec ? 9 : 5;
+    case MO_EQ: case MO_NE:
+        return cprec ? 8 : 4;
+    case MO_AND:
+        return cprec ? 4 : 3;
+    case MO_LXOR:               /* C's has it between && and || */
+        return cprec ? 3 : 2;
+    default:                    /* MO_OR */
+        return 2;
+    }
+}
+
+static int mc_fail(struct math_comp *c, int err)
+{
+    if (!c->err)
+        c->err = err;
+    return -1;
+}
+
+static int mc_number(struct math_comp *c)
+{
+    const char *s = c->p;
+    char *end;
+    int base = 10;
+
+    if (*s == '0' && (s[1] == 'x' || s[1] == 'X'))
+        base = 16, s += 2;
+    else if (*s == '0' && (s[1] == 'b' || s[1] == 'B'))
+        base = 2, s += 2;
+    else {
+        const char *t = s;
+
+        while (idigit(*t))
+            t++;
+        if (*t == '.' || *t == 'e' || *t == 'E') {
+            c->num.type = MN_FLOAT;
+            c->num.u.d = strtod(s, &end);
+            goto done;
+        }
+        if (*t == '#')
+            return mc_fail(c, ENOTSUP);
+        if (c->octal && *s == '0')
+            base = 8;
+    }
+    c->num.type = MN_INTEGER;
+    c->num.u.l = (zlong)strtoull(s, &end, base);
+    if (end == s)
+        return mc_fail(c, EINVAL);
+done:
+    /* 1_000: zsh reads the separators, this doesn't */
+    if (*end == '_')
+        return mc_fail(c, ENOTSUP);
+    if (iident(*end))
+        return mc_fail(c, EINVAL);
+    c->p = end;
+    c->tok = MT_NUM;
+    return 0;
+}
+
+/* Read the next token into c */
+static int mc_next(struct math_comp *c)
+{
+    size_t i;
+
+    while (*c->p == ' ' || *c->p == '\t' || *c->p == '\n')
+        c->p++;
+    if (!*c->p) {
+        c->tok = MT_END;
+        return 0;
+    }
+    if (idigit(*c->p) || (*c->p == '.' && idigit(c->p[1])))
+        return mc_number(c);
+    if (iident(*c->p)) {
+        c->ident = c->p;
+        while (iident(*c->p))
+            c->p++;
+        c->identlen = (int)(c->p - c->ident);
+        c->tok = MT_IDENT;
+        return 0;
+    }
+    switch (*c->p) {
+    case '(': c->tok = MT_LPAR; c->p++; return 0;
+    case ')': c->tok = MT_RPAR; c->p++; return 0;
+    case '?': c->tok = MT_QUEST; c->p++; return 0;
+    case ':': c->tok = MT_COLON; c->p++; return 0;
+    case ',': c->tok = MT_COMMA; c->p++; return 0;
+    }
+    if ((c->p[0] == '+' || c->p[0] == '-') && c->p[1] == c->p[0]) {
+        c->tok = c->p[0] == '+' ? MT_INCR : MT_DECR;
+        c->p += 2;
+        return 0;
+    }
+    for (i = 0; i < sizeof(math_binops) / sizeof(math_binops[0]); i++) {
+        size_t len = strlen(math_binops[i].s);
+
+        if (strncmp(c->p, math_binops[i].s, len))
+            continue;
+        c->p += len;
+        c->op = math_binops[i].op;
+        if (*c->p == '=' && c->op != MO_LT && c->op != MO_LE &&
+            c->op != MO_GT && c->op != MO_GE && c->op != MO_EQ &&
+            c->op != MO_NE) {
+            c->p++;
+            c->tok = MT_ASSIGN;
+        } else
+            c->tok = MT_OP;
+        return 0;
+    }
+    switch (*c->p) {
+    case '=':
+        c->p++;
+        c->tok = MT_ASSIGN;
+        c->op = -1;
+        return 0;
+    case '!': case '~':
+        c->op = *c->p++ == '!' ? MO_NOT : MO_COMP;
+        c->tok = MT_OP;
+        return 0;
+    case '[': case '$': case '#':
+        return mc_fail(c, ENOTSUP);
+    }
+    return mc_fail(c, EINVAL);
+}
+
+/* Emit op; delta is its effect on the stack depth */
+static int mc_emit(struct math_comp *c, int op, int arg, int delta)
+{
+    struct libzsh_math *m = c->m;
+
+    if (m->nops == m->opsize) {
+        m->opsize = m->opsize ? 2 * m->opsize : 16;
+        m->ops = (struct math_op *)zrealloc(m->ops,
+                                            m->opsize * sizeof(*m->ops));
+    }
+    m->ops[m->nops].op = op;
+    m->ops[m->nops].arg = arg;
+    c->sp += delta;
+    if (c->sp > m->depth)
+        m->depth = c->sp;
+    return m->nops++;
+}
+
+static void mc_const(struct math_comp *c, mnumber n)
+{
+    struct libzsh_math *m = c->m;
+
+    if (m->nconsts == m->constsize) {
+        m->constsize = m->constsize ? 2 * m->constsize : 8;
+        m->consts = (mnumber *)zrealloc(m->consts,
+                                        m->constsize * sizeof(*m->consts));
+    }
+    m->consts[m->nconsts] = n;
+    mc_emit(c, MO_NUM, m->nconsts++, 1);
+}
+
+static void mc_one(struct math_comp *c)
+{
+    mnumber one;
+
+    one.type = MN_INTEGER;
+    one.u.l = 1;
+    mc_const(c, one);
+}
+
+/* The slot of the identifier just read */
+static int mc_ref(struct math_comp *c)
+{
+    struct libzsh_math *m = c->m;
+    int i;
+
+    for (i = 0; i < m->nrefs; i++)
+        if (!strncmp(m->refs[i].name, c->ident, c->identlen) &&
+            !m->refs[i].name[c->identlen])
+            return i;
+    if (m->nrefs == m->refsize) {
+        m->refsize = m->refsize ? 2 * m->refsize : 4;
+        m->refs = (struct math_ref *)zrealloc(m->refs,
+                                              m->refsize * sizeof(*m->refs));
+    }
+    memset(&m->refs[i], 0, sizeof(m->refs[i]));
+    m->refs[i].name = ztrduppfx(c->ident, c->identlen);
+    return m->nrefs++;
+}
+
+static int mc_comma(struct math_comp *c);
+static int mc_assign(struct math_comp *c);
+
+/* A primary with its postfix ++ or --; c->tok is its first token */
+static int mc_primary(struct math_comp *c)
+{
+    int ref;
+
+    switch (c->tok) {
+    case MT_NUM:
+        mc_const(c, c->num);
+        return mc_next(c);
+    case MT_LPAR:
+        if (mc_next(c) || mc_comma(c))
+            return -1;
+        if (c->tok != MT_RPAR)
+            return mc_fail(c, EINVAL);
+        return mc_next(c);
+    case MT_IDENT:
+        ref = mc_ref(c);
+        if (*c->p == '(' || *c->p == '[')
+            return mc_fail(c, ENOTSUP);
+        mc_emit(c, MO_PARAM, ref, 1);
+        if (mc_next(c))
+            return -1;
+        if (c->tok == MT_INCR || c->tok == MT_DECR) {
+            mc_emit(c, MO_DUP, 0, 1);
+            mc_one(c);
+            mc_emit(c, c->tok == MT_INCR ? MO_ADD : MO_SUB, 0, -1);
+            mc_emit(c, MO_STORE, ref, 0);
+            mc_emit(c, MO_POP, 0, -1);
+            return mc_next(c);
+        }
+        return 0;
+    }
+    return mc_fail(c, EINVAL);
+}
+
+static int mc_unary(struct math_comp *c)
+{
+    if (c->tok == MT_INCR || c->tok == MT_DECR) {
+        int op = c->tok == MT_INCR ? MO_ADD : MO_SUB, ref;
+
+        if (mc_next(c))
+            return -1;
+        if (c->tok != MT_IDENT)
+            return mc_fail(c, EINVAL);
+        ref = mc_ref(c);
+        mc_emit(c, MO_PARAM, ref, 1);
+        mc_one(c);
+        mc_emit(c, op, 0, -1);
+        mc_emit(c, MO_STORE, ref, 0);
+        return mc_next(c);
+    }
+    if (c->tok == MT_OP &&
+        (c->op == MO_ADD || c->op == MO_SUB || c->op == MO_NOT ||
+         c->op == MO_COMP)) {
+        int op = c->op;
+
+        if (mc_next(c) || mc_unary(c))
+            return -1;
+        if (op != MO_ADD)
+            mc_emit(c, op == MO_SUB ? MO_NEG : op, 0, 0);
+        return 0;
+    }
+    return mc_primary(c);
+}
+
+static int mc_binary(struct math_comp *c, int minprec)
+{
+    if (mc_unary(c))
+        return -1;
+    while (c->tok == MT_OP && c->op != MO_NOT && c->op != MO_COMP &&
+           math_prec(c->op, c->cprec) >= minprec) {
+        int op = c->op, prec = math_prec(op, c->cprec), jump = -1;
+
+        if (op == MO_AND || op == MO_OR)
+            jump = mc_emit(c, op, 0, -1);
+        if (mc_next(c) || mc_binary(c, op == MO_POW ? prec : prec + 1))
+            return -1;
+        if (jump >= 0) {
+            mc_emit(c, MO_BOOL, 0, 0);
+            c->m->ops[jump].arg = c->m->nops;
+        } else
+            mc_emit(c, op, 0, -1);
+    }
+    return 0;
+}
+
+static int mc_ternary(struct math_comp *c)
+{
+    int jfalse, jend;
+
+    if (mc_binary(c, 0))
+        return -1;
+    if (c->tok != MT_QUEST)
+        return 0;
+    jfalse = mc_emit(c, MO_JFALSE, 0, -1);
+    if (mc_next(c) || mc_assign(c))
+        return -1;
+    if (c->tok != MT_COLON)
+        return mc_fail(c, EINVAL);
+    jend = mc_emit(c, MO_JMP, 0, -1);
+    c->m->ops[jfalse].arg = c->m->nops;
+    if (mc_next(c) || mc_ternary(c))
+        return -1;
+    c->m->ops[jend].arg = c->m->nops;
+    return 0;
+}
+
+static int mc_assign(struct math_comp *c)
+{
+    struct libzsh_math *m = c->m;
+    int start = m->nops, ref, op;
+
+    if (mc_ternary(c))
+        return -1;
+    if (c->tok != MT_ASSIGN)
+        return 0;
+    /* The left side must have been a name alone */
+    if (m->nops != start + 1 || m->ops[start].op != MO_PARAM)
+        return mc_fail(c, EINVAL);
+    ref = m->ops[start].arg;
+    op = c->op;
+    if (op < 0) {
+        m->nops = start;
+        c->sp--;
+    }
+    if (op == MO_AND || op == MO_OR) {
+        int jump = mc_emit(c, op, 0, -1);
+
+        if (mc_next(c) || mc_assign(c))
+            return -1;
+        mc_emit(c, MO_BOOL, 0, 0);
+        m->ops[jump].arg = m->nops;
+    } else {
+        if (mc_next(c) || mc_assign(c))
+            return -1;
+        if (op >= 0)
+            mc_emit(c, op, 0, -1);
+    }
+    mc_emit(c, MO_STORE, ref, 0);
+    return 0;
+}
+
+static int mc_comma(struct math_comp *c)
+{
+    if (mc_assign(c))
+        return -1;
+    while (c->tok == MT_COMMA) {
+        mc_emit(c, MO_POP, 0, -1);
+        if (mc_next(c) || mc_assign(c))
+            return -1;
+    }
+    return 0;
+}
+
+static void math_free_entered(libzsh_math *m)
+{
+    int i;
+
+    for (i = 0; i < m->nrefs; i++)
+        zsfree(m->refs[i].name);
+    if (m->refs)
+        zfree(m->refs, m->refsize * sizeof(*m->refs));
+    if (m->ops)
+        zfree(m->ops, m->opsize * sizeof(*m->ops));
+    if (m->consts)
+        zfree(m->consts, m->constsize * sizeof(*m->consts));
+    if (m->stack)
+        zfree(m->stack, m->depth * sizeof(*m->stack));
+    zfree(m, sizeof(*m));
+}
+
+void libzsh_math_free(libzsh_math *m)
+{
+    libzsh_context *ctx;
+
+    if (!m)
+        return;
+    ctx = m->ctx;
+    libzsh_context_enter(ctx);
+    math_free_entered(m);
+    libzsh_context_leave(ctx);
+}
+
+libzsh_math *libzsh_math_compile(libzsh_context *ctx, const char *expr)
+{
+    struct math_comp c;
+    libzsh_math *m;
+
+    libzsh_context_enter(ctx);
+    m = (libzsh_math *)zshcalloc(sizeof(*m));
+    m->ctx = ctx;
+    memset(&c, 0, sizeof(c));
+    c.m = m;
+    c.p = expr;
+    c.cprec = isset(CPRECEDENCES);
+    c.octal = isset(OCTALZEROES);
+
+    if (mc_next(&c) ||
+        (c.tok != MT_END && (mc_comma(&c) || c.tok != MT_END))) {
+        math_free_entered(m);
+        libzsh_context_leave(ctx);
+        errno = c.err ? c.err : EINVAL;
+        return NULL;
+    }
+    if (!m->nops) {
+        /* An empty expression is 0, as for matheval() */
+        mnumber zero;
+
+        zero.type = MN_INTEGER;
+        zero.u.l = 0;
+        mc_const(&c, zero);
+    }
+    m->stack = (mnumber *)zalloc(m->depth * sizeof(*m->stack));
+    libzsh_context_leave(ctx);
+    return m;
+}
+
+/*
+ * Evaluating
+ */
+
+static Param mr_node(struct math_ref *r)
+{
+    unsigned long gen = libzsh_hashtable_gen(paramtab);
+
+    if (!gen || r->ht != paramtab || r->gen != gen) {
+        r->pm = (Param)paramtab->getnode(paramtab, r->name);
+        r->ht = paramtab;
+        r->gen = gen;
+    }
+    return r->pm;
+}
+
+static int mr_get(struct math_ref *r, mnumber *n)
+{
+    Param pm = mr_node(r);
+
+    if (!pm || (pm->node.flags & PM_UNSET)) {
+        if (unset(UNSET))
+            return -1;
+        n->type = MN_INTEGER;
+        n->u.l = 0;
+    } else if (pm->node.flags & PM_INTEGER) {
+        n->type = MN_INTEGER;
+        n->u.l = pm->gsu.i->getfn(pm);
+    } else if (pm->node.flags & (PM_EFLOAT | PM_FFLOAT)) {
+        n->type = MN_FLOAT;
+        n->u.d = pm->gsu.f->getfn(pm);
+    } else {
+        struct value vbuf;
+
+        memset(&vbuf, 0, sizeof(vbuf));
+        vbuf.pm = pm;
+        vbuf.end = -1;
+        *n = getnumvalue(&vbuf);
+    }
+    return errflag ? -1 : 0;
+}
+
+static int mr_set(struct math_ref *r, mnumber n)
+{
+    return setnparam(dupstring(r->name), n) && !errflag ? 0 : -1;
+}
+
+static int m_true(mnumber n)
+{
+    return n.type == MN_FLOAT ? n.u.d != 0 : n.u.l != 0;
+}
+
+static zlong m_int(mnumber n)
+{
+    return n.type == MN_FLOAT ? (zlong)n.u.d : n.u.l;
+}
+
+static double m_float(mnumber n)
+{
+    return n.type == MN_FLOAT ? n.u.d : (double)n.u.l;
+}
+
+/* a op b into *r; returns errno to fail with, or 0 */
+static int m_binop(int op, mnumber a, mnumber b, mnumber *r)
+{
+    int fl = a.type == MN_FLOAT || b.type == MN_FLOAT;
+    zlong x, y;
+
+    r->type = MN_INTEGER;
+    switch (op) {
+    case MO_LT: case MO_LE: case MO_GT: case MO_GE: case MO_EQ: case MO_NE:
+        if (fl) {
+            double p = m_float(a), q = m_float(b);
+
+            r->u.l = op == MO_LT ? p < q : op == MO_LE ? p <= q :
+                op == MO_GT ? p > q : op == MO_GE ? p >= q :
+                op == MO_EQ ? p == q : p != q;
+        } else {
+            x = a.u.l, y = b.u.l;
+            r->u.l = op == MO_LT ? x < y : op == MO_LE ? x <= y :
+                op == MO_GT ? x > y : op == MO_GE ? x >= y :
+                op == MO_EQ ? x == y : x != y;
+        }
+        return 0;
+    case MO_LXOR:
+        r->u.l = m_true(a) != m_true(b);
+        return 0;
+    case MO_BAND: case MO_BXOR: case MO_BOR: case MO_SHL: case MO_SHR:
+        x = m_int(a), y = m_int(b);
+        /* Shift counts are taken as the processor takes them */
+        r->u.l = op == MO_BAND ? (x & y) : op == MO_BXOR ? (x ^ y) :
+            op == MO_BOR ? (x | y) :
+            op == MO_SHL ? (zlong)((zulong)x << (y & 63)) : (x >> (y & 63));
+        return 0;
+    case MO_POW:
+        if (!fl && b.u.l >= 0) {
+            zulong base = (zulong)a.u.l, res = 1;
+
+            for (y = b.u.l; y; y >>= 1, base *= base)
+                if (y & 1)
+                    res *= base;
+            r->u.l = (zlong)res;
+            return 0;
+        }
+        r->type = MN_FLOAT;
+        r->u.d = pow(m_float(a), m_float(b));
+        return 0;
+    }
+    if (fl) {
+        double p = m_float(a), q = m_float(b);
+
+        r->type = MN_FLOAT;
+        r->u.d = op == MO_MUL ? p * q : op == MO_DIV ? p / q :
+            op == MO_MOD ? fmod(p, q) : op == MO_ADD ? p + q : p - q;
+        return 0;
+    }
+    x = a.u.l, y = b.u.l;
+    switch (op) {
+    case MO_DIV: case MO_MOD:
+        if (!y)
+            return EDOM;
+        if (y == -1)            /* the one quotient that can overflow */
+            r->u.l = op == MO_DIV ? (zlong)-(zulong)x : 0;
+        else
+            r->u.l = op == MO_DIV ? x / y : x % y;
+        return 0;
+    case MO_MUL:
+        r->u.l = (zlong)((zulong)x * (zulong)y);
+        return 0;
+    case MO_ADD:
+        r->u.l = (zlong)((zulong)x + (zulong)y);
+        return 0;
+    default:
+        r->u.l = (zlong)((zulong)x - (zulong)y);
+        return 0;
+    }
+}
+
+int libzsh_math_eval_entered(libzsh_math *m, struct libzsh_number *out)
+{
+    mnumber *st = m->stack, r;
+    int pc, sp = 0, err = 0, onoerrs = noerrs;
+
+    noerrs = 1;
+    errflag = 0;
+    for (pc = 0; pc < m->nops && !err; pc++) {
+        const struct math_op *o = &m->ops[pc];
+
+        switch (o->op) {
+        case MO_NUM:
+            st[sp++] = m->consts[o->arg];
+            break;
+        case MO_PARAM:
+            if (mr_get(&m->refs[o->arg], &st[sp++]))
+                err = EINVAL;
+            break;
+        case MO_STORE:
+            if (mr_set(&m->refs[o->arg], st[sp - 1]))
+                err = EINVAL;
+            break;
+        case MO_DUP:
+            st[sp] = st[sp - 1];
+            sp++;
+            break;
+        case MO_POP:
+            sp--;
+            break;
+        case MO_NEG:
+            if (st[sp - 1].type == MN_FLOAT)
+                st[sp - 1].u.d = -st[sp - 1].u.d;
+            else
+                st[sp - 1].u.l = (zlong)-(zulong)st[sp - 1].u.l;
+            break;
+        case MO_NOT:
+            st[sp - 1].u.l = !m_true(st[sp - 1]);
+            st[sp - 1].type = MN_INTEGER;
+            break;
+        case MO_COMP:
+            st[sp - 1].u.l = ~m_int(st[sp - 1]);
+            st[sp - 1].type = MN_INTEGER;
+            break;
+        case MO_AND: case MO_OR:
+            if (m_true(st[sp - 1]) == (o->op == MO_OR)) {
+                st[sp - 1].type = MN_INTEGER;
+                st[sp - 1].u.l = o->op == MO_OR;
+                pc = o->arg - 1;
+            } else
+                sp--;
+            break;
+        case MO_BOOL:
+            st[sp - 1].u.l = m_true(st[sp - 1]);
+            st[sp - 1].type = MN_INTEGER;
+            break;
+        case MO_JFALSE:
+            if (!m_true(st[--sp]))
+                pc = o->arg - 1;
+            break;
+        case MO_JMP:
+            pc = o->arg - 1;
+            break;
+        default:
+            err = m_binop(o->op, st[sp - 2], st[sp - 1], &r);
+            st[--sp - 1] = r;
+            break;
+        }
+    }
+    noerrs = onoerrs;
+    errflag = 0;
+
+    if (err) {
+        out->type = LIBZSH_MATH_ERROR;
+        out->i = 0;
+        out->d = 0;
+        errno = err;
+        return -1;
+    }
+    r = st[sp - 1];
+    out->type = r.type == MN_FLOAT ? LIBZSH_MATH_FLOAT : LIBZSH_MATH_INTEGER;
+    out->i = r.type == MN_FLOAT ? (long long)r.u.d : (long long)r.u.l;
+    out->d = r.type == MN_FLOAT ? r.u.d : (double)r.u.l;
+    return 0;
+}
+
+int libzsh_math_eval(libzsh_math *m, struct libzsh_number *out)
+{
+    struct libzsh_pool *pool;
+    int ret;
+
+    libzsh_context_enter(m->ctx);
+    /* Assignments go into the shared parameter table */
+    pool = libzsh_pool_shared();
+    libzsh_params_init();
+    pushheap();
+    ret = libzsh_math_eval_entered(m, out);
+    popheap();
+    libzsh_pool_use(pool);
+    libzsh_context_leave(m->ctx);
+    return ret;
+}
+
+/* Heap resets between expressions of a batch */
+#define MATH_HEAP_BATCH 1024
+
+size_t libzsh_math_eval_batch(libzsh_math *const *m, size_t n,
+                              struct libzsh_number *out)
+{
+    struct libzsh_pool *pool;
+    size_t i, failed = 0;
+
+    if (!n)
+        return 0;
+    libzsh_context_enter(m[0]->ctx);
+    pool = libzsh_pool_shared();
+    libzsh_params_init();
+    pushheap();
+    for (i = 0; i < n; i++) {
+        if (libzsh_math_eval_entered(m[i], &out[i]))
+            failed++;
+        if (i % MATH_HEAP_BATCH == MATH_HEAP_BATCH - 1)
+            freeheap();
+    }
+    popheap();
+    libzsh_pool_use(pool);
+    libzsh_context_leave(m[0]->ctx);
+    return failed;
+}
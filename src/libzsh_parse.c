@@ -0,0 +1,101 @@
+/*
+ * libzsh_parse.c - One-call parsing into a context's heap arena
+ *
+ * This wraps the sequence every caller used to spell out by hand:
+ * pushheap(), lexinit(), a zalloc'd copy of the input with a trailing
+ * newline, inpush(), parse_list(), inpop(), popheap().  Instead the
+ * input is metafied straight into the context's heap and the heap is
+ * recycled between calls with freeheap(), which keeps the last arena
+ * mapped, so a steady stream of short parses does not go back to the
+ * system allocator for input or parse-tree storage.
+ */
+
+#include <limits.h>
+
+#include "libzsh_int.h"
+
+/*
+ * Parse with the context already entered.  Used by libzsh_parse() and
+ * by the other libzsh entry points that parse as part of a larger job.
+ */
+Eprog libzsh_parse_entered(const char *buf, size_t len, int flags)
+{
+    Eprog prog;
+    char *input;
+    int onoerrs = noerrs;
+
+    if (len > (size_t)INT_MAX)
+        return NULL;
+
+    if (!(flags & LIBZSH_PARSE_KEEP))
+        freeheap();
+
+    /* One heap copy, metafied, doubles as the NUL terminator. */
+    input = metafy((char *)buf, (int)len, META_HEAPDUP);
+
+    if (flags & LIBZSH_PARSE_QUIET)
+        noerrs = 1;
+    errflag = 0;
+    lineno = 1;
+
+    lexinit();
+    inpush(input, 0, NULL);
+    libzsh_diag_input(input);
+    prog = parse_list();
+    libzsh_diag_input(NULL);
+    inpop();
+
+    if (errflag)
+        prog = NULL;
+    errflag = 0;
+    noerrs = onoerrs;
+
+    if (prog && (flags & LIBZSH_PARSE_PERMANENT)) {
+        struct libzsh_pool *pool = libzsh_pool_shared();
+
+        prog = dupeprog(prog, 0);
+        libzsh_pool_use(pool);
+    }
+
+    return prog;
+}
+
+Eprog libzsh_parse(libzsh_context *ctx, const char *buf, size_t len, int flags)
+{
+    Eprog prog;
+
+    libzsh_context_enter_shared(ctx);
+    prog = libzsh_parse_entered(buf, len, flags);
+    libzsh_context_leave(ctx);
+
+    return prog;
+}
+
+void libzsh_reset(libzsh_context *ctx)
+{
+    libzsh_context_enter_shared(ctx);
+    freeheap();
+    libzsh_context_leave(ctx);
+}
+
+char *libzsh_eprog_text(libzsh_context *ctx, Eprog prog)
+{
+    struct libzsh_pool *pool;
+    char *text;
+
+    /* text.c formats into static buffers, so this needs the lock too. */
+    libzsh_context_enter(ctx);
+    pool = libzsh_pool_shared();
+    text = getpermtext(prog, prog->prog, 0);
+    libzsh_pool_use(pool);
+    libzsh_context_leave(ctx);
+
+    return text;
+}
+
+void libzsh_eprog_release(libzsh_context *ctx, Eprog prog)
+{
+    libzsh_context_enter(ctx);
+    freeeprog(prog);
+    libzsh_context_leave(ctx);
+}
@@ -0,0 +1,418 @@
+/*
+ * libzsh_pattern.c - Matching one compiled pattern against many strings
+ *
+ * patcompile() turns a tokenized pattern into a program that pattry()
+ * runs over a metafied string.  To filter large numbers of strings we
+ * compile once and, before running the program, check literal text the
+ * pattern can't match without:
+ *
+ * - a prefix, if the pattern starts with literal characters;
+ * - a suffix, if it ends with them;
+ * - the longest literal run anywhere else, searched for with memchr()
+ *   (vectorized in the C library) and memcmp().
+ *
+ * Most strings in a typical filter fail one of these in a few
+ * instructions.  The literals are found by a conservative scan of the
+ * pattern text: anything that might be an operator (groups, brackets,
+ * numeric ranges, ksh-style and extended-glob operators) counts as a
+ * wildcard whatever the options, and patterns with alternation at the
+ * top level, negation or glob flags get no prefilter at all.  A string
+ * rejected by the prefilter can never match; everything else goes to
+ * the full matcher.
+ *
+ * Patterns made only of literals and stars -- literal, literal*,
+ * *literal, *literal*, literal*literal and * -- are matched by those
+ * checks alone and never reach the matcher.
+ *
+ * Strings are raw bytes; those containing bytes that need it are
+ * metafied into a buffer before matching.
+ */
+
+#include "libzsh_int.h"
+
+struct libzsh_pattern {
+    libzsh_context *ctx;        /* options the pattern was compiled under */
+    Patprog prog;
+    int kind;                   /* LIBZSH_PATTERN_*: how it is matched */
+    char *prefix, *suffix, *must;
+    size_t prefixlen, suffixlen, mustlen;
+    char *mbuf;                 /* metafied copy of the current string */
+    size_t mbufsz;
+};
+
+/* Literal runs of a pattern looked at for the prefilter */
+#define PATTERN_RUNS 16
+
+/*
+ * Literal runs of the pattern text, in order.  start/end say whether
+ * the first run begins the pattern and the last one ends it.
+ */
+struct pat_runs {
+    const char *text[PATTERN_RUNS];
+    size_t len[PATTERN_RUNS];
+    char *buf;                  /* runs with backslashes removed */
+    int n, start, end;
+    int lost;                   /* there were more than PATTERN_RUNS */
+    int stars;                  /* the only wildcard used is '*' */
+};
+
+/* Index after the bracket expression starting at p[i] == '[' */
+static size_t skip_bracket(const char *p, size_t len, size_t i)
+{
+    i++;
+    if (i < len && (p[i] == '!' || p[i] == '^'))
+        i++;
+    if (i < len && p[i] == ']')
+        i++;
+    while (i < len && p[i] != ']') {
+        if (p[i] == '[' && i + 1 < len && p[i + 1] == ':') {
+            /* [:class:], looked for only as far as the pattern goes */
+            size_t e;
+
+            for (e = i + 2; e + 1 < len; e++)
+                if (p[e] == ':' && p[e + 1] == ']')
+                    break;
+            if (e + 1 < len) {
+                i = e + 2;
+                continue;
+            }
+        }
+        if (p[i] == '\\' && i + 1 < len)
+            i++;
+        i++;
+    }
+    return i < len ? i + 1 : len;
+}
+
+/* Index after the group starting at p[i] == '(', or the closing char */
+static size_t skip_nested(const char *p, size_t len, size_t i,
+                          char open, char close)
+{
+    int depth = 0;
+
+    for (; i < len; i++) {
+        if (p[i] == '\\' && i + 1 < len)
+            i++;
+        else if (p[i] == '[' && open == '(')
+            i = skip_bracket(p, len, i) - 1;
+        else if (p[i] == open)
+            depth++;
+        else if (p[i] == close && !--depth)
+            return i + 1;
+    }
+    return len;
+}
+
+/*
+ * Split the pattern into literal runs.  Returns 0 if there must be no
+ * prefilter.
+ */
+static int pattern_runs(const char *p, size_t len, struct pat_runs *r)
+{
+    char *out = r->buf;
+    char *run = out;
+    size_t i = 0;
+    int wild = 0;               /* a wildcard came since the last run */
+
+    r->n = r->lost = 0;
+    r->start = r->end = r->stars = 1;
+
+#define END_RUN() do { \
+        if (out > run && r->n < PATTERN_RUNS) { \
+            r->text[r->n] = run; \
+            r->len[r->n++] = out - run; \
+        } else if (out > run) \
+            r->lost = 1; \
+        run = out; \
+    } while (0)
+#define WILDCARD() do { \
+        if (c != '*') \
+            r->stars = 0; \
+        END_RUN(); \
+        if (!r->n) \
+            r->start = 0; \
+        wild = 1; \
+    } while (0)
+
+    while (i < len) {
+        char c = p[i];
+
+        switch (c) {
+        case '|':
+        case '^':
+            return 0;
+        case '~':
+            /* What follows is excluded, not required */
+            WILDCARD();
+            i = len;
+            continue;
+        case '(':
+            if (i + 1 < len && p[i + 1] == '#')
+                return 0;
+            /* With KSH_GLOB, +( @( !( apply to the group */
+            if (out > run && strchr("+@!", out[-1]))
+                out--;
+            WILDCARD();
+            i = skip_nested(p, len, i, '(', ')');
+            continue;
+        case '#':
+            /* x# and x## make x optional or repeated */
+            if (out > run)
+                out--;
+            WILDCARD();
+            i++;
+            continue;
+        case '[':
+            WILDCARD();
+            i = skip_bracket(p, len, i);
+            continue;
+        case '<':
+            WILDCARD();
+            i = skip_nested(p, len, i, '<', '>');
+            continue;
+        case '*':
+        case '?':
+            WILDCARD();
+            i++;
+            continue;
+        case '\\':
+            if (++i == len)
+                return 0;
+            c = p[i];
+            break;
+        }
+        wild = 0;
+        *out++ = c;
+        i++;
+    }
+    END_RUN();
+    if (wild || r->lost)
+        r->end = 0;
+    return 1;
+
+#undef END_RUN
+#undef WILDCARD
+}
+
+static char *dupmem(const char *p, size_t len)
+{
+    char *s = (char *)zalloc(len + 1);
+
+    memcpy(s, p, len);
+    s[len] = '\0';
+    return s;
+}
+
+/* Choose the prefilter from the runs */
+static void pattern_prefilter(libzsh_pattern *pat, const char *p, size_t len)
+{
+    struct pat_runs r;
+    int first = 0, last, i, best = -1;
+
+    r.buf = (char *)zhalloc(len + 1);
+    if (!pattern_runs(p, len, &r))
+        return;
+
+    /*
+     * Literals and stars only: the checks below are the whole match.
+     * With one run and both ends anchored there is no wildcard at all.
+     */
+    if (r.stars && !r.lost) {
+        if (!r.n)
+            pat->kind = r.start ? LIBZSH_PATTERN_EXACT : LIBZSH_PATTERN_ANY;
+        else if (r.n == 1 && r.start)
+            pat->kind = r.end ? LIBZSH_PATTERN_EXACT : LIBZSH_PATTERN_PREFIX;
+        else if (r.n == 1)
+            pat->kind = r.end ? LIBZSH_PATTERN_SUFFIX :
+                LIBZSH_PATTERN_SUBSTRING;
+        else if (r.n == 2 && r.start && r.end)
+            pat->kind = LIBZSH_PATTERN_AFFIX;
+    }
+    if (!r.n)
+        return;
+    last = r.n - 1;
+
+    if (r.start) {
+        pat->prefix = dupmem(r.text[0], r.len[0]);
+        pat->prefixlen = r.len[0];
+        first = 1;
+    }
+    if (r.end && pat->kind != LIBZSH_PATTERN_EXACT && last >= first) {
+        pat->suffix = dupmem(r.text[last], r.len[last]);
+        pat->suffixlen = r.len[last];
+        last--;
+    }
+    for (i = first; i <= last; i++)
+        if (best < 0 || r.len[i] > r.len[best])
+            best = i;
+    if (best >= 0) {
+        pat->must = dupmem(r.text[best], r.len[best]);
+        pat->mustlen = r.len[best];
+    }
+}
+
+libzsh_pattern *libzsh_pattern_compile(libzsh_context *ctx, const char *pat,
+                                       size_t len)
+{
+    libzsh_pattern *p;
+    Patprog prog;
+    char *s;
+
+    libzsh_context_enter(ctx);
+    pushheap();
+    s = metafy((char *)pat, (int)len, META_HEAPDUP);
+    tokenize(s);
+    prog = patcompile(s, PAT_ZDUP, NULL);
+    errflag = 0;
+
+    if (!prog) {
+        popheap();
+        libzsh_context_leave(ctx);
+        return NULL;
+    }
+    p = (libzsh_pattern *)zshcalloc(sizeof(*p));
+    p->ctx = ctx;
+    p->prog = prog;
+    pattern_prefilter(p, pat, len);
+    popheap();
+    libzsh_context_leave(ctx);
+
+    return p;
+}
+
+void libzsh_pattern_free(libzsh_pattern *pat)
+{
+    if (!pat)
+        return;
+    libzsh_context_enter(pat->ctx);
+    freepatprog(pat->prog);
+    libzsh_context_leave(pat->ctx);
+    zsfree(pat->prefix);
+    zsfree(pat->suffix);
+    zsfree(pat->must);
+    if (pat->mbuf)
+        zfree(pat->mbuf, pat->mbufsz);
+    zfree(pat, sizeof(*pat));
+}
+
+static int contains(const char *s, size_t len, const char *lit, size_t llen)
+{
+    const char *p = s, *end;
+
+    if (llen > len)
+        return 0;
+    end = s + len - llen + 1;
+    while (p < end && (p = memchr(p, *lit, end - p))) {
+        if (!memcmp(p, lit, llen))
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+/*
+ * The literal checks alone: 0 if s can't match, 1 if it matches, 2 if
+ * the matcher has to decide.  Only reads the pattern, so any number of
+ * threads may call this without the context.
+ */
+int libzsh_pattern_prefilter(libzsh_pattern *pat, const char *s, size_t len)
+{
+    if (pat->prefixlen && (len < pat->prefixlen ||
+                           memcmp(s, pat->prefix, pat->prefixlen)))
+        return 0;
+    if (pat->kind == LIBZSH_PATTERN_EXACT)
+        return len == pat->prefixlen;
+    if (pat->suffixlen &&
+        (len < pat->prefixlen + pat->suffixlen ||
+         memcmp(s + len - pat->suffixlen, pat->suffix, pat->suffixlen)))
+        return 0;
+    if (pat->mustlen &&
+        !contains(s + pat->prefixlen, len - pat->prefixlen - pat->suffixlen,
+                  pat->must, pat->mustlen))
+        return 0;
+    return pat->kind == LIBZSH_PATTERN_GENERIC ? 2 : 1;
+}
+
+/* Run the matcher on s, which passed the prefilter; context entered */
+static int run_matcher(libzsh_pattern *pat, const char *s, size_t len)
+{
+    size_t i, mlen;
+    char *m;
+
+    /* pattry() wants metafied input */
+    for (i = 0, mlen = len; i < len; i++)
+        if (imeta(s[i]))
+            mlen++;
+    if (mlen == len)
+        return pattrylen(pat->prog, (char *)s, (int)len, (int)len, NULL, 0);
+
+    if (mlen + 1 > pat->mbufsz) {
+        if (pat->mbuf)
+            zfree(pat->mbuf, pat->mbufsz);
+        pat->mbufsz = mlen + 1 > 256 ? mlen + 1 : 256;
+        pat->mbuf = (char *)zalloc(pat->mbufsz);
+    }
+    for (i = 0, m = pat->mbuf; i < len; i++) {
+        if (imeta(s[i])) {
+            *m++ = Meta;
+            *m++ = s[i] ^ 32;
+        } else
+            *m++ = s[i];
+    }
+    *m = '\0';
+    return pattrylen(pat->prog, pat->mbuf, (int)mlen, (int)len, NULL, 0);
+}
+
+/* Match s with the context entered */
+int libzsh_pattern_match_entered(libzsh_pattern *pat, const char *s,
+                                 size_t len)
+{
+    int r = libzsh_pattern_prefilter(pat, s, len);
+
+    return r == 2 ? run_matcher(pat, s, len) : r;
+}
+
+int libzsh_pattern_match(libzsh_pattern *pat, const char *s, size_t len)
+{
+    int ret;
+
+    libzsh_context_enter(pat->ctx);
+    pushheap();
+    ret = libzsh_pattern_match_entered(pat, s, len);
+    popheap();
+    libzsh_context_leave(pat->ctx);
+
+    return ret;
+}
+
+/* Strings matched between heap resets */
+#define PATTERN_HEAP_BATCH 1024
+
+size_t libzsh_pattern_match_batch(libzsh_pattern *pat,
+                                  const char *const *strings, size_t n,
+                                  unsigned char *results)
+{
+    size_t i, matched = 0;
+
+    memset(results, 0, (n + 7) / 8);
+    libzsh_context_enter(pat->ctx);
+    pushheap();
+    for (i = 0; i < n; i++) {
+        if (libzsh_pattern_match_entered(pat, strings[i],
+                                         strlen(strings[i]))) {
+            results[i / 8] |= (unsigned char)(1 << (i % 8));
+            matched++;
+        }
+        if (i % PATTERN_HEAP_BATCH == PATTERN_HEAP_BATCH - 1)
+            freeheap();
+    }
+    popheap();
+    libzsh_context_leave(pat->ctx);
+
+    return matched;
+}
+
+int libzsh_pattern_kind(libzsh_pattern *pat)
+{
+    return pat->kind;
+}
@@ -0,0 +1,112 @@
+/*
+ * libzsh_phash.c - Lookups in the name sets fixed at build time
+ *
+ * The reserved words (hashtable.c), option names (options.c) and
+ * builtins (builtin.c) are all known when libzsh is built, yet zsh
+ * puts them into chained hash tables at startup and follows chains to
+ * find them.  gen_phash.sh reads them out of the sources and lays each
+ * set out as a perfect hash: one pass over the name, a displacement
+ * from a small array, and exactly one slot to compare against, whether
+ * the name is there or not.
+ *
+ * libzsh_is_reserved_word(), libzsh_is_builtin() and
+ * libzsh_option_lookup() answer from these tables alone, with nothing
+ * to construct and no context needed.  They say what zsh was built
+ * with; disable and enable, and builtins loaded from modules, don't
+ * change them.  The reserved word and option tables that zsh does
+ * build are indexed through them too (libzsh_hashtable_perfect()).
+ */
+
+#include "libzsh_int.h"
+
+struct ph_entry {
+    const char *name;           /* NULL: empty slot */
+    int value;
+};
+
+struct libzsh_phash {
+    const struct ph_entry *slots;
+    unsigned int nslots;
+    const unsigned short *disp;
+    unsigned int nbuckets;
+};
+
+#include "libzsh_phash.h"
+
+const struct libzsh_phash libzsh_phash_reswd = PH_RESWD_TABLE;
+const struct libzsh_phash libzsh_phash_option = PH_OPTION_TABLE;
+const struct libzsh_phash libzsh_phash_builtin = PH_BUILTIN_TABLE;
+
+/* The high bits of x scaled to 0 .. n-1 */
+static unsigned int ph_range(unsigned int x, unsigned int n)
+{
+    return (unsigned int)(((zulong)x * n) >> 32);
+}
+
+/*
+ * The slot of name in ph, or -1 if it isn't one of ph's names.
+ * Must hash as gen_phash.sh does.
+ */
+int libzsh_phash_find(const struct libzsh_phash *ph, const char *name)
+{
+    const unsigned char *p = (const unsigned char *)name;
+    unsigned int h = 5381, b, m, i;
+
+    for (; *p; p++)
+        h = h * 33 + *p;
+    b = ph_range(h * PH_BUCKET_MULT, ph->nbuckets);
+    m = PH_SLOT_MULT * (2 * (unsigned int)ph->disp[b] + 1);
+    i = ph_range(h * m, ph->nslots);
+    if (ph->slots[i].name && !strcmp(ph->slots[i].name, name))
+        return (int)i;
+    return -1;
+}
+
+unsigned int libzsh_phash_slots(const struct libzsh_phash *ph)
+{
+    return ph->nslots;
+}
+
+/*
+ * Static queries
+ */
+
+int libzsh_is_reserved_word(const char *name)
+{
+    return name && libzsh_phash_find(&libzsh_phash_reswd, name) >= 0;
+}
+
+int libzsh_is_builtin(const char *name)
+{
+    return name && libzsh_phash_find(&libzsh_phash_builtin, name) >= 0;
+}
+
+/*
+ * As optlookup() does: case and underscores don't matter, and a "no"
+ * in front (tried first) gives the option's number negated.  Returns
+ * 0 (OPT_INVALID) for a name that isn't an option.
+ */
+int libzsh_option_lookup(const char *name)
+{
+    char buf[64];
+    size_t len = 0;
+    int i;
+
+    if (!name)
+        return 0;
+    for (; *name; name++) {
+        if (*name == '_')
+            continue;
+        if (len == sizeof(buf) - 1)
+            return 0;
+        buf[len++] = (char)tulower((unsigned char)*name);
+    }
+    buf[len] = '\0';
+
+    if (buf[0] == 'n' && buf[1] == 'o' &&
+        (i = libzsh_phash_find(&libzsh_phash_option, buf + 2)) >= 0)
+        return -libzsh_phash_option.slots[i].value;
+    if ((i = libzsh_phash_find(&libzsh_phash_option, buf)) >= 0)
+        return libzsh_phash_option.slots[i].value;
+    return 0;
+}
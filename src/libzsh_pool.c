@@ -0,0 +1,423 @@
+/*
+ * libzsh_pool.c - Size-class pools behind zalloc() and zfree()
+ *
+ * zsh's permanent allocations (zalloc(), zshcalloc(), ztrdup() and
+ * everything built on them) go to malloc() one at a time, and most of
+ * them are small: hash and list nodes, short strings.  With
+ * LIBZSH_POOL_ALLOC, mem.c is compiled with its allocators renamed to
+ * zsh_sys_*() and the ones here take their place.  zle_utils.c, which
+ * frees and grows the line with free() and realloc(), is compiled to
+ * call zsh_sys_*() (and libzsh_sys_ztrdup()) instead.
+ *
+ * Blocks of up to POOL_MAX bytes come from chunks of POOL_CHUNK bytes,
+ * each cut into blocks of one size class.  Every block starts with a
+ * header naming its chunk (or none, for blocks passed on to malloc(),
+ * which name their pool before that), so zfree() and zrealloc() never
+ * depend on the size their callers pass.  A chunk keeps its own free
+ * list, allocation takes the first chunk of the class with room, and a
+ * chunk emptied by a free is given back unless it is the last one of
+ * its class with room.
+ *
+ * Each context has a pool of its own, used while the calling thread
+ * has it entered; the rest of the time the shared pool is.  Freeing a
+ * context frees its pool's chunks and large blocks whole, without
+ * visiting a block, so whatever zsh allocated while it was entered goes
+ * with it.  What libzsh keeps beyond a context (parameter values,
+ * permanent and cached programs, what an image defines, text handed to
+ * the caller) is allocated from the shared pool, by switching to it
+ * with libzsh_pool_shared() around the allocation.
+ *
+ * Each pool has a lock of its own.  zalloc() takes that of the thread's
+ * current pool, which for a context only the thread that entered it
+ * uses; zfree() takes that of the pool the block came from, found in
+ * the block's header, so a block goes back where it came from whichever
+ * pool is current.  No pool lock is held while taking another.
+ */
+
+#include <pthread.h>
+
+#include "libzsh_int.h"
+
+#ifdef LIBZSH_POOL_ALLOC
+
+/* mem.c's allocators, renamed */
+extern void *zsh_sys_zalloc(size_t size);
+extern void zsh_sys_zfree(void *p, int sz);
+
+#define POOL_CHUNK (64 * 1024)
+#define POOL_MAX   256              /* largest block served from a chunk */
+#define POOL_HEAD  16               /* header; keeps blocks 16-aligned */
+
+static const unsigned int class_size[LIBZSH_ALLOC_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+/* Class of a request of up to POOL_MAX bytes, by 16-byte units */
+static unsigned char class_of[POOL_MAX / 16 + 1];
+
+struct pool_chunk {
+    struct libzsh_pool *pool;
+    struct pool_chunk *next, *prev;     /* all the pool's chunks */
+    struct pool_chunk *anext, *aprev;   /* those of the class with room */
+    void *free;                         /* freed blocks */
+    char *bump, *end;                   /* blocks never handed out */
+    unsigned int cls, live, avail;      /* avail: on the class list */
+};
+
+struct pool_head {
+    struct pool_chunk *chunk;           /* NULL: from malloc() */
+    size_t size;                        /* usable bytes */
+};
+
+/* Before the header of a block passed on to malloc() */
+struct pool_large {
+    struct pool_large *next, *prev;     /* all the pool's large blocks */
+    struct libzsh_pool *pool;
+    size_t pad;                         /* keeps blocks 16-aligned */
+};
+
+struct libzsh_pool {
+    pthread_mutex_t lock;
+    struct pool_chunk *chunks;
+    struct pool_chunk *avail[LIBZSH_ALLOC_CLASSES];
+    struct pool_large *large;
+    struct libzsh_alloc_stats stats;
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static struct libzsh_pool shared_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static _Thread_local struct libzsh_pool *pool_current = &shared_pool;
+
+static void pool_init(void)
+{
+    unsigned int u, c = 0;
+
+    for (u = 0; u <= POOL_MAX / 16; u++) {
+        while (class_size[c] < u * 16)
+            c++;
+        class_of[u] = (unsigned char)c;
+    }
+    for (c = 0; c < LIBZSH_ALLOC_CLASSES; c++)
+        shared_pool.stats.class_size[c] = class_size[c];
+}
+
+#define HEAD(p) ((struct pool_head *)((char *)(p) - POOL_HEAD))
+#define LARGE(h) ((struct pool_large *)(h) - 1)
+#define LARGE_SIZE(size) (sizeof(struct pool_large) + POOL_HEAD + (size))
+
+/* The pool a block came from */
+static struct libzsh_pool *block_pool(struct pool_head *h)
+{
+    return h->chunk ? h->chunk->pool : LARGE(h)->pool;
+}
+
+static void avail_add(struct libzsh_pool *pool, struct pool_chunk *ch)
+{
+    ch->aprev = NULL;
+    ch->anext = pool->avail[ch->cls];
+    if (ch->anext)
+        ch->anext->aprev = ch;
+    pool->avail[ch->cls] = ch;
+    ch->avail = 1;
+}
+
+static void avail_del(struct libzsh_pool *pool, struct pool_chunk *ch)
+{
+    if (ch->aprev)
+        ch->aprev->anext = ch->anext;
+    else
+        pool->avail[ch->cls] = ch->anext;
+    if (ch->anext)
+        ch->anext->aprev = ch->aprev;
+    ch->avail = 0;
+}
+
+static struct pool_chunk *chunk_new(struct libzsh_pool *pool, unsigned int cls)
+{
+    struct pool_chunk *ch = (struct pool_chunk *)zsh_sys_zalloc(POOL_CHUNK);
+    size_t off = (sizeof(*ch) + POOL_HEAD - 1) / POOL_HEAD * POOL_HEAD;
+
+    memset(ch, 0, sizeof(*ch));
+    ch->pool = pool;
+    ch->cls = cls;
+    ch->bump = (char *)ch + off;
+    ch->end = (char *)ch + POOL_CHUNK;
+    ch->next = pool->chunks;
+    if (ch->next)
+        ch->next->prev = ch;
+    pool->chunks = ch;
+    avail_add(pool, ch);
+    pool->stats.chunks++;
+    pool->stats.chunks_made++;
+    return ch;
+}
+
+static void chunk_free(struct pool_chunk *ch)
+{
+    struct libzsh_pool *pool = ch->pool;
+
+    if (ch->avail)
+        avail_del(pool, ch);
+    if (ch->prev)
+        ch->prev->next = ch->next;
+    else
+        pool->chunks = ch->next;
+    if (ch->next)
+        ch->next->prev = ch->prev;
+    pool->stats.chunks--;
+    zsh_sys_zfree(ch, POOL_CHUNK);
+}
+
+/* A block of at least size bytes; called with pool's lock held */
+static void *pool_get(struct libzsh_pool *pool, size_t size)
+{
+    struct pool_head *h;
+
+    pool->stats.allocs++;
+    if (size > POOL_MAX) {
+        struct pool_large *l =
+            (struct pool_large *)zsh_sys_zalloc(LARGE_SIZE(size));
+
+        l->pool = pool;
+        l->prev = NULL;
+        l->next = pool->large;
+        if (l->next)
+            l->next->prev = l;
+        pool->large = l;
+        h = (struct pool_head *)(l + 1);
+        h->chunk = NULL;
+        h->size = size;
+        pool->stats.large++;
+    } else {
+        unsigned int cls = class_of[(size + 15) / 16];
+        size_t bsize = POOL_HEAD + class_size[cls];
+        struct pool_chunk *ch = pool->avail[cls];
+
+        if (!ch)
+            ch = chunk_new(pool, cls);
+        if (ch->free) {
+            h = (struct pool_head *)ch->free;
+            ch->free = *(void **)ch->free;
+        } else {
+            h = (struct pool_head *)ch->bump;
+            ch->bump += bsize;
+        }
+        if (!ch->free && ch->bump + bsize > ch->end)
+            avail_del(pool, ch);
+        h->chunk = ch;
+        h->size = class_size[cls];
+        ch->live++;
+        pool->stats.live[cls]++;
+    }
+    return (char *)h + POOL_HEAD;
+}
+
+/* Give back p, from pool; called with pool's lock held */
+static void pool_put(struct libzsh_pool *pool, void *p)
+{
+    struct pool_head *h = HEAD(p);
+    struct pool_chunk *ch = h->chunk;
+    struct pool_chunk *other;
+
+    pool->stats.frees++;
+    if (!ch) {
+        struct pool_large *l = LARGE(h);
+
+        if (l->prev)
+            l->prev->next = l->next;
+        else
+            pool->large = l->next;
+        if (l->next)
+            l->next->prev = l->prev;
+        zsh_sys_zfree(l, LARGE_SIZE(h->size));
+        return;
+    }
+    pool->stats.live[ch->cls]--;
+    *(void **)h = ch->free;
+    ch->free = h;
+    /* Keep an empty chunk only if the class has no other with room */
+    other = pool->avail[ch->cls] == ch ? ch->anext : pool->avail[ch->cls];
+    if (!--ch->live && other)
+        chunk_free(ch);
+    else if (!ch->avail)
+        avail_add(pool, ch);
+}
+
+/*
+ * The allocators
+ */
+
+void *zalloc(size_t size)
+{
+    struct libzsh_pool *pool = pool_current;
+    void *p;
+
+    pthread_once(&pool_once, pool_init);
+    pthread_mutex_lock(&pool->lock);
+    p = pool_get(pool, size ? size : 1);
+    pthread_mutex_unlock(&pool->lock);
+    return p;
+}
+
+void *zshcalloc(size_t size)
+{
+    void *p = zalloc(size);
+
+    memset(p, 0, size ? size : 1);
+    return p;
+}
+
+void *zrealloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (!ptr)
+        return size ? zalloc(size) : NULL;
+    if (!size) {
+        zfree(ptr, 0);
+        return NULL;
+    }
+    /* Still fits its class (or fills its malloc() block) */
+    if (size <= HEAD(ptr)->size &&
+        (HEAD(ptr)->chunk || size == HEAD(ptr)->size))
+        return ptr;
+    p = zalloc(size);
+    memcpy(p, ptr, size < HEAD(ptr)->size ? size : HEAD(ptr)->size);
+    zfree(ptr, 0);
+    return p;
+}
+
+void zfree(void *p, UNUSED(int sz))
+{
+    struct libzsh_pool *pool;
+
+    if (!p)
+        return;
+    pool = block_pool(HEAD(p));
+    pthread_mutex_lock(&pool->lock);
+    pool_put(pool, p);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void zsfree(char *p)
+{
+    zfree(p, 0);
+}
+
+/* ztrdup() for zle_utils.c, from mem.c's zalloc() */
+char *libzsh_sys_ztrdup(const char *s)
+{
+    char *t;
+
+    if (!s)
+        return NULL;
+    t = (char *)zsh_sys_zalloc(strlen(s) + 1);
+    strcpy(t, s);
+    return t;
+}
+
+/*
+ * Context pools
+ */
+
+struct libzsh_pool *libzsh_pool_new(void)
+{
+    struct libzsh_pool *pool;
+    unsigned int c;
+
+    pthread_once(&pool_once, pool_init);
+    pool = (struct libzsh_pool *)zsh_sys_zalloc(sizeof(*pool));
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    for (c = 0; c < LIBZSH_ALLOC_CLASSES; c++)
+        pool->stats.class_size[c] = class_size[c];
+    return pool;
+}
+
+/* Allocate from pool (the shared pool if NULL) on this thread from now on */
+void libzsh_pool_use(struct libzsh_pool *pool)
+{
+    pool_current = pool ? pool : &shared_pool;
+}
+
+/* Allocate from the shared pool; returns the pool to go back to */
+struct libzsh_pool *libzsh_pool_shared(void)
+{
+    struct libzsh_pool *pool = pool_current;
+
+    pool_current = &shared_pool;
+    return pool;
+}
+
+/* Whether p, from zalloc(), came from the shared pool */
+int libzsh_pool_is_shared(void *p)
+{
+    return block_pool(HEAD(p)) == &shared_pool;
+}
+
+/* Free pool and every block still allocated from it */
+void libzsh_pool_free(struct libzsh_pool *pool)
+{
+    struct pool_chunk *ch, *next;
+    struct pool_large *l, *lnext;
+
+    if (!pool)
+        return;
+    if (pool_current == pool)
+        pool_current = &shared_pool;
+    for (ch = pool->chunks; ch; ch = next) {
+        next = ch->next;
+        zsh_sys_zfree(ch, POOL_CHUNK);
+    }
+    for (l = pool->large; l; l = lnext) {
+        lnext = l->next;
+        zsh_sys_zfree(l, LARGE_SIZE(((struct pool_head *)(l + 1))->size));
+    }
+    pthread_mutex_destroy(&pool->lock);
+    zsh_sys_zfree(pool, sizeof(*pool));
+}
+
+int libzsh_alloc_stats(libzsh_context *ctx, struct libzsh_alloc_stats *st)
+{
+    struct libzsh_pool *pool = ctx ? ctx->pool : &shared_pool;
+
+    pthread_once(&pool_once, pool_init);
+    pthread_mutex_lock(&pool->lock);
+    *st = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+#else /* !LIBZSH_POOL_ALLOC */
+
+struct libzsh_pool *libzsh_pool_new(void)
+{
+    return NULL;
+}
+
+void libzsh_pool_use(UNUSED(struct libzsh_pool *pool))
+{
+}
+
+struct libzsh_pool *libzsh_pool_shared(void)
+{
+    return NULL;
+}
+
+int libzsh_pool_is_shared(UNUSED(void *p))
+{
+    return 1;
+}
+
+void libzsh_pool_free(UNUSED(struct libzsh_pool *pool))
+{
+}
+
+int libzsh_alloc_stats(UNUSED(libzsh_context *ctx),
+                       struct libzsh_alloc_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    return -1;
+}
+
+#endif /* LIBZSH_POOL_ALLOC */
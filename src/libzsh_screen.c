@@ -0,0 +1,496 @@
+/*
+ * libzsh_screen.c - Damage-tracked redisplay of a prompt and edit line
+ *
+ * Each frame is laid out into a grid of cells, one per terminal column,
+ * and compared with the grid drawn by the previous frame.  Only the
+ * span of each row between its first and last changed cell is written,
+ * and the row is cleared to the end only if it got shorter.  Output
+ * goes into one buffer that is handed to the sink at the end, so a
+ * frame costs at most one write().
+ *
+ * Like zle_refresh.c this only moves the cursor relatively (CR, and
+ * the ANSI up/down/left/right sequences), so it works wherever the
+ * drawing starts.  Rows are created below the region with CR-LF so the
+ * terminal scrolls if it has to; afterwards they can be reached with
+ * cursor-down.  Writing the last column leaves the terminal in the
+ * "pending wrap" state, which we get out of with a CR before moving.
+ */
+
+#include "libzsh_int.h"
+
+#ifdef MULTIBYTE_SUPPORT
+# include <wchar.h>
+#endif
+
+/*
+ * One screen cell.  A cell with len 0 is either empty (width 0) or the
+ * right half of a double-width character (width 2).
+ */
+struct screen_cell {
+    char ch[6];                 /* the character, combining marks included */
+    unsigned char len;
+    unsigned char width;
+};
+
+#define CELL_ESC_MAX 16         /* longest escape sequence we emit */
+
+struct libzsh_screen {
+    libzsh_output_fn out;
+    void *data;
+    int cols;
+    struct screen_cell *shown;  /* what the terminal shows */
+    struct screen_cell *next;   /* the frame being built */
+    int shownrows, nextrows;    /* rows in use in each grid */
+    int gridrows;               /* rows allocated in each grid */
+    int currow, curcol;         /* terminal cursor, region relative */
+    int drawn;                  /* rows that exist below the origin */
+    int fresh;                  /* terminal contents unknown */
+    char *buf;                  /* output for this frame */
+    size_t buflen, bufsz;
+};
+
+libzsh_screen *libzsh_screen_new(int cols, libzsh_output_fn out, void *data)
+{
+    libzsh_screen *s;
+
+    if (cols < 1 || !out)
+        return NULL;
+    s = (libzsh_screen *)zshcalloc(sizeof(*s));
+    s->out = out;
+    s->data = data;
+    s->cols = cols;
+    s->fresh = 1;
+    return s;
+}
+
+static void grids_free(libzsh_screen *s)
+{
+    if (s->gridrows) {
+        size_t sz = (size_t)s->gridrows * s->cols * sizeof(struct screen_cell);
+
+        zfree(s->shown, sz);
+        zfree(s->next, sz);
+    }
+    s->shown = s->next = NULL;
+    s->gridrows = s->shownrows = s->nextrows = 0;
+}
+
+void libzsh_screen_free(libzsh_screen *s)
+{
+    if (!s)
+        return;
+    grids_free(s);
+    if (s->buf)
+        zfree(s->buf, s->bufsz);
+    zfree(s, sizeof(*s));
+}
+
+void libzsh_screen_reset(libzsh_screen *s)
+{
+    s->fresh = 1;
+}
+
+void libzsh_screen_resize(libzsh_screen *s, int cols)
+{
+    if (cols < 1)
+        return;
+    if (cols != s->cols) {
+        grids_free(s);
+        s->cols = cols;
+    }
+    s->fresh = 1;
+}
+
+/* Make sure both grids have at least rows rows, keeping their contents */
+static void grids_reserve(libzsh_screen *s, int rows)
+{
+    size_t rowsz = (size_t)s->cols * sizeof(struct screen_cell);
+    struct screen_cell *o, *n;
+    int sz = s->gridrows ? s->gridrows : 4;
+
+    if (rows <= s->gridrows)
+        return;
+    while (sz < rows)
+        sz *= 2;
+    o = (struct screen_cell *)zshcalloc(sz * rowsz);
+    n = (struct screen_cell *)zshcalloc(sz * rowsz);
+    if (s->gridrows) {
+        memcpy(o, s->shown, s->gridrows * rowsz);
+        memcpy(n, s->next, s->gridrows * rowsz);
+        zfree(s->shown, s->gridrows * rowsz);
+        zfree(s->next, s->gridrows * rowsz);
+    }
+    s->shown = o;
+    s->next = n;
+    s->gridrows = sz;
+}
+
+#define CELL(s, g, r, c) ((s)->g[(size_t)(r) * (s)->cols + (c)])
+
+/*
+ * Output buffer
+ */
+
+static void out_add(libzsh_screen *s, const char *p, size_t n)
+{
+    if (s->buflen + n > s->bufsz) {
+        size_t sz = s->bufsz ? s->bufsz : 256;
+        char *nb;
+
+        while (sz < s->buflen + n)
+            sz *= 2;
+        nb = (char *)zalloc(sz);
+        if (s->buflen)
+            memcpy(nb, s->buf, s->buflen);
+        if (s->buf)
+            zfree(s->buf, s->bufsz);
+        s->buf = nb;
+        s->bufsz = sz;
+    }
+    memcpy(s->buf + s->buflen, p, n);
+    s->buflen += n;
+}
+
+/* "ESC [ n c", with n omitted when it is 1; returns the length */
+static int csi(char *p, int n, char c)
+{
+    if (n == 1)
+        return sprintf(p, "\033[%c", c);
+    return sprintf(p, "\033[%d%c", n, c);
+}
+
+static void out_csi(libzsh_screen *s, int n, char c)
+{
+    char esc[CELL_ESC_MAX];
+
+    out_add(s, esc, csi(esc, n, c));
+}
+
+/*
+ * Layout
+ */
+
+struct layout {
+    int row, col;               /* next free cell */
+    int crow, ccol;             /* where the cursor goes */
+};
+
+/* Start a new row if the current one is full */
+static void layout_wrap(libzsh_screen *s, struct layout *lo, int width)
+{
+    if (lo->col + width > s->cols) {
+        /* Pad out a double-width character that doesn't fit */
+        while (lo->col < s->cols) {
+            grids_reserve(s, lo->row + 1);
+            CELL(s, next, lo->row, lo->col).ch[0] = ' ';
+            CELL(s, next, lo->row, lo->col).len = 1;
+            CELL(s, next, lo->row, lo->col).width = 1;
+            lo->col++;
+        }
+        lo->row++;
+        lo->col = 0;
+    }
+    grids_reserve(s, lo->row + 1);
+}
+
+static void layout_put(libzsh_screen *s, struct layout *lo,
+                       const char *p, int n, int width)
+{
+    struct screen_cell *cell;
+
+    if (width == 0) {
+        /* A combining character joins the previous cell, if there is room */
+        if (lo->col > 0) {
+            cell = &CELL(s, next, lo->row, lo->col - 1);
+            if (cell->len == 0 && lo->col > 1)
+                cell--;
+            if (cell->len + n <= (int)sizeof(cell->ch)) {
+                memcpy(cell->ch + cell->len, p, n);
+                cell->len += n;
+            }
+        }
+        return;
+    }
+    layout_wrap(s, lo, width);
+    cell = &CELL(s, next, lo->row, lo->col);
+    memcpy(cell->ch, p, n);
+    cell->len = n;
+    cell->width = width;
+    if (width == 2) {
+        cell[1].len = 0;
+        cell[1].width = 2;
+    }
+    lo->col += width;
+}
+
+/*
+ * Lay out len bytes of text.  If cursor is not (size_t)-1, the cursor
+ * position is recorded when the byte at that offset is reached.
+ */
+static void layout_text(libzsh_screen *s, struct layout *lo,
+                        const char *text, size_t len, size_t cursor)
+{
+    size_t i = 0;
+#ifdef MULTIBYTE_SUPPORT
+    mbstate_t mbs;
+
+    memset(&mbs, 0, sizeof(mbs));
+#endif
+
+    for (;;) {
+        unsigned char c;
+        int n = 1, width = 1;
+
+        if (i == cursor) {
+            /* Cursor after a full row goes at the start of the next */
+            if (lo->col >= s->cols) {
+                lo->crow = lo->row + 1;
+                lo->ccol = 0;
+            } else {
+                lo->crow = lo->row;
+                lo->ccol = lo->col;
+            }
+        }
+        if (i >= len)
+            break;
+
+        c = (unsigned char)text[i];
+        if (c == '\n') {
+            lo->row++;
+            lo->col = 0;
+            i++;
+            continue;
+        } else if (c == '\t') {
+            int stop;
+
+            layout_wrap(s, lo, 1);
+            stop = (lo->col / 8 + 1) * 8;
+            if (stop > s->cols)
+                stop = s->cols;
+            while (lo->col < stop)
+                layout_put(s, lo, " ", 1, 1);
+            i++;
+            continue;
+        } else if (c < 0x20 || c == 0x7f) {
+            char ctl[2];
+
+            ctl[0] = '^';
+            ctl[1] = (char)(c ^ 0x40);
+            layout_put(s, lo, ctl, 1, 1);
+            layout_put(s, lo, ctl + 1, 1, 1);
+            i++;
+            continue;
+        }
+#ifdef MULTIBYTE_SUPPORT
+        if (c >= 0x80) {
+            wchar_t wc;
+            size_t ret = mbrtowc(&wc, text + i, len - i, &mbs);
+
+            if (ret == (size_t)-1 || ret == (size_t)-2 || ret == 0 ||
+                ret > sizeof(((struct screen_cell *)0)->ch) ||
+                (width = wcwidth(wc)) < 0 || width > 2) {
+                /* Show what we can't decode as a question mark */
+                memset(&mbs, 0, sizeof(mbs));
+                layout_put(s, lo, "?", 1, 1);
+                i++;
+                continue;
+            }
+            n = (int)ret;
+        }
+#endif
+        layout_put(s, lo, text + i, n, width);
+        i += n;
+    }
+}
+
+/*
+ * Output of a frame
+ */
+
+static int cell_same(const struct screen_cell *a, const struct screen_cell *b)
+{
+    return a->len == b->len && a->width == b->width &&
+        memcmp(a->ch, b->ch, a->len) == 0;
+}
+
+/* Columns in use in a row of a grid */
+static int row_end(libzsh_screen *s, struct screen_cell *grid, int r)
+{
+    int c = s->cols;
+
+    while (c > 0 && grid[(size_t)r * s->cols + c - 1].len == 0 &&
+           grid[(size_t)r * s->cols + c - 1].width == 0)
+        c--;
+    return c;
+}
+
+/* Write one cell of the new grid at the cursor */
+static void out_cell(libzsh_screen *s, const struct screen_cell *cell)
+{
+    if (cell->len == 0) {
+        if (cell->width == 0) {
+            out_add(s, " ", 1);
+            s->curcol++;
+        }
+        return;
+    }
+    out_add(s, cell->ch, cell->len);
+    s->curcol += cell->width;
+}
+
+static void move_to(libzsh_screen *s, int row, int col)
+{
+    char esc[CELL_ESC_MAX];
+
+    /*
+     * Leave the pending wrap state, unless the CR-LF that adds a row
+     * below is going to do it anyway.
+     */
+    if (s->curcol >= s->cols &&
+        !(row >= s->drawn && s->currow == s->drawn - 1)) {
+        out_add(s, "\r", 1);
+        s->curcol = 0;
+    }
+
+    if (row < s->currow)
+        out_csi(s, s->currow - row, 'A');
+    else if (row > s->currow) {
+        if (row < s->drawn)
+            out_csi(s, row - s->currow, 'B');
+        else {
+            if (s->currow < s->drawn - 1)
+                out_csi(s, s->drawn - 1 - s->currow, 'B');
+            for (; s->drawn <= row; s->drawn++)
+                out_add(s, "\r\n", 2);
+            s->curcol = 0;
+        }
+    }
+    s->currow = row;
+
+    if (col == s->curcol)
+        return;
+    if (col == 0)
+        out_add(s, "\r", 1);
+    else if (col < s->curcol) {
+        int left = csi(esc, s->curcol - col, 'D');
+
+        if (1 + csi(esc, col, 'C') < left) {
+            out_add(s, "\r", 1);
+            out_csi(s, col, 'C');
+        } else
+            out_csi(s, s->curcol - col, 'D');
+    } else {
+        /*
+         * The cells we'd skip are already right on the screen, so
+         * writing them again may be shorter than the escape sequence.
+         */
+        int right = csi(esc, col - s->curcol, 'C'), bytes = 0, c;
+
+        for (c = s->curcol; c < col && bytes < right; c++) {
+            const struct screen_cell *cell = &CELL(s, next, row, c);
+
+            if (cell->width != 1 || cell->len == 0)
+                bytes = right;
+            else
+                bytes += cell->len;
+        }
+        if (bytes < right) {
+            for (c = s->curcol; c < col; c++)
+                out_cell(s, &CELL(s, next, row, c));
+        } else
+            out_add(s, esc, right);
+    }
+    s->curcol = col;
+}
+
+int libzsh_screen_frame(libzsh_screen *s, const char *prompt, size_t plen,
+                        const char *line, size_t llen, size_t cursor)
+{
+    struct layout lo;
+    struct screen_cell *tmp;
+    int r, ret = 0;
+
+    memset(&lo, 0, sizeof(lo));
+    grids_reserve(s, 1);
+    memset(s->next, 0, (size_t)s->gridrows * s->cols * sizeof(*s->next));
+    if (cursor > llen)
+        cursor = llen;
+    layout_text(s, &lo, prompt, plen, (size_t)-1);
+    layout_text(s, &lo, line, llen, cursor);
+    s->nextrows = (lo.col ? lo.row : lo.row - 1) + 1;
+    if (s->nextrows <= lo.crow)
+        s->nextrows = lo.crow + 1;
+    grids_reserve(s, s->nextrows);
+
+    if (s->fresh) {
+        /* Start over on the cursor's row */
+        out_add(s, "\r\033[J", 4);
+        s->currow = s->curcol = 0;
+        s->drawn = 1;
+        memset(s->shown, 0, (size_t)s->gridrows * s->cols * sizeof(*s->shown));
+        s->shownrows = 0;
+        s->fresh = 0;
+    }
+
+    for (r = 0; r < s->nextrows; r++) {
+        int nend = row_end(s, s->next, r), c0, c1, c;
+
+        for (c0 = 0; c0 < s->cols; c0++)
+            if (!cell_same(&CELL(s, shown, r, c0), &CELL(s, next, r, c0)))
+                break;
+        if (c0 == s->cols)
+            continue;
+        for (c1 = s->cols - 1; c1 > c0; c1--)
+            if (!cell_same(&CELL(s, shown, r, c1), &CELL(s, next, r, c1)))
+                break;
+
+        /* Don't start on the right half of a wide character */
+        if (c0 > 0 && CELL(s, next, r, c0).len == 0 &&
+            CELL(s, next, r, c0).width == 2)
+            c0--;
+
+        move_to(s, r, c0);
+        for (c = c0; c <= c1 && c < nend; c++)
+            out_cell(s, &CELL(s, next, r, c));
+        /* The row got shorter */
+        if (c1 >= nend)
+            out_add(s, "\033[K", 3);
+    }
+
+    if (s->shownrows > s->nextrows) {
+        move_to(s, s->nextrows, 0);
+        out_add(s, "\033[J", 3);
+    }
+    move_to(s, lo.crow, lo.ccol);
+
+    tmp = s->shown;
+    s->shown = s->next;
+    s->next = tmp;
+    s->shownrows = s->nextrows;
+
+    if (s->buflen) {
+        libzsh_trace_refresh_bytes(s->buflen);
+        if (s->out(s->data, s->buf, s->buflen) < 0) {
+            s->fresh = 1;
+            ret = -1;
+        }
+        s->buflen = 0;
+    }
+    return ret;
+}
+
+int libzsh_screen_finish(libzsh_screen *s)
+{
+    int ret = 0;
+
+    if (!s->fresh) {
+        move_to(s, s->shownrows - 1, 0);
+        out_add(s, "\n", 1);
+        libzsh_trace_refresh_bytes(s->buflen);
+        if (s->out(s->data, s->buf, s->buflen) < 0)
+            ret = -1;
+        s->buflen = 0;
+    }
+    s->fresh = 1;
+    return ret;
+}
@@ -0,0 +1,89 @@
+/*
+ * libzsh_stream.c - Parsing a script from a file descriptor
+ *
+ * This is the shell's own script-reading path: with strin clear, the
+ * lexer pulls more input through inputline() and shingetline(), which
+ * read SHIN a buffer at a time and hand the lexer one line at a time.
+ * As in loop() in init.c, parse_event() is called repeatedly to get one
+ * top-level list per call, and each list's heap is recycled once the
+ * caller has seen it.  The shell input buffer is saved and restored
+ * around the parse just as source does.
+ */
+
+#include "libzsh_int.h"
+
+int libzsh_parse_fd(libzsh_context *ctx, int fd, int flags,
+                    libzsh_event_fn fn, void *data, long *errline)
+{
+    int oshin, ostrin, onoerrs, ret = 0;
+    Eprog prog;
+    zlong start;
+
+    libzsh_context_enter(ctx);
+
+    oshin = SHIN;
+    ostrin = strin;
+    onoerrs = noerrs;
+
+    SHIN = fd;
+    strin = 0;
+    shinbufsave();
+    if (flags & LIBZSH_PARSE_QUIET)
+        noerrs = 1;
+    errflag = 0;
+    lineno = 1;
+    lexinit();
+
+    /*
+     * inputline() installs each line it reads in the top input stack
+     * entry; give it one of our own so the last line is freed by inpop().
+     */
+    inpush((char *)"", 0, NULL);
+
+    for (;;) {
+        freeheap();
+
+        isfirstln = 1;
+        start = lineno;
+        if (!(prog = parse_event(ENDINPUT))) {
+            /* As loop() does: end of input, an error, or a blank line */
+            if (tok == ENDINPUT && !errflag)
+                break;
+            if (tok == LEXERR || errflag) {
+                if (errline)
+                    *errline = (long)lineno;
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        if (empty_eprog(prog)) {
+            if (lexstop)
+                break;
+            continue;
+        }
+
+        if (flags & LIBZSH_PARSE_PERMANENT) {
+            struct libzsh_pool *pool = libzsh_pool_shared();
+
+            prog = dupeprog(prog, 0);
+            libzsh_pool_use(pool);
+        }
+        if ((ret = fn(data, prog, (long)start)))
+            break;
+        if (lexstop)
+            break;
+    }
+
+    inpop();
+    freeheap();
+    shinbufrestore();
+    errflag = 0;
+    noerrs = onoerrs;
+    strin = ostrin;
+    SHIN = oshin;
+
+    libzsh_context_leave(ctx);
+
+    return ret;
+}
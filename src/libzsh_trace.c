@@ -0,0 +1,388 @@
+/*
+ * libzsh_trace.c - Counters and call tracing for the hot paths
+ *
+ * With LIBZSH_TRACE, lex.c, parse.c, pattern.c, glob.c and
+ * zle_refresh.c are compiled with zshlex(), ctxtlex(), parse_list(),
+ * parse_event(), patcompile(), zglob() and zrefresh() renamed to
+ * zsh_untraced_*(), and the functions here take their place: they count
+ * tokens and wordcode, time the call and hand it to the context's hook
+ * and recorder.  Calls made inside the same file go to the originals,
+ * so the lexer's own recursion is not counted twice.  The hash table
+ * indexes and the heap arenas count with LIBZSH_COUNT() directly.
+ *
+ * Counters live with the context, and libzsh_context_enter() points
+ * the thread's libzsh_stats_cur at them, so the hooks cost an add
+ * through a pointer and never take a lock.  Screens draw without the
+ * context lock, so their bytes go to an atomic counter of their own,
+ * which is added to the shared counters when those are read.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "libzsh_int.h"
+
+#ifdef LIBZSH_TRACE
+
+/* The originals, renamed */
+extern void zsh_untraced_zshlex(void);
+extern void zsh_untraced_ctxtlex(void);
+extern Eprog zsh_untraced_parse_list(void);
+extern Eprog zsh_untraced_parse_event(int endtok);
+extern Patprog zsh_untraced_patcompile(char *exp, int inflags, char **endexp);
+extern void zsh_untraced_zglob(LinkList list, LinkNode np, int nountok);
+#ifdef LIBZSH_WITH_ZLE
+extern void zsh_untraced_zrefresh(void);
+#endif
+
+struct trace_event {
+    int kind, depth;
+    unsigned long long begin, end;
+};
+
+struct libzsh_trace {
+    struct libzsh_stats stats;
+    libzsh_trace_fn fn;         /* libzsh_context_set_trace() */
+    void *data;
+    struct trace_event *events; /* libzsh_trace_record() */
+    size_t nevents, maxevents;
+    unsigned long dropped;      /* calls past maxevents */
+    int depth;                  /* traced calls under way */
+    unsigned int id;            /* its track in the trace */
+};
+
+static const char *const kind_names[LIBZSH_TRACE_KINDS] = {
+    "parse", "patcompile", "glob", "refresh"
+};
+
+static struct libzsh_trace shared_trace;
+static atomic_ulong shared_refresh;
+static atomic_uint next_id = 1;
+
+_Thread_local struct libzsh_stats *libzsh_stats_cur = &shared_trace.stats;
+static _Thread_local struct libzsh_trace *trace_cur = &shared_trace;
+
+struct libzsh_trace *libzsh_trace_new(void)
+{
+    struct libzsh_trace *t = zshcalloc(sizeof(*t));
+
+    t->id = atomic_fetch_add(&next_id, 1);
+    return t;
+}
+
+void libzsh_trace_use(struct libzsh_trace *trace)
+{
+    trace_cur = trace ? trace : &shared_trace;
+    libzsh_stats_cur = &trace_cur->stats;
+}
+
+void libzsh_trace_free(struct libzsh_trace *trace)
+{
+    if (!trace)
+        return;
+    free(trace->events);
+    zfree(trace, sizeof(*trace));
+}
+
+void libzsh_trace_refresh_bytes(size_t n)
+{
+    atomic_fetch_add_explicit(&shared_refresh, n, memory_order_relaxed);
+}
+
+static unsigned long long trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A traced call under way.  The trace is remembered in case the call
+ * itself enters or leaves a context.
+ */
+struct trace_span {
+    struct libzsh_trace *t;
+    int kind;
+    unsigned long long begin;
+};
+
+static void trace_begin(struct trace_span *sp, int kind)
+{
+    struct libzsh_trace *t = trace_cur;
+
+    sp->t = t;
+    sp->kind = kind;
+    sp->begin = trace_now();
+    t->depth++;
+    if (t->fn)
+        t->fn(t->data, kind, LIBZSH_TRACE_BEGIN, sp->begin);
+}
+
+static void trace_end(struct trace_span *sp)
+{
+    struct libzsh_trace *t = sp->t;
+    unsigned long long end = trace_now();
+
+    t->depth--;
+    t->stats.calls[sp->kind]++;
+    t->stats.ns[sp->kind] += end - sp->begin;
+    if (t->maxevents) {
+        if (t->nevents < t->maxevents) {
+            struct trace_event *e = &t->events[t->nevents++];
+
+            e->kind = sp->kind;
+            e->depth = t->depth;
+            e->begin = sp->begin;
+            e->end = end;
+        } else
+            t->dropped++;
+    }
+    if (t->fn)
+        t->fn(t->data, sp->kind, LIBZSH_TRACE_END, end);
+}
+
+void zshlex(void)
+{
+    zsh_untraced_zshlex();
+    LIBZSH_COUNT(tokens, 1);
+}
+
+void ctxtlex(void)
+{
+    zsh_untraced_ctxtlex();
+    LIBZSH_COUNT(tokens, 1);
+}
+
+static Eprog trace_parsed(struct trace_span *sp, Eprog prog)
+{
+    if (prog)
+        sp->t->stats.eprog_bytes += prog->len;
+    trace_end(sp);
+    return prog;
+}
+
+Eprog parse_list(void)
+{
+    struct trace_span sp;
+
+    trace_begin(&sp, LIBZSH_TRACE_PARSE);
+    return trace_parsed(&sp, zsh_untraced_parse_list());
+}
+
+Eprog parse_event(int endtok)
+{
+    struct trace_span sp;
+
+    trace_begin(&sp, LIBZSH_TRACE_PARSE);
+    return trace_parsed(&sp, zsh_untraced_parse_event(endtok));
+}
+
+Patprog patcompile(char *exp, int inflags, char **endexp)
+{
+    struct trace_span sp;
+    Patprog prog;
+
+    trace_begin(&sp, LIBZSH_TRACE_PATCOMPILE);
+    prog = zsh_untraced_patcompile(exp, inflags, endexp);
+    trace_end(&sp);
+    return prog;
+}
+
+void zglob(LinkList list, LinkNode np, int nountok)
+{
+    struct trace_span sp;
+
+    trace_begin(&sp, LIBZSH_TRACE_GLOB);
+    zsh_untraced_zglob(list, np, nountok);
+    trace_end(&sp);
+}
+
+#ifdef LIBZSH_WITH_ZLE
+void zrefresh(void)
+{
+    struct trace_span sp;
+
+    trace_begin(&sp, LIBZSH_TRACE_REFRESH);
+    zsh_untraced_zrefresh();
+    trace_end(&sp);
+}
+#endif
+
+int libzsh_stats_get(libzsh_context *ctx, struct libzsh_stats *st)
+{
+    if (ctx) {
+        libzsh_context_enter(ctx);
+        *st = ctx->trace->stats;
+        libzsh_context_leave(ctx);
+    } else {
+        libzsh_lock();
+        *st = shared_trace.stats;
+        libzsh_unlock();
+        st->refresh_bytes += atomic_load(&shared_refresh);
+    }
+    return 0;
+}
+
+int libzsh_stats_reset(libzsh_context *ctx)
+{
+    if (ctx) {
+        libzsh_context_enter(ctx);
+        memset(&ctx->trace->stats, 0, sizeof(ctx->trace->stats));
+        libzsh_context_leave(ctx);
+    } else {
+        libzsh_lock();
+        memset(&shared_trace.stats, 0, sizeof(shared_trace.stats));
+        atomic_store(&shared_refresh, 0);
+        libzsh_unlock();
+    }
+    return 0;
+}
+
+int libzsh_context_set_trace(libzsh_context *ctx, libzsh_trace_fn fn,
+                             void *data)
+{
+    libzsh_context_enter(ctx);
+    ctx->trace->fn = fn;
+    ctx->trace->data = data;
+    libzsh_context_leave(ctx);
+    return 0;
+}
+
+int libzsh_trace_record(libzsh_context *ctx, size_t max)
+{
+    struct trace_event *events = NULL;
+
+    if (max && !(events = malloc(max * sizeof(*events))))
+        return -1;
+
+    libzsh_context_enter(ctx);
+    free(ctx->trace->events);
+    ctx->trace->events = events;
+    ctx->trace->maxevents = max;
+    ctx->trace->nevents = 0;
+    ctx->trace->dropped = 0;
+    libzsh_context_leave(ctx);
+    return 0;
+}
+
+/* Write all of buf to fd */
+static int trace_put(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int libzsh_trace_write(libzsh_context *ctx, int fd)
+{
+    struct trace_event *events;
+    size_t i, nevents;
+    unsigned long dropped;
+    unsigned int id;
+    long pid = (long)getpid();
+    char line[256];
+    int len, ret = 0;
+
+    /* Take the events away, so the file is written without the lock */
+    libzsh_context_enter(ctx);
+    events = ctx->trace->events;
+    nevents = ctx->trace->nevents;
+    dropped = ctx->trace->dropped;
+    id = ctx->trace->id;
+    ctx->trace->events = events ? malloc(ctx->trace->maxevents *
+                                         sizeof(*events)) : NULL;
+    if (!ctx->trace->events)
+        ctx->trace->maxevents = 0;
+    ctx->trace->nevents = 0;
+    ctx->trace->dropped = 0;
+    libzsh_context_leave(ctx);
+
+    if (trace_put(fd, "{\"traceEvents\":[", 16) < 0)
+        ret = -1;
+    for (i = 0; !ret && i < nevents; i++) {
+        struct trace_event *e = &events[i];
+
+        /* Complete events, in microseconds */
+        len = snprintf(line, sizeof(line),
+                       "%s\n{\"name\":\"%s\",\"cat\":\"libzsh\",\"ph\":\"X\","
+                       "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u,"
+                       "\"args\":{\"depth\":%d}}",
+                       i ? "," : "", kind_names[e->kind], e->begin / 1000.0,
+                       (e->end - e->begin) / 1000.0, pid, id, e->depth);
+        if (trace_put(fd, line, len) < 0)
+            ret = -1;
+    }
+    if (!ret) {
+        len = snprintf(line, sizeof(line),
+                       "\n],\"displayTimeUnit\":\"ns\","
+                       "\"otherData\":{\"dropped\":%lu}}\n", dropped);
+        if (trace_put(fd, line, len) < 0)
+            ret = -1;
+    }
+    free(events);
+    return ret < 0 ? -1 : (int)nevents;
+}
+
+#else /* !LIBZSH_TRACE */
+
+struct libzsh_trace *libzsh_trace_new(void)
+{
+    return NULL;
+}
+
+void libzsh_trace_use(UNUSED(struct libzsh_trace *trace))
+{
+}
+
+void libzsh_trace_free(UNUSED(struct libzsh_trace *trace))
+{
+}
+
+void libzsh_trace_refresh_bytes(UNUSED(size_t n))
+{
+}
+
+int libzsh_stats_get(UNUSED(libzsh_context *ctx), struct libzsh_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    errno = ENOSYS;
+    return -1;
+}
+
+int libzsh_stats_reset(UNUSED(libzsh_context *ctx))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int libzsh_context_set_trace(UNUSED(libzsh_context *ctx),
+                             UNUSED(libzsh_trace_fn fn), UNUSED(void *data))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int libzsh_trace_record(UNUSED(libzsh_context *ctx), UNUSED(size_t max))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int libzsh_trace_write(UNUSED(libzsh_context *ctx), UNUSED(int fd))
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* LIBZSH_TRACE */
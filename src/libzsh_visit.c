@@ -0,0 +1,694 @@
+/*
+ * libzsh_visit.c - Walking the wordcode of a parsed program
+ *
+ * A program is the wordcode parse.c emits: lists of sublists of
+ * pipelines of commands, each command preceded by its redirections and
+ * assignments, compound commands holding further lists.  The layouts
+ * walked here are the ones exec.c and text.c read: each compound
+ * command's code gives the offset to its end, so the walk can always
+ * resume after it, and the strings are read as ecgetstr() reads them,
+ * either from the program's string table or, for up to three bytes,
+ * from the code itself.  A function definition's body has strings of
+ * its own, starting part of the way into the table.
+ *
+ * Nothing is copied or formatted: the words handed to the callback
+ * point into the program.  The walk reads the program only, so it needs
+ * no context and allocates with malloc(), like the glob walkers.
+ */
+
+#include "libzsh_int.h"
+
+/* The node kinds are the codes */
+#if LIBZSH_NODE_SIMPLE != WC_SIMPLE || LIBZSH_NODE_TRY != WC_TRY
+#error "libzsh.h's node kinds don't match zsh.h's wordcodes"
+#endif
+
+struct visit {
+    const wordcode *end;                /* of the program's code */
+    libzsh_visit_fn fn;
+    void *data;
+    /* What the command being gathered has; reused for each */
+    struct libzsh_span *spans;
+    size_t nspans, szspans;
+    struct libzsh_assign *assigns;
+    size_t nassigns, szassigns;
+    struct libzsh_redir *redirs;
+    size_t nredirs, szredirs;
+    int err;                            /* why the walk gave up */
+};
+
+/* Where a walk is: the code, and the string table its strings are in */
+struct visit_pos {
+    const wordcode *pc;
+    const char *strs, *strend;
+};
+
+/*
+ * Give up on the walk, for code that is out of bounds or not as
+ * parse.c makes it (EINVAL) or for want of memory.  The -1 is told
+ * apart from a callback's own -1 by v->err.
+ */
+static int bad(struct visit *v, int err)
+{
+    v->err = err;
+    return -1;
+}
+
+#define GET(v, p, w) do {                       \
+        if ((p)->pc >= (v)->end)                \
+            return bad(v, EINVAL);              \
+        (w) = *(p)->pc++;                       \
+    } while (0)
+
+/* Step over a word the walk has no use for */
+#define SKIPW(v, p) do {                        \
+        if ((p)->pc >= (v)->end)                \
+            return bad(v, EINVAL);              \
+        (p)->pc++;                              \
+    } while (0)
+
+static int grow(void **arr, size_t *sz, size_t n, size_t elt)
+{
+    size_t nsz;
+    void *na;
+
+    if (n < *sz)
+        return 0;
+    nsz = *sz ? *sz * 2 : 16;
+    if (!(na = realloc(*arr, nsz * elt)))
+        return -1;
+    *arr = na;
+    *sz = nsz;
+    return 0;
+}
+
+/*
+ * Decode the string code c, as ecgetstr() does.  Returns -1 if it
+ * points outside the string table or at a string that runs off its end.
+ */
+static int span_set(struct libzsh_span *sp, wordcode c,
+                    const struct visit_pos *p)
+{
+    sp->tokens = (int)(c & 1);
+    if (c == 6 || c == 7) {
+        sp->s = "";
+        sp->len = 0;
+    } else if (c & 2) {
+        /* Up to three bytes in the code itself; pointed at later */
+        sp->inl[0] = (char)((c >> 3) & 0xff);
+        sp->inl[1] = (char)((c >> 11) & 0xff);
+        sp->inl[2] = (char)((c >> 19) & 0xff);
+        sp->inl[3] = '\0';
+        sp->s = NULL;
+        sp->len = strlen(sp->inl);
+    } else {
+        const char *nul;
+
+        if ((size_t)(c >> 2) >= (size_t)(p->strend - p->strs))
+            return -1;
+        sp->s = p->strs + (c >> 2);
+        if (!(nul = memchr(sp->s, '\0', p->strend - sp->s)))
+            return -1;
+        sp->len = nul - sp->s;
+    }
+    return 0;
+}
+
+static void span_fix(struct libzsh_span *sp)
+{
+    if (!sp->s)
+        sp->s = sp->inl;
+}
+
+/* Collect count strings into the command's words */
+static int get_strs(struct visit *v, struct visit_pos *p, wordcode count)
+{
+    wordcode c;
+
+    while (count--) {
+        GET(v, p, c);
+        if (grow((void **)&v->spans, &v->szspans, v->nspans,
+                 sizeof(*v->spans)))
+            return bad(v, ENOMEM);
+        if (span_set(&v->spans[v->nspans++], c, p))
+            return bad(v, EINVAL);
+    }
+    return 0;
+}
+
+/* A WC_ASSIGN, its code already read, as addvars() reads it */
+static int get_assign(struct visit *v, struct visit_pos *p, wordcode code)
+{
+    struct libzsh_assign *a;
+    wordcode c;
+
+    if (grow((void **)&v->assigns, &v->szassigns, v->nassigns,
+             sizeof(*v->assigns)))
+        return bad(v, ENOMEM);
+    a = &v->assigns[v->nassigns++];
+    a->array = WC_ASSIGN_TYPE(code) == WC_ASSIGN_ARRAY;
+    a->append = WC_ASSIGN_TYPE2(code) == WC_ASSIGN_INC;
+    GET(v, p, c);
+    if (span_set(&a->name, c, p))
+        return bad(v, EINVAL);
+    /* Values are indexes into spans until the command is complete */
+    a->values = (const struct libzsh_span *)(uintptr_t)v->nspans;
+    a->nvalues = a->array ? WC_ASSIGN_NUM(code) : 1;
+    return get_strs(v, p, (wordcode)a->nvalues);
+}
+
+/* A WC_REDIR, its code already read, as ecgetredirs() reads it */
+static int get_redir(struct visit *v, struct visit_pos *p, wordcode code)
+{
+    struct libzsh_redir *r;
+    wordcode c;
+
+    if (grow((void **)&v->redirs, &v->szredirs, v->nredirs,
+             sizeof(*v->redirs)))
+        return bad(v, ENOMEM);
+    r = &v->redirs[v->nredirs++];
+    memset(r, 0, sizeof(*r));
+    r->type = WC_REDIR_TYPE(code);
+    GET(v, p, c);
+    r->fd = (int)c;
+    GET(v, p, c);
+    if (span_set(&r->target, c, p))
+        return bad(v, EINVAL);
+    if (WC_REDIR_FROM_HEREDOC(code)) {
+        GET(v, p, c);
+        if (span_set(&r->here_end, c, p))
+            return bad(v, EINVAL);
+        SKIPW(v, p);            /* the terminator as matched */
+    } else
+        r->here_end.s = "";
+    if (WC_REDIR_VARID(code)) {
+        GET(v, p, c);
+        if (span_set(&r->varid, c, p))
+            return bad(v, EINVAL);
+    } else
+        r->varid.s = "";
+    return 0;
+}
+
+/* Hand over a node whose words and so on have been gathered */
+static int emit(struct visit *v, struct libzsh_node *node, size_t words,
+                size_t nwords)
+{
+    size_t i;
+
+    for (i = 0; i < v->nspans; i++)
+        span_fix(&v->spans[i]);
+    for (i = 0; i < v->nassigns; i++) {
+        span_fix(&v->assigns[i].name);
+        v->assigns[i].values = v->spans + (uintptr_t)v->assigns[i].values;
+    }
+    for (i = 0; i < v->nredirs; i++) {
+        span_fix(&v->redirs[i].target);
+        span_fix(&v->redirs[i].here_end);
+        span_fix(&v->redirs[i].varid);
+    }
+    node->words = v->spans + words;
+    node->nwords = nwords;
+    node->assigns = v->assigns;
+    node->nassigns = v->nassigns;
+    node->redirs = v->redirs;
+    node->nredirs = v->nredirs;
+    return v->fn(v->data, node, LIBZSH_VISIT_ENTER);
+}
+
+static int leave(struct visit *v, const struct libzsh_node *enter)
+{
+    struct libzsh_node node;
+
+    memset(&node, 0, sizeof(node));
+    node.kind = enter->kind;
+    node.depth = enter->depth;
+    node.lineno = enter->lineno;
+    node.flags = enter->flags;
+    return v->fn(v->data, &node, LIBZSH_VISIT_LEAVE);
+}
+
+static int visit_lists(struct visit *v, struct visit_pos *p, int depth);
+static int visit_sublist(struct visit *v, struct visit_pos *p, int depth,
+                         int flags, int *more);
+
+/* A condition of [[ ... ]], its operands added to the words */
+static int visit_cond(struct visit *v, struct visit_pos *p, int nest)
+{
+    wordcode code;
+    int ret, type;
+
+    if (nest > 1000)
+        return bad(v, EINVAL);
+    GET(v, p, code);
+    if (wc_code(code) != WC_COND)
+        return bad(v, EINVAL);
+    switch ((type = WC_COND_TYPE(code))) {
+    case COND_NOT:
+        return visit_cond(v, p, nest + 1);
+    case COND_AND:
+    case COND_OR:
+        if ((ret = visit_cond(v, p, nest + 1)))
+            return ret;
+        return visit_cond(v, p, nest + 1);
+    case COND_MOD:
+        return get_strs(v, p, 1 + WC_COND_SKIP(code));
+    case COND_MODI:
+        return get_strs(v, p, 3);
+    case COND_STREQ:
+    case COND_STRDEQ:
+    case COND_STRNEQ:
+        /* Left and right, and the right's pattern slot */
+        if ((ret = get_strs(v, p, 2)))
+            return ret;
+        SKIPW(v, p);
+        return 0;
+    default:
+        /* Binary operators, or a unary test named by its letter */
+        return get_strs(v, p, type <= COND_REGEX ? 2 : 1);
+    }
+}
+
+/* Hand over a node with nothing under it, for which SKIP means 0 */
+static int leaf(struct visit *v, struct libzsh_node *node, size_t words)
+{
+    int ret = emit(v, node, words, v->nspans - words);
+
+    return ret == LIBZSH_VISIT_SKIP ? 0 : ret;
+}
+
+/* The branches of an if or the arms of a case, up to end */
+static int visit_arms(struct visit *v, struct visit_pos *p, int depth,
+                      long lineno, int kind, const wordcode *end)
+{
+    struct libzsh_node arm;
+    const wordcode *next;
+    wordcode code, n;
+    int ret = 0;
+
+    while (!ret && p->pc < end && wc_code(*p->pc) == (wordcode)kind) {
+        code = *p->pc++;
+        next = p->pc + (kind == WC_IF ? WC_IF_SKIP(code) : WC_CASE_SKIP(code));
+        if (next > end)
+            return bad(v, EINVAL);
+        v->nspans = v->nassigns = v->nredirs = 0;
+        memset(&arm, 0, sizeof(arm));
+        arm.kind = LIBZSH_NODE_ARM;
+        arm.depth = depth;
+        arm.lineno = lineno;
+        if (kind == WC_CASE) {
+            /* Its patterns, each followed by its pattern slot */
+            GET(v, p, n);
+            while (n--) {
+                if ((ret = get_strs(v, p, 1)))
+                    return ret;
+                SKIPW(v, p);
+            }
+        } else if (WC_IF_TYPE(code) == WC_IF_ELSE)
+            arm.flags = LIBZSH_NODE_ELSE;
+        if ((ret = emit(v, &arm, 0, v->nspans)) == LIBZSH_VISIT_SKIP)
+            ret = 0;
+        else if (!ret) {
+            /* if and elif have a condition before the body */
+            if (kind == WC_IF && WC_IF_TYPE(code) != WC_IF_ELSE)
+                ret = visit_lists(v, p, depth + 1);
+            if (!ret && !(ret = visit_lists(v, p, depth + 1)))
+                ret = leave(v, &arm);
+        }
+        p->pc = next;
+    }
+    return ret;
+}
+
+/* One command with the redirections and assignments before it */
+static int visit_cmd(struct visit *v, struct visit_pos *p, int depth,
+                     int flags, long lineno)
+{
+    struct libzsh_node node;
+    const wordcode *end = NULL, *next = NULL;
+    wordcode code, c, n;
+    size_t words;
+    int ret, kind;
+
+    v->nspans = v->nassigns = v->nredirs = 0;
+    while (p->pc < v->end && (wc_code(*p->pc) == WC_REDIR ||
+                              wc_code(*p->pc) == WC_ASSIGN)) {
+        code = *p->pc++;
+        if ((ret = wc_code(code) == WC_REDIR ? get_redir(v, p, code) :
+             get_assign(v, p, code)))
+            return ret;
+    }
+    memset(&node, 0, sizeof(node));
+    node.depth = depth;
+    node.lineno = lineno;
+    node.flags = flags;
+    words = v->nspans;
+    if (p->pc >= v->end || wc_code(*p->pc) < WC_SIMPLE) {
+        /* Only assignments, as a simple command with no words */
+        if (!v->nassigns)
+            return bad(v, EINVAL);
+        node.kind = LIBZSH_NODE_SIMPLE;
+        return leaf(v, &node, words);
+    }
+    code = *p->pc++;
+    if ((kind = wc_code(code)) > WC_TRY)
+        return bad(v, EINVAL);
+    node.kind = kind;
+
+    switch (kind) {
+    case WC_SIMPLE:
+        if ((ret = get_strs(v, p, WC_SIMPLE_ARGC(code))))
+            return ret;
+        return leaf(v, &node, words);
+    case WC_TYPESET:
+        /* The words, then assignments, whose values follow the words */
+        if ((ret = get_strs(v, p, WC_TYPESET_ARGC(code))))
+            return ret;
+        GET(v, p, n);
+        while (n--) {
+            GET(v, p, c);
+            if (wc_code(c) != WC_ASSIGN)
+                return bad(v, EINVAL);
+            if ((ret = get_assign(v, p, c)))
+                return ret;
+        }
+        ret = emit(v, &node, words, WC_TYPESET_ARGC(code));
+        return ret == LIBZSH_VISIT_SKIP ? 0 : ret;
+    case WC_AUTOFN:
+        return leaf(v, &node, words);
+    case WC_ARITH:
+        if ((ret = get_strs(v, p, 1)))
+            return ret;
+        return leaf(v, &node, words);
+    case WC_COND:
+        p->pc--;
+        if ((ret = visit_cond(v, p, 0)))
+            return ret;
+        return leaf(v, &node, words);
+    case WC_TIMED:
+        if (WC_TIMED_TYPE(code) != WC_TIMED_PIPE)
+            return leaf(v, &node, words);
+        if ((ret = emit(v, &node, words, 0)) == LIBZSH_VISIT_SKIP) {
+            /* Step over the pipeline as its sublist code says */
+            GET(v, p, c);
+            if (p->pc + WC_SUBLIST_SKIP(c) > v->end)
+                return bad(v, EINVAL);
+            p->pc += WC_SUBLIST_SKIP(c);
+            return 0;
+        }
+        if (ret)
+            return ret;
+        if ((ret = visit_sublist(v, p, depth + 1, 0, &kind)))
+            return ret;         /* kind is just somewhere to put the type */
+        return leave(v, &node);
+    }
+
+    /* Compound commands, each of which says where it ends */
+    switch (kind) {
+    case WC_SUBSH:
+        end = p->pc + WC_SUBSH_SKIP(code);
+        break;
+    case WC_CURSH:
+        end = p->pc + WC_CURSH_SKIP(code);
+        SKIPW(v, p);            /* only used by try/always */
+        break;
+    case WC_TRY:
+        end = p->pc + WC_TRY_SKIP(code);
+        break;
+    case WC_FUNCDEF:
+        end = p->pc + WC_FUNCDEF_SKIP(code);
+        GET(v, p, n);
+        if ((ret = get_strs(v, p, n)))
+            return ret;
+        node.nnames = n;
+        if (!n && end < v->end) {
+            /* An anonymous function's arguments follow its end */
+            struct visit_pos ap;
+
+            ap.pc = end;
+            ap.strs = p->strs;
+            ap.strend = p->strend;
+            GET(v, &ap, c);
+            next = end + c;
+            GET(v, &ap, n);
+            if ((ret = get_strs(v, &ap, n)))
+                return ret;
+            if (next > v->end || next < ap.pc)
+                return bad(v, EINVAL);
+        }
+        break;
+    case WC_FOR:
+        end = p->pc + WC_FOR_SKIP(code);
+        if (WC_FOR_TYPE(code) == WC_FOR_COND) {
+            if ((ret = get_strs(v, p, 3)))
+                return ret;
+            break;
+        }
+        GET(v, p, n);
+        if ((ret = get_strs(v, p, n)))
+            return ret;
+        node.nnames = n;
+        if (WC_FOR_TYPE(code) == WC_FOR_LIST) {
+            GET(v, p, n);
+            if ((ret = get_strs(v, p, n)))
+                return ret;
+        }
+        break;
+    case WC_SELECT:
+        end = p->pc + WC_SELECT_SKIP(code);
+        if ((ret = get_strs(v, p, 1)))
+            return ret;
+        node.nnames = 1;
+        if (WC_SELECT_TYPE(code) == WC_SELECT_LIST) {
+            GET(v, p, n);
+            if ((ret = get_strs(v, p, n)))
+                return ret;
+        }
+        break;
+    case WC_WHILE:
+        end = p->pc + WC_WHILE_SKIP(code);
+        if (WC_WHILE_TYPE(code) == WC_WHILE_UNTIL)
+            node.flags |= LIBZSH_NODE_UNTIL;
+        break;
+    case WC_REPEAT:
+        end = p->pc + WC_REPEAT_SKIP(code);
+        if ((ret = get_strs(v, p, 1)))
+            return ret;
+        break;
+    case WC_CASE:
+        end = p->pc + WC_CASE_SKIP(code);
+        if ((ret = get_strs(v, p, 1)))
+            return ret;
+        break;
+    case WC_IF:
+        end = p->pc + WC_IF_SKIP(code);
+        break;
+    }
+    if (end > v->end || end < p->pc)
+        return bad(v, EINVAL);
+
+    if ((ret = emit(v, &node, words, v->nspans - words)) == LIBZSH_VISIT_SKIP)
+        ret = 0;
+    else if (!ret) {
+        switch (kind) {
+        case WC_SUBSH:
+        case WC_CURSH:
+        case WC_FOR:
+        case WC_SELECT:
+        case WC_REPEAT:
+            ret = visit_lists(v, p, depth + 1);
+            break;
+        case WC_WHILE:
+            /* The condition, then the body */
+            if (!(ret = visit_lists(v, p, depth + 1)))
+                ret = visit_lists(v, p, depth + 1);
+            break;
+        case WC_TRY: {
+            const wordcode *always;
+
+            /* The try block, then where the code after the head says */
+            GET(v, p, c);
+            always = p->pc + WC_TRY_SKIP(c);
+            if (always > end)
+                return bad(v, EINVAL);
+            if (!(ret = visit_lists(v, p, depth + 1))) {
+                p->pc = always;
+                ret = visit_lists(v, p, depth + 1);
+            }
+            break;
+        }
+        case WC_FUNCDEF: {
+            struct visit_pos fp;
+            wordcode sbeg, slen;
+
+            /*
+             * Where the body's strings start in the table, then their
+             * length, the body's pattern count and its tracing flag.
+             */
+            GET(v, p, sbeg);
+            GET(v, p, slen);
+            SKIPW(v, p);
+            SKIPW(v, p);
+            if (sbeg > (size_t)(p->strend - p->strs) ||
+                slen > (size_t)(p->strend - p->strs) - sbeg)
+                return bad(v, EINVAL);
+            fp.pc = p->pc;
+            fp.strs = p->strs + sbeg;
+            fp.strend = fp.strs + slen;
+            ret = visit_lists(v, &fp, depth + 1);
+            break;
+        }
+        case WC_CASE:
+        case WC_IF:
+            ret = visit_arms(v, p, depth + 1, lineno, kind, end);
+            break;
+        }
+        if (!ret)
+            ret = leave(v, &node);
+    }
+    if (ret)
+        return ret;
+    p->pc = next ? next : end;
+    return 0;
+}
+
+/* A pipeline, its sublist code already read */
+static int visit_pipeline(struct visit *v, struct visit_pos *p, int depth,
+                          int flags, wordcode slcode)
+{
+    const wordcode *next;
+    wordcode code, c;
+    int ret, lflags;
+
+    if (WC_SUBLIST_FLAGS(slcode) & WC_SUBLIST_NOT)
+        flags |= LIBZSH_NODE_NOT;
+    if (WC_SUBLIST_FLAGS(slcode) & WC_SUBLIST_COPROC)
+        flags |= LIBZSH_NODE_COPROC;
+
+    if (WC_SUBLIST_FLAGS(slcode) & WC_SUBLIST_SIMPLE) {
+        /* One command, with the line number in place of a pipe code */
+        GET(v, p, c);
+        return visit_cmd(v, p, depth, flags, c ? (long)c - 1 : 0);
+    }
+    if (p->pc >= v->end || wc_code(*p->pc) != WC_PIPE)
+        return 0;               /* a lone ! or coproc */
+    do {
+        GET(v, p, code);
+        lflags = flags;
+        next = NULL;
+        if (WC_PIPE_TYPE(code) == WC_PIPE_MID) {
+            /* The offset from here to the next command's pipe code */
+            GET(v, p, c);
+            if ((next = p->pc - 1 + c) > v->end)
+                return bad(v, EINVAL);
+            lflags |= LIBZSH_NODE_PIPED;
+        }
+        if ((ret = visit_cmd(v, p, depth, lflags,
+                             WC_PIPE_LINENO(code) ?
+                             (long)WC_PIPE_LINENO(code) - 1 : 0)))
+            return ret;
+        if (next)
+            p->pc = next;
+    } while (WC_PIPE_TYPE(code) == WC_PIPE_MID);
+    return 0;
+}
+
+/* One sublist; *type says whether another follows it with && or || */
+static int visit_sublist(struct visit *v, struct visit_pos *p, int depth,
+                         int flags, int *type)
+{
+    wordcode code;
+    const wordcode *next;
+    int ret;
+
+    GET(v, p, code);
+    if (wc_code(code) != WC_SUBLIST)
+        return bad(v, EINVAL);
+    next = WC_SUBLIST_SKIP(code) ? p->pc + WC_SUBLIST_SKIP(code) : NULL;
+    if ((ret = visit_pipeline(v, p, depth, flags, code)))
+        return ret;
+    if (next && next <= v->end && next > p->pc)
+        p->pc = next;
+    *type = WC_SUBLIST_TYPE(code);
+    return 0;
+}
+
+/* Lists up to the one marked as the last, or a WC_END */
+static int visit_lists(struct visit *v, struct visit_pos *p, int depth)
+{
+    const wordcode *next;
+    wordcode code, c;
+    int ret, flags, lflags, type;
+
+    for (;;) {
+        if (p->pc >= v->end)
+            return 0;
+        GET(v, p, code);
+        if (wc_code(code) == WC_END)
+            return 0;
+        if (wc_code(code) != WC_LIST)
+            return bad(v, EINVAL);
+        flags = (WC_LIST_TYPE(code) & Z_ASYNC) ? LIBZSH_NODE_ASYNC : 0;
+        if (WC_LIST_TYPE(code) & Z_SIMPLE) {
+            /* One command, with its line number first */
+            next = p->pc + WC_LIST_SKIP(code);
+            GET(v, p, c);
+            ret = visit_cmd(v, p, depth, flags, c ? (long)c - 1 : 0);
+            if (!ret && next <= v->end && next > p->pc)
+                p->pc = next;
+        } else {
+            /* Each sublist after the first says how it was joined on */
+            lflags = flags;
+            do {
+                ret = visit_sublist(v, p, depth, lflags, &type);
+                lflags = flags | (type == WC_SUBLIST_AND ? LIBZSH_NODE_AND :
+                                  type == WC_SUBLIST_OR ? LIBZSH_NODE_OR : 0);
+            } while (!ret && type != WC_SUBLIST_END);
+        }
+        if (ret)
+            return ret;
+        if (WC_LIST_TYPE(code) & Z_END)
+            return 0;
+    }
+}
+
+int libzsh_visit(struct eprog *prog, libzsh_visit_fn fn, void *data)
+{
+    struct visit v;
+    struct visit_pos p;
+    int ret;
+
+    size_t len = prog->len;
+
+    memset(&v, 0, sizeof(v));
+    v.fn = fn;
+    v.data = data;
+    /*
+     * The strings follow the code, as bld_eprog() and dumps lay it out,
+     * up to the end of the program; len counts the pattern slots unless
+     * the program is mapped from a .zwc file.
+     */
+    if (!(prog->flags & EF_MAP))
+        len -= prog->npats * sizeof(Patprog);
+    p.pc = prog->prog;
+    p.strs = prog->strs;
+    p.strend = (const char *)prog->prog + len;
+    if (!p.strs)
+        p.strs = p.strend;      /* dummy_eprog: code, no strings */
+    if (p.strs < (const char *)prog->prog || p.strs > p.strend) {
+        errno = EINVAL;
+        return -1;
+    }
+    v.end = (const wordcode *)prog->prog +
+        (p.strs - (const char *)prog->prog) / sizeof(wordcode);
+
+    ret = visit_lists(&v, &p, 0);
+    free(v.spans);
+    free(v.assigns);
+    free(v.redirs);
+    if (v.err) {
+        errno = v.err;
+        return -1;
+    }
+    return ret;
+}
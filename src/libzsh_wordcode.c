@@ -0,0 +1,369 @@
+/*
+ * libzsh_wordcode.c - Loading and writing .zwc wordcode dump files
+ *
+ * The file format is the one zcompile writes (see the comments on
+ * "dumping functions" in Src/parse.c): a header of FD_PRELEN words
+ * holding the magic number, flags and zsh version, one fdhead plus name
+ * per function, then the wordcode and strings of each function.  The
+ * whole thing is written twice, the second copy byte-swapped, so either
+ * byte order can use the file.
+ *
+ * The parse.c helpers for this are static and tied to autoload, so the
+ * format is handled here.  Loaded programs are built the same way
+ * parse.c builds them for a mapped dump (EF_MAP, prog->dump set), which
+ * means freeeprog() releases them correctly.
+ */
+
+#include "libzsh_int.h"
+#include "version.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#if defined(MAP_SHARED) && defined(PROT_READ)
+#define USE_MMAP 1
+#endif
+#endif
+
+/* These match the definitions in Src/parse.c */
+#define DUMP_MINMAP 4096
+#define DUMP_PRELEN 12
+#define DUMP_MAGIC  0x04050607
+#define DUMP_OMAGIC 0x07060504
+#define DUMPF_MAP   1
+#define DUMPF_OTHER 2
+
+struct dump_head {
+    wordcode start;     /* offset to function definition */
+    wordcode len;       /* length of wordcode/strings */
+    wordcode npats;     /* number of patterns needed */
+    wordcode strs;      /* offset to strings */
+    wordcode hlen;      /* header length (incl. name) */
+    wordcode flags;     /* flags and offset to name tail */
+};
+
+#define DUMP_HEADWORDS (sizeof(struct dump_head) / sizeof(wordcode))
+
+#define dumpbyte(f,i)   ((wordcode) (((unsigned char *) (((Wordcode) (f)) + 1))[i]))
+#define dumpsetbyte(f,i,v) \
+    ((((unsigned char *) (((Wordcode) (f)) + 1))[i]) = ((unsigned char) (v)))
+#define dumpother(f)    (dumpbyte(f, 1) + (dumpbyte(f, 2) << 8) + (dumpbyte(f, 3) << 16))
+#define dumpversion(f)  ((char *) (((Wordcode) (f)) + 2))
+#define dumpname(h)     ((char *) (((struct dump_head *) (h)) + 1))
+#define dumptail(h)     ((h)->flags >> 2)
+
+struct wordcode_func {
+    const char *name;           /* full name as stored */
+    const char *tail;           /* name without leading directories */
+    const struct dump_head *head;
+};
+
+struct libzsh_wordcode {
+    struct funcdump dump;       /* what the programs' dump field points to */
+    size_t size;                /* bytes from dump.map to end of file */
+    struct wordcode_func *funcs;
+    size_t nfuncs;
+};
+
+static void wordcode_unmap(Wordcode addr, size_t len)
+{
+#ifdef USE_MMAP
+    munmap((void *)addr, len);
+#else
+    free(addr);
+#endif
+}
+
+/*
+ * Check the header of the copy at map and index its functions.
+ */
+static int wordcode_index(libzsh_wordcode *wc)
+{
+    Wordcode map = wc->dump.map;
+    size_t words = wc->size / sizeof(wordcode), hlen, n;
+    const struct dump_head *h;
+
+    if (words <= DUMP_PRELEN || map[0] != DUMP_MAGIC)
+        return -1;
+    if (strncmp(dumpversion(map), ZSH_VERSION,
+                (DUMP_PRELEN - 2) * sizeof(wordcode)))
+        return -1;
+    if ((hlen = map[DUMP_PRELEN]) > words)
+        return -1;
+
+    /* First pass: validate and count */
+    for (n = 0, h = (const struct dump_head *)(map + DUMP_PRELEN);
+         (Wordcode)h < map + hlen; n++) {
+        /* The fixed fields must be in the header before they are read */
+        if ((Wordcode)h + DUMP_HEADWORDS > map + hlen ||
+            h->hlen < DUMP_HEADWORDS + 1 ||
+            h->hlen > (size_t)(map + hlen - (Wordcode)h) ||
+            h->start < hlen ||
+            h->start + (h->len + sizeof(wordcode) - 1) / sizeof(wordcode) >
+            words || h->strs > h->len)
+            return -1;
+        h = (const struct dump_head *)((Wordcode)h + h->hlen);
+    }
+
+    wc->nfuncs = n;
+    /* Indexed without the lock */
+    if (!(wc->funcs = calloc(n ? n : 1, sizeof(*wc->funcs))))
+        return -1;
+    for (n = 0, h = (const struct dump_head *)(map + DUMP_PRELEN);
+         n < wc->nfuncs; n++) {
+        const char *name = dumpname(h);
+        size_t maxlen = (h->hlen - DUMP_HEADWORDS) * sizeof(wordcode);
+
+        if (!memchr(name, '\0', maxlen) || dumptail(h) >= maxlen)
+            return -1;
+        wc->funcs[n].name = name;
+        wc->funcs[n].tail = name + dumptail(h);
+        wc->funcs[n].head = h;
+        h = (const struct dump_head *)((Wordcode)h + h->hlen);
+    }
+
+    return 0;
+}
+
+libzsh_wordcode *libzsh_load_wordcode(const char *path)
+{
+    libzsh_wordcode *wc;
+    struct stat st;
+    Wordcode addr;
+    size_t off = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_NOCTTY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size < (DUMP_PRELEN + 1) * sizeof(wordcode)) {
+        close(fd);
+        return NULL;
+    }
+
+#ifdef USE_MMAP
+    addr = (Wordcode)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == (Wordcode)MAP_FAILED)
+        return NULL;
+#else
+    if (!(addr = (Wordcode)malloc(st.st_size))) {
+        close(fd);
+        return NULL;
+    }
+    if (read_loop(fd, (char *)addr, st.st_size) != st.st_size) {
+        free(addr);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+#endif
+
+    /* Written on a machine of the other byte order: use the second copy */
+    if (addr[0] == DUMP_OMAGIC) {
+        off = dumpother(addr);
+        if (off % sizeof(wordcode) || off >= (size_t)st.st_size) {
+            wordcode_unmap(addr, st.st_size);
+            return NULL;
+        }
+    }
+
+    libzsh_lock();
+    wc = (libzsh_wordcode *)zshcalloc(sizeof(*wc));
+    wc->dump.dev = st.st_dev;
+    wc->dump.ino = st.st_ino;
+    wc->dump.fd = -1;
+    wc->dump.addr = addr;
+    wc->dump.map = addr + off / sizeof(wordcode);
+    wc->dump.len = st.st_size;
+    wc->dump.filename = ztrdup(path);
+    wc->size = st.st_size - off;
+    libzsh_unlock();
+
+    if (wordcode_index(wc)) {
+        libzsh_wordcode_close(wc);
+        return NULL;
+    }
+
+    return wc;
+}
+
+void libzsh_wordcode_close(libzsh_wordcode *wc)
+{
+    if (!wc)
+        return;
+
+    DPUTS(wc->dump.count, "BUG: closing wordcode file with programs in use");
+
+    wordcode_unmap(wc->dump.addr, wc->dump.len);
+
+    free(wc->funcs);
+    libzsh_lock();
+    zsfree(wc->dump.filename);
+    zfree(wc, sizeof(*wc));
+    libzsh_unlock();
+}
+
+size_t libzsh_wordcode_count(libzsh_wordcode *wc)
+{
+    return wc->nfuncs;
+}
+
+const char *libzsh_wordcode_name(libzsh_wordcode *wc, size_t i)
+{
+    return i < wc->nfuncs ? wc->funcs[i].name : NULL;
+}
+
+Eprog libzsh_wordcode_get_index(libzsh_wordcode *wc, size_t i)
+{
+    const struct dump_head *h;
+    Patprog *pp;
+    Eprog prog;
+    int np;
+
+    if (i >= wc->nfuncs)
+        return NULL;
+    h = wc->funcs[i].head;
+
+    libzsh_lock();
+    prog = (Eprog)zalloc(sizeof(*prog));
+    prog->flags = EF_MAP;
+    prog->len = h->len;
+    prog->npats = np = h->npats;
+    prog->nref = 1;
+    prog->pats = pp = (Patprog *)zalloc(np * sizeof(Patprog));
+    prog->prog = wc->dump.map + h->start;
+    prog->strs = ((char *)prog->prog) + h->strs;
+    prog->shf = NULL;
+    prog->dump = &wc->dump;
+    wc->dump.count++;
+    while (np--)
+        *pp++ = dummy_patprog1;
+    libzsh_unlock();
+
+    return prog;
+}
+
+Eprog libzsh_wordcode_get(libzsh_wordcode *wc, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < wc->nfuncs; i++)
+        if (!strcmp(wc->funcs[i].tail, name))
+            return libzsh_wordcode_get_index(wc, i);
+
+    return NULL;
+}
+
+static void dump_swap(Wordcode p, size_t n)
+{
+    wordcode c;
+
+    for (; n--; p++) {
+        c = *p;
+        *p = (((c & 0xff) << 24) |
+              ((c & 0xff00) << 8) |
+              ((c & 0xff0000) >> 8) |
+              ((c & 0xff000000) >> 24));
+    }
+}
+
+/* Bytes of wordcode and strings in prog, i.e. without the pattern slots */
+#define dump_proglen(p) ((p)->len - (p)->npats * sizeof(Patprog))
+#define dump_progwords(p) \
+    ((dump_proglen(p) + sizeof(wordcode) - 1) / sizeof(wordcode))
+
+/*
+ * Lay out one copy of the file at buf, as write_dump() in parse.c does.
+ */
+static void dump_copy(Wordcode buf, const char *const *names,
+                      Eprog const *progs, size_t n, size_t hlen,
+                      size_t tlen, int other)
+{
+    Wordcode wp = buf;
+    size_t i, start = hlen;
+
+    memset(wp, 0, DUMP_PRELEN * sizeof(wordcode));
+    wp[0] = other ? DUMP_OMAGIC : DUMP_MAGIC;
+    dumpsetbyte(wp, 0, (tlen >= DUMP_MINMAP ? DUMPF_MAP : 0) | other);
+    dumpsetbyte(wp, 1, tlen & 0xff);
+    dumpsetbyte(wp, 2, (tlen >> 8) & 0xff);
+    dumpsetbyte(wp, 3, (tlen >> 16) & 0xff);
+    strcpy(dumpversion(wp), ZSH_VERSION);
+    wp += DUMP_PRELEN;
+
+    for (i = 0; i < n; i++) {
+        struct dump_head *h = (struct dump_head *)wp;
+        const char *tail = strrchr(names[i], '/');
+        size_t nlen = strlen(names[i]);
+
+        h->start = start;
+        h->len = dump_proglen(progs[i]);
+        h->npats = progs[i]->npats;
+        h->strs = progs[i]->strs - (char *)progs[i]->prog;
+        h->hlen = DUMP_HEADWORDS + (nlen + sizeof(wordcode)) / sizeof(wordcode);
+        h->flags = (tail ? tail + 1 - names[i] : 0) << 2;
+        start += dump_progwords(progs[i]);
+
+        memset(dumpname(h), 0, (h->hlen - DUMP_HEADWORDS) * sizeof(wordcode));
+        memcpy(dumpname(h), names[i], nlen);
+        wp += h->hlen;
+        if (other)
+            dump_swap((Wordcode)h, DUMP_HEADWORDS);
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t words = dump_progwords(progs[i]);
+
+        if (words)
+            wp[words - 1] = 0;
+        memcpy(wp, progs[i]->prog, dump_proglen(progs[i]));
+        if (other)
+            dump_swap(wp, (Wordcode)progs[i]->strs - progs[i]->prog);
+        wp += words;
+    }
+}
+
+int libzsh_dump_wordcode(const char *path, const char *const *names,
+                         Eprog const *progs, size_t n)
+{
+    size_t i, hlen = DUMP_PRELEN, tlen = 0;
+    Wordcode buf;
+    int fd, ret = 0;
+
+    for (i = 0; i < n; i++) {
+        hlen += DUMP_HEADWORDS +
+            (strlen(names[i]) + sizeof(wordcode)) / sizeof(wordcode);
+        tlen += dump_progwords(progs[i]);
+    }
+    tlen = (tlen + hlen) * sizeof(wordcode);
+
+    /* The offset of the second copy is stored in 24 bits */
+    if (tlen >= (1 << 24)) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    libzsh_lock();
+    buf = (Wordcode)zalloc(2 * tlen);
+    libzsh_unlock();
+
+    dump_copy(buf, names, progs, n, hlen, tlen, 0);
+    dump_copy(buf + tlen / sizeof(wordcode), names, progs, n, hlen, tlen,
+              DUMPF_OTHER);
+
+    /* Like zcompile: replace any existing (read-only) file */
+    unlink(path);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOCTTY, 0444)) < 0)
+        ret = -1;
+    else {
+        if (write_loop(fd, (char *)buf, 2 * tlen) != (ssize_t)(2 * tlen))
+            ret = -1;
+        if (close(fd))
+            ret = -1;
+    }
+
+    libzsh_lock();
+    zfree(buf, 2 * tlen);
+    libzsh_unlock();
+
+    return ret;
+}
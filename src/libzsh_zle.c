@@ -0,0 +1,1002 @@
+/*
+ * libzsh_zle.c - Driving ZLE from fed input instead of a blocking read
+ *
+ * zleread() pulls keys with getbyte(), which blocks on the terminal.
+ * Here the caller pushes bytes in as they arrive and we do what
+ * zlecore() does with them: find the binding in the current keymap, as
+ * getkeymapcmd() would but through its compiled table (libzsh_keymap.c),
+ * and run the widget with execzlefunc().  If the bytes so far are a
+ * prefix of a longer binding we return and wait for more, rather than
+ * reading on.
+ *
+ * Some widgets read further keys for themselves (quoted-insert needs the
+ * next character, self-insert the rest of a multibyte character).
+ * Before a widget runs, the input that follows is handed to getbyte()
+ * through the unget buffer; whatever it took is then dropped from our
+ * queue.  Widgets known to read one more character are only run once a
+ * whole character is queued.  Those that run a nested read loop of
+ * their own (incremental search, vi operators, execute-named-cmd) can't
+ * work without blocking and are refused with a beep.
+ *
+ * zle_hist.c's widgets walk zsh's history ring, which has nothing of a
+ * session's in it.  Given a libzsh_history, a session runs the history
+ * widgets itself on that instead, searching through its index.
+ * Incremental search is then a mode of the session: while it lasts,
+ * each byte fed edits the search string or moves between matches, as
+ * the isearch keymap's keys do, and any other key ends it and is run as
+ * usual.
+ *
+ * Bracketed paste (the bracketed-paste binding, ESC [200~) is not run as
+ * a widget, which would read the text with getbyte() until ESC [201~.
+ * The pasted bytes are collected here instead, across feeds if need be,
+ * and inserted in one go when the end marker arrives.
+ *
+ * Each session has its own line, cursor, mark, keymap, numeric argument
+ * and undo history, swapped into the ZLE globals while it is fed.  The
+ * kill ring, history and keymap definitions are shared.  Sessions are
+ * fed under the context lock.  The line and undo records are
+ * zle_utils.c's, which frees and grows them with free() and realloc(),
+ * so they (and what it converts for us) are freed here with free().
+ */
+
+#include <pthread.h>
+
+#include "libzsh_int.h"
+#include "zle.mdh"
+
+/* ZLE globals and functions that are not exported */
+extern ZLE_STRING_T zleline;
+extern int zlell, zlecs, linesz, mark, region_active;
+extern Keymap curkeymap, localkeymap;
+extern char *curkeymapname;
+extern struct modifier zmod;
+extern int prefixflag, lastcmd, insmode, done;
+extern struct change *changes, *curchange;
+extern zlong undo_changeno, undo_limitno;
+extern int kungetct;
+extern HashTable keymapnamtab;
+extern char *zlenoargs[];
+#ifdef MULTIBYTE_SUPPORT
+extern int lastchar_wide_valid;
+#endif
+
+extern void init_thingies(void);
+extern void init_keymaps(void);
+extern void sizeline(int sz);
+extern void spaceinline(int ct);
+extern ZLE_STRING_T stringaszleline(char *instr, int incs,
+                                    int *outll, int *outsz, int *outcs);
+extern void handleprefixes(void);
+extern void handleundo(void);
+extern void setlastline(void);
+extern void ungetbytes(char *s, int len);
+extern int selectkeymap(char *name, int fb);
+extern int execzlefunc(Thingy func, char **args, int set_bindk,
+                       int set_lbindk);
+extern void initmodifier(struct modifier *mp);
+extern int invicmdmode(void);
+extern int findbol(void);
+extern int findeol(void);
+
+/* Input made available to a widget that reads for itself */
+#define ZLE_LOOKAHEAD 16
+/* String bindings expanded in a row before we give up on a loop */
+#define ZLE_MACRO_MAX 100
+
+/* The ZLE globals that belong to a session */
+struct zle_state {
+    ZLE_STRING_T zleline;
+    int zlell, zlecs, linesz, mark, region_active;
+    Keymap curkeymap, localkeymap;
+    char *curkeymapname;
+    struct modifier zmod;
+    int prefixflag, lastcmd, insmode, done;
+    struct change *changes, *curchange;
+    zlong undo_changeno, undo_limitno;
+};
+
+/* Raw bytes kept by a session, with a cursor offset */
+struct zle_text {
+    char *buf;                  /* NUL-terminated */
+    size_t len, sz, cs;
+};
+
+struct libzsh_zle {
+    struct zle_state state;     /* the session, while not being fed */
+    struct zle_state outer;     /* the displaced globals, while fed */
+    char *in;                   /* queued input */
+    size_t inpos, inlen, insz;
+    int accepted;               /* the line was accepted; clear on next feed */
+    int pasting;                /* collecting a bracketed paste */
+    char *paste;                /* the text pasted so far */
+    size_t pastelen, pastesz;
+    char *line;                 /* last line returned by libzsh_zle_line() */
+    size_t linesz;
+    libzsh_history *hist;       /* for the history widgets, or NULL */
+    long histpos;               /* line shown, -1 for the one being edited */
+    struct zle_text edit;       /* that one, while a history line is shown */
+    int searching;              /* -1 or 1 in a search back or forward */
+    long searchpos;             /* histpos when the search began */
+    struct zle_text orig;       /* the line then, for send-break */
+    struct zle_text search;     /* the search string */
+};
+
+/*
+ * Widgets that read one more character themselves, and those that run
+ * a read loop of their own.
+ */
+static const char *const reads_char[] = {
+    "quoted-insert", "vi-quoted-insert",
+    "vi-find-next-char", "vi-find-next-char-skip",
+    "vi-find-prev-char", "vi-find-prev-char-skip",
+    "vi-replace-chars", "vi-set-buffer", "vi-set-mark",
+    "vi-goto-mark", "vi-goto-mark-line",
+    NULL
+};
+
+static const char *const reads_loop[] = {
+    "history-incremental-search-backward",
+    "history-incremental-search-forward",
+    "history-incremental-pattern-search-backward",
+    "history-incremental-pattern-search-forward",
+    "vi-history-search-backward", "vi-history-search-forward",
+    "execute-named-cmd", "where-is", "describe-key-briefly",
+    "read-command", "universal-argument", "argument-base",
+    "vi-change", "vi-delete", "vi-yank", "vi-indent", "vi-unindent",
+    "vi-oper-swap-case", "vi-up-case", "vi-down-case",
+    NULL
+};
+
+/* Widgets run on a session's history instead, and how */
+#define HW_STEP   0             /* to the next line */
+#define HW_WORD   1             /* to the next starting with the first word */
+#define HW_PREFIX 2             /* ... with the line up to the cursor */
+#define HW_SEARCH 3             /* incremental search */
+
+static const struct hist_widget {
+    const char *name;
+    int kind, dir;
+    int lines;                  /* goes up or down the line's own first */
+} hist_widgets[] = {
+    { "up-line-or-history", HW_STEP, -1, 1 },
+    { "down-line-or-history", HW_STEP, 1, 1 },
+    { "up-history", HW_STEP, -1, 0 },
+    { "down-history", HW_STEP, 1, 0 },
+    { "up-line-or-search", HW_WORD, -1, 1 },
+    { "down-line-or-search", HW_WORD, 1, 1 },
+    { "history-search-backward", HW_WORD, -1, 0 },
+    { "history-search-forward", HW_WORD, 1, 0 },
+    { "history-beginning-search-backward", HW_PREFIX, -1, 0 },
+    { "history-beginning-search-forward", HW_PREFIX, 1, 0 },
+    { "history-incremental-search-backward", HW_SEARCH, -1, 0 },
+    { "history-incremental-search-forward", HW_SEARCH, 1, 0 },
+    { NULL, 0, 0, 0 }
+};
+
+static pthread_once_t zle_init_once = PTHREAD_ONCE_INIT;
+
+static void zle_init_routine(void)
+{
+    libzsh_init();
+    init_thingies();
+    init_keymaps();
+#ifdef LIBZSH_HASH_INDEX
+    libzsh_hashtable_index(thingytab);
+    libzsh_hashtable_index(keymapnamtab);
+#endif
+}
+
+int libzsh_zle_init(void)
+{
+    return pthread_once(&zle_init_once, zle_init_routine) ? -1 : 0;
+}
+
+static int name_in(const char *name, const char *const *list)
+{
+    for (; *list; list++)
+        if (!strcmp(name, *list))
+            return 1;
+    return 0;
+}
+
+static void zle_state_save(struct zle_state *st)
+{
+    st->zleline = zleline;
+    st->zlell = zlell;
+    st->zlecs = zlecs;
+    st->linesz = linesz;
+    st->mark = mark;
+    st->region_active = region_active;
+    st->curkeymap = curkeymap;
+    st->localkeymap = localkeymap;
+    st->curkeymapname = curkeymapname;
+    st->zmod = zmod;
+    st->prefixflag = prefixflag;
+    st->lastcmd = lastcmd;
+    st->insmode = insmode;
+    st->done = done;
+    st->changes = changes;
+    st->curchange = curchange;
+    st->undo_changeno = undo_changeno;
+    st->undo_limitno = undo_limitno;
+}
+
+static void zle_state_restore(const struct zle_state *st)
+{
+    zleline = st->zleline;
+    zlell = st->zlell;
+    zlecs = st->zlecs;
+    linesz = st->linesz;
+    mark = st->mark;
+    region_active = st->region_active;
+    curkeymap = st->curkeymap;
+    localkeymap = st->localkeymap;
+    curkeymapname = st->curkeymapname;
+    zmod = st->zmod;
+    prefixflag = st->prefixflag;
+    lastcmd = st->lastcmd;
+    insmode = st->insmode;
+    done = st->done;
+    changes = st->changes;
+    curchange = st->curchange;
+    undo_changeno = st->undo_changeno;
+    undo_limitno = st->undo_limitno;
+}
+
+/* Install the session's state; called with the lock held */
+static void zle_enter(libzsh_zle *s)
+{
+    zle_state_save(&s->outer);
+    zle_state_restore(&s->state);
+    /* Undo records changes against the line as it last saw it */
+    setlastline();
+    pushheap();
+}
+
+static void zle_leave(libzsh_zle *s)
+{
+    popheap();
+    zle_state_save(&s->state);
+    zle_state_restore(&s->outer);
+}
+
+static void clear_line(libzsh_zle *s)
+{
+    s->histpos = -1;
+    s->searching = 0;
+    zlell = zlecs = mark = 0;
+    region_active = 0;
+    zleline[0] = ZWC('\0');
+    initmodifier(&zmod);
+    prefixflag = 0;
+    done = 0;
+}
+
+libzsh_zle *libzsh_zle_new(const char *keymap)
+{
+    libzsh_zle *s;
+
+    if (!keymap)
+        keymap = "main";
+
+    /* Undo records are zle_utils.c's, which may free this one */
+    s = (libzsh_zle *)zshcalloc(sizeof(*s));
+    s->state.changes = s->state.curchange =
+        (struct change *)calloc(1, sizeof(struct change));
+    if (!s->state.changes) {
+        zfree(s, sizeof(*s));
+        return NULL;
+    }
+
+    libzsh_lock();
+    zle_enter(s);
+    sizeline(256);
+    clear_line(s);
+    if (selectkeymap((char *)keymap, 0)) {
+        zle_leave(s);
+        libzsh_unlock();
+        libzsh_zle_free(s);
+        return NULL;
+    }
+    zle_leave(s);
+    libzsh_unlock();
+
+    return s;
+}
+
+void libzsh_zle_free(libzsh_zle *s)
+{
+    struct change *ch, *next;
+
+    if (!s)
+        return;
+    for (ch = s->state.changes; ch; ch = next) {
+        next = ch->next;
+        free(ch->del);
+        free(ch->ins);
+        free(ch);
+    }
+    free(s->state.zleline);
+    zsfree(s->state.curkeymapname);
+    if (s->in)
+        zfree(s->in, s->insz);
+    if (s->line)
+        zfree(s->line, s->linesz);
+    if (s->paste)
+        zfree(s->paste, s->pastesz);
+    if (s->edit.buf)
+        zfree(s->edit.buf, s->edit.sz);
+    if (s->orig.buf)
+        zfree(s->orig.buf, s->orig.sz);
+    if (s->search.buf)
+        zfree(s->search.buf, s->search.sz);
+    zfree(s, sizeof(*s));
+}
+
+/* Bytes needed to complete the character starting at p, 0 if complete */
+static int char_incomplete(const char *p, size_t n)
+{
+#ifdef MULTIBYTE_SUPPORT
+    mbstate_t mbs;
+    wchar_t wc;
+
+    if (!n)
+        return 1;
+    if ((unsigned char)*p < 0x80)
+        return 0;
+    memset(&mbs, 0, sizeof(mbs));
+    return mbrtowc(&wc, p, n, &mbs) == (size_t)-2;
+#else
+    return !n;
+#endif
+}
+
+/*
+ * Insert raw text at the cursor: one conversion with stringaszleline(),
+ * one spaceinline() (which grows the line through sizeline()) and one
+ * copy, so the cost is linear in the length of the text.  Recorded as a
+ * single undo event.
+ */
+static void insert_text(const char *buf, size_t len)
+{
+    ZLE_STRING_T ws;
+    int wl, wsz;
+
+    if (!len)
+        return;
+    ws = stringaszleline(metafy((char *)buf, (int)len, META_HEAPDUP), 0,
+                         &wl, &wsz, NULL);
+    spaceinline(wl);
+    ZS_memcpy(zleline + zlecs, ws, wl);
+    zlecs += wl;
+    free(ws);
+    handleundo();
+}
+
+/* Keep len bytes of buf (which may be in t already) in t */
+static void text_set(struct zle_text *t, const char *buf, size_t len,
+                     size_t cs)
+{
+    if (len + 1 > t->sz) {
+        size_t sz = t->sz ? t->sz : 64;
+        char *nb;
+
+        while (sz < len + 1)
+            sz *= 2;
+        nb = (char *)zalloc(sz);
+        memcpy(nb, buf, len);
+        if (t->buf)
+            zfree(t->buf, t->sz);
+        t->buf = nb;
+        t->sz = sz;
+    } else
+        memmove(t->buf, buf, len);
+    t->buf[len] = '\0';
+    t->len = len;
+    t->cs = cs;
+}
+
+/* The line as raw bytes on the heap, with the cursor's offset in *cs */
+static char *line_text(size_t *len, size_t *cs)
+{
+    int outll, outcs, ulen, i, c;
+    char *str = zlelineasstring(zleline, zlell, zlecs, &outll, &outcs, 1);
+
+    for (i = c = 0; i < outcs; i++, c++)
+        if (str[i] == Meta)
+            i++;
+    unmetafy(str, &ulen);
+    *len = ulen;
+    *cs = c;
+    return str;
+}
+
+/* Make raw bytes the line, with the cursor cs bytes in, as setline() */
+static void show_text(const char *buf, size_t len, size_t cs)
+{
+    int incs = (int)strlen(metafy((char *)buf, (int)cs, META_HEAPDUP));
+
+    free(zleline);
+    zleline = stringaszleline(metafy((char *)buf, (int)len, META_HEAPDUP),
+                              incs, &zlell, &linesz, &zlecs);
+    if (mark > zlell)
+        mark = zlell;
+    region_active = 0;
+}
+
+/* Offset of needle in line, which contains it */
+static size_t text_find(const char *line, size_t len, const char *needle,
+                        size_t nlen)
+{
+    size_t i;
+
+    for (i = 0; i + nlen <= len; i++)
+        if (!memcmp(line + i, needle, nlen))
+            break;
+    return i;
+}
+
+/*
+ * Show history line idx, or the edited line for -1, with the cursor cs
+ * bytes in (at the end if it is past it).  The edited line is kept when
+ * another is first shown.
+ */
+static void hist_show(libzsh_zle *s, long idx, size_t cs)
+{
+    const char *line;
+    size_t len;
+
+    if (idx < 0) {
+        line = s->edit.buf;
+        len = s->edit.len;
+    } else {
+        if (s->histpos < 0) {
+            size_t elen, ecs;
+            char *cur = line_text(&elen, &ecs);
+
+            text_set(&s->edit, cur, elen, ecs);
+        }
+        line = libzsh_history_get(s->hist, idx, &len);
+    }
+    show_text(line, len, cs < len ? cs : len);
+    s->histpos = idx;
+}
+
+/*
+ * The next line from idx (-1 for the edited line) back (dir < 0) or
+ * forward that starts with str (prefix set) or contains it, skipping
+ * any the same as skip; -1 if there is none.
+ */
+static long hist_find(libzsh_zle *s, long idx, int dir, const char *str,
+                      size_t len, int prefix, const char *skip,
+                      size_t skiplen)
+{
+    size_t count = libzsh_history_count(s->hist), llen;
+    const char *line;
+
+    for (;;) {
+        if (dir < 0) {
+            size_t before = idx < 0 ? count : (size_t)idx;
+
+            idx = prefix ?
+                libzsh_history_prefix(s->hist, str, len, before) :
+                libzsh_history_search(s->hist, str, len, before);
+        } else if (idx >= 0)
+            idx = prefix ?
+                libzsh_history_prefix_after(s->hist, str, len, idx) :
+                libzsh_history_search_after(s->hist, str, len, idx);
+        if (idx < 0 || !skip)
+            return idx;
+        line = libzsh_history_get(s->hist, idx, &llen);
+        if (llen != skiplen || memcmp(line, skip, llen))
+            return idx;
+    }
+}
+
+/*
+ * Show the next match for the search string in the search's direction;
+ * with stay, the line shown is kept if it still matches.  Returns
+ * LIBZSH_ZLE_* events.
+ */
+static int search_next(libzsh_zle *s, int stay)
+{
+    const char *line;
+    size_t len;
+    long idx = -1;
+
+    if (!s->search.len)
+        return LIBZSH_ZLE_BEEP;
+    if (stay && s->histpos >= 0) {
+        line = libzsh_history_get(s->hist, s->histpos, &len);
+        if (text_find(line, len, s->search.buf, s->search.len) +
+            s->search.len <= len)
+            idx = s->histpos;
+    }
+    if (idx < 0)
+        idx = hist_find(s, s->histpos, s->searching, s->search.buf,
+                        s->search.len, 0, NULL, 0);
+    if (idx < 0)
+        return LIBZSH_ZLE_BEEP;
+    line = libzsh_history_get(s->hist, idx, &len);
+    hist_show(s, idx, text_find(line, len, s->search.buf, s->search.len));
+    handleundo();
+    return LIBZSH_ZLE_REDRAW;
+}
+
+/*
+ * Take the next queued byte in an incremental search, adding its events
+ * to *events.  Returns 0 if it ends the search and is to be run as a
+ * key instead.
+ */
+static int search_key(libzsh_zle *s, int *events)
+{
+    unsigned char c = (unsigned char)s->in[s->inpos];
+    size_t len = s->search.len;
+    char *buf;
+
+    if (c == '\a') {
+        /* send-break: back to the line the search began on */
+        s->inpos++;
+        s->searching = 0;
+        show_text(s->orig.buf, s->orig.len, s->orig.cs);
+        s->histpos = s->searchpos;
+        handleundo();
+        *events |= LIBZSH_ZLE_REDRAW;
+        return 1;
+    }
+    if (c == 022 || c == 023) {
+        /* ^R, ^S: the next match back or forward */
+        s->inpos++;
+        s->searching = c == 022 ? -1 : 1;
+        *events |= search_next(s, 0);
+        return 1;
+    }
+    if (c == '\b' || c == 0177) {
+        /* Drop the last character (a UTF-8 one whole) and search again */
+        s->inpos++;
+        while (len && ((unsigned char)s->search.buf[--len] & 0xc0) == 0x80)
+            ;
+        text_set(&s->search, s->search.buf, len, 0);
+        show_text(s->orig.buf, s->orig.len, s->orig.cs);
+        s->histpos = s->searchpos;
+        *events |= LIBZSH_ZLE_REDRAW;
+        if (len)
+            *events |= search_next(s, 1);
+        else
+            handleundo();
+        return 1;
+    }
+    if (c < 040) {
+        s->searching = 0;
+        return 0;
+    }
+    s->inpos++;
+    buf = (char *)zhalloc(len + 1);
+    memcpy(buf, s->search.buf, len);
+    buf[len] = (char)c;
+    text_set(&s->search, buf, len + 1, 0);
+    *events |= search_next(s, 1);
+    return 1;
+}
+
+/* Run history widget w on the session's history; returns LIBZSH_ZLE_* */
+static int hist_run(libzsh_zle *s, const struct hist_widget *w)
+{
+    int n = zmult, dir = w->dir, events = LIBZSH_ZLE_REDRAW;
+    size_t count = libzsh_history_count(s->hist), len, cs, plen;
+    char *cur;
+    long idx;
+
+    if (w->kind == HW_SEARCH) {
+        cur = line_text(&len, &cs);
+        text_set(&s->orig, cur, len, cs);
+        text_set(&s->search, "", 0, 0);
+        s->searching = dir;
+        s->searchpos = s->histpos;
+        handleprefixes();
+        return events;
+    }
+
+    if (n < 0) {
+        n = -n;
+        dir = -dir;
+    }
+    while (n--) {
+        cur = line_text(&len, &cs);
+        if (w->kind == HW_STEP) {
+            if (dir < 0 ? !s->histpos || !count : s->histpos < 0)
+                break;
+            if (dir < 0)
+                idx = s->histpos < 0 ? (long)count - 1 : s->histpos - 1;
+            else
+                idx = (size_t)s->histpos + 1 < count ? s->histpos + 1 : -1;
+            hist_show(s, idx, (size_t)-1);
+            continue;
+        }
+        /* The first word, or the line up to the cursor */
+        if (w->kind == HW_WORD)
+            for (plen = 0; plen < len && !inblank(cur[plen]); plen++)
+                ;
+        else
+            plen = cs;
+        idx = hist_find(s, s->histpos, dir, cur, plen, 1, cur, len);
+        if (idx < 0 && (dir < 0 || s->histpos < 0 || s->edit.len < plen ||
+                        memcmp(s->edit.buf, cur, plen)))
+            break;
+        /* Past the newest match, the edited line if it matches too */
+        hist_show(s, idx, w->kind == HW_WORD ? (size_t)-1 : cs);
+    }
+    if (n >= 0)
+        events |= LIBZSH_ZLE_BEEP;
+    handleprefixes();
+    handleundo();
+    return events;
+}
+
+/*
+ * Move queued input into the paste buffer up to the end marker.
+ * Returns 1 once the paste is complete, 0 if more input is needed.
+ */
+static int paste(libzsh_zle *s)
+{
+    static const char end[] = "\033[201~";
+    const size_t endlen = sizeof(end) - 1;
+    const char *p = s->in + s->inpos, *e = s->in + s->inlen, *q = p;
+    size_t take, skip = 0;
+
+    while ((q = memchr(q, '\033', e - q))) {
+        size_t avail = (size_t)(e - q) < endlen ? (size_t)(e - q) : endlen;
+
+        if (!memcmp(q, end, avail)) {
+            /* The whole marker, or what has arrived of it so far */
+            skip = avail;
+            break;
+        }
+        q++;
+    }
+    if (!q)
+        q = e;
+    take = q - p;
+
+    if (s->pastelen + take > s->pastesz) {
+        size_t sz = s->pastesz ? s->pastesz : 256;
+        char *nb;
+
+        while (sz < s->pastelen + take)
+            sz *= 2;
+        nb = (char *)zalloc(sz);
+        if (s->paste) {
+            memcpy(nb, s->paste, s->pastelen);
+            zfree(s->paste, s->pastesz);
+        }
+        s->paste = nb;
+        s->pastesz = sz;
+    }
+    memcpy(s->paste + s->pastelen, p, take);
+    s->pastelen += take;
+    s->inpos += take;
+
+    if (skip < endlen)
+        return 0;
+    s->inpos += skip;
+    s->pasting = 0;
+
+    /* Terminals send returns for newlines, as bracketedstring() knows */
+    for (take = 0; take < s->pastelen; take++)
+        if (s->paste[take] == '\r')
+            s->paste[take] = '\n';
+    insert_text(s->paste, s->pastelen);
+    s->pastelen = 0;
+    return 1;
+}
+
+/*
+ * Find the binding for the queued input, as getkeymapcmd() does: keep
+ * going while the keys so far are a prefix of some binding and use the
+ * longest one that is bound.  Returns its length, with *tp and *strp
+ * set as by keybind(); *tp is NULL for an undefined key.  Returns 0 if
+ * more input is needed to decide, which with timedout set never
+ * happens.  The lookup is done in the keymap's compiled table.
+ */
+static size_t resolve(libzsh_zle *s, int timedout, Thingy *tp, char **strp)
+{
+    Keymap km = localkeymap ? localkeymap : curkeymap;
+
+    return libzsh_keymap_resolve(libzsh_keymap_for(km), s->in + s->inpos,
+                                 s->inlen - s->inpos, timedout, tp, strp);
+}
+
+/*
+ * Run one widget for the queued input; returns LIBZSH_ZLE_* events.
+ * *how is DISPATCH_WAIT if more input is needed first, DISPATCH_MACRO
+ * if the keys were replaced by a string binding.
+ */
+#define DISPATCH_RAN   0
+#define DISPATCH_WAIT  1
+#define DISPATCH_MACRO 2
+
+static int dispatch(libzsh_zle *s, int timedout, int *how)
+{
+    Thingy t;
+    char *str;
+    size_t n = resolve(s, timedout, &t, &str), rest, push;
+    unsigned char last;
+
+    *how = DISPATCH_RAN;
+    if (!n) {
+        *how = DISPATCH_WAIT;
+        return 0;
+    }
+
+    if (str) {
+        /* A string binding (bindkey -s): replace the keys with it */
+        int len;
+        char *u = unmetafy(dupstring(str), &len);
+        size_t need = s->inlen - s->inpos - n + len;
+
+        if (need > s->insz) {
+            char *nb = (char *)zalloc(need);
+
+            memcpy(nb + len, s->in + s->inpos + n, s->inlen - s->inpos - n);
+            if (s->in)
+                zfree(s->in, s->insz);
+            s->in = nb;
+            s->insz = need;
+        } else
+            memmove(s->in + len, s->in + s->inpos + n,
+                    s->inlen - s->inpos - n);
+        memcpy(s->in, u, len);
+        s->inpos = 0;
+        s->inlen = need;
+        *how = DISPATCH_MACRO;
+        return 0;
+    }
+
+    last = (unsigned char)s->in[s->inpos + n - 1];
+    rest = s->inlen - s->inpos - n;
+
+    if (!t) {
+        s->inpos += n;
+        return LIBZSH_ZLE_BEEP;
+    }
+
+    /* End of input on an empty line, as zlecore() checks */
+    if (!zlell && last == 4) {
+        s->inpos += n;
+        return LIBZSH_ZLE_EOF;
+    }
+
+    if (!strcmp(t->nam, "bracketed-paste")) {
+        s->inpos += n;
+        s->pasting = 1;
+        return 0;
+    }
+    if (s->hist) {
+        const struct hist_widget *w;
+
+        for (w = hist_widgets; w->name; w++)
+            if (!strcmp(t->nam, w->name))
+                break;
+        if (w->name && !(w->lines && (w->dir < 0 ? findbol() > 0 :
+                                      findeol() < zlell))) {
+            s->inpos += n;
+            return hist_run(s, w);
+        }
+    }
+    if (name_in(t->nam, reads_loop)) {
+        s->inpos += n;
+        return LIBZSH_ZLE_BEEP;
+    }
+    /* Wait for the rest of a character the widget will read */
+    if (!timedout &&
+        ((name_in(t->nam, reads_char) && char_incomplete(s->in + s->inpos + n,
+                                                         rest)) ||
+         (last >= 0x80 &&
+          char_incomplete(s->in + s->inpos + n - 1, rest + 1)))) {
+        *how = DISPATCH_WAIT;
+        return 0;
+    }
+    if (timedout && (name_in(t->nam, reads_char) ||
+                     (last >= 0x80 &&
+                      char_incomplete(s->in + s->inpos + n - 1, rest + 1)))) {
+        /* Not going to get it: don't let the widget read on */
+        s->inpos += n;
+        return LIBZSH_ZLE_BEEP;
+    }
+
+    s->inpos += n;
+    lastchar = last;
+#ifdef MULTIBYTE_SUPPORT
+    lastchar_wide_valid = 0;
+#endif
+    push = rest < ZLE_LOOKAHEAD ? rest : ZLE_LOOKAHEAD;
+    kungetct = 0;
+    if (push)
+        ungetbytes(s->in + s->inpos, (int)push);
+
+    if (execzlefunc(t, zlenoargs, 1, 0)) {
+        handleprefixes();
+        handleundo();
+        s->inpos += push - kungetct;
+        kungetct = 0;
+        return LIBZSH_ZLE_BEEP | LIBZSH_ZLE_REDRAW;
+    }
+    handleprefixes();
+    /* For vi mode, make sure the cursor isn't somewhere illegal */
+    if (invicmdmode() && zlecs > findbol() &&
+        (zlecs == zlell || zleline[zlecs] == ZWC('\n')))
+        DECCS();
+    handleundo();
+
+    s->inpos += push - kungetct;
+    kungetct = 0;
+    return LIBZSH_ZLE_REDRAW;
+}
+
+/* Queue bytes and process as much input as possible */
+static int feed(libzsh_zle *s, const char *bytes, size_t n, int timedout)
+{
+    int events = 0, how = DISPATCH_RAN, macros = 0;
+
+    if (s->inpos && s->inpos == s->inlen)
+        s->inpos = s->inlen = 0;
+    if (n) {
+        if (s->inlen + n > s->insz) {
+            size_t sz = s->insz ? s->insz : 256;
+            char *nb;
+
+            while (sz < s->inlen - s->inpos + n)
+                sz *= 2;
+            nb = (char *)zalloc(sz);
+            memcpy(nb, s->in + s->inpos, s->inlen - s->inpos);
+            if (s->in)
+                zfree(s->in, s->insz);
+            s->in = nb;
+            s->insz = sz;
+            s->inlen -= s->inpos;
+            s->inpos = 0;
+        }
+        memcpy(s->in + s->inlen, bytes, n);
+        s->inlen += n;
+    }
+
+    libzsh_lock();
+    zle_enter(s);
+
+    if (s->accepted) {
+        clear_line(s);
+        s->accepted = 0;
+        events |= LIBZSH_ZLE_REDRAW;
+    }
+
+    while (s->inpos < s->inlen) {
+        if (s->pasting) {
+            /* Not a pending key sequence: timeouts don't end a paste */
+            if (!paste(s))
+                break;
+            events |= LIBZSH_ZLE_REDRAW;
+            continue;
+        }
+        if (s->searching && search_key(s, &events))
+            continue;
+        events |= dispatch(s, timedout, &how);
+        if (how == DISPATCH_WAIT)
+            break;
+        if (how == DISPATCH_MACRO) {
+            if (++macros > ZLE_MACRO_MAX) {
+                /* A string binding that expands to itself */
+                s->inpos = s->inlen;
+                events |= LIBZSH_ZLE_BEEP;
+                break;
+            }
+            continue;
+        }
+        macros = 0;
+        if (errflag) {
+            /* send-break: the line is abandoned */
+            errflag = 0;
+            clear_line(s);
+            events |= LIBZSH_ZLE_BREAK | LIBZSH_ZLE_REDRAW;
+        }
+        if (done) {
+            done = 0;
+            s->accepted = 1;
+            events |= LIBZSH_ZLE_ACCEPT;
+            break;
+        }
+        if (events & LIBZSH_ZLE_EOF)
+            break;
+    }
+
+    zle_leave(s);
+    libzsh_unlock();
+
+    if (how == DISPATCH_WAIT)
+        events |= LIBZSH_ZLE_PENDING;
+    if (s->inpos == s->inlen || how == DISPATCH_WAIT || s->pasting)
+        events |= LIBZSH_ZLE_NEED_INPUT;
+    return events;
+}
+
+int libzsh_zle_feed(libzsh_zle *s, const char *bytes, size_t n)
+{
+    return feed(s, bytes, n, 0);
+}
+
+int libzsh_zle_timeout(libzsh_zle *s)
+{
+    return feed(s, NULL, 0, 1);
+}
+
+const char *libzsh_zle_line(libzsh_zle *s, size_t *len, size_t *cursor)
+{
+    int outll, outcs, ulen, cs, i;
+    char *str;
+
+    libzsh_lock();
+    str = zlelineasstring(s->state.zleline, s->state.zlell, s->state.zlecs,
+                          &outll, &outcs, 0);
+    libzsh_unlock();
+
+    /* The cursor offset in the unmetafied text */
+    for (i = cs = 0; i < outcs; i++, cs++)
+        if (str[i] == Meta)
+            i++;
+    unmetafy(str, &ulen);
+
+    if ((size_t)ulen + 1 > s->linesz) {
+        if (s->line)
+            zfree(s->line, s->linesz);
+        s->linesz = ulen + 1 > 256 ? ulen + 1 : 256;
+        s->line = (char *)zalloc(s->linesz);
+    }
+    memcpy(s->line, str, ulen);
+    s->line[ulen] = '\0';
+    free(str);
+
+    if (len)
+        *len = ulen;
+    if (cursor)
+        *cursor = cs;
+    return s->line;
+}
+
+void libzsh_zle_set_line(libzsh_zle *s, const char *buf, size_t len)
+{
+    libzsh_lock();
+    zle_enter(s);
+    clear_line(s);
+    s->accepted = 0;
+    setline(metafy((char *)buf, (int)len, META_HEAPDUP), ZSL_TOEND);
+    zle_leave(s);
+    libzsh_unlock();
+}
+
+void libzsh_zle_insert(libzsh_zle *s, const char *buf, size_t len)
+{
+    libzsh_lock();
+    zle_enter(s);
+    if (s->accepted) {
+        clear_line(s);
+        s->accepted = 0;
+    }
+    insert_text(buf, len);
+    zle_leave(s);
+    libzsh_unlock();
+}
+
+void libzsh_zle_set_history(libzsh_zle *s, libzsh_history *h)
+{
+    s->hist = h;
+    s->histpos = -1;
+    s->searching = 0;
+}
+
+const char *libzsh_zle_search(libzsh_zle *s, size_t *len)
+{
+    if (!s->searching)
+        return NULL;
+    if (len)
+        *len = s->search.len;
+    return s->search.buf;
+}
@@ -6,9 +6,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <locale.h>
+
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "zsh.mdh"
+#include "libzsh.h"
+#include "libzsh_tls.h"
+
+#ifdef LIBZSH_WITH_ZLE
+#include "zle.mdh"
+
+/* ZLE functions that are not exported */
+extern Keymap openkeymap(char *name);
+extern int bindkey(Keymap km, const char *seq, Thingy bind, char *str);
+extern Thingy refthingy(Thingy th);
+#endif
 
 /* Test counters */
 static int tests_run = 0;
@@ -35,68 +48,17 @@ static int tests_passed = 0;
         } \
     } while (0)
 
-/*
- * Forward declarations for functions not in .epro headers
- */
-extern void createoptiontable(void);
-extern void createaliastables(void);
-extern void createreswdtable(void);
-
 /* Global variables we need to initialize */
-extern unsigned char *cmdstack;
-extern int cmdsp;
-extern int strin;  /* flag: reading from string, not stdin */
-#define CMDSTACKSZ 256
+extern LIBZSH_TLS_strin int strin;  /* flag: reading from string, not stdin */
 
 /*
  * Minimal initialization for testing parser/lexer
- * Note: We intentionally skip job control since it's not needed for parsing.
+ * Note: libzsh_init() intentionally skips job control since it's not
+ * needed for parsing.
  */
-static int initialized = 0;
-
 static void init_for_tests(void)
 {
-    if (initialized)
-        return;
-
-#ifdef USE_LOCALE
-    setlocale(LC_ALL, "");
-#endif
-
-    /* Set up metafication type table */
-    int t0;
-    typtab['\0'] |= IMETA;
-    typtab[STOUC(Meta)] |= IMETA;
-    typtab[STOUC(Marker)] |= IMETA;
-    for (t0 = (int)STOUC(Pound); t0 <= (int)STOUC(Nularg); t0++)
-        typtab[t0] |= ITOK | IMETA;
-
-    /* Set up file descriptor table */
-    fdtable_size = zopenmax();
-    fdtable = zshcalloc(fdtable_size * sizeof(*fdtable));
-    fdtable[0] = fdtable[1] = fdtable[2] = FDT_EXTERNAL;
-
-    /* Create option table (needed for parser) */
-    createoptiontable();
-
-    /* Initialize lexer tables */
-    initlextabs();
-
-    /* Initialize hash tables needed for parsing */
-    createreswdtable();   /* reserved words: if, then, else, fi, etc. */
-    createaliastables();  /* aliases */
-
-    /* Initialize command stack for parser */
-    cmdstack = (unsigned char *)zalloc(CMDSTACKSZ);
-    cmdsp = 0;
-
-    /* Initialize parser state */
-    init_parse();
-
-    /* Initialize history mechanism (sets up hgetc, hungetc, etc.) */
-    hbegin(0);  /* 0 = don't save history */
-
-    initialized = 1;
+    libzsh_init();
 }
 
 /*
@@ -151,6 +113,162 @@ static int test_reswdtab(void)
     return 1;
 }
 
+/*
+ * Test: An indexed hash table answers as its chains do
+ */
+extern int libzsh_hashtable_index(HashTable ht);
+extern void libzsh_hashtable_unindex(HashTable ht);
+
+static void free_test_node(HashNode hn)
+{
+    zsfree(hn->nam);
+    zfree(hn, sizeof(*hn));
+}
+
+static int test_hashtable_index(void)
+{
+    static const char *const words[] = {
+        "if", "then", "fi", "echo", "[[", "}", "a-name-longer-than-inline",
+    };
+    HashTable ht;
+    HashNode hn, old;
+    char buf[40];
+    size_t i;
+
+    init_for_tests();
+
+    /* The reserved word table, whether or not it is indexed */
+    for (i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+        ASSERT(reswdtab->getnode(reswdtab, words[i]) ==
+               gethashnode(reswdtab, words[i]));
+
+    ht = newhashtable(17, "test", NULL);
+    ht->hash = hasher;
+    ht->emptytable = emptyhashtable;
+    ht->cmpnodes = strcmp;
+    ht->addnode = addhashnode;
+    ht->getnode = gethashnode;
+    ht->getnode2 = gethashnode2;
+    ht->removenode = removehashnode;
+    ht->freenode = free_test_node;
+    for (i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "before-%zu", i);
+        ht->addnode(ht, ztrdup(buf), zshcalloc(sizeof(struct hashnode)));
+    }
+    ASSERT(libzsh_hashtable_index(ht) == 0);
+    ASSERT(ht->getnode != gethashnode);
+
+    /* Nodes from before and after indexing, long names and short */
+    for (i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), i % 2 ? "n%zu" : "a-longer-name-%zu", i);
+        ht->addnode(ht, ztrdup(buf), zshcalloc(sizeof(struct hashnode)));
+    }
+    ASSERT(ht->ct == 1100);
+    ASSERT(ht->getnode(ht, "before-42") == gethashnode(ht, "before-42"));
+    ASSERT(ht->getnode(ht, "n999") != NULL);
+    ASSERT(ht->getnode(ht, "a-longer-name-998") != NULL);
+    ASSERT(ht->getnode(ht, "n998") == NULL);
+
+    /* Replacing, removing and disabling */
+    old = ht->getnode(ht, "a-longer-name-10");
+    hn = (HashNode)zshcalloc(sizeof(struct hashnode));
+    ht->addnode(ht, ztrdup("a-longer-name-10"), hn);
+    ASSERT(old != hn && ht->getnode(ht, "a-longer-name-10") == hn);
+    for (i = 0; i < 1000; i += 3) {
+        snprintf(buf, sizeof(buf), i % 2 ? "n%zu" : "a-longer-name-%zu", i);
+        if ((old = ht->removenode(ht, buf)))
+            free_test_node(old);
+    }
+    for (i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), i % 2 ? "n%zu" : "a-longer-name-%zu", i);
+        ASSERT(ht->getnode2(ht, buf) == gethashnode2(ht, buf));
+        ASSERT((ht->getnode(ht, buf) != NULL) == (i % 3 != 0));
+    }
+    hn = ht->getnode(ht, "n1");
+    hn->flags |= DISABLED;
+    ASSERT(ht->getnode(ht, "n1") == NULL && ht->getnode2(ht, "n1") == hn);
+
+    ht->emptytable(ht);
+    ASSERT(ht->getnode2(ht, "n1") == NULL);
+    libzsh_hashtable_unindex(ht);
+    ASSERT(ht->getnode == gethashnode);
+    deletehashtable(ht);
+
+    return 1;
+}
+
+/*
+ * Test: The tables made at build time agree with the ones zsh builds
+ */
+struct libzsh_phash;
+extern const struct libzsh_phash libzsh_phash_reswd;
+extern int libzsh_hashtable_perfect(HashTable ht,
+                                    const struct libzsh_phash *ph);
+
+static int test_phash_tables(void)
+{
+    HashTable ht;
+    HashNode hn;
+    int i;
+
+    init_for_tests();
+
+    ASSERT(libzsh_is_reserved_word("if"));
+    ASSERT(libzsh_is_reserved_word("[["));
+    ASSERT(libzsh_is_reserved_word("}"));
+    ASSERT(!libzsh_is_reserved_word("echo"));
+    ASSERT(!libzsh_is_reserved_word("iff"));
+    ASSERT(!libzsh_is_reserved_word(""));
+    ASSERT(libzsh_is_builtin("echo"));
+    ASSERT(libzsh_is_builtin("alias"));
+    ASSERT(!libzsh_is_builtin("ls"));
+
+    ASSERT(libzsh_option_lookup("EXTENDED_GLOB") == EXTENDEDGLOB);
+    ASSERT(libzsh_option_lookup("noextendedglob") == -EXTENDEDGLOB);
+    ASSERT(libzsh_option_lookup("bogus") == OPT_INVALID);
+    ASSERT(libzsh_option_lookup("no") == OPT_INVALID);
+
+    /* Every name in the tables zsh builds, and nothing else */
+    for (i = 0; i < reswdtab->hsize; i++)
+        for (hn = reswdtab->nodes[i]; hn; hn = hn->next) {
+            ASSERT(libzsh_is_reserved_word(hn->nam));
+            ASSERT(reswdtab->getnode2(reswdtab, hn->nam) == hn);
+        }
+    for (i = 0; i < optiontab->hsize; i++)
+        for (hn = optiontab->nodes[i]; hn; hn = hn->next) {
+            ASSERT(libzsh_option_lookup(hn->nam) == optlookup(hn->nam));
+            ASSERT(optiontab->getnode2(optiontab, hn->nam) == hn);
+        }
+    ASSERT(reswdtab->getnode(reswdtab, "echo") == NULL);
+
+    /* A table leaves the perfect hash when a name outside it is added */
+    ht = newhashtable(17, "test", NULL);
+    ht->hash = hasher;
+    ht->emptytable = emptyhashtable;
+    ht->cmpnodes = strcmp;
+    ht->addnode = addhashnode;
+    ht->getnode = gethashnode;
+    ht->getnode2 = gethashnode2;
+    ht->removenode = removehashnode;
+    ht->freenode = free_test_node;
+    ht->addnode(ht, ztrdup("if"), zshcalloc(sizeof(struct hashnode)));
+    ht->addnode(ht, ztrdup("fi"), zshcalloc(sizeof(struct hashnode)));
+    ASSERT(libzsh_hashtable_perfect(ht, &libzsh_phash_reswd) == 0);
+    ht->addnode(ht, ztrdup("then"), zshcalloc(sizeof(struct hashnode)));
+    if ((hn = ht->removenode(ht, "fi")))
+        free_test_node(hn);
+    ASSERT(ht->getnode(ht, "then") == gethashnode(ht, "then"));
+    ASSERT(ht->getnode(ht, "fi") == NULL && ht->getnode(ht, "if") != NULL);
+    ht->addnode(ht, ztrdup("echo"), zshcalloc(sizeof(struct hashnode)));
+    ASSERT(ht->getnode(ht, "echo") == gethashnode(ht, "echo"));
+    ASSERT(ht->getnode(ht, "if") == gethashnode(ht, "if"));
+    ASSERT(libzsh_hashtable_perfect(ht, &libzsh_phash_reswd) == -1);
+    libzsh_hashtable_unindex(ht);
+    deletehashtable(ht);
+
+    return 1;
+}
+
 /*
  * Test: Lexer tokenization
  */
@@ -494,6 +612,1866 @@ static int test_dupstring(void)
     return 1;
 }
 
+/*
+ * Test: zalloc() from a context's pool, freed with the context
+ */
+static int test_alloc_pools(void)
+{
+    struct libzsh_alloc_stats st, shared, after;
+    libzsh_context *ctx;
+    char *big, *p;
+    int i;
+
+    init_for_tests();
+
+    ctx = libzsh_context_new();
+    ASSERT(ctx != NULL);
+    if (libzsh_alloc_stats(ctx, &st) != 0) {
+        /* Built without LIBZSH_POOL_ALLOC */
+        ASSERT(st.allocs == 0);
+        libzsh_context_free(ctx);
+        return 1;
+    }
+    ASSERT(st.class_size[0] == 16);
+    ASSERT(st.class_size[LIBZSH_ALLOC_CLASSES - 1] == 256);
+
+    libzsh_context_enter(ctx);
+    (void)ztrdup("left for the context to free");
+    big = (char *)zalloc(1000);
+    for (i = 0; i < 1000; i++) {
+        p = zalloc(40);
+        memset(p, i, 40);
+        p = zrealloc(p, 48);        /* same class */
+        p = zrealloc(p, 300);       /* to malloc() */
+        zfree(p, 300);
+    }
+    libzsh_context_leave(ctx);
+
+    /* A large block freed outside goes back to the context's pool */
+    ASSERT(libzsh_alloc_stats(NULL, &shared) == 0);
+    zfree(big, 1000);
+    ASSERT(libzsh_alloc_stats(NULL, &after) == 0);
+    ASSERT(after.frees == shared.frees);
+
+    ASSERT(libzsh_alloc_stats(ctx, &st) == 0);
+    ASSERT(st.allocs >= 2002);
+    ASSERT(st.frees >= 2001);
+    ASSERT(st.large >= 1001);
+    ASSERT(st.live[1] >= 1);        /* the string, 29 bytes */
+    ASSERT(st.chunks >= 1);
+
+    /* Its chunks go with it, not to the shared pool */
+    ASSERT(libzsh_alloc_stats(NULL, &shared) == 0);
+    libzsh_context_free(ctx);
+    ASSERT(libzsh_alloc_stats(NULL, &after) == 0);
+    ASSERT(after.chunks <= shared.chunks);
+    for (i = 0; i < LIBZSH_ALLOC_CLASSES; i++)
+        ASSERT(after.live[i] <= shared.live[i]);
+
+    return 1;
+}
+
+/*
+ * Test: heap arenas freed by popheap() are reused by the next push
+ */
+static int test_heap_arenas(void)
+{
+    struct libzsh_heap_policy pol, saved;
+    struct libzsh_heap_stats st, st2;
+    int round, flags;
+
+    init_for_tests();
+
+    if (libzsh_heap_get_policy(&saved) != 0) {
+        /* Heaps not mapped through libzsh */
+        ASSERT(libzsh_heap_stats(&st) == -1);
+        return 1;
+    }
+    pol.retain = 1024 * 1024;
+    pol.flags = 0xff;
+    ASSERT(libzsh_heap_set_policy(&pol) == -1);
+
+    for (flags = 0; flags <= LIBZSH_HEAP_THP; flags += LIBZSH_HEAP_THP) {
+        pol.flags = flags;
+        ASSERT(libzsh_heap_set_policy(&pol) == 0);
+        for (round = 0; round < 3; round++) {
+            char *big;
+
+            ASSERT(libzsh_heap_stats(&st) == 0);
+            pushheap();
+            big = zhalloc(100000);  /* more than an arena holds */
+            memset(big, 'x', 100000);
+            ASSERT(libzsh_heap_stats(&st2) == 0);
+            ASSERT(st2.in_use > st.in_use);
+            ASSERT(st2.peak >= st2.in_use);
+            popheap();
+            ASSERT(libzsh_heap_stats(&st2) == 0);
+            if (round)
+                ASSERT(st2.reused > st.reused && st2.maps == st.maps);
+        }
+    }
+    ASSERT(st2.retained >= 100000);
+
+    ASSERT(libzsh_heap_set_policy(&saved) == 0);
+    return 1;
+}
+
+/*
+ * Test: per-context counters, the trace hook and the recorded trace
+ */
+static int trace_hook_calls[2];
+
+static void trace_hook(void *data, int kind, int phase,
+                       unsigned long long ns)
+{
+    (void)data;
+    (void)ns;
+    if (kind == LIBZSH_TRACE_PARSE)
+        trace_hook_calls[phase]++;
+}
+
+static int test_trace_stats(void)
+{
+    static const char src[] = "for i in a b; do echo $(cat $i); done\n";
+    struct libzsh_stats st, other;
+    libzsh_context *ctx, *ctx2;
+    char buf[4096];
+    FILE *f;
+    size_t n;
+
+    init_for_tests();
+
+    ctx = libzsh_context_new();
+    ASSERT(ctx != NULL);
+    if (libzsh_stats_get(ctx, &st) != 0) {
+        /* Built without LIBZSH_TRACE */
+        ASSERT(errno == ENOSYS && st.tokens == 0);
+        ASSERT(libzsh_trace_record(ctx, 16) == -1);
+        libzsh_context_free(ctx);
+        return 1;
+    }
+    ASSERT(st.tokens == 0 && st.calls[LIBZSH_TRACE_PARSE] == 0);
+    ctx2 = libzsh_context_new();
+    ASSERT(ctx2 != NULL);
+
+    ASSERT(libzsh_context_set_trace(ctx, trace_hook, NULL) == 0);
+    ASSERT(libzsh_trace_record(ctx, 16) == 0);
+    ASSERT(libzsh_parse(ctx, src, strlen(src), 0) != NULL);
+
+    ASSERT(libzsh_stats_get(ctx, &st) == 0);
+    ASSERT(st.tokens >= 10);
+    ASSERT(st.eprog_bytes > 0);
+    ASSERT(st.calls[LIBZSH_TRACE_PARSE] >= 1);
+    ASSERT(trace_hook_calls[LIBZSH_TRACE_BEGIN] ==
+           trace_hook_calls[LIBZSH_TRACE_END]);
+    ASSERT(trace_hook_calls[LIBZSH_TRACE_END] ==
+           (int)st.calls[LIBZSH_TRACE_PARSE]);
+
+    /* Nothing was counted against the other context */
+    ASSERT(libzsh_stats_get(ctx2, &other) == 0);
+    ASSERT(other.tokens == 0 && other.eprog_bytes == 0);
+
+    f = tmpfile();
+    ASSERT(f != NULL);
+    ASSERT(libzsh_trace_write(ctx, fileno(f)) ==
+           (int)st.calls[LIBZSH_TRACE_PARSE]);
+    rewind(f);
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    ASSERT(strncmp(buf, "{\"traceEvents\":[", 16) == 0);
+    ASSERT(strstr(buf, "\"name\":\"parse\"") != NULL);
+    ASSERT(strstr(buf, "\"ph\":\"X\"") != NULL);
+
+    ASSERT(libzsh_stats_reset(ctx) == 0);
+    ASSERT(libzsh_stats_get(ctx, &st) == 0);
+    ASSERT(st.tokens == 0 && st.calls[LIBZSH_TRACE_PARSE] == 0);
+
+    libzsh_context_free(ctx2);
+    libzsh_context_free(ctx);
+    return 1;
+}
+
+/*
+ * Helper: parse a string inside an entered context
+ */
+static int parse_in_context(const char *cmd, const char *expect)
+{
+    int ok = 0;
+
+    pushheap();
+    lexinit();
+
+    inpush(dupstring(cmd), 0, NULL);
+
+    Eprog prog = parse_list();
+    if (prog && !empty_eprog(prog)) {
+        char *text = getpermtext(prog, prog->prog, 0);
+        ok = text && strstr(text, expect) != NULL;
+        zsfree(text);
+    }
+
+    inpop();
+    popheap();
+
+    return ok;
+}
+
+/*
+ * Test: Options set in one context don't leak into another
+ */
+static int test_context_isolation(void)
+{
+    init_for_tests();
+
+    libzsh_context *a = libzsh_context_new();
+    libzsh_context *b = libzsh_context_new();
+    ASSERT(a != NULL);
+    ASSERT(b != NULL);
+
+    ASSERT(libzsh_context_setopt(a, "shwordsplit", 1) == 0);
+    ASSERT(libzsh_context_setopt(a, "no_such_option", 1) == -1);
+
+    libzsh_context_enter(a);
+    int a_set = isset(SHWORDSPLIT);
+    int a_ok = parse_in_context("echo from a\n", "from a");
+    libzsh_context_leave(a);
+
+    libzsh_context_enter(b);
+    int b_set = isset(SHWORDSPLIT);
+    int b_ok = parse_in_context("echo from b\n", "from b");
+    /* Setting an option from inside the context */
+    ASSERT(libzsh_context_setopt(b, "ksharrays", 1) == 0);
+    int b_inside = isset(KSHARRAYS);
+    ASSERT(libzsh_context_setopt(b, "ksharrays", 0) == 0);
+    libzsh_context_leave(b);
+
+    ASSERT(a_set);
+    ASSERT(!b_set);
+    ASSERT(a_ok);
+    ASSERT(b_ok);
+    ASSERT(b_inside);
+
+    /* The process-wide option state is untouched */
+    ASSERT(!isset(SHWORDSPLIT));
+
+    libzsh_context_free(a);
+    libzsh_context_free(b);
+
+    return 1;
+}
+
+#define CONTEXT_THREADS 4
+#define CONTEXT_PARSES 100
+
+static void *context_thread(void *arg)
+{
+    int *passed = arg;
+    libzsh_context *ctx = libzsh_context_new();
+
+    for (int i = 0; i < CONTEXT_PARSES; i++) {
+        libzsh_context_enter(ctx);
+        *passed += parse_in_context("if true; then echo yes; fi\n", "then");
+        libzsh_context_leave(ctx);
+    }
+
+    libzsh_context_free(ctx);
+    return NULL;
+}
+
+/*
+ * Test: Contexts can be used from several threads at once
+ */
+static int test_context_threads(void)
+{
+    pthread_t threads[CONTEXT_THREADS];
+    int passed[CONTEXT_THREADS] = {0};
+
+    init_for_tests();
+
+    for (int i = 0; i < CONTEXT_THREADS; i++)
+        ASSERT(pthread_create(&threads[i], NULL, context_thread, &passed[i]) == 0);
+    for (int i = 0; i < CONTEXT_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < CONTEXT_THREADS; i++)
+        ASSERT(passed[i] == CONTEXT_PARSES);
+
+    return 1;
+}
+
+static void *parse_thread(void *arg)
+{
+    int *passed = arg;
+    libzsh_context *ctx = libzsh_context_new();
+    const char *src = "for f in *.c; do wc -l $f | sort; done";
+    unsigned short type[32];
+    unsigned int start[32], len[32];
+    unsigned char flags[32];
+    struct libzsh_tokens toks = { 32, 0, type, start, len, flags };
+
+    for (int i = 0; i < CONTEXT_PARSES; i++) {
+        Eprog prog = libzsh_parse(ctx, src, strlen(src), 0);
+        char *text = prog ? libzsh_eprog_text(ctx, prog) : NULL;
+
+        /* Lexing turns alias expansion off while it runs */
+        *passed += text && strstr(text, "wc -l $f | sort") != NULL &&
+            libzsh_lex(ctx, src, strlen(src), &toks) == 0;
+        zsfree(text);
+    }
+
+    libzsh_context_free(ctx);
+    return NULL;
+}
+
+/*
+ * Test: libzsh_parse() runs on several threads at once, each parse
+ * giving the same program as alone
+ */
+static int test_parse_threads(void)
+{
+    pthread_t threads[CONTEXT_THREADS];
+    int passed[CONTEXT_THREADS] = {0};
+
+    init_for_tests();
+
+    for (int i = 0; i < CONTEXT_THREADS; i++)
+        ASSERT(pthread_create(&threads[i], NULL, parse_thread, &passed[i]) == 0);
+    for (int i = 0; i < CONTEXT_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < CONTEXT_THREADS; i++)
+        ASSERT(passed[i] == CONTEXT_PARSES);
+
+    /* ...and has it back on afterwards */
+    libzsh_context *ctx = libzsh_context_new();
+    libzsh_context_enter(ctx);
+    aliastab->addnode(aliastab, ztrdup("ll"),
+                      createaliasnode(ztrdup("ls -l"), 0));
+    libzsh_context_leave(ctx);
+    Eprog prog = libzsh_parse(ctx, "ll", 2, 0);
+    ASSERT(prog != NULL);
+    char *text = libzsh_eprog_text(ctx, prog);
+    ASSERT(text && strcmp(text, "ls -l") == 0);
+    zsfree(text);
+    libzsh_context_enter(ctx);
+    aliastab->freenode(aliastab->removenode(aliastab, "ll"));
+    libzsh_context_leave(ctx);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: One-call parse from a caller-owned buffer
+ */
+static int test_parse_api(void)
+{
+    libzsh_context *ctx = libzsh_context_new();
+    ASSERT(ctx != NULL);
+
+    /* Not NUL- or newline-terminated: only the first 8 bytes count */
+    const char buf[] = "echo onexxxx";
+    Eprog prog = libzsh_parse(ctx, buf, 8, 0);
+    ASSERT(prog != NULL);
+    ASSERT(!empty_eprog(prog));
+
+    char *text = libzsh_eprog_text(ctx, prog);
+    ASSERT(text != NULL);
+    ASSERT(strcmp(text, "echo one") == 0);
+    zsfree(text);
+
+    /* A parse error gives NULL and leaves the context usable */
+    const char *bad = "if true; then";
+    ASSERT(libzsh_parse(ctx, bad, strlen(bad), LIBZSH_PARSE_QUIET) == NULL);
+
+    /* Permanent results outlive the arena */
+    const char *perm = "cat file | wc -l";
+    prog = libzsh_parse(ctx, perm, strlen(perm), LIBZSH_PARSE_PERMANENT);
+    ASSERT(prog != NULL);
+    libzsh_reset(ctx);
+    for (int i = 0; i < 1000; i++)
+        ASSERT(libzsh_parse(ctx, buf, 8, 0) != NULL);
+    text = libzsh_eprog_text(ctx, prog);
+    ASSERT(strstr(text, "wc -l") != NULL);
+    zsfree(text);
+    freeeprog(prog);
+
+    /* The wordcode buffer is kept between parses, not allocated for each */
+    struct libzsh_alloc_stats st, shared, st2, shared2;
+
+    if (libzsh_alloc_stats(ctx, &st) == 0) {
+        ASSERT(libzsh_alloc_stats(NULL, &shared) == 0);
+        for (int i = 0; i < 1000; i++)
+            ASSERT(libzsh_parse(ctx, buf, 8, 0) != NULL);
+        ASSERT(libzsh_alloc_stats(ctx, &st2) == 0);
+        ASSERT(libzsh_alloc_stats(NULL, &shared2) == 0);
+        ASSERT((st2.large - st.large) + (shared2.large - shared.large) < 10);
+    }
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Errors go to the context's sink as records
+ */
+struct diag_seen {
+    int count;
+    struct libzsh_diag last;
+    char token[32];
+    char text[128];
+};
+
+static void diag_record(void *data, const struct libzsh_diag *d)
+{
+    struct diag_seen *seen = (struct diag_seen *)data;
+
+    seen->count++;
+    seen->last = *d;
+    snprintf(seen->token, sizeof(seen->token), "%.*s",
+             d->nstr ? (int)d->len[0] : 0, d->nstr ? d->str[0] : "");
+    libzsh_diag_format(d, seen->text, sizeof(seen->text));
+}
+
+static int test_diag_sink(void)
+{
+    libzsh_context *ctx = libzsh_context_new();
+    const char *bad = "echo ok\nfi\n";
+    struct diag_seen seen;
+    char small[8];
+    int count;
+#ifdef LIBZSH_WITH_PATTERNS
+    const char *math[] = { "$(( 1 + ))" };
+    struct libzsh_expansion out;
+#endif
+
+    memset(&seen, 0, sizeof(seen));
+    libzsh_context_set_diag(ctx, diag_record, &seen);
+
+    ASSERT(libzsh_parse(ctx, bad, strlen(bad), 0) == NULL);
+    ASSERT(seen.count == 1);
+    ASSERT(seen.last.severity == LIBZSH_DIAG_ERROR);
+    ASSERT(seen.last.source == LIBZSH_DIAG_PARSER);
+    ASSERT(seen.last.line == 2);
+    ASSERT(strcmp(seen.token, "fi") == 0);
+    ASSERT(strcmp(seen.text, "parse error near `fi'") == 0);
+    ASSERT(seen.last.offset >= 10 && seen.last.offset <= (long)strlen(bad));
+
+    /* Truncated like snprintf() */
+    ASSERT(libzsh_diag_format(&seen.last, small, sizeof(small)) ==
+           strlen(seen.text));
+    ASSERT(strcmp(small, "parse e") == 0);
+
+    /* Nothing for good input or while errors are suppressed */
+    ASSERT(libzsh_parse(ctx, "echo ok", 7, 0) != NULL);
+    ASSERT(libzsh_parse(ctx, bad, strlen(bad), LIBZSH_PARSE_QUIET) == NULL);
+    ASSERT(seen.count == 1);
+
+#ifdef LIBZSH_WITH_PATTERNS
+    ASSERT(libzsh_expand(ctx, math, 1, 0, &out) == 1);
+    libzsh_expansion_free(&out);
+    ASSERT(seen.count == 2);
+    ASSERT(seen.last.source == LIBZSH_DIAG_MATH);
+    ASSERT(seen.last.offset == -1);
+    ASSERT(strstr(seen.text, "math") != NULL);
+#endif
+
+    count = seen.count;
+    libzsh_context_set_diag(ctx, NULL, NULL);
+    ASSERT(libzsh_parse(ctx, bad, strlen(bad), LIBZSH_PARSE_QUIET) == NULL);
+    ASSERT(seen.count == count);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Parse cache hands out shared programs and honours options
+ */
+static int test_parse_cache(void)
+{
+    struct libzsh_parse_cache_stats stats;
+    libzsh_context *ctx = libzsh_context_new();
+    libzsh_context *ksh = libzsh_context_new();
+    libzsh_parse_cache *cache = libzsh_parse_cache_new(2);
+    ASSERT(cache != NULL);
+
+    ASSERT(libzsh_context_setopt(ksh, "kshglob", 1) == 0);
+
+    const char *cmd = "ls *.c | sort";
+    Eprog p1 = libzsh_parse_cached(ctx, cache, cmd, strlen(cmd), 0);
+    Eprog p2 = libzsh_parse_cached(ctx, cache, cmd, strlen(cmd), 0);
+    ASSERT(p1 != NULL);
+    ASSERT(p1 == p2);
+
+    /* Different option state is a different key */
+    Eprog p3 = libzsh_parse_cached(ksh, cache, cmd, strlen(cmd), 0);
+    ASSERT(p3 != NULL);
+    ASSERT(p3 != p1);
+
+    /* Evicting p1 leaves the caller's references intact */
+    const char *other = "echo other";
+    Eprog p4 = libzsh_parse_cached(ctx, cache, other, strlen(other), 0);
+    ASSERT(p4 != NULL);
+
+    libzsh_parse_cache_stats(cache, &stats);
+    ASSERT(stats.entries == 2);
+    ASSERT(stats.hits == 1);
+    ASSERT(stats.misses == 3);
+    ASSERT(stats.evictions == 1);
+
+    char *text = libzsh_eprog_text(ctx, p1);
+    ASSERT(strstr(text, "sort") != NULL);
+    zsfree(text);
+
+    /* Failed parses are not cached */
+    const char *bad = "( echo";
+    ASSERT(libzsh_parse_cached(ctx, cache, bad, strlen(bad),
+                               LIBZSH_PARSE_QUIET) == NULL);
+
+    libzsh_eprog_release(ctx, p1);
+    libzsh_eprog_release(ctx, p2);
+    libzsh_eprog_release(ctx, p3);
+    libzsh_eprog_release(ctx, p4);
+
+    libzsh_parse_cache_free(cache);
+    libzsh_context_free(ksh);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Programs survive a round trip through a .zwc file
+ */
+static int test_wordcode_dump(void)
+{
+    char path[] = "/tmp/libzsh_test_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0);
+    close(fd);
+
+    libzsh_context *ctx = libzsh_context_new();
+    const char *src[2] = {
+        "for i in a b c; do echo $i; done",
+        "if [[ -n $1 ]]; then print -r -- ${1:-x}; fi"
+    };
+    const char *names[2] = { "dir/loop", "cond" };
+    Eprog progs[2];
+    char *texts[2];
+
+    for (int i = 0; i < 2; i++) {
+        progs[i] = libzsh_parse(ctx, src[i], strlen(src[i]),
+                                LIBZSH_PARSE_PERMANENT);
+        ASSERT(progs[i] != NULL);
+        texts[i] = libzsh_eprog_text(ctx, progs[i]);
+    }
+
+    ASSERT(libzsh_dump_wordcode(path, names, progs, 2) == 0);
+
+    libzsh_wordcode *wc = libzsh_load_wordcode(path);
+    ASSERT(wc != NULL);
+    ASSERT(libzsh_wordcode_count(wc) == 2);
+    ASSERT(strcmp(libzsh_wordcode_name(wc, 0), "dir/loop") == 0);
+
+    /* Looked up by the name without its directory, as autoload does */
+    Eprog loaded[2] = {
+        libzsh_wordcode_get(wc, "loop"),
+        libzsh_wordcode_get(wc, "cond")
+    };
+    ASSERT(libzsh_wordcode_get(wc, "missing") == NULL);
+
+    for (int i = 0; i < 2; i++) {
+        ASSERT(loaded[i] != NULL);
+        ASSERT(loaded[i]->flags & EF_MAP);
+        char *text = libzsh_eprog_text(ctx, loaded[i]);
+        ASSERT(strcmp(text, texts[i]) == 0);
+        zsfree(text);
+        zsfree(texts[i]);
+        libzsh_eprog_release(ctx, loaded[i]);
+        libzsh_eprog_release(ctx, progs[i]);
+    }
+
+    libzsh_wordcode_close(wc);
+
+    /* Headers that don't fit, or point into the header, are refused */
+    unsigned int map[1024], hlen;
+    FILE *f = fopen(path, "rb");
+    ASSERT(f != NULL);
+    size_t words = fread(map, sizeof(*map), 1024, f);
+    fclose(f);
+    ASSERT(words > 24 && words < 1024);
+    hlen = map[12];
+    for (int i = 0; i < 2; i++) {
+        if (i == 0)
+            map[12] = 14;               /* too short for one function */
+        else
+            map[12 + map[16]] = 0;      /* the second starts in it */
+        f = fopen(path, "wb");
+        ASSERT(f != NULL);
+        ASSERT(fwrite(map, sizeof(*map), words, f) == words);
+        fclose(f);
+        ASSERT(libzsh_load_wordcode(path) == NULL);
+        map[12] = hlen;
+    }
+
+    libzsh_context_free(ctx);
+    unlink(path);
+
+    return 1;
+}
+
+/*
+ * Test: Parsed programs are walked node by node
+ */
+struct visit_trace {
+    char buf[512];
+    int skip_kind, stop_at_wc;
+    int ls_ok;
+    long for_line;
+};
+
+static int span_is(const struct libzsh_span *sp, const char *s)
+{
+    return sp->len == strlen(s) && memcmp(sp->s, s, sp->len) == 0;
+}
+
+static int visit_record(void *data, const struct libzsh_node *node, int event)
+{
+    struct visit_trace *t = (struct visit_trace *)data;
+    size_t len = strlen(t->buf), i;
+
+    if (event == LIBZSH_VISIT_LEAVE) {
+        snprintf(t->buf + len, sizeof(t->buf) - len, "/%d ", node->kind);
+        return 0;
+    }
+    len += snprintf(t->buf + len, sizeof(t->buf) - len, "%d@%d%s%s%s[",
+                    node->kind, node->depth,
+                    node->flags & LIBZSH_NODE_PIPED ? "p" : "",
+                    node->flags & LIBZSH_NODE_AND ? "&" : "",
+                    node->flags & LIBZSH_NODE_ELSE ? "e" : "");
+    for (i = 0; i < node->nwords; i++)
+        len += snprintf(t->buf + len, sizeof(t->buf) - len, "%s%.*s",
+                        i ? " " : "", (int)node->words[i].len,
+                        node->words[i].s);
+    snprintf(t->buf + len, sizeof(t->buf) - len, "] ");
+
+    if (node->nwords && span_is(&node->words[0], "ls"))
+        t->ls_ok = node->nassigns == 1 &&
+            span_is(&node->assigns[0].name, "a") &&
+            node->assigns[0].nvalues == 1 &&
+            span_is(&node->assigns[0].values[0], "1") &&
+            node->nredirs == 2 &&
+            node->redirs[0].type == REDIR_WRITE &&
+            node->redirs[0].fd == 1 &&
+            span_is(&node->redirs[0].target, "out") &&
+            node->redirs[1].type == REDIR_MERGEOUT &&
+            node->redirs[1].fd == 2 &&
+            span_is(&node->redirs[1].target, "1");
+    if (node->kind == LIBZSH_NODE_FOR)
+        t->for_line = node->nnames == 1 ? node->lineno : -1;
+    if (t->stop_at_wc && node->nwords && span_is(&node->words[0], "wc")) {
+        if (t->stop_at_wc == -1)
+            errno = ERANGE;
+        return t->stop_at_wc;
+    }
+    return node->kind == t->skip_kind ? LIBZSH_VISIT_SKIP : 0;
+}
+
+static int test_wordcode_visit(void)
+{
+    libzsh_context *ctx = libzsh_context_new();
+    const char *cmd = "a=1 ls -l >out 2>&1 | wc -l && "
+        "if true; then echo hi; else echo no; fi";
+    const char *defs = "f() { cat; }\nfor i in a b; do :; done";
+    struct visit_trace t;
+    Eprog prog;
+
+    prog = libzsh_parse(ctx, cmd, strlen(cmd), LIBZSH_PARSE_PERMANENT);
+    ASSERT(prog != NULL);
+
+    memset(&t, 0, sizeof(t));
+    ASSERT(libzsh_visit(prog, visit_record, &t) == 0);
+    ASSERT(strcmp(t.buf, "6@0p[ls -l] 6@0[wc -l] 17@0&[] "
+                  "32@1[] 6@2[true] 6@2[echo hi] /32 "
+                  "32@1e[] 6@2[echo no] /32 /17 ") == 0);
+    ASSERT(t.ls_ok);
+
+    /* Skipping the if leaves out its branches and its leaving */
+    memset(&t, 0, sizeof(t));
+    t.skip_kind = LIBZSH_NODE_IF;
+    ASSERT(libzsh_visit(prog, visit_record, &t) == 0);
+    ASSERT(strcmp(t.buf, "6@0p[ls -l] 6@0[wc -l] 17@0&[] ") == 0);
+
+    /* Anything else stops the walk and is passed back */
+    memset(&t, 0, sizeof(t));
+    t.stop_at_wc = 7;
+    ASSERT(libzsh_visit(prog, visit_record, &t) == 7);
+    ASSERT(strcmp(t.buf, "6@0p[ls -l] 6@0[wc -l] ") == 0);
+
+    /* Even -1, with errno as the callback set it */
+    memset(&t, 0, sizeof(t));
+    t.stop_at_wc = -1;
+    ASSERT(libzsh_visit(prog, visit_record, &t) == -1 && errno == ERANGE);
+
+    /* A string that runs off the end of the table is refused */
+    struct eprog cut = *prog;
+    cut.len = prog->npats * sizeof(Patprog) +
+        (prog->strs - (char *)prog->prog) + 2;
+    memset(&t, 0, sizeof(t));
+    ASSERT(libzsh_visit(&cut, visit_record, &t) == -1 && errno == EINVAL);
+    libzsh_eprog_release(ctx, prog);
+
+    /* A function's body has strings of its own */
+    prog = libzsh_parse(ctx, defs, strlen(defs), 0);
+    ASSERT(prog != NULL);
+    memset(&t, 0, sizeof(t));
+    ASSERT(libzsh_visit(prog, visit_record, &t) == 0);
+    ASSERT(strcmp(t.buf, "11@0[f] 6@1[cat] /11 "
+                  "12@0[i a b] 6@1[:] /12 ") == 0);
+    ASSERT(t.for_line == 2);
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Helper: collect the start lines and text of streamed lists
+ */
+struct stream_result {
+    int count;
+    long lines[8];
+    int saw_while;
+};
+
+static int stream_event(void *data, Eprog prog, long lineno)
+{
+    struct stream_result *res = data;
+    char *text = getpermtext(prog, prog->prog, 0);
+
+    if (res->count < 8)
+        res->lines[res->count] = lineno;
+    res->count++;
+    if (strstr(text, "while"))
+        res->saw_while = 1;
+    zsfree(text);
+
+    return 0;
+}
+
+static int write_temp_script(char *path, const char *script)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    if (write(fd, script, strlen(script)) != (ssize_t)strlen(script)) {
+        close(fd);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+ * Test: Scripts are parsed from a file descriptor one list at a time
+ */
+static int test_parse_fd(void)
+{
+    struct stream_result res = {0};
+    char path[] = "/tmp/libzsh_test_XXXXXX";
+    long errline = 0;
+    const char *script =
+        "echo one\n"
+        "\n"
+        "while read x; do\n"
+        "  print $x\n"
+        "done\n"
+        "ls | wc -l";
+
+    libzsh_context *ctx = libzsh_context_new();
+    int fd = write_temp_script(path, script);
+    ASSERT(fd >= 0);
+
+    ASSERT(libzsh_parse_fd(ctx, fd, 0, stream_event, &res, &errline) == 0);
+    ASSERT(res.count == 3);
+    ASSERT(res.lines[0] == 1);
+    ASSERT(res.lines[1] == 3);
+    ASSERT(res.lines[2] == 6);
+    ASSERT(res.saw_while);
+    close(fd);
+    unlink(path);
+
+    /* Lists before an error are still delivered */
+    char bad_path[] = "/tmp/libzsh_test_XXXXXX";
+    memset(&res, 0, sizeof(res));
+    fd = write_temp_script(bad_path, "echo ok\nif true; then\n");
+    ASSERT(fd >= 0);
+    ASSERT(libzsh_parse_fd(ctx, fd, LIBZSH_PARSE_QUIET, stream_event,
+                           &res, &errline) == -1);
+    ASSERT(res.count == 1);
+    ASSERT(errline >= 2);
+    close(fd);
+    unlink(bad_path);
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Many files are syntax-checked by worker threads
+ */
+struct check_seen {
+    pthread_t caller;
+    int calls, elsewhere;
+    int status[4];
+    long line[4], col[4];
+    char message[4][64];
+};
+
+static void check_record(void *data, size_t index,
+                         const struct libzsh_check_result *r)
+{
+    struct check_seen *seen = (struct check_seen *)data;
+
+    seen->calls++;
+    seen->elsewhere += !pthread_equal(pthread_self(), seen->caller);
+    if (index >= 4)
+        return;
+    seen->status[index] = r->status;
+    seen->line[index] = r->line;
+    seen->col[index] = r->col;
+    snprintf(seen->message[index], sizeof(seen->message[index]), "%s",
+             r->message);
+}
+
+static int test_check_files(void)
+{
+    char good[] = "/tmp/libzsh_test_XXXXXX";
+    char bad[] = "/tmp/libzsh_test_XXXXXX";
+    char empty[] = "/tmp/libzsh_test_XXXXXX";
+    char loop[] = "/tmp/libzsh_test_XXXXXX";
+    const char *paths[4];
+    struct check_seen seen;
+    libzsh_context *ctx = libzsh_context_new();
+    int fd;
+
+    fd = write_temp_script(good, "for f in *.c; do\n  cc -c $f\ndone\n");
+    ASSERT(fd >= 0);
+    close(fd);
+    fd = write_temp_script(bad, "true\necho hi )\n");
+    ASSERT(fd >= 0);
+    close(fd);
+    fd = write_temp_script(empty, "");
+    ASSERT(fd >= 0);
+    close(fd);
+    paths[0] = good;
+    paths[1] = bad;
+    paths[2] = "/nonexistent/script";
+    paths[3] = empty;
+
+    memset(&seen, 0, sizeof(seen));
+    seen.caller = pthread_self();
+    ASSERT(libzsh_check_files(ctx, paths, 4, 2, check_record, &seen) == 2);
+    ASSERT(seen.calls == 4 && seen.elsewhere == 0);
+    ASSERT(seen.status[0] == LIBZSH_CHECK_OK);
+    ASSERT(seen.status[1] == LIBZSH_CHECK_ESYNTAX);
+    ASSERT(seen.line[1] == 2 && seen.col[1] == 9);
+    ASSERT(strstr(seen.message[1], "parse error") != NULL);
+    ASSERT(seen.status[2] == LIBZSH_CHECK_EOPEN);
+    ASSERT(seen.status[3] == LIBZSH_CHECK_OK);
+
+    /* One worker per processor, and no files at all */
+    memset(&seen, 0, sizeof(seen));
+    seen.caller = pthread_self();
+    ASSERT(libzsh_check_files(ctx, paths, 2, 0, check_record, &seen) == 1);
+    ASSERT(seen.calls == 2 && seen.status[1] == LIBZSH_CHECK_ESYNTAX);
+    ASSERT(seen.elsewhere == 0);
+    ASSERT(libzsh_check_files(ctx, paths, 0, 0, check_record, &seen) == 0);
+
+    /* The workers parse with ctx's options */
+    fd = write_temp_script(loop, "for i in a b; echo $i\n");
+    ASSERT(fd >= 0);
+    close(fd);
+    paths[0] = loop;
+    memset(&seen, 0, sizeof(seen));
+    seen.caller = pthread_self();
+    ASSERT(libzsh_check_files(ctx, paths, 1, 1, check_record, &seen) == 0);
+    ASSERT(libzsh_context_setopt(ctx, "shortloops", 0) == 0);
+    ASSERT(libzsh_check_files(ctx, paths, 1, 1, check_record, &seen) == 1);
+    ASSERT(seen.status[0] == LIBZSH_CHECK_ESYNTAX);
+
+    unlink(good);
+    unlink(bad);
+    unlink(empty);
+    unlink(loop);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Options, aliases, functions and keymaps survive an image
+ */
+extern void createshfunctable(void);
+
+static int test_state_image(void)
+{
+    char path[] = "/tmp/libzsh_image_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0);
+    close(fd);
+
+    libzsh_context *ctx = libzsh_context_new(), *other;
+    ASSERT(libzsh_context_setopt(ctx, "extendedglob", 1) == 0);
+
+#ifdef LIBZSH_WITH_ZLE
+    ASSERT(libzsh_zle_init() == 0);
+    /* A string binding, as bindkey -s makes */
+    libzsh_context_enter(ctx);
+    ASSERT(bindkey(openkeymap("main"), "\033z", refthingy(t_undefinedkey),
+                   "hi") == 0);
+    libzsh_context_leave(ctx);
+    libzsh_keymap_invalidate();
+    libzsh_keymap *kc = libzsh_keymap_compile("main");
+    size_t states = libzsh_keymap_states(kc);
+    libzsh_keymap_free(kc);
+#endif
+
+    Eprog body = libzsh_parse(ctx, "echo hi", 7, LIBZSH_PARSE_PERMANENT);
+    ASSERT(body != NULL);
+
+    libzsh_context_enter(ctx);
+    aliastab->addnode(aliastab, ztrdup("ll"),
+                      createaliasnode(ztrdup("ls -l"), 0));
+    sufaliastab->addnode(sufaliastab, ztrdup("txt"),
+                         createaliasnode(ztrdup("less"), ALIAS_SUFFIX));
+    gethashnode2(reswdtab, "select")->flags |= DISABLED;
+    if (!shfunctab)
+        createshfunctable();
+    Shfunc shf = (Shfunc)zshcalloc(sizeof(*shf));
+    shf->funcdef = body;
+    shf->lineno = 3;
+    shfunctab->addnode(shfunctab, ztrdup("greet"), shf);
+    libzsh_context_leave(ctx);
+
+    ASSERT(libzsh_image_save(ctx, path) == 0);
+
+    /* Undo it all, then load into a fresh context */
+    libzsh_context_enter(ctx);
+    aliastab->emptytable(aliastab);
+    sufaliastab->emptytable(sufaliastab);
+    gethashnode2(reswdtab, "select")->flags &= ~DISABLED;
+    shfunctab->emptytable(shfunctab);
+    libzsh_context_leave(ctx);
+
+    other = libzsh_context_new();
+    ASSERT(libzsh_image_load(other, path) == 0);
+
+    libzsh_context_enter(other);
+    ASSERT(isset(EXTENDEDGLOB));
+    Alias al = (Alias)aliastab->getnode(aliastab, "ll");
+    ASSERT(al && strcmp(al->text, "ls -l") == 0);
+    ASSERT(sufaliastab->getnode(sufaliastab, "txt") != NULL);
+    ASSERT(gethashnode2(reswdtab, "select")->flags & DISABLED);
+    ASSERT(!(gethashnode2(reswdtab, "if")->flags & DISABLED));
+    shf = (Shfunc)shfunctab->getnode(shfunctab, "greet");
+    ASSERT(shf && shf->lineno == 3 && shf->funcdef->flags == EF_REAL);
+    char *text = getpermtext(shf->funcdef, shf->funcdef->prog, 0);
+    ASSERT(strcmp(text, "echo hi") == 0);
+    zsfree(text);
+    libzsh_context_leave(other);
+
+#ifdef LIBZSH_WITH_ZLE
+    /* The keymaps are copies with the same bindings */
+    kc = libzsh_keymap_compile("main");
+    const char *widget = NULL;
+    ASSERT(libzsh_keymap_states(kc) == states);
+    ASSERT(libzsh_keymap_lookup(kc, "\033b", 2, 0, &widget, NULL) == 2);
+    ASSERT(widget && strcmp(widget, "backward-word") == 0);
+    const char *str = NULL;
+    ASSERT(libzsh_keymap_lookup(kc, "\033z", 2, 0, &widget, &str) == 2);
+    ASSERT(widget == NULL && str && strcmp(str, "hi") == 0);
+    libzsh_keymap_free(kc);
+#endif
+
+    /* A damaged image changes nothing */
+    fd = open(path, O_WRONLY);
+    ASSERT(fd >= 0);
+    lseek(fd, 64, SEEK_SET);
+    ASSERT(write(fd, "garbage", 7) == 7);
+    close(fd);
+    libzsh_context_enter(ctx);
+    aliastab->emptytable(aliastab);
+    libzsh_context_leave(ctx);
+    ASSERT(libzsh_image_load(other, path) == -1 && errno == EINVAL);
+    ASSERT(aliastab->getnode(aliastab, "ll") == NULL);
+    ASSERT(libzsh_image_load(other, "/nonexistent/image") == -1);
+
+    libzsh_context_enter(ctx);
+    sufaliastab->emptytable(sufaliastab);
+    gethashnode2(reswdtab, "select")->flags &= ~DISABLED;
+    shfunctab->emptytable(shfunctab);
+    libzsh_context_leave(ctx);
+    libzsh_context_free(other);
+    libzsh_context_free(ctx);
+    unlink(path);
+
+    return 1;
+}
+
+/*
+ * Test: Token export reports offsets into the original buffer
+ */
+static int test_lex_tokens(void)
+{
+    unsigned short type[16];
+    unsigned int start[16], len[16];
+    unsigned char flags[16];
+    struct libzsh_tokens toks = { 16, 0, type, start, len, flags };
+
+    /* "\xe2\x80\x94" (an em dash) contains a byte that gets metafied */
+    const char *buf = "if x; then echo a\xe2\x80\x94" "b | grep $(ls -l) # note\nfi";
+    libzsh_context *ctx = libzsh_context_new();
+
+    ASSERT(libzsh_lex(ctx, buf, strlen(buf), &toks) == 0);
+    ASSERT(toks.count == 11);
+
+    /* if */
+    ASSERT(type[0] == IF);
+    ASSERT(start[0] == 0 && len[0] == 2);
+    ASSERT(flags[0] & LIBZSH_TOKEN_RESERVED);
+    ASSERT(flags[0] & LIBZSH_TOKEN_CMDPOS);
+
+    /* ; */
+    ASSERT(type[2] == SEPER);
+    ASSERT(start[2] == 4 && len[2] == 1);
+
+    /* echo, then the word with the multibyte character */
+    ASSERT(type[4] == STRING);
+    ASSERT(flags[4] & LIBZSH_TOKEN_CMDPOS);
+    ASSERT(start[5] == 16 && len[5] == 5);
+    ASSERT(flags[5] & LIBZSH_TOKEN_META);
+    ASSERT(!(flags[5] & LIBZSH_TOKEN_CMDPOS));
+
+    /* The command substitution is part of a single word */
+    ASSERT(type[6] == BAR);
+    ASSERT(memcmp(buf + start[8], "$(ls -l)", len[8]) == 0);
+
+    /* The comment runs up to and including its newline */
+    ASSERT(flags[9] & LIBZSH_TOKEN_COMMENT);
+    ASSERT(memcmp(buf + start[9], "# note\n", len[9]) == 0);
+
+    ASSERT(type[10] == FI);
+    ASSERT(start[10] == strlen(buf) - 2);
+
+    /* Running out of room is reported */
+    toks.capacity = 3;
+    ASSERT(libzsh_lex(ctx, buf, strlen(buf), &toks) == 1);
+    ASSERT(toks.count == 3);
+
+    /* An unterminated quote is a lexical error */
+    toks.capacity = 16;
+    const char *bad = "echo 'oops";
+    ASSERT(libzsh_lex(ctx, bad, strlen(bad), &toks) == -1);
+    ASSERT(type[toks.count - 1] == LEXERR);
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Compare the incremental lexer's tokens with a full lex of line
+ */
+static int line_lexer_matches(libzsh_context *ctx, libzsh_line_lexer *ll,
+                              const char *line)
+{
+    unsigned short type[64];
+    unsigned int start[64], len[64];
+    unsigned char flags[64];
+    struct libzsh_tokens full = { 64, 0, type, start, len, flags };
+    const struct libzsh_tokens *inc = libzsh_line_lexer_tokens(ll);
+
+    libzsh_lex(ctx, line, strlen(line), &full);
+    if (inc->count != full.count)
+        return 0;
+    return memcmp(inc->type, type, full.count * sizeof(*type)) == 0 &&
+        memcmp(inc->start, start, full.count * sizeof(*start)) == 0 &&
+        memcmp(inc->len, len, full.count * sizeof(*len)) == 0 &&
+        memcmp(inc->flags, flags, full.count * sizeof(*flags)) == 0;
+}
+
+/*
+ * Test: Re-lexing an edited line only touches the command edited
+ */
+static int test_line_lexer(void)
+{
+    libzsh_context *ctx = libzsh_context_new();
+    libzsh_line_lexer *ll = libzsh_line_lexer_new();
+    size_t first, last;
+    const char *line;
+
+    line = "echo one; ls -l | wc; print done";
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == 0);
+    ASSERT(first == 0 && last == libzsh_line_lexer_tokens(ll)->count);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+
+    /* Typing in the middle command: only "ls -la |" is re-lexed */
+    line = "echo one; ls -la | wc; print done";
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == 0);
+    ASSERT(first == 3 && last == 6);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+
+    /* No change, nothing to do */
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == 0);
+    ASSERT(first == last);
+
+    /* Opening a quote swallows the rest of the line */
+    line = "echo one; ls '-la | wc; print done";
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == -1);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+
+    /* ...and closing it again recovers the tail */
+    line = "echo one; ls '-la' | wc; print done";
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == 0);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+
+    /* Turning ';' into ';;' or '&' into '&&' is seen */
+    line = "echo one& ls '-la' | wc; print done";
+    libzsh_line_lexer_update(ctx, ll, line, strlen(line), &first, &last);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+    line = "echo one&& ls '-la' | wc; print done";
+    libzsh_line_lexer_update(ctx, ll, line, strlen(line), &first, &last);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+
+    /* The '&&' inside [[ ]] is no place to resume or stop */
+    line = "[[ a && b ]]; echo x";
+    libzsh_line_lexer_update(ctx, ll, line, strlen(line), &first, &last);
+    line = "[[ a && bc ]]; echo x";
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == 0);
+    ASSERT(first == 0 && last == 6);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+    line = "x && b ]]; echo x";
+    libzsh_line_lexer_update(ctx, ll, line, strlen(line), &first, &last);
+    line = "[[ x && b ]]; echo x";
+    ASSERT(libzsh_line_lexer_update(ctx, ll, line, strlen(line),
+                                    &first, &last) == 0);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+    line = "echo one&& ls '-la' | wc; print done";
+    libzsh_line_lexer_update(ctx, ll, line, strlen(line), &first, &last);
+
+    /* The caller says where the edit is: "x" typed after "wc" */
+    line = "echo one&& ls '-la' | wcx; print done";
+    ASSERT(libzsh_line_lexer_edit(ctx, ll, line, strlen(line), 24, 0,
+                                  &first, &last) == 0);
+    ASSERT(first == 6 && last == 8);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+    /* ...and "wcx" replaced by "cat" */
+    line = "echo one&& ls '-la' | cat; print done";
+    ASSERT(libzsh_line_lexer_edit(ctx, ll, line, strlen(line), 22, 3,
+                                  &first, &last) == 0);
+    ASSERT(line_lexer_matches(ctx, ll, line));
+    errno = 0;
+    ASSERT(libzsh_line_lexer_edit(ctx, ll, line, strlen(line), 40, 0,
+                                  &first, &last) == -1);
+    ASSERT(errno == EINVAL);
+
+    /* Deleting everything */
+    ASSERT(libzsh_line_lexer_update(ctx, ll, "", 0, &first, &last) == 0);
+    ASSERT(libzsh_line_lexer_tokens(ll)->count == 0);
+
+    libzsh_line_lexer_free(ll);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Sink collecting screen output
+ */
+struct screen_capture {
+    char buf[1024];
+    size_t len;
+    int calls;
+};
+
+static int capture_output(void *data, const char *buf, size_t len)
+{
+    struct screen_capture *cap = (struct screen_capture *)data;
+
+    cap->calls++;
+    if (cap->len + len >= sizeof(cap->buf))
+        return -1;
+    memcpy(cap->buf + cap->len, buf, len);
+    cap->len += len;
+    cap->buf[cap->len] = '\0';
+    return 0;
+}
+
+/*
+ * Test: Screen refresh only sends what changed, in one write per frame
+ */
+static int test_screen_refresh(void)
+{
+    struct screen_capture cap = { "", 0, 0 };
+    libzsh_screen *s = libzsh_screen_new(20, capture_output, &cap);
+
+    ASSERT(s != NULL);
+
+    /* The first frame draws everything */
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo", 4, 4) == 0);
+    ASSERT(cap.calls == 1);
+    ASSERT(strcmp(cap.buf, "\r\033[J$ echo") == 0);
+
+    /* Typing at the end sends just the new character */
+    cap.len = 0;
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo ", 5, 5) == 0);
+    ASSERT(cap.calls == 2);
+    ASSERT(strcmp(cap.buf, " ") == 0);
+
+    /* Nothing changed: no output at all */
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo ", 5, 5) == 0);
+    ASSERT(cap.calls == 2);
+
+    /* Moving the cursor back is just cursor motion */
+    cap.len = 0;
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo ", 5, 0) == 0);
+    ASSERT(strcmp(cap.buf, "\033[5D") == 0);
+
+    /* Deleting the last character clears the end of the row */
+    cap.len = 0;
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo", 4, 4) == 0);
+    ASSERT(strcmp(cap.buf, "\033[4C\033[K") == 0);
+
+    /* A line longer than the terminal wraps onto a new row */
+    cap.len = 0;
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo 0123456789abcdefgh", 23,
+                               23) == 0);
+    ASSERT(strcmp(cap.buf, " 0123456789abc\r\ndefgh") == 0);
+
+    /* ...and shrinking it again removes the row */
+    cap.len = 0;
+    ASSERT(libzsh_screen_frame(s, "$ ", 2, "echo", 4, 4) == 0);
+    ASSERT(strstr(cap.buf, "\033[J") != NULL);
+
+    /* Finishing moves below the drawing */
+    cap.len = 0;
+    ASSERT(libzsh_screen_finish(s) == 0);
+    ASSERT(strcmp(cap.buf, "\r\n") == 0);
+
+    libzsh_screen_free(s);
+
+    return 1;
+}
+
+/*
+ * Test: History search finds the same lines as a scan of every line
+ */
+static int history_matches(libzsh_history *h, size_t idx, const char *s,
+                           size_t slen, int prefix)
+{
+    size_t len, i;
+    const char *line = libzsh_history_get(h, idx, &len);
+
+    for (i = 0; i + slen <= len; i++) {
+        if (!memcmp(line + i, s, slen))
+            return 1;
+        if (prefix)
+            break;
+    }
+    return 0;
+}
+
+static long history_scan(libzsh_history *h, const char *s, size_t slen,
+                         size_t before, int prefix)
+{
+    while (before--)
+        if (history_matches(h, before, s, slen, prefix))
+            return (long)before;
+    return -1;
+}
+
+static long history_scan_after(libzsh_history *h, const char *s,
+                               size_t slen, size_t after, int prefix)
+{
+    while (++after < libzsh_history_count(h))
+        if (history_matches(h, after, s, slen, prefix))
+            return (long)after;
+    return -1;
+}
+
+static int test_history_index(void)
+{
+    static const char *words[] = {
+        "git", "status", "commit", "-m", "ls", "-la", "make", "cd",
+        "src", "grep", "-rn", "foo", "|", "less", "vi", "main.c"
+    };
+    static const char *queries[] = {
+        "g", "-l", "git", "git st", "src |", "make cd", "main.c", "nothere"
+    };
+    libzsh_history *h = libzsh_history_new();
+    unsigned int seed = 1;
+    size_t i, q, len;
+    char line[128];
+
+    ASSERT(h != NULL);
+    ASSERT(libzsh_history_search(h, "git", 3, 0) == -1);
+
+    for (i = 0; i < 5000; i++) {
+        int n = 1 + i % 5, w;
+
+        len = 0;
+        for (w = 0; w < n; w++) {
+            const char *word;
+
+            seed = seed * 1103515245 + 12345;
+            word = words[(seed >> 16) % 16];
+            if (w)
+                line[len++] = ' ';
+            memcpy(line + len, word, strlen(word));
+            len += strlen(word);
+        }
+        ASSERT(libzsh_history_add(h, line, len) == (long)i);
+    }
+    ASSERT(libzsh_history_count(h) == 5000);
+    ASSERT(libzsh_history_get(h, 5000, NULL) == NULL);
+
+    /* Walk back through all matches of each query */
+    for (q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        size_t qlen = strlen(queries[q]);
+        int prefix;
+
+        for (prefix = 0; prefix < 2; prefix++) {
+            size_t before = 5000;
+
+            for (;;) {
+                long want = history_scan(h, queries[q], qlen, before, prefix);
+                long got = prefix ?
+                    libzsh_history_prefix(h, queries[q], qlen, before) :
+                    libzsh_history_search(h, queries[q], qlen, before);
+
+                ASSERT(got == want);
+                if (got < 0)
+                    break;
+                before = got;
+            }
+        }
+    }
+
+    /* And forward from the first line */
+    for (q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        size_t qlen = strlen(queries[q]);
+        int prefix;
+
+        for (prefix = 0; prefix < 2; prefix++) {
+            size_t after = 0;
+
+            for (;;) {
+                long want = history_scan_after(h, queries[q], qlen, after,
+                                               prefix);
+                long got = prefix ?
+                    libzsh_history_prefix_after(h, queries[q], qlen, after) :
+                    libzsh_history_search_after(h, queries[q], qlen, after);
+
+                ASSERT(got == want);
+                if (got < 0)
+                    break;
+                after = got;
+            }
+        }
+    }
+
+    libzsh_history_add(h, "", 0);
+    ASSERT(libzsh_history_get(h, 5000, &len) != NULL && len == 0);
+
+    libzsh_history_free(h);
+
+    return 1;
+}
+
+/*
+ * Test: History files are read newest first and see other sessions' appends
+ */
+static int test_histfile(void)
+{
+    char path[] = "/tmp/libzsh_histXXXXXX";
+    libzsh_histfile *a, *b;
+    const char *line;
+    size_t len;
+    long stamp;
+    char buf[32];
+    int fd, i;
+
+    ASSERT((fd = mkstemp(path)) >= 0);
+    close(fd);
+    unlink(path);
+
+    a = libzsh_histfile_open(path);
+    ASSERT(a != NULL);
+    ASSERT(libzsh_histfile_entry(a, 0, NULL, NULL) == NULL);
+    for (i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "echo %d", i);
+        ASSERT(libzsh_histfile_append(a, buf, strlen(buf), 1000 + i) == 0);
+    }
+
+    /* A second session sees them all, newest first */
+    b = libzsh_histfile_open(path);
+    ASSERT(b != NULL);
+    line = libzsh_histfile_entry(b, 0, &len, &stamp);
+    ASSERT(line && len == 7 && !strcmp(line, "echo 99") && stamp == 1099);
+    line = libzsh_histfile_entry(b, 99, &len, &stamp);
+    ASSERT(line && !strcmp(line, "echo 0") && stamp == 1000);
+    ASSERT(libzsh_histfile_entry(b, 100, NULL, NULL) == NULL);
+
+    /* Appends from the other session show up after a refresh */
+    ASSERT(libzsh_histfile_append(a, "ls\0-l", 5, 2000) == 0);
+    ASSERT(libzsh_histfile_refresh(b) == 0);
+    line = libzsh_histfile_entry(b, 0, &len, NULL);
+    ASSERT(line && len == 5 && !memcmp(line, "ls\0-l", 5));
+    line = libzsh_histfile_entry(b, 1, NULL, NULL);
+    ASSERT(line && !strcmp(line, "echo 99"));
+    ASSERT(libzsh_histfile_count(b) == 101);
+
+    /* A record still being written is left for a later refresh */
+    fd = open(path, O_WRONLY | O_APPEND);
+    ASSERT(fd >= 0);
+    ASSERT(write(fd, "\012\0\0\0CERH", 8) == 8);
+    ASSERT(libzsh_histfile_refresh(b) == 0);
+    ASSERT(libzsh_histfile_count(b) == 101);
+    close(fd);
+
+    /* ...and one that never completes doesn't hide what follows */
+    ASSERT(libzsh_histfile_append(a, "pwd", 3, 3000) == 0);
+    ASSERT(libzsh_histfile_append(a, "cd", 2, 3001) == 0);
+    ASSERT(libzsh_histfile_refresh(b) == 0);
+    line = libzsh_histfile_entry(b, 0, NULL, NULL);
+    ASSERT(line && !strcmp(line, "cd"));
+    line = libzsh_histfile_entry(b, 1, NULL, NULL);
+    ASSERT(line && !strcmp(line, "pwd"));
+    line = libzsh_histfile_entry(b, 2, &len, NULL);
+    ASSERT(line && len == 5 && !memcmp(line, "ls\0-l", 5));
+    ASSERT(libzsh_histfile_count(b) == 103);
+    libzsh_histfile_close(b);
+    b = libzsh_histfile_open(path);
+    ASSERT(b != NULL);
+    line = libzsh_histfile_entry(b, 0, NULL, NULL);
+    ASSERT(line && !strcmp(line, "cd"));
+    ASSERT(libzsh_histfile_count(b) == 103);
+    line = libzsh_histfile_entry(b, 102, NULL, NULL);
+    ASSERT(line && !strcmp(line, "echo 0"));
+
+    libzsh_histfile_close(a);
+    libzsh_histfile_close(b);
+    unlink(path);
+
+    return 1;
+}
+
+#ifdef LIBZSH_WITH_PATTERNS
+/*
+ * Test: Batch pattern matching agrees with the pattern
+ */
+static int test_pattern_batch(void)
+{
+    static const char *const paths[] = {
+        "src/main.c", "src/main.h", "README", "src/lex.c.orig",
+        "doc/foo.txt", "bar.txt", "\204raw.c", "src/sub/deep.c"
+    };
+    static const struct {
+        const char *pat;
+        unsigned char bits;     /* which paths match */
+        size_t count;
+    } cases[] = {
+        { "*.c",            0xc1, 3 },
+        { "src/*.[ch]",     0x83, 3 },
+        { "README",         0x04, 1 },
+        { "*(foo|bar).txt", 0x30, 2 },
+        { "src/*",          0x8b, 4 },
+        { "*\\.orig",       0x08, 1 },
+    };
+    libzsh_context *ctx = libzsh_context_new();
+    size_t i;
+
+    ASSERT(ctx != NULL);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        libzsh_pattern *pat = libzsh_pattern_compile(ctx, cases[i].pat,
+                                                     strlen(cases[i].pat));
+        unsigned char results[1];
+        size_t j, n = 0;
+
+        ASSERT(pat != NULL);
+        ASSERT(libzsh_pattern_match_batch(pat, paths, 8, results) ==
+               cases[i].count);
+        ASSERT(results[0] == cases[i].bits);
+        for (j = 0; j < 8; j++)
+            n += libzsh_pattern_match(pat, paths[j], strlen(paths[j]));
+        ASSERT(n == cases[i].count);
+        libzsh_pattern_free(pat);
+    }
+
+    /* An unbalanced group doesn't compile */
+    ASSERT(libzsh_pattern_compile(ctx, "(foo", 4) == NULL);
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Patterns of literals and stars are matched without the matcher
+ */
+static int test_pattern_kinds(void)
+{
+    static const struct {
+        const char *pat;
+        int kind;
+        const char *yes, *no;
+    } cases[] = {
+        { "main.c",   LIBZSH_PATTERN_EXACT,     "main.c",     "main.cc" },
+        { "src/*",    LIBZSH_PATTERN_PREFIX,    "src/a/b",    "lib/src/" },
+        { "*.txt",    LIBZSH_PATTERN_SUFFIX,    ".txt",       "a.txt~" },
+        { "*core*",   LIBZSH_PATTERN_SUBSTRING, "libcore.so", "cor" },
+        { "lib*.so",  LIBZSH_PATTERN_AFFIX,     "lib.so",     "lib.s" },
+        { "ab*ba",    LIBZSH_PATTERN_AFFIX,     "abba",       "aba" },
+        { "**",       LIBZSH_PATTERN_ANY,       "",           NULL },
+        { "a\\*b*",   LIBZSH_PATTERN_PREFIX,    "a*bc",       "axbc" },
+        { "*.[ch]",   LIBZSH_PATTERN_GENERIC,   "x.h",        "x.o" },
+        { "?*.c",     LIBZSH_PATTERN_GENERIC,   "a.c",        ".c" },
+    };
+    libzsh_context *ctx = libzsh_context_new();
+    size_t i;
+
+    ASSERT(ctx != NULL);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        libzsh_pattern *pat = libzsh_pattern_compile(ctx, cases[i].pat,
+                                                     strlen(cases[i].pat));
+
+        ASSERT(pat != NULL);
+        ASSERT(libzsh_pattern_kind(pat) == cases[i].kind);
+        ASSERT(libzsh_pattern_match(pat, cases[i].yes,
+                                    strlen(cases[i].yes)) == 1);
+        if (cases[i].no)
+            ASSERT(libzsh_pattern_match(pat, cases[i].no,
+                                        strlen(cases[i].no)) == 0);
+        libzsh_pattern_free(pat);
+    }
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Recursive globs find what ** would, in sorted order
+ */
+static const char *const glob_tree[] = {
+    "sub/", "sub/deep/", ".git/", "a.c", "b.h", ".hid.c", "sub/c.c",
+    "sub/deep/d.c", ".git/.e.c",
+};
+
+static int glob_check(libzsh_context *ctx, const char *top,
+                      const char *pattern, int flags,
+                      const char *const *want, size_t nwant)
+{
+    size_t n, i, toplen = strlen(top);
+    char **paths;
+    int ok;
+
+    if (libzsh_glob_recursive(ctx, top, pattern, flags, 4, &paths, &n))
+        return 0;
+    ok = n == nwant && paths[n] == NULL;
+    for (i = 0; ok && i < n; i++)
+        ok = !strncmp(paths[i], top, toplen) && paths[i][toplen] == '/' &&
+            !strcmp(paths[i] + toplen + 1, want[i]);
+    libzsh_glob_free(paths, n);
+    return ok;
+}
+
+static int test_glob_recursive(void)
+{
+    static const char *const c_files[] = {
+        "a.c", "sub/c.c", "sub/deep/d.c",
+    };
+    static const char *const plain[] = {
+        "a.c", "b.h", "sub/c.c", "sub/deep/d.c",
+    };
+    static const char *const dirs[] = { "sub", "sub/deep" };
+    static const char *const followed[] = {
+        "a.c", "link/c.c", "link/deep/d.c", "sub/c.c", "sub/deep/d.c",
+    };
+    static const char *const dotted[] = { ".git", ".hid.c" };
+    char top[] = "/tmp/libzsh_globXXXXXX", path[64];
+    libzsh_context *ctx = libzsh_context_new();
+    size_t i;
+
+    ASSERT(ctx != NULL);
+    ASSERT(mkdtemp(top) != NULL);
+    for (i = 0; i < sizeof(glob_tree) / sizeof(glob_tree[0]); i++) {
+        size_t len = strlen(glob_tree[i]);
+
+        snprintf(path, sizeof(path), "%s/%s", top, glob_tree[i]);
+        if (glob_tree[i][len - 1] == '/')
+            ASSERT(mkdir(path, 0700) == 0);
+        else
+            ASSERT(close(open(path, O_WRONLY | O_CREAT, 0600)) == 0);
+    }
+    snprintf(path, sizeof(path), "%s/link", top);
+    ASSERT(symlink("sub", path) == 0);
+
+    ASSERT(glob_check(ctx, top, "*.c", 0, c_files, 3));
+    ASSERT(glob_check(ctx, top, "*", LIBZSH_GLOB_FILES, plain, 4));
+    ASSERT(glob_check(ctx, top, "*", LIBZSH_GLOB_DIRS, dirs, 2));
+    ASSERT(glob_check(ctx, top, "*.c", LIBZSH_GLOB_FOLLOW, followed, 5));
+    /* A leading dot matches dot files but doesn't enter .git for .git/.e.c */
+    ASSERT(glob_check(ctx, top, ".*", 0, dotted, 2));
+    ASSERT(glob_check(ctx, top, "*.[ch]", LIBZSH_GLOB_FILES, plain, 4));
+    ASSERT(glob_check(ctx, top, "nothing", 0, NULL, 0));
+
+    unlink(path);
+    for (i = sizeof(glob_tree) / sizeof(glob_tree[0]); i-- > 0; ) {
+        snprintf(path, sizeof(path), "%s/%s", top, glob_tree[i]);
+        if (glob_tree[i][strlen(glob_tree[i]) - 1] == '/')
+            rmdir(path);
+        else
+            unlink(path);
+    }
+    rmdir(top);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Globs in one directory share a listing until it changes
+ */
+static int test_glob_cache(void)
+{
+    static const char *const names[] = { "a.c", "b.c", "c.h", "d.c" };
+    char top[] = "/tmp/libzsh_globXXXXXX", path[64];
+    libzsh_context *ctx = libzsh_context_new();
+    struct timeval tv[2];
+    size_t n, hits, reads, i;
+    char **paths;
+
+    ASSERT(ctx != NULL);
+    ASSERT(mkdtemp(top) != NULL);
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", top, names[i]);
+        ASSERT(close(open(path, O_WRONLY | O_CREAT, 0600)) == 0);
+    }
+    /* A directory changed just now isn't trusted: make it older */
+    memset(tv, 0, sizeof(tv));
+    tv[0].tv_sec = tv[1].tv_sec = 1000000000;
+    ASSERT(utimes(top, tv) == 0);
+
+    libzsh_glob_cache_begin(ctx);
+    ASSERT(libzsh_glob_dir(ctx, top, "*.c", 0, &paths, &n) == 0);
+    ASSERT(n == 2 && !strcmp(paths[1] + strlen(top), "/b.c"));
+    libzsh_glob_free(paths, n);
+    ASSERT(libzsh_glob_dir(ctx, top, "*.h", 0, &paths, &n) == 0);
+    ASSERT(n == 1 && !strcmp(paths[0] + strlen(top), "/c.h"));
+    libzsh_glob_free(paths, n);
+    libzsh_glob_cache_stats(ctx, &hits, &reads);
+    ASSERT(hits == 1 && reads == 1);
+
+    /* A new entry changes the directory, so it is read again */
+    snprintf(path, sizeof(path), "%s/%s", top, names[3]);
+    ASSERT(close(open(path, O_WRONLY | O_CREAT, 0600)) == 0);
+    tv[0].tv_sec = tv[1].tv_sec = 1000000001;
+    ASSERT(utimes(top, tv) == 0);
+    ASSERT(libzsh_glob_dir(ctx, top, "*.c", 0, &paths, &n) == 0);
+    ASSERT(n == 3 && !strcmp(paths[2] + strlen(top), "/d.c"));
+    libzsh_glob_free(paths, n);
+    libzsh_glob_cache_stats(ctx, &hits, &reads);
+    ASSERT(hits == 1 && reads == 2);
+    libzsh_glob_cache_end(ctx);
+
+    /* Without a cache the result is the same */
+    ASSERT(libzsh_glob_dir(ctx, top, "*.c", 0, &paths, &n) == 0);
+    ASSERT(n == 3);
+    libzsh_glob_free(paths, n);
+
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", top, names[i]);
+        unlink(path);
+    }
+    rmdir(top);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: A batch of strings expanded into one buffer
+ */
+static int test_expand_batch(void)
+{
+    static const char *const in[] = {
+        "hello $name", "${undef:-dflt}", "$((6 * 7))", "${(U)name}",
+        "${name", "$(echo hi)", "`echo hi`", "${nope?unset}", "plain",
+    };
+    static const int want[] = {
+        0, 0, 0, 0, LIBZSH_EXPAND_ESYNTAX, LIBZSH_EXPAND_ECMDSUBST,
+        LIBZSH_EXPAND_ECMDSUBST, LIBZSH_EXPAND_EFAILED, 0,
+    };
+    static const char *const names[] = { "a.txt", "b.txt", "c.log" };
+    size_t n = sizeof(in) / sizeof(in[0]), i;
+    struct libzsh_expansion out;
+    char top[] = "/tmp/libzsh_expandXXXXXX", path[64];
+    const char *pat[1];
+    libzsh_context *ctx = libzsh_context_new();
+
+    ASSERT(ctx != NULL);
+    ASSERT(libzsh_setparam(ctx, "name", "world") == 0);
+    ASSERT(libzsh_expand(ctx, in, n, LIBZSH_EXPAND_QUIET, &out) == 4);
+    ASSERT(out.count == n && out.offs[n] == out.len);
+    for (i = 0; i < n; i++)
+        ASSERT(out.status[i] == want[i]);
+    ASSERT(!strcmp(out.buf + out.offs[0], "hello world"));
+    ASSERT(!strcmp(out.buf + out.offs[1], "dflt"));
+    ASSERT(!strcmp(out.buf + out.offs[2], "42"));
+    ASSERT(!strcmp(out.buf + out.offs[3], "WORLD"));
+    ASSERT(out.offs[4] == out.offs[5]);
+    ASSERT(!strcmp(out.buf + out.offs[8], "plain"));
+    libzsh_expansion_free(&out);
+
+    /* Nor when the command only turns up while expanding */
+    ASSERT(libzsh_setparam(ctx, "code", "$(echo hi)") == 0);
+    pat[0] = "${(e)code}";
+    ASSERT(libzsh_expand(ctx, pat, 1, LIBZSH_EXPAND_QUIET, &out) == 1);
+    ASSERT(out.status[0] == LIBZSH_EXPAND_ECMDSUBST && out.len == 0);
+    libzsh_expansion_free(&out);
+
+    /* Globbing only when asked for */
+    ASSERT(mkdtemp(top) != NULL);
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", top, names[i]);
+        ASSERT(close(open(path, O_WRONLY | O_CREAT, 0600)) == 0);
+    }
+    ASSERT(libzsh_setparam(ctx, "dir", top) == 0);
+    pat[0] = "$dir/*.txt";
+    ASSERT(libzsh_expand(ctx, pat, 1, 0, &out) == 0);
+    snprintf(path, sizeof(path), "%s/*.txt", top);
+    ASSERT(!strcmp(out.buf, path) && out.len == strlen(path) + 1);
+    libzsh_expansion_free(&out);
+    ASSERT(libzsh_expand(ctx, pat, 1, LIBZSH_EXPAND_GLOB, &out) == 0);
+    snprintf(path, sizeof(path), "%s/b.txt", top);
+    ASSERT(out.len == 2 * (strlen(path) + 1));
+    ASSERT(!strcmp(out.buf + strlen(path) + 1, path));
+    libzsh_expansion_free(&out);
+
+    /* Glob qualifiers run code, so they too need LIBZSH_EXPAND_CMDSUBST */
+    pat[0] = "$dir/*.txt(e:true:)";
+    ASSERT(libzsh_expand(ctx, pat, 1, LIBZSH_EXPAND_GLOB |
+                         LIBZSH_EXPAND_QUIET, &out) == 1);
+    libzsh_expansion_free(&out);
+    ASSERT(libzsh_context_setopt(ctx, "extendedglob", 1) == 0);
+    pat[0] = "$dir/*.txt(#qe:true:)";
+    ASSERT(libzsh_expand(ctx, pat, 1, LIBZSH_EXPAND_GLOB |
+                         LIBZSH_EXPAND_QUIET, &out) == 1);
+    ASSERT(out.status[0] == LIBZSH_EXPAND_ECMDSUBST);
+    libzsh_expansion_free(&out);
+    ASSERT(libzsh_expand(ctx, pat, 1, LIBZSH_EXPAND_GLOB |
+                         LIBZSH_EXPAND_CMDSUBST, &out) == 0);
+    ASSERT(out.len == 2 * (strlen(path) + 1));
+    libzsh_expansion_free(&out);
+    ASSERT(libzsh_context_setopt(ctx, "extendedglob", 0) == 0);
+
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", top, names[i]);
+        unlink(path);
+    }
+    rmdir(top);
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+
+/*
+ * Test: Arithmetic compiled once, evaluated as parameters change
+ */
+static int math_is(libzsh_context *ctx, const char *expr, long long want)
+{
+    libzsh_math *m = libzsh_math_compile(ctx, expr);
+    struct libzsh_number num;
+    int ok;
+
+    if (!m)
+        return 0;
+    ok = libzsh_math_eval(m, &num) == 0 &&
+        num.type == LIBZSH_MATH_INTEGER && num.i == want;
+    libzsh_math_free(m);
+    return ok;
+}
+
+static int test_math_compiled(void)
+{
+    libzsh_context *ctx = libzsh_context_new();
+    struct libzsh_number num;
+    libzsh_math *m;
+
+    ASSERT(ctx != NULL);
+    ASSERT(libzsh_setparam(ctx, "x", "6") == 0);
+    ASSERT(libzsh_setparam(ctx, "s", "3 + 4") == 0);
+    ASSERT(math_is(ctx, "x * 7", 42));
+    ASSERT(math_is(ctx, "y = x++, y + x", 13));
+    ASSERT(math_is(ctx, "x", 7));
+    ASSERT(math_is(ctx, "s * 2", 14));
+    ASSERT(math_is(ctx, "x > 5 && (x -= 2) || 9", 1));
+    ASSERT(math_is(ctx, "x ? 0x10 : 3", 16));
+    ASSERT(math_is(ctx, "", 0));
+
+    /* zsh's precedence unless C_PRECEDENCES is set */
+    ASSERT(math_is(ctx, "1 + 2 << 3", 17));
+    ASSERT(libzsh_context_setopt(ctx, "cprecedences", 1) == 0);
+    ASSERT(math_is(ctx, "1 + 2 << 3", 24));
+    ASSERT(math_is(ctx, "1 || 1 ^^ 1", 1));
+    ASSERT(math_is(ctx, "1 ^^ 1 && 0", 1));
+    ASSERT(libzsh_context_setopt(ctx, "cprecedences", 0) == 0);
+    ASSERT(math_is(ctx, "1 || 1 ^^ 1", 0));
+
+    /* A parameter created after compiling is found */
+    m = libzsh_math_compile(ctx, "w + 1");
+    ASSERT(m != NULL);
+    ASSERT(libzsh_math_eval(m, &num) == 0 && num.i == 1);
+    ASSERT(libzsh_setparam(ctx, "w", "5") == 0);
+    ASSERT(libzsh_math_eval(m, &num) == 0 && num.i == 6);
+    libzsh_math_free(m);
+
+    m = libzsh_math_compile(ctx, "x / 4.0");
+    ASSERT(m != NULL);
+    ASSERT(libzsh_math_eval(m, &num) == 0);
+    ASSERT(num.type == LIBZSH_MATH_FLOAT && num.d == 1.25);
+    libzsh_math_free(m);
+
+    m = libzsh_math_compile(ctx, "x / (x - x)");
+    ASSERT(m != NULL);
+    ASSERT(libzsh_math_eval(m, &num) == -1 && errno == EDOM);
+    ASSERT(num.type == LIBZSH_MATH_ERROR);
+    libzsh_math_free(m);
+
+    ASSERT(libzsh_math_compile(ctx, "sqrt(2)") == NULL && errno == ENOTSUP);
+    ASSERT(libzsh_math_compile(ctx, "1 +") == NULL && errno == EINVAL);
+    ASSERT(libzsh_math_compile(ctx, "1_000") == NULL && errno == ENOTSUP);
+
+    libzsh_context_free(ctx);
+
+    return 1;
+}
+#endif /* LIBZSH_WITH_PATTERNS */
+
 /*
  * Main test runner
  */
@@ -505,9 +2483,13 @@ int main(int argc, char *argv[])
     TEST(heap_allocation);
     TEST(ztrdup);
     TEST(dupstring);
+    TEST(alloc_pools);
+    TEST(heap_arenas);
 
     printf("\nHash table tests:\n");
     TEST(reswdtab);
+    TEST(hashtable_index);
+    TEST(phash_tables);
 
     printf("\nParser tests:\n");
     TEST(parser_simple);
@@ -517,6 +2499,45 @@ int main(int argc, char *argv[])
     TEST(parser_function);
     TEST(parser_subshell);
 
+    printf("\nContext tests:\n");
+    TEST(context_isolation);
+    TEST(context_threads);
+    TEST(parse_threads);
+    TEST(parse_api);
+    TEST(diag_sink);
+    TEST(trace_stats);
+    TEST(parse_cache);
+    TEST(wordcode_dump);
+    TEST(wordcode_visit);
+    TEST(parse_fd);
+    TEST(check_files);
+    TEST(state_image);
+
+    printf("\nLexer tests:\n");
+    TEST(lex_tokens);
+    TEST(line_lexer);
+
+    printf("\nScreen tests:\n");
+    TEST(screen_refresh);
+
+    printf("\nHistory tests:\n");
+    TEST(history_index);
+    TEST(histfile);
+
+#ifdef LIBZSH_WITH_PATTERNS
+    printf("\nPattern tests:\n");
+    TEST(pattern_batch);
+    TEST(pattern_kinds);
+
+    printf("\nGlob tests:\n");
+    TEST(glob_recursive);
+    TEST(glob_cache);
+
+    printf("\nExpansion tests:\n");
+    TEST(expand_batch);
+    TEST(math_compiled);
+#endif
+
     printf("\n========================================\n");
     printf("Tests passed: %d/%d\n", tests_passed, tests_run);
     printf("========================================\n");
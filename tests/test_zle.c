@@ -15,6 +15,8 @@
 
 #include "zsh.mdh"
 #include "zle.mdh"
+#include "libzsh.h"
+#include "libzsh_tls.h"
 
 /* Forward declarations */
 extern void init_jobs(char **argv, char **envp);
@@ -26,9 +28,9 @@ extern void createreswdtable(void);
 extern void init_thingies(void);
 extern void init_keymaps(void);
 
-extern unsigned char *cmdstack;
-extern int cmdsp;
-extern int strin;
+extern LIBZSH_TLS_cmdstack unsigned char *cmdstack;
+extern LIBZSH_TLS_cmdsp int cmdsp;
+extern LIBZSH_TLS_strin int strin;
 #define CMDSTACKSZ 256
 
 /* ZLE globals we need */
@@ -236,19 +238,277 @@ static void demo_widgets(void)
     printf("\n");
 }
 
+/*
+ * Demonstrate feeding input to a session instead of a blocking read
+ */
+static int demo_key_feed(void)
+{
+    libzsh_zle *session = libzsh_zle_new("emacs");
+    const char *line;
+    size_t len, cursor;
+    int events, failed = 0;
+
+    printf("=== Key Feed Demo ===\n\n");
+
+    if (!session) {
+        printf("Could not create a session.\n");
+        return 1;
+    }
+
+    events = libzsh_zle_feed(session, "echo hello", 10);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Fed \"echo hello\": \"%s\" (cursor %zu)\n", line, cursor);
+    if (strcmp(line, "echo hello") || cursor != 10 ||
+        !(events & LIBZSH_ZLE_NEED_INPUT))
+        failed++;
+
+    /* ESC alone is a prefix: nothing happens until the next key */
+    events = libzsh_zle_feed(session, "\033", 1);
+    printf("Fed ESC: %s\n", (events & LIBZSH_ZLE_PENDING) ?
+           "waiting for more" : "dispatched");
+    if (!(events & LIBZSH_ZLE_PENDING))
+        failed++;
+
+    /* ESC b is backward-word */
+    libzsh_zle_feed(session, "b", 1);
+    libzsh_zle_line(session, &len, &cursor);
+    printf("Fed \"b\" (backward-word): cursor %zu\n", cursor);
+    if (cursor != 5)
+        failed++;
+
+    /* Ctrl+A, Ctrl+K: kill the whole line, then accept a new one */
+    libzsh_zle_feed(session, "\001\013", 2);
+    events = libzsh_zle_feed(session, "ls -l\rpwd", 9);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Accepted: \"%s\"\n", line);
+    if (!(events & LIBZSH_ZLE_ACCEPT) || strcmp(line, "ls -l"))
+        failed++;
+
+    /* The input after the newline starts the next line */
+    libzsh_zle_feed(session, NULL, 0);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Next line: \"%s\"\n", line);
+    if (strcmp(line, "pwd"))
+        failed++;
+
+    libzsh_zle_free(session);
+    printf("\n");
+
+    return failed;
+}
+
+/*
+ * Demonstrate bracketed paste and bulk insertion
+ */
+static int demo_paste(void)
+{
+    libzsh_zle *session = libzsh_zle_new("emacs");
+    const char *line;
+    size_t len, cursor, big = 200 * 1024;
+    char *text;
+    int events, failed = 0;
+
+    printf("=== Paste Demo ===\n\n");
+
+    if (!session) {
+        printf("Could not create a session.\n");
+        return 1;
+    }
+
+    /* The paste ends in the middle of its end marker */
+    libzsh_zle_feed(session, "ab", 2);
+    events = libzsh_zle_feed(session, "\033[200~one\rtwo\033[20", 17);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Paste so far: \"%s\"\n", line);
+    if (strcmp(line, "ab") || !(events & LIBZSH_ZLE_NEED_INPUT))
+        failed++;
+
+    /* The rest arrives: the return in the paste is a newline, not accept */
+    events = libzsh_zle_feed(session, "1~c", 3);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("After paste: \"%s\" (cursor %zu)\n", line, cursor);
+    if (strcmp(line, "abone\ntwoc") || cursor != 10 ||
+        (events & LIBZSH_ZLE_ACCEPT))
+        failed++;
+
+    /* A large insertion goes in as one piece */
+    text = malloc(big);
+    memset(text, 'x', big);
+    libzsh_zle_set_line(session, "", 0);
+    libzsh_zle_insert(session, text, big);
+    libzsh_zle_line(session, &len, &cursor);
+    printf("Inserted %zu bytes: line is %zu bytes\n", big, len);
+    if (len != big || cursor != big)
+        failed++;
+    free(text);
+
+    libzsh_zle_free(session);
+    printf("\n");
+
+    return failed;
+}
+
+/*
+ * Demonstrate looking up bindings in a compiled keymap
+ */
+static int demo_compiled_keymap(void)
+{
+    static const struct {
+        const char *keys;
+        int final;
+        size_t len;
+        const char *widget;
+    } cases[] = {
+        { "a",        0, 1, "self-insert" },
+        { "ab",       0, 1, "self-insert" },
+        { "\033b",    0, 2, "backward-word" },
+        { "\033",     0, 0, NULL },            /* still a prefix */
+        { "\033",     1, 1, NULL },            /* timed out: unbound */
+        { "\030\025", 0, 2, "undo" },
+    };
+    libzsh_keymap *kc = libzsh_keymap_compile("emacs");
+    size_t i;
+    int failed = 0;
+
+    printf("=== Compiled Keymap Demo ===\n\n");
+
+    if (!kc) {
+        printf("Could not compile the emacs keymap.\n");
+        return 1;
+    }
+    printf("emacs: %zu states\n", libzsh_keymap_states(kc));
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char *widget = NULL;
+        size_t len = libzsh_keymap_lookup(kc, cases[i].keys,
+                                          strlen(cases[i].keys),
+                                          cases[i].final, &widget, NULL);
+
+        printf("  case %zu: %zu bytes -> %s\n", i, len,
+               widget ? widget : "(none)");
+        if (len != cases[i].len ||
+            (cases[i].widget && (!widget || strcmp(widget, cases[i].widget))))
+            failed++;
+    }
+
+    libzsh_keymap_free(kc);
+    if (libzsh_keymap_compile("no-such-keymap"))
+        failed++;
+    printf("\n");
+
+    return failed;
+}
+
+/*
+ * Demonstrate the history widgets in a session given a history
+ */
+static int demo_history(void)
+{
+    static const char *const lines[] = {
+        "git status", "ls -la", "git commit -m fix", "make", NULL
+    };
+    libzsh_zle *session = libzsh_zle_new("emacs");
+    libzsh_history *h = libzsh_history_new();
+    const char *line, *search;
+    size_t len, cursor;
+    int i, events, failed = 0;
+
+    printf("=== History Demo ===\n\n");
+
+    if (!session || !h) {
+        printf("Could not create a session.\n");
+        return 1;
+    }
+    for (i = 0; lines[i]; i++)
+        libzsh_history_add(h, lines[i], strlen(lines[i]));
+    libzsh_zle_set_history(session, h);
+
+    /* Ctrl+P twice (up-line-or-history), then Ctrl+N twice back down */
+    libzsh_zle_feed(session, "ec\020\020", 4);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Up twice: \"%s\"\n", line);
+    if (strcmp(line, "git commit -m fix") || cursor != len)
+        failed++;
+    libzsh_zle_feed(session, "\016\016", 2);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Down twice: \"%s\"\n", line);
+    if (strcmp(line, "ec"))
+        failed++;
+
+    /* ESC p (history-search-backward): lines with the same first word */
+    libzsh_zle_set_line(session, "git", 3);
+    libzsh_zle_feed(session, "\033p", 2);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Searched for \"git\": \"%s\"\n", line);
+    if (strcmp(line, "git commit -m fix"))
+        failed++;
+    libzsh_zle_feed(session, "\033p", 2);
+    events = libzsh_zle_feed(session, "\033p", 2);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("And on: \"%s\"%s\n", line,
+           (events & LIBZSH_ZLE_BEEP) ? " (no more)" : "");
+    if (strcmp(line, "git status") || !(events & LIBZSH_ZLE_BEEP))
+        failed++;
+
+    /* Ctrl+R (history-incremental-search-backward), typing "la" */
+    libzsh_zle_set_line(session, "", 0);
+    libzsh_zle_feed(session, "\022la", 3);
+    search = libzsh_zle_search(session, &len);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("bck-i-search: %s_ -> \"%s\" (cursor %zu)\n",
+           search ? search : "(none)", line, cursor);
+    if (!search || strcmp(search, "la") || strcmp(line, "ls -la") ||
+        cursor != 4)
+        failed++;
+
+    /* No older match; return ends the search and accepts the line */
+    events = libzsh_zle_feed(session, "\022", 1);
+    if (!(events & LIBZSH_ZLE_BEEP))
+        failed++;
+    events = libzsh_zle_feed(session, "\r", 1);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Accepted: \"%s\"\n", line);
+    if (!(events & LIBZSH_ZLE_ACCEPT) || strcmp(line, "ls -la") ||
+        libzsh_zle_search(session, NULL))
+        failed++;
+
+    /* Ctrl+G gives up a search, back to the line it began on */
+    libzsh_zle_feed(session, "mk\022git\007", 6);
+    line = libzsh_zle_line(session, &len, &cursor);
+    printf("Search abandoned: \"%s\"\n", line);
+    if (strcmp(line, "mk") || libzsh_zle_search(session, NULL))
+        failed++;
+
+    libzsh_zle_free(session);
+    libzsh_history_free(h);
+    printf("\n");
+
+    return failed;
+}
+
 int main(int argc, char *argv[])
 {
+    int failed;
+
     printf("ZLE (Zsh Line Editor) Example\n");
     printf("==============================\n\n");
 
     /* Initialize */
     init_zle_subsystem();
 
+    /* "test_zle paste" runs the paste demo alone */
+    if (argc > 1 && !strcmp(argv[1], "paste"))
+        return demo_paste() ? 1 : 0;
+
     /* Run demos */
     demo_keymaps();
     demo_widgets();
     demo_line_buffer();
+    failed = demo_key_feed();
+    failed += demo_paste();
+    failed += demo_history();
+    failed += demo_compiled_keymap();
 
     printf("=== Done ===\n");
-    return 0;
+    return failed ? 1 : 0;
 }